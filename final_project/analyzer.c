@@ -0,0 +1,361 @@
+/*
+ * Delay analyzer
+ * Computes the max delay vs. playback rate curve of received streams, the
+ * values plot.sh used to compute with bc. A packet with seq Y received at X ms
+ * is late for rate R (frames/s) by X - floor(Y * 1000 / R) ms, the max delay
+ * for R is the largest such value (0 if no packet is late).
+ * All R values are computed in a single pass over each file.
+ *
+ * Inputs are "ms seq" data files or binary client traces (GRAPH_TRACE_FILE),
+ * directories are searched recursively for *.data files and traces. Files are
+ * mapped and analyzed by a pool of threads.
+ * For every input <name>.txt (the delay values, same format as plot.sh) and
+ * <name>.gp (gnuplot script drawing the data and the delay lines) are written,
+ * <name> is the input without its extension or the -o argument.
+ * Arrival stats are printed: reordering, interarrival time and jitter, and
+ * per server counts (traces only, data files hold no source).
+ *
+ * usage: ./analyzer [-r <R list>] [-j <threads>] [-o <output name>] <file|dir> ...
+ *   R list: comma separated values and first:last:step ranges, default 10:100:10
+ *   -o only with a single input file
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for open_memstream
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+#define AN_R_MAX 64         // R values per run
+#define AN_FILES_MAX 4096   // input files per run
+#define AN_THREADS_MAX 64
+#define AN_JITTER_GAIN 16   // jitter estimate moves by 1/16 of each new sample (RFC 3550)
+
+/* Arrival stats of one stream or one server */
+typedef struct an_flow {
+    uint64_t pkts;
+    uint64_t retx;          // PKT_FLAG_RETX set (traces only)
+    uint64_t last;          // last arrival (ns)
+    uint64_t lastGap;       // last interarrival time (ns)
+    uint64_t gapSum;        // sum of interarrival times (ns)
+    double jitter;          // smoothed |interarrival change| (ns)
+} an_flow;
+
+/* One analyzed file */
+typedef struct an_job {
+    char* path;
+    bool ok;
+    char* report;           // stats text, printed in input order
+    size_t reportLen;
+} an_job;
+
+static unsigned int rates[AN_R_MAX];
+static unsigned int rateCount = 0;
+static char* outName = NULL;
+static an_job jobs[AN_FILES_MAX];
+static unsigned int jobCount = 0;
+static unsigned int nextJob = 0; // (atomic)
+
+// add a packet arrival to a flow
+static void flowAdd(an_flow* f, uint64_t ns, bool retx) {
+    if (f->pkts > 0) {
+        uint64_t gap = (ns > f->last) ? ns - f->last : 0;
+        f->gapSum += gap;
+        if (f->pkts > 1) {
+            double d = (gap > f->lastGap) ? (double) (gap - f->lastGap) : (double) (f->lastGap - gap);
+            f->jitter += (d - f->jitter) / AN_JITTER_GAIN;
+        }
+        f->lastGap = gap;
+    }
+    f->last = ns;
+    f->pkts++;
+    if (retx) f->retx++;
+}
+
+static void flowPrint(FILE* out, an_flow* f, uint64_t total) {
+    fprintf(out, "%8" PRIu64 " pkts (%5.1f%%), %6" PRIu64 " retx, interarrival mean %9.3f ms, jitter %9.3f ms\n",
+            f->pkts, total ? 100.0 * f->pkts / total : 0, f->retx,
+            (f->pkts > 1) ? f->gapSum / 1e6 / (f->pkts - 1) : 0, f->jitter / 1e6);
+}
+
+// parse an unsigned number, returns false at the end of the data
+static bool parseNum(const char** p, const char* end, uint64_t* val) {
+    while ((*p < end) && ((**p < '0') || (**p > '9'))) (*p)++;
+    if (*p == end) return false;
+    *val = 0;
+    while ((*p < end) && (**p >= '0') && (**p <= '9')) *val = *val * 10 + (uint64_t) (*(*p)++ - '0');
+    return true;
+}
+
+// map a file read-only, NULL if it cannot be mapped or is empty
+static const char* mapFile(char* path, size_t* len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+    struct stat st;
+    void* mem = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED) return NULL;
+    madvise(mem, st.st_size, MADV_SEQUENTIAL);
+    *len = st.st_size;
+    return (const char*) mem;
+}
+
+static bool isTrace(const char* mem, size_t len) {
+    trace_filehdr hdr;
+    if (len < sizeof (hdr)) return false;
+    memcpy(&hdr, mem, sizeof (hdr));
+    return (hdr.magic == TRACE_MAGIC) && (hdr.recSize == sizeof (trace_rec));
+}
+
+// output name of an input: -o or the path without its extension
+static void baseName(char* path, char* base, size_t size) {
+    snprintf(base, size, "%s", (outName != NULL) ? outName : path);
+    if (outName != NULL) return;
+    char* dot = strrchr(base, '.');
+    char* slash = strrchr(base, '/');
+    if ((dot != NULL) && ((slash == NULL) || (dot > slash)) && (dot != base)) *dot = '\0';
+}
+
+// <base>.txt - same lines as plot.sh wrote
+static bool writeTxt(char* base, char* path, uint64_t* delay) {
+    char name[PATH_MAX + 8]; // base and extension
+    snprintf(name, sizeof (name), "%s.txt", base);
+    FILE* f = fopen(name, "w");
+    if (f == NULL) return false;
+    fprintf(f, "ECE537 ATeam Project Delay Values\nJohn Vennard & Jan Beran\nInput file: %s\n", path);
+    for (unsigned int k = 0; k < rateCount; k++) {
+        fprintf(f, "R = %u results in max delay = %" PRIu64 " ms\n", rates[k], delay[k]);
+    }
+    return (fclose(f) == 0);
+}
+
+// <base>.gp - the plot.sh graph, traces are read by gnuplot as binary records
+static bool writeGp(char* base, char* path, bool trace, uint64_t* delay) {
+    char name[PATH_MAX + 8]; // base and extension
+    snprintf(name, sizeof (name), "%s.gp", base);
+    FILE* f = fopen(name, "w");
+    if (f == NULL) return false;
+    fprintf(f, "set yrange [0:*]\nset xlabel \"ms\"\nset ylabel \"frame\"\nset term svg\nset nokey\n");
+    fprintf(f, "set output \"%s.svg\"\n", base);
+    for (unsigned int k = 0; k < rateCount; k++) {
+        fprintf(f, "F%u(x) = %u / 1000.0 * (x - %" PRIu64 ")\n", k + 1, rates[k], delay[k]);
+    }
+    if (trace) {
+        // columns: ns, seq, src, type, flags, reserved - data packets only
+        fprintf(f, "plot \"%s\" binary skip=%zu format=\"%%uint64%%uint32%%uint8%%uint8%%uint8%%uint8\" "
+                "using ($1 / 1000000):($4 == %u ? $2 : 1/0)", path, sizeof (trace_filehdr), TYPE_DATA);
+    } else {
+        fprintf(f, "plot \"%s\"", path);
+    }
+    for (unsigned int k = 0; k < rateCount; k++) fprintf(f, ", F%u(x)", k + 1);
+    fprintf(f, "\n");
+    return (fclose(f) == 0);
+}
+
+/* analyze one file: delays for all R values and arrival stats in one pass */
+static void analyze(an_job* job) {
+    size_t len;
+    const char* mem = mapFile(job->path, &len);
+    FILE* out = open_memstream(&job->report, &job->reportLen);
+    if (out == NULL) return;
+    if (mem == NULL) {
+        fprintf(out, "%s: Error: file could not be read\n", job->path);
+        fclose(out);
+        return;
+    }
+
+    bool trace = isTrace(mem, len);
+    uint64_t delay[AN_R_MAX] = {};
+    an_flow all = {};
+    an_flow servers[SERVER_MAX] = {};
+    uint64_t maxSeq = 0, reordered = 0, reorderSum = 0, reorderMax = 0, dups = 0;
+    const trace_rec* rec = (const trace_rec*) (mem + sizeof (trace_filehdr));
+    const trace_rec* recEnd = rec + (trace ? (len - sizeof (trace_filehdr)) / sizeof (trace_rec) : 0);
+    const char* p = mem;
+    for (;;) {
+        uint64_t ns, seq;
+        uint8_t src = 0, flags = 0;
+        if (trace) {
+            if (rec == recEnd) break;
+            ns = rec->ns;
+            seq = rec->seq;
+            src = rec->src;
+            flags = rec->flags;
+            if ((rec++)->type != TYPE_DATA) continue;
+        } else {
+            uint64_t ms;
+            if (!parseNum(&p, mem + len, &ms) || !parseNum(&p, mem + len, &seq)) break;
+            ns = ms * 1000000;
+        }
+
+        // lateness against every playback line, ms resolution like the data files
+        uint64_t x = ns / 1000000;
+        for (unsigned int k = 0; k < rateCount; k++) {
+            uint64_t due = seq * 1000 / rates[k];
+            if ((x > due) && (x - due > delay[k])) delay[k] = x - due;
+        }
+
+        if (seq < maxSeq) {
+            reordered++;
+            reorderSum += maxSeq - seq;
+            if (maxSeq - seq > reorderMax) reorderMax = maxSeq - seq;
+        } else if (seq == maxSeq) {
+            dups++;
+        } else {
+            maxSeq = seq;
+        }
+        bool retx = (flags & PKT_FLAG_RETX);
+        flowAdd(&all, ns, retx);
+        if (trace && (src < SERVER_MAX)) flowAdd(&servers[src], ns, retx);
+    }
+    munmap((void*) mem, len);
+
+    char base[PATH_MAX];
+    baseName(job->path, base, sizeof (base));
+    job->ok = writeTxt(base, job->path, delay) && writeGp(base, job->path, trace, delay);
+    fprintf(out, "%s: %" PRIu64 " data pkts (%s), last seq %" PRIu64 ", %.0f ms\n", job->path, all.pkts,
+            trace ? "trace" : "text", maxSeq, all.last / 1e6);
+    if (!job->ok) fprintf(out, "  Error: %s.txt / %s.gp could not be written\n", base, base);
+    fprintf(out, "  max delay:");
+    for (unsigned int k = 0; k < rateCount; k++) fprintf(out, " R=%u %" PRIu64 " ms%s", rates[k], delay[k], (k + 1 < rateCount) ? "," : "\n");
+    fprintf(out, "  reordered %" PRIu64 " pkts (%.1f%%), distance mean %.1f max %" PRIu64 ", %" PRIu64 " duplicates\n",
+            reordered, all.pkts ? 100.0 * reordered / all.pkts : 0, reordered ? (double) reorderSum / reordered : 0,
+            reorderMax, dups);
+    fprintf(out, "  all:      ");
+    flowPrint(out, &all, all.pkts);
+    for (unsigned int i = 0; i < SERVER_MAX; i++) {
+        if (servers[i].pkts == 0) continue;
+        fprintf(out, "  server %u: ", i);
+        flowPrint(out, &servers[i], all.pkts);
+    }
+    fclose(out);
+}
+
+static void* worker(void* arg) {
+    if (arg) arg = NULL;
+    for (;;) {
+        unsigned int j = __atomic_fetch_add(&nextJob, 1, __ATOMIC_RELAXED);
+        if (j >= jobCount) return NULL;
+        analyze(&jobs[j]);
+    }
+}
+
+static bool addJob(char* path) {
+    if (jobCount == AN_FILES_MAX) {
+        printf("Warning: more than %u input files, %s skipped\n", AN_FILES_MAX, path);
+        return false;
+    }
+    jobs[jobCount++].path = strdup(path);
+    return true;
+}
+
+// *.data files and traces in a directory tree
+static void addDir(char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) return;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof (path), "%s/%s", dir, e->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            addDir(path);
+            continue;
+        }
+        size_t n = strlen(e->d_name);
+        bool data = (n > 5) && (strcmp(e->d_name + n - 5, ".data") == 0);
+        if (!data) {
+            FILE* f = fopen(path, "r");
+            trace_filehdr hdr;
+            data = (f != NULL) && (fread(&hdr, sizeof (hdr), 1, f) == 1) && (hdr.magic == TRACE_MAGIC);
+            if (f != NULL) fclose(f);
+        }
+        if (data) addJob(path);
+    }
+    closedir(d);
+}
+
+// "10,25,30:100:10" - returns false if malformed or too many values
+static bool parseRates(char* list) {
+    rateCount = 0;
+    for (char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        unsigned int first, last, step = 1;
+        int n = sscanf(tok, "%u:%u:%u", &first, &last, &step);
+        if (n == 1) last = first;
+        if ((n < 1) || (first == 0) || (last < first) || (step == 0)) return false;
+        for (unsigned int r = first; r <= last; r += step) {
+            if (rateCount == AN_R_MAX) return false;
+            rates[rateCount++] = r;
+        }
+    }
+    return (rateCount > 0);
+}
+
+int main(int argc, char *argv[]) {
+    char defRates[] = "10:100:10";
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = (cpus > 0) ? (unsigned int) cpus : 1;
+    bool ok = parseRates(defRates);
+    int opt;
+    while ((opt = getopt(argc, argv, "r:j:o:")) != -1) {
+        switch (opt) {
+            case 'r':
+                ok = parseRates(optarg);
+                break;
+            case 'j':
+                threads = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                outName = optarg;
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+    if (threads > AN_THREADS_MAX) threads = AN_THREADS_MAX;
+    for (int i = optind; ok && (i < argc); i++) {
+        struct stat st;
+        if (stat(argv[i], &st) != 0) {
+            printf("Error: %s does not exist\n", argv[i]);
+            exit(1);
+        }
+        if (S_ISDIR(st.st_mode)) {
+            addDir(argv[i]);
+        } else {
+            addJob(argv[i]);
+        }
+    }
+    if (!ok || (optind == argc) || (threads < 1) || ((outName != NULL) && (jobCount != 1))) {
+        printf("Usage: %s [-r <R list>] [-j <threads 1-%u>] [-o <output name>] <file|dir> ...\n", argv[0], AN_THREADS_MAX);
+        printf("  R list: comma separated values and first:last:step ranges (default %s, at most %u values)\n",
+                "10:100:10", AN_R_MAX);
+        printf("  -o only with a single input file\n");
+        exit(1);
+    }
+    if (threads > jobCount) threads = (jobCount > 0) ? jobCount : 1;
+
+    uint64_t start = monotonicNs();
+    pthread_t pool[AN_THREADS_MAX];
+    for (unsigned int t = 0; t < threads; t++) pthread_create(&pool[t], NULL, worker, NULL);
+    for (unsigned int t = 0; t < threads; t++) pthread_join(pool[t], NULL);
+    double ms = (monotonicNs() - start) / 1e6;
+
+    bool allOk = true;
+    for (unsigned int j = 0; j < jobCount; j++) {
+        if (jobs[j].report != NULL) fwrite(jobs[j].report, 1, jobs[j].reportLen, stdout);
+        allOk = allOk && jobs[j].ok;
+        free(jobs[j].report);
+        free(jobs[j].path);
+    }
+    printf("%u files, %u R values, %u threads, %.1f ms\n", jobCount, rateCount, threads, ms);
+    return allOk ? 0 : 1;
+}
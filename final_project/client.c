@@ -13,50 +13,72 @@
  * 4. splice change value does not currently scale with frame size - must check
  */
 
-#define _BSD_SOURCE // for usleep
+#define _GNU_SOURCE // for usleep, recvmmsg
 #include <signal.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 #include "common.h"
 #include "packet_buffer.h"
+#include "client_ctl.h"
+#include "trace.h"
 
-    unsigned int debugMisSeq = 0;
-    struct timeval tvTest1, tvTest2;
-int currRate[4] = {[0 ... 3] = RATE_MAX};
+int currRate[SERVER_MAX] = {[0 ... SERVER_MAX - 1] = RATE_MAX};
 /* Variable Declarations */
-static char *saddr[4]; //server ip addresses
-static struct sockaddr_in server[4];
+static unsigned int serverCount = 0; //number of servers streaming the file
+static char *saddr[SERVER_MAX]; //server ip addresses
+static struct sockaddr_in server[SERVER_MAX];
 static int soc;
 
 //in/out packet structures
-static unsigned char pktIn[PKTLEN_DATA] = {};
+static unsigned char pktRx[PKTLEN_DATA] = {}; //single packet reads (file request)
 static unsigned char pktOut[PKTLEN_MSG] = {};
-static pkthdr_common* hdrIn = (pkthdr_common*) pktIn;
-static unsigned char* payloadIn = pktIn + HDRLEN;
-
-//rate calculations, splice variables and timers
-static struct timeval tvStart, tvRecv, tvCheck, tvSplice, tvSpliceAck;
-float srcpkts[4] = {};
-static uint8_t sendRatio[4] = {};
-static int oldRatio[4] = {}; //holds old ratios to check threshold for change
-bool started = false;
-bool startedSplice = false;
-bool ackdNewRatios = true;
-static bool ackdRatio[4] = {[0 ... 3] = false};
-static int lastPkt = 0;
-static unsigned int currTxRate = RATE_MAX; // server tx rate currently set
-FILE* graphDataFile;
-static pthread_mutex_t bufMutex;
+static unsigned char* pktIn = pktRx; //packet being processed, in pktRx or in the rx batch
+static pkthdr_common* hdrIn = (pkthdr_common*) pktRx;
+static unsigned char* payloadIn = pktRx + HDRLEN;
+
+//batched receive variables
+static unsigned char rxSlotMem[RX_GRO_SLOTS * RX_GRO_SIZE]; //datagram slots of one recvmmsg call (>= RX_BATCH_MAX * PKTLEN_DATA)
+static struct mmsghdr rxMsgs[RX_BATCH_MAX];
+static struct iovec rxIov[2 * RX_BATCH_MAX]; //datagram slot, or header and payload with rxZeroCopy
+static char rxCtrl[RX_BATCH_MAX][CMSG_SPACE(sizeof (int))]; //UDP_GRO segment size of each datagram
+static unsigned int rxSlots = RX_BATCH_MAX; //datagrams per recvmmsg call
+static bool groEnabled = false; //packets of one server may arrive coalesced
+static bool rxZeroCopy = false; //payloads are received straight into packet buffer slots
+static unsigned int bufWindow = 0; //packet buffer window (pkts), 0 = sized from the round trip of the request
+static unsigned int bufFlags = 0; //BUF_PREFAULT, BUF_MLOCK
+static packet_buffer* pktBuf = NULL; //created when the first reply to the request arrives
+static unsigned char rxHdr[RX_BATCH_MAX][HDRLEN]; //headers of the zero-copy datagrams
+static unsigned char* rxPayload[RX_BATCH_MAX]; //packet buffer slots lent to the zero-copy datagrams
+
+//splice, rate and lost packet control, timers
+static client_ctl ctl; //splice state is shared with the timer thread (guarded inside), the packet buffer needs no lock
+static struct timeval tvStart, tvRecv;
+static trace rxTrace; //received packets for the graph, written to GRAPH_TRACE_FILE
+static uint64_t rxNs; //receive time of the packets being processed (monotonicNs)
+static ev_loop rxLoop; //receive path event loop
+static unsigned int rxErrCount = 0;
+static bool rxSeen = false; //packet received since the last rx timeout check
+static bool timerStop = false; //the timer thread stops its loop at the next round (atomic)
+static bool finRecv[SERVER_MAX] = {}; //server sent its last packet, sent twice
+static unsigned int finCount = 0;
+static int rxDoneFd = -1; //the timer thread signals the rx loop that every packet up to the last seq was flushed
 
 /* Function Declarations */
 char* checkArgs(int argc, char *argv[]);
 bool plotGraph(void);
 void sigintHandler();
-bool spliceTx();
-void spliceAckCheck(int rxLen);
-bool spliceRatio(int rxLen);
 bool reqFile(char** filename);
+bool initBuffer(char* filename, uint64_t reqNs);
 bool receiveMovie();
-bool calcSplice();
+void sendCtl(void* arg, unsigned int i, unsigned char* pkt);
+int rxPacket(unsigned char* pkt, unsigned char** payload, int rxLen, bool* success);
+void initRx(int soc);
+unsigned int rxSegSize(struct msghdr* msg, unsigned int len);
+bool rxZeroCopyBatch(int count, bool* success);
+void onRxSocket(int soc, void* arg);
+void onRxTimeout(int timer, void* arg);
+void onRxDone(int fd, void* arg);
+void onCheckTimer(int timer, void* arg);
 int restrictServer();
 int increaseServer();
 
@@ -64,7 +86,7 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, sigintHandler);
     char* filename = checkArgs(argc, argv);
 
-    soc = udpInit(UDP_PORT + 1, RECV_TIMEOUT);  
+    soc = udpInit(NULL, UDP_PORT + 1, RECV_TIMEOUT);  
     if (soc == -1) {
         printf("Error: UDP socket could not be initialized, program stopped\n");
         exit(1);
@@ -72,6 +94,13 @@ int main(int argc, char *argv[]) {
         dprintf("UDP socket initialized, SOCID=%d\n", soc);
     }
 
+    // splice ratios, rates and NAKs are decided by the control logic, sent through the socket
+    if (!ctlInit(&ctl, serverCount, sendCtl, NULL, (unsigned int) time(NULL))) {
+        printf("Error: Stream control could not be initialized, program stopped\n");
+        close(soc);
+        exit(1);
+    }
+
     // start transmission of file
     printf("Requesting file '%s' from servers\n", filename);
     if (reqFile(&filename) == false) {
@@ -98,227 +127,303 @@ int main(int argc, char *argv[]) {
     if (plotGraph() == false) {
         printf("Warning: Graph could not be plotted\n");
     } else {
-        printf("Data successfully calculated up to packet %i: see out.pdf and out.txt\n",lastPkt);
+        printf("Data successfully calculated up to packet %i: see out.pdf and out.txt\n",ctl.lastPkt);
     }
     */
 
     return 0;
 }
 
-//TODO changing to decrease send rates depending on splice ratio
-bool checkRateLost(void) { // adjust tx rates
-    double bufOc = bufGetOccupancy();
-    dprintf("bufOc = %f\n",bufOc);
-    if ((bufOc > BUF_MAX_OCCUP) || (bufOc < BUF_MIN_OCCUP)) {
-        /*
-        //TODO added code
-        if (bufOc > BUF_MAX_OCCUP) {
-            int selServer = restrictServer();
-            dprintf("restricting rate of SERVER %i\n",selServer);
-            if (selServer == -1) { //send to all
-                for (int i = 0; i < 4; i++) {
-                    if (currRate[i] >= 2) {
-                        currRate[i] /= 2;
-                        if (fillpkt(pktOut, ID_CLIENT, i, TYPE_RATE, currRate[i], 0, 0) == false) return false;
-                        sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &server[i], sizeof (server[i]));
-                    }
-                }
-            } else { //send to one server
-                if (currRate[selServer] >= 2) {
-                    currRate[selServer] /= 2;
-                    if (fillpkt(pktOut, ID_CLIENT, selServer, TYPE_RATE, currRate[selServer], 0, 0) == false) return false;
-                    sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &server[selServer], sizeof (server[selServer]));
-                }
+/* timer round: flush the buffer, adjust rates, request lost packets */
+void onCheckTimer(int timer, void* arg) {
+    if (timer) timer = 0; // dummy arg usage
+    if (__atomic_load_n(&timerStop, __ATOMIC_ACQUIRE)) {
+        evStop((ev_loop*) arg); // streaming finished, the packet buffer is about to be destroyed
+        return;
+    }
+    // the buffer takes packets from the rx thread meanwhile, this thread is its only consumer
+    printf("New timer round\n");
+    bufFlushFrame(pktBuf);        
+    if (ctlStreamDone(&ctl)) {
+        // whole file flushed, wake the rx loop up and stop
+        eventfd_write(rxDoneFd, 1);
+        evStop((ev_loop*) arg);
+        return;
+    }
+    ctlTimerRound(&ctl); // check Lost packets TODO slow down this check need to allow time for packet to be recieved
+}
+
+void* timerProc(void* arg) {   
+    if (arg) arg=NULL; // dummy arg usage
+    // periodic timerfd, rounds do not drift by the time spent in them
+    ev_loop timerLoop;
+    if (!evInit(&timerLoop)) return NULL;
+    int timer = evAddTimer(&timerLoop, onCheckTimer, &timerLoop);
+    if ((timer == -1) || !evSetTimer(timer, BUF_CHECK_TIME * 1000ULL, BUF_CHECK_TIME * 1000ULL)) {
+        printf("Error: Timer could not be started\n");
+        return NULL;
+    }
+    evRun(&timerLoop);
+    evClose(&timerLoop);
+    return NULL;
+}
+
+/* process one received packet, returns RX_OK to continue, RX_TERMINATED when the stream ended
+ * payload follows the header or is a lent buffer slot (rxZeroCopy), exchanged for a free one when the buffer keeps it */
+int rxPacket(unsigned char* pkt, unsigned char** payload, int rxLen, bool* success) {
+    pktIn = pkt;
+    hdrIn = (pkthdr_common*) pkt;
+    payloadIn = *payload;
+    int rxRes = checkRxStatus(rxLen, pktIn, ID_CLIENT);
+    if (rxRes == RX_TERMINATED) {
+        *success = false;
+        return RX_TERMINATED;
+    } else if (rxRes != RX_OK) {
+        rxErrCount++;
+        return rxRes;
+    }
+    traceRecord(&rxTrace, rxNs, hdrIn);
+
+    switch (hdrIn->type) {
+        case TYPE_SPLICE_ACK:
+        case TYPE_DATA:
+            // expected type - deal with splice ratios
+            if (ctlRxPacket(&ctl, pktIn, rxLen) == false) {
+                printf("Error in spliceRatio function\n");
+                return RX_OK;
             }
-        } else if (bufOc < BUF_MIN_OCCUP) {
-            int selServer = increaseServer();
-            dprintf("increasing rate of SERVER %i\n",selServer);
-            if (selServer != -1) {
-                currRate[selServer] += 2;
-                if (fillpkt(pktOut, ID_CLIENT, selServer, TYPE_RATE, currRate[selServer], 0, 0) == false) return false;
-                sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &server[selServer], sizeof (server[selServer]));
+            break;
+        case TYPE_FIN:
+            // last seq of the stream, the servers still answer NAKs, the timer thread ends the stream when all is flushed
+            if (hdrIn->seq > 0) {
+                ctlSetEnd(&ctl, hdrIn->seq);
+                return RX_OK;
             }
-        }
-        */
-        //TODO end 
-        if ((bufOc > BUF_MAX_OCCUP) && (currTxRate >= 2)) {
-            currTxRate /= 2; dprintf("Decreased desired tx rate, RATE=%u\n", currTxRate);
-            // broadcast decrease rate request to all servers
-            for (int i = 0; i < 4; i++) {
-                if (fillpkt(pktOut, ID_CLIENT, i, TYPE_RATE, currTxRate, (unsigned char*) &currTxRate, sizeof (unsigned int)) == false) {
-                    return false;
-                }
-                sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &server[i], sizeof (server[i]));
-                //dprintPkt(pktOut, PKTLEN_MSG, true);
-            }
-        } else if ((bufOc < BUF_MIN_OCCUP) && (currTxRate + 2 <= RATE_MAX)) {
-            currTxRate += 2;
-            dprintf("Increased desired tx rate, RATE=%u\n", currTxRate);
-            // broadcast increase rate request to all servers
-            for (int i = 0; i < 4; i++) {
-                if (fillpkt(pktOut, ID_CLIENT, i, TYPE_RATE, currTxRate, (unsigned char*) &currTxRate, sizeof (unsigned int)) == false) {
-                    return false;
-                }
-                sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &server[i], sizeof (server[i]));
-                //dprintPkt(pktOut, PKTLEN_MSG, true);
+            // no last seq, the others may still be sending their share, the stream ends with the last FIN
+            if ((hdrIn->src < serverCount) && !finRecv[hdrIn->src]) {
+                finRecv[hdrIn->src] = true;
+                finCount++;
             }
+            if (finCount < serverCount) return RX_OK;
+            *success = true;
+            return RX_TERMINATED;
+        default:
+            printf("Warning: Received an unexpected packet type, ignoring it\n");
+            rxErrCount++;
+            return RX_UNKNOWN_PKT;
+    }
+
+    if (hdrIn->type != TYPE_DATA) return RX_OK; //hotfix
+
+    // a retransmission of an answered NAK is a duplicate, the buffer has or had the packet
+    if (ctlNakAnswer(&ctl, hdrIn) == false) return RX_OK;
+
+    // add received packet in the buffer, a lent slot is handed over instead of copied
+    if ((rxZeroCopy ? bufCommit(pktBuf, hdrIn->seq, payload) : bufAdd(pktBuf, hdrIn->seq, payloadIn)) == false) {
+        printf("Warning: Buffer write error, SEQ=%u\n", hdrIn->seq);
+    }
+    return RX_OK;
+}
+
+/* prepare the recvmmsg slots, coalesced datagrams need bigger (and fewer) slots */
+void initRx(int soc) {
+    int one = 1;
+    int size = RX_RCVBUF;
+    if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size)) != 0) {
+        printf("Warning: Socket receive buffer could not be enlarged\n");
+    }
+    if (rxZeroCopy) {
+        //header and payload of every datagram land in separate buffers, each packet needs its own slot (no GRO)
+        for (unsigned int i = 0; i < RX_BATCH_MAX; i++) {
+            rxPayload[i] = bufGetSlot(pktBuf);
+            rxIov[2 * i].iov_base = rxHdr[i];
+            rxIov[2 * i].iov_len = HDRLEN;
+            rxIov[2 * i + 1].iov_base = rxPayload[i];
+            rxIov[2 * i + 1].iov_len = DATALEN;
+            memset(&rxMsgs[i], 0, sizeof (rxMsgs[i]));
+            rxMsgs[i].msg_hdr.msg_iov = &rxIov[2 * i];
+            rxMsgs[i].msg_hdr.msg_iovlen = 2;
         }
+        rxSlots = RX_BATCH_MAX;
+        printf("Rx batch %u datagrams, zero-copy into buffer slots\n", rxSlots);
+        return;
+    }
+    groEnabled = (setsockopt(soc, SOL_UDP, UDP_GRO, &one, sizeof (one)) == 0);
+    rxSlots = groEnabled ? RX_GRO_SLOTS : RX_BATCH_MAX;
+    unsigned int slotSize = groEnabled ? RX_GRO_SIZE : PKTLEN_DATA;
+    for (unsigned int i = 0; i < rxSlots; i++) {
+        rxIov[i].iov_base = rxSlotMem + i * slotSize;
+        rxIov[i].iov_len = slotSize;
+        memset(&rxMsgs[i], 0, sizeof (rxMsgs[i]));
+        rxMsgs[i].msg_hdr.msg_iov = &rxIov[i];
+        rxMsgs[i].msg_hdr.msg_iovlen = 1;
+        if (groEnabled) rxMsgs[i].msg_hdr.msg_control = rxCtrl[i];
+    }
+    printf("Rx batch %u datagrams, %s\n", rxSlots, groEnabled ? "UDP GRO" : "recvmmsg");
+}
+
+/* process a zero-copy batch, the next packets go to the slots the buffer gave back, false to stop */
+bool rxZeroCopyBatch(int count, bool* success) {
+    bool stop = false;
+    for (int i = 0; (i < count) && !stop; i++) {
+        stop = (rxPacket(rxHdr[i], &rxPayload[i], rxMsgs[i].msg_len, success) == RX_TERMINATED) ||
+                (rxErrCount >= MAX_ERR_COUNT);
+        rxIov[2 * i + 1].iov_base = rxPayload[i];
+    }
+    return !stop;
+}
+
+/* size of the packets coalesced in a datagram, len if it holds a single packet */
+unsigned int rxSegSize(struct msghdr* msg, unsigned int len) {
+    if (!groEnabled) return len;
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if ((cm->cmsg_level != SOL_UDP) || (cm->cmsg_type != UDP_GRO)) continue;
+        int segSize;
+        memcpy(&segSize, CMSG_DATA(cm), sizeof (segSize));
+        if (segSize > 0) return segSize;
     }
+    return len;
+}
 
-    // request lost packets
-    uint32_t lostSeq = bufGetFirstLost();
-    int numMissing = 0;
-    if (lostSeq > 0) dprintf("Sending lost pkt requests:\n");
-    while (lostSeq > 0) {
-        //dprintf("Detected lost packet, SEQ=%u\n", lostSeq);
+/* socket readable: drain it in batches */
+void onRxSocket(int soc, void* arg) {
+    bool* success = (bool*) arg;
 
-        //TODO adding better missing packet redirection
-        int tthresh = (SPLICE_FRAME / SPLICE_IGNORE_THRESH);
-        bool selServer[4] = {[0 ... 3] = true};
-        for (int i = 0; i < 4; i++) {
-            if (sendRatio[i] < tthresh) selServer[i] = false; 
+    while (1) {
+        for (unsigned int i = 0; i < rxSlots; i++) {
+            rxMsgs[i].msg_hdr.msg_controllen = groEnabled ? sizeof (rxCtrl[i]) : 0;
+        }
+        int count = recvmmsg(soc, rxMsgs, rxSlots, 0, NULL);
+        if ((count < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return; // drained
+        rxSeen = true;
+        if (count < 0) {
+            printf("Warning: Rx error occurred\n");
+            if (++rxErrCount >= MAX_ERR_COUNT) evStop(&rxLoop);
+            return;
         }
-        bool selected = false;
-        int finalSelection = 0;
-        while (!selected) {
-            srand(time(NULL));
-            finalSelection = (rand() + numMissing) % 4;
-            if (selServer[finalSelection] == true) {
-                //dprintf("Picked server %i to send missing packet request to\n",finalSelection);
-                selected = true;
+        gettimeofday(&tvRecv, NULL); //one timestamp for the whole batch
+        rxNs = monotonicNs();
+
+        bool stop = false;
+        if (rxZeroCopy) stop = !rxZeroCopyBatch(count, success);
+        for (int i = 0; (i < count) && !stop && !rxZeroCopy; i++) {
+            unsigned char* pkt = (unsigned char*) rxIov[i].iov_base;
+            unsigned int len = rxMsgs[i].msg_len;
+            unsigned int segSize = rxSegSize(&rxMsgs[i].msg_hdr, len);
+            //split coalesced datagrams, the last packet may be shorter
+            for (unsigned int off = 0; !stop;) {
+                unsigned int segLen = (len - off < segSize) ? len - off : segSize;
+                unsigned char* payload = pkt + off + HDRLEN;
+                stop = (rxPacket(pkt + off, &payload, segLen, success) == RX_TERMINATED) || (rxErrCount >= MAX_ERR_COUNT);
+                off += segSize;
+                if (off >= len) break;
             }
         }
-        int maxServer = finalSelection;
-        dprintf("MIS SEQ=%u to S: %i\n",lostSeq,maxServer);
-        if (debugMisSeq == 0) {
-            debugMisSeq = lostSeq;
-            gettimeofday(&tvTest1, NULL);
+        if (stop) {
+            evStop(&rxLoop);
+            return;
         }
-
-
-        if (fillpkt(pktOut, ID_CLIENT, maxServer, TYPE_NAK, lostSeq, NULL, 0) == false) {
-            return false;
-        }
-        sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &server[maxServer], sizeof (server[maxServer]));
-        //dprintPkt(pktOut, PKTLEN_MSG, true);
-
-        lostSeq = bufGetNextLost();
-        numMissing++;
-        //return true; //TODO DEBUG TRYING TO ONLY SEND ONE MISSING PKT REQUEST PER TIMER ENTRY
     }
-    dprintf("Total Missing pkts = %i\n",numMissing);
-    
-    return true;
 }
 
-void* timerProc(void* arg) {   
-    if (arg) arg=NULL; // dummy arg usage
-    while (1) {        
-        usleep(BUF_CHECK_TIME); // sleep 100 ms        
-        pthread_mutex_lock(&bufMutex);
-        printf("New timer round\n");
-        bufFlushFrame();        
-        checkRateLost(); // check Lost packets TODO slow down this check need to allow time for packet to be recieved
-        pthread_mutex_unlock(&bufMutex);
+/* no packet for RECV_TIMEOUT secs */
+void onRxTimeout(int timer, void* arg) {
+    if (timer) timer = 0; // dummy arg usage
+    if (arg) arg = NULL;
+    if (rxSeen) {
+        rxSeen = false;
+        return;
     }
+    dprintf("Rx timeout on socket / nothing received\n");
+    if (++rxErrCount >= MAX_ERR_COUNT) evStop(&rxLoop);
+}
+
+/* every packet up to the last seq was flushed (timer thread) */
+void onRxDone(int fd, void* arg) {
+    eventfd_t val;
+    eventfd_read(fd, &val);
+    *((bool*) arg) = true;
+    evStop(&rxLoop);
 }
 
 bool receiveMovie(void) {
-    struct sockaddr_in sender;
-    unsigned int senderSize = sizeof (sender);
-    unsigned int errCount = 0;
+    bool success = false;
 
-    pthread_mutex_init(&bufMutex, NULL);
+    rxDoneFd = eventfd(0, EFD_NONBLOCK);
+    if (rxDoneFd == -1) {
+        printf("Error: Stream end signal could not be created\n");
+        return false;
+    }
     pthread_t timerThread;
     if (pthread_create(&timerThread, NULL, &timerProc, NULL) != 0) {
         printf("Error: Timer could not be created\n");
         return false;
     }
 
-    while (errCount < MAX_ERR_COUNT) {
-        memset(pktIn, 0, PKTLEN_DATA);
-        gettimeofday(&tvRecv, NULL);
-        int rxLen = recvfrom(soc, pktIn, PKTLEN_DATA, 0, (struct sockaddr*) &sender, &senderSize);
-
-        int rxRes = checkRxStatus(rxLen, pktIn, ID_CLIENT);
-        if (rxRes == RX_TERMINATED) {
-            fclose(graphDataFile);
-            bufFinish();
-            return false;
-        } else if (rxRes != RX_OK) {
-            errCount++;
-            continue;
-        }
+    // socket is drained by the event loop, recv timeout is replaced by a timer
+    int opts = fcntl(soc, F_GETFL);
+    opts = (opts | O_NONBLOCK);
+    fcntl(soc, F_SETFL, opts);
+    initRx(soc);
 
-        switch (hdrIn->type) {
-            case TYPE_SPLICE_ACK:
-            case TYPE_DATA:
-                // expected type - deal with splice ratios
-                if (spliceRatio(rxLen) == false) {
-                    printf("Error in spliceRatio function\n");
-                    continue;
-                }
-                break;
-            case TYPE_FIN:
-                fclose(graphDataFile);
-                bufFinish();
-                return true;
-            default:
-                printf("Warning: Received an unexpected packet type, ignoring it\n");
-                errCount++;
-                continue;
-        }
-
-        //store last sequence number received
-        lastPkt = hdrIn->seq;
-        if (hdrIn->type != TYPE_DATA) continue; //hotfix
-
-        //DEBUG check missing pkt
-        if (hdrIn->seq == debugMisSeq) {
-            gettimeofday(&tvTest2, NULL);
-            unsigned int diffTest = timeDiff(&tvTest1, &tvTest2);
-            printf("GOT THE FIRST MISSING PKT = %i after %i ms\n",debugMisSeq,diffTest);
-            //exit(1);
-        }
-        
-        // add received packet in the buffer
-        pthread_mutex_lock(&bufMutex);
-        if (bufAdd(hdrIn->seq, payloadIn) == false) {
-            printf("Warning: Buffer write error, SEQ=%u\n", hdrIn->seq);
-        }
-        pthread_mutex_unlock(&bufMutex);
-        unsigned int diff = timeDiff(&tvStart, &tvRecv);
-        if ((diff == UINT_MAX) || (fprintf(graphDataFile, "%u %u\n", diff, hdrIn->seq) < 0)) {
-            printf("Warning: Graph data file write error\n");
+    int timeout = -1;
+    if (evInit(&rxLoop) && evAddFd(&rxLoop, soc, onRxSocket, &success) && evAddFd(&rxLoop, rxDoneFd, onRxDone, &success)) {
+        timeout = evAddTimer(&rxLoop, onRxTimeout, NULL);
+    }
+    if ((timeout == -1) || !evSetTimer(timeout, RECV_TIMEOUT * 1000000000ULL, RECV_TIMEOUT * 1000000000ULL)) {
+        printf("Error: Event loop could not be created\n");
+        return false;
+    }
+    rxSeen = true;
+    evRun(&rxLoop);
+    evClose(&rxLoop);
+
+    if (rxErrCount >= MAX_ERR_COUNT) printf("Error: Received maximum number of subsequent bad packets\n");
+    traceClose(&rxTrace);
+    __atomic_store_n(&timerStop, true, __ATOMIC_RELEASE);
+    pthread_join(timerThread, NULL);
+    close(rxDoneFd);
+    bufFlushFrame(pktBuf); // packets received since the last timer round
+    if (success) {
+        // the servers keep the sessions for NAKs until told the stream is over
+        for (int j = 0; j < 2; j++) {
+            for (unsigned int i = 0; i < serverCount; i++) {
+                if (fillpkt(pktOut, ID_CLIENT, i, TYPE_FIN, 0, NULL, 0)) sendCtl(NULL, i, pktOut);
+            }
         }
     }
-
-    printf("Error: Received maximum number of subsequent bad packets\n");
-    fclose(graphDataFile);
-    bufFinish();
-    return false;
+    printf("Stream stats: %" PRIu64 " NAK lists, %" PRIu64 " NAK seqs (%" PRIu64 " retries, %" PRIu64 " held), %" PRIu64
+            " duplicate retx, %" PRIu64 " splice changes, %" PRIu64 " rate changes, %" PRIu64 " buffer stalls\n",
+            ctl.stats.nakPkts, ctl.stats.nakSeqs, ctl.stats.nakRetries, ctl.stats.nakHeld, ctl.stats.retxDups,
+            ctl.stats.spliceTx, ctl.stats.rateTx, bufGetStalls(pktBuf));
+    for (unsigned int i = 0; i < serverCount; i++) {
+        printf("Server %u: round trip %u us (+-%u), NAK timeout %u us\n", i, ctl.rtt[i].srtt, ctl.rtt[i].rttvar, ctl.rtt[i].rto);
+    }
+    bufDestroy(pktBuf);
+    pktBuf = NULL;
+    ctlClose(&ctl);
+    return success;
 }
 
 bool reqFile(char** filename) {
     struct sockaddr_in sender;
-    unsigned char pkt[4][PKTLEN_MSG];
+    unsigned char pkt[SERVER_MAX][PKTLEN_MSG];
     unsigned int senderSize = sizeof (sender);
     unsigned int errCount = 0;
-    unsigned int serverAck[4] = {[0 ... 3] = false};
+    bool serverAck[SERVER_MAX] = {};
     bool done = false;
 
-    // create graph file
-    graphDataFile = fopen(GRAPH_DATA_FILE, "w");
-    if (graphDataFile == NULL) {
-        printf("Error: Graph file could not be created, program stopped\n");
+    // start the receive trace, its time base is the request
+    if (traceOpen(&rxTrace, GRAPH_TRACE_FILE) == false) {
+        printf("Error: Graph trace could not be created, program stopped\n");
         return false;
     }
 
-    //create targets and fill request data for all servers
-    int i;
-    for (i = 0; i < 4; i++) {
+    //create targets and fill request data for all servers, seq tells the servers how many there are
+    unsigned int i;
+    for (i = 0; i < serverCount; i++) {
         if (initHostStruct(&server[i], saddr[i], UDP_PORT) == false) return false;
-        if (fillpkt(pkt[i], ID_CLIENT, i, TYPE_REQ, 0, (unsigned char*) *filename, strlen(*filename)) == false) return false;
+        if (fillpkt(pkt[i], ID_CLIENT, i, TYPE_REQ, serverCount, (unsigned char*) *filename, strlen(*filename)) == false) return false;
         sendto(soc, pkt[i], PKTLEN_MSG, 0, (struct sockaddr*) &server[i], sizeof (server[i]));
     }
 
@@ -327,52 +432,56 @@ bool reqFile(char** filename) {
     char streamedFilename[strlen(*filename) + 10];
     snprintf(streamedFilename, strlen(*filename) + 10, "client_%s", *filename);
 
-    // init packet buffer
-    if (bufInit(streamedFilename) == false) {
-        printf("Error: packet buffer could not be initialized, program stopped\n");
-        return false;
-    }
-
-    // send the request and receive a reply
+    // send the request and receive a reply, the packet buffer is sized when the first reply arrives
+    struct timeval tvReq;
+    uint64_t reqNs = monotonicNs();
+    bool bufReady = false;
     gettimeofday(&tvStart, NULL); //start time from acknowledge of start request
+    tvReq = tvStart;
     while (errCount < MAX_ERR_COUNT) {
         //check for acks from each server
         done = true;
-        for (i = 0; i < 4; i++) if (!serverAck[i]) done = false;
+        for (i = 0; i < serverCount; i++) if (!serverAck[i]) done = false;
         if (done) {
             printf("Received all acks from servers!\n");
             return true;
         }
+        //request or ack lost (the first bursts of many servers can overflow the socket), ask again
+        gettimeofday(&tvRecv, NULL);
+        if (timeDiff(&tvReq, &tvRecv) > REQ_RETRY_TIME) {
+            for (i = 0; i < serverCount; i++) {
+                if (!serverAck[i]) sendto(soc, pkt[i], PKTLEN_MSG, 0, (struct sockaddr*) &server[i], sizeof (server[i]));
+            }
+            tvReq = tvRecv;
+            reqNs = monotonicNs();
+        }
         //read acks from servers
         memset(pktIn, 0, PKTLEN_DATA);
         int rxRes = recvfrom(soc, pktIn, PKTLEN_DATA, 0, (struct sockaddr*) &sender, &senderSize);
         gettimeofday(&tvRecv, NULL);
+        rxNs = monotonicNs();
         rxRes = checkRxStatus(rxRes, pktIn, ID_CLIENT);
         if (rxRes == RX_TERMINATED) return false;
         if (rxRes != RX_OK) continue;
-        if (hdrIn->src > 3) {
+        if (hdrIn->src >= serverCount) {
             printf("Error: invalid server source\n");
             return false;
         }
+        traceRecord(&rxTrace, rxNs, hdrIn);
+        if (!bufReady && ((hdrIn->type == TYPE_REQACK) || (hdrIn->type == TYPE_DATA))) {
+            if (!initBuffer(streamedFilename, reqNs)) return false;
+            bufReady = true;
+        }
         switch (hdrIn->type) {
             case TYPE_REQACK:
                 serverAck[hdrIn->src] = true;
                 continue;
             case TYPE_DATA:
-                //Receive packet before all acks from servers received 
-                if (serverAck[hdrIn->src]) {
-                    // add received packet in the buffer
-                    pthread_mutex_lock(&bufMutex);
-                    if (bufAdd(hdrIn->seq, payloadIn) == false) {
-                        printf("Warning: Buffer write error, SEQ=%u\n", hdrIn->seq);
-                    }
-                    pthread_mutex_unlock(&bufMutex);
-                    unsigned int diff = timeDiff(&tvStart, &tvRecv);
-                    if ((diff == UINT_MAX) || (fprintf(graphDataFile, "%u %u\n", diff, hdrIn->seq) < 0)) {
-                        printf("Warning: Graph data file write error\n");
-                    }
-                } else {
-                    dprintf("Warning: got data pkt before acknowledge from that server\n");
+                //Receive packet before all acks from servers received, the server got the request even if its ack was lost
+                serverAck[hdrIn->src] = true;
+                // add received packet in the buffer
+                if (bufAdd(pktBuf, hdrIn->seq, payloadIn) == false) {
+                    printf("Warning: Buffer write error, SEQ=%u\n", hdrIn->seq);
                 }
                 continue;
                 break;
@@ -389,130 +498,43 @@ bool reqFile(char** filename) {
     return false;
 }
 
-bool calcSplice() {
-    float total = srcpkts[0] + srcpkts[1] + srcpkts[2] + srcpkts[3];
-    float srcRatio[4];
-    for (int i = 0; i < 4; i++) srcRatio[i] = (srcpkts[i] / total);
-    float check = 0;
-    for (int i = 0; i < 4; i++) check += srcRatio[i];
-    dprintf("Src pkts recorded: 1 - %f, 2 - %f, 3 - %f, 4 - %f\nTotal: %f\n",srcpkts[0],srcpkts[1],srcpkts[2],srcpkts[3],total);
-    for (int i = 0; i < 4; i++) srcpkts[i] = 0; //clear packet data
-    if (check != 1) {
-        printf("Error with splice ratio check (= %.10f)\n", check);
-    }
-    for (int i = 0; i < 4; i++) sendRatio[i] = (int) (srcRatio[i] * SPLICE_FRAME);
-    return true;
-}
-
-bool spliceRatio(int rxLen) {
-    int checkTime, i;
-
-    //check for splice acks
-    if (!ackdNewRatios) spliceAckCheck(rxLen);
-    //if (hdrIn->type == TYPE_SPLICE_ACK) return true;
-
-    //check that packet is of valid type before recording
-    if (hdrIn->type == TYPE_DATA) {
-        //record where packet came from
-        int src = checkRxSrc(rxLen, pktIn, ID_CLIENT);
-        if ((src < 0) || (src > 3)) return false;
-        srcpkts[src]++;
-    } else if (hdrIn->type == TYPE_SPLICE_ACK){
-        return true;
-    } else {
-        return false;
+/* init the packet buffer, window for the rate of all servers and the round trip of the request */
+bool initBuffer(char* filename, uint64_t reqNs) {
+    unsigned int rttUs = (unsigned int) ((monotonicNs() - reqNs) / 1000);
+    unsigned int pktRate = serverCount * RATE_MAX;
+    unsigned int window = bufWindow;
+    if (window == 0) {
+        window = bufBdpWindow(pktRate, rttUs);
+        printf("Request round trip %u us, %u pkts/s expected\n", rttUs, pktRate);
     }
-
-    //timer trigger for splice ratio calculations
-    if (!started) {
-        gettimeofday(&tvSplice, NULL);
-        started = true;
-        return true;
-    } else {
-        gettimeofday(&tvCheck, NULL);
-        checkTime = timeDiff(&tvSplice, &tvCheck);
+    pktBuf = bufCreate(filename, window, bufFlags);
+    if (pktBuf == NULL) {
+        printf("Error: packet buffer could not be initialized, program stopped\n");
+        return false;
     }
-    if (checkTime > SPLICE_DELAY) {
-        gettimeofday(&tvSplice, NULL);
-        if (!calcSplice()) {
-            printf("Error recalculating splice after ack timeout\n");
-        }
-        if (!startedSplice) {
-            for (i = 0; i < 4; i++) oldRatio[i] = sendRatio[i];
-            startedSplice = true;
-        } else {
-            //calculate total of absolute value of change of each ratio
-            int change = 0;
-            for (i = 0; i < 4; i++) change += abs(sendRatio[i] - oldRatio[i]); //TODO must scale with frame size
-            for (i = 0; i < 4; i++) oldRatio[i] = sendRatio[i];
-            dprintf("Splice Check: time = %i, ratios:\n", checkTime);
-            for (i = 0; i < 4; i++) printf("%i: %i\n", i, sendRatio[i]);
-            dprintf("change value: %i\n", change);
-            if ((change >= SPLICE_THRESH)&&(ackdNewRatios)) {
-                //send ratio to servers
-                printf("Change (%i) exceeded at time %i, sending new splice ratios\n", change, checkTime);
-                if (!spliceTx()) return false;
-            }
-        }
+    printf("Packet buffer window %u pkts\n", bufGetWindow(pktBuf));
+    if (!ctlSetBuffer(&ctl, pktBuf)) {
+        printf("Error: Lost packet lists could not be allocated\n");
+        return false;
     }
+    ctlSeedRtt(&ctl, rttUs); // first NAK timeouts, until retransmissions are sampled
     return true;
 }
 
-void spliceAckCheck(int rxLen) {
-    int i;
-    //check splice timeout
-    gettimeofday(&tvCheck, NULL);
-    int check = timeDiff(&tvSpliceAck, &tvCheck);
-    if (check > (SPLICE_DELAY / 8)) { //TODO mess with this timiing - important
-        printf("Warning: Splice ack timeout, resending ratios\n");
-        gettimeofday(&tvSplice, NULL);
-        if (!calcSplice()) { //recalculate splice ratios on timeout
-            printf("Error recalculating splice after ack timeout\n");
-        }
-        if (!spliceTx()) {
-            printf("Error: Failed to resend splice ratios\n");
-        }
-    }
-    //read splice ack
-    if (hdrIn->type == TYPE_SPLICE_ACK) {
-        int src = checkRxSrc(rxLen, pktIn, ID_CLIENT);
-        if ((src < 0) || (src > 3)) {
-            printf("Error: Splice ack contains invalid src\n");
-        } else {
-            ackdRatio[src] = true;
-        }
-    }
-    //exclude extremely congested lines from needing ack
-    int tthresh = (SPLICE_FRAME / SPLICE_IGNORE_THRESH);
-    for (i = 0; i < 4; i++) if (sendRatio[i] <= tthresh) ackdRatio[i] = true;
-
-    //check for all four acks
-    ackdNewRatios = true;
-    for (i = 0; i < 4; i++) if (!ackdRatio[i]) ackdNewRatios = false;
-    if (ackdNewRatios) dprintf("Splice ack success! Got all 4 acks\n");
-}
-
-bool spliceTx() {
-    uint8_t i, j;
-    uint32_t seqGap = lastPkt + SPLICE_GAP;
-    ackdNewRatios = false;
-    for (i = 0; i < 4; i++) ackdRatio[i] = false;
-
-    //double tap sending splice ratios - TODO see if necessary
-    for (j = 0; j < 1; j++) {
-        for (i = 0; i < 4; i++) {
-            if (fillpktSplice(pktOut, i, seqGap, sendRatio) == false) return false;
-            if (initHostStruct(&server[i], saddr[i], UDP_PORT) == false) return false;
-            sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &server[i], sizeof (server[i]));
-        }
-    }
-    dprintf("Sent splice ratios!!!\n");
-    gettimeofday(&tvSpliceAck, NULL);
-    return true;
+/* control packet to server i (splice ratios, rate, NAK lists) */
+void sendCtl(void* arg, unsigned int i, unsigned char* pkt) {
+    if (arg) arg = NULL; // dummy arg usage
+    sendto(soc, pkt, PKTLEN_MSG, 0, (struct sockaddr*) &server[i], sizeof (server[i]));
 }
 
 bool plotGraph(void) {
-    char cmd[strlen(GRAPH_DATA_FILE) + strlen(GNUPLOT_SCRIPT) + 10];
+    char cmd[strlen(GRAPH_TRACE_FILE) + strlen(GRAPH_DATA_FILE) + strlen(GNUPLOT_SCRIPT) + 20];
+
+    // convert the binary trace to the "ms seq" data file
+    snprintf(cmd, sizeof (cmd), "./tracedump %s > %s", GRAPH_TRACE_FILE, GRAPH_DATA_FILE);
+    if (system(cmd) != 0) {
+        return false;
+    }
 
     // set gnuplot script permissions
     snprintf(cmd, sizeof (cmd), "chmod +x %s", GNUPLOT_SCRIPT);
@@ -533,9 +555,9 @@ void sigintHandler() {
     signal(SIGINT, sigintHandler);
     printf("\nShutting down streaming service...\n");
     //send kill signal to servers
-    int i, j;
+    unsigned int i, j;
     for (j = 0; j < 2; j++) {
-        for (i = 0; i < 4; i++) {
+        for (i = 0; i < serverCount; i++) {
             fillpkt(pktOut, ID_CLIENT, i, TYPE_FIN, 0, NULL, 0);
             initHostStruct(&server[i], saddr[i], UDP_PORT);
             sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &server[i], sizeof (server[i]));
@@ -546,23 +568,47 @@ void sigintHandler() {
 }
 
 char* checkArgs(int argc, char *argv[]) {
-    char *filename;
-    if ((argc != 6) && (argc != 5)) {
-        printf("Usage: %s <server 0 ip> <server 1 ip> <server 2 ip> <server 3 ip> [<requested file>]\n", argv[0]);
-        exit(1);
-    } else if (argc == 6) {
-        filename = argv[5];
+    char *filename = TEST_FILE;
+    struct in_addr addr;
+    int opt;
+    while ((opt = getopt(argc, argv, "zw:pl")) != -1) {
+        switch (opt) {
+            case 'z':
+                rxZeroCopy = true;
+                break;
+            case 'w':
+                bufWindow = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                bufFlags |= BUF_PREFAULT;
+                break;
+            case 'l':
+                bufFlags |= BUF_MLOCK;
+                break;
+            default:
+                optind = argc + 1; //force usage print
+                break;
+        }
+    }
+    int first = optind;
+    int last = argc - 1;
+    //last argument is the requested file unless it is a server address
+    if ((last > first) && (inet_pton(AF_INET, argv[last], &addr) != 1)) {
+        filename = argv[last--];
         if (strlen(filename) > MAX_FILENAME_LEN) {
             printf("Error: Filename too long\n");
             exit(1);
         }
-    } else {
-        filename = TEST_FILE;
     }
-    saddr[0] = argv[1];
-    saddr[1] = argv[2];
-    saddr[2] = argv[3];
-    saddr[3] = argv[4];
+    if ((first > argc) || (last < first) || (last - first >= SERVER_MAX) || (bufWindow > BUF_WINDOW_MAX)) {
+        printf("Usage: %s [-z] [-w <pkts>] [-p] [-l] <server 0 ip> [<server 1 ip> ... <server %u ip>] [<requested file>]\n",
+                argv[0], SERVER_MAX - 1);
+        printf("  -z: receive payloads straight into packet buffer slots (no UDP GRO)\n");
+        printf("  -w: packet buffer window (up to %u pkts), sized from the request round trip by default\n", BUF_WINDOW_MAX);
+        printf("  -p: pre-fault the packet buffer, -l: lock it in memory\n");
+        exit(1);
+    }
+    for (int i = first; i <= last; i++) saddr[serverCount++] = argv[i];
     return filename;
 }
 
@@ -570,7 +616,7 @@ char* checkArgs(int argc, char *argv[]) {
 int increaseServer() {
     int temp = RATE_MAX;
     int server = -1;
-    for (int i = 0;i < 4;i++) {
+    for (unsigned int i = 0; i < serverCount; i++) {
         if (currRate[i] < temp) {
             temp = currRate[i];
             server = i;
@@ -578,72 +624,36 @@ int increaseServer() {
     }
     return server;
 }
+
+/* points of a server: number of servers with a lower value (ties go to the lower index) */
+static int rankPoints(float* values, unsigned int server) {
+    int points = 0;
+    for (unsigned int i = 0; i < serverCount; i++) {
+        if ((values[i] < values[server]) || ((values[i] == values[server]) && (i > server))) points++;
+    }
+    return points;
+}
+
 /*
  * Rate adjustment based on current rates and current restrictions
  *
- * Slowest rate gets 0 points, highest is 3, tied get rnd value
- * Most restrictions gets 0 points, least gets 3, tied get rnd value
+ * Slowest rate gets 0 points, highest gets serverCount - 1, tied go by server order
+ * Most restrictions gets 0 points, least gets serverCount - 1, tied go by server order
  *
  * Reduce rate of server with highest total
  *
  */
 int restrictServer() {
-    int ratesP[4] = {};
-    int restP[4] = {};
-    int tempA = 0;
-    int tempB = 0;
-    int a[4], b[4];
-    //find max values
-    for (int i = 0;i < 4;i++) {
-        if (srcpkts[i] > tempA) {
-            a[0] = i;
-            tempA = srcpkts[i];
-        }
-        if (currRate[i] > tempB) {
-            b[0] = i;
-            tempB = currRate[i];
-        }
-    }
-    ratesP[a[0]] = 3; 
-    restP[b[0]] = 3; 
-    tempA = 0;
-    tempB = 0;
-    for (int i = 0;i < 4;i++) {
-        if ((a[0] != i) && (srcpkts[i] > tempA)) {
-            a[1] = i;
-            tempA = srcpkts[i];
-        }
-        if ((b[0] != i) && (currRate[i] > tempB)) {
-            b[1] = i;
-            tempB = currRate[i];
-        }
-    }
-    ratesP[a[1]] = 2; 
-    restP[b[1]] = 2; 
-    tempA = 0;
-    tempB = 0;
-    for (int i = 0;i < 4;i++) {
-        if ((a[0] != i) && (a[1] != i) && (srcpkts[i] > tempA)) {
-            a[2] = i;
-            tempA = srcpkts[i];
-        }
-        if ((b[0] != i) && (b[1] != i) && (currRate[i] > tempB)) {
-            b[2] = i;
-            tempB = currRate[i];
-        }
-    }
-    ratesP[a[2]] = 1; 
-    restP[b[2]] = 1; 
-    int totals[4] = {};
-    //Calculate final values
-    for (int i = 0;i < 4;i++) totals[i] = ratesP[i] + restP[i];
+    float rates[SERVER_MAX];
+    for (unsigned int i = 0; i < serverCount; i++) rates[i] = currRate[i];
     //find max value
-    tempA = 0;
+    int temp = 0;
     int server = -1;
-    for (int i = 0;i < 4;i++) {
-        if (totals[i] > tempA) {
+    for (unsigned int i = 0; i < serverCount; i++) {
+        int total = rankPoints(ctl.srcpkts, i) + rankPoints(rates, i);
+        if (total > temp) {
             server = i;
-            tempA = totals[i];
+            temp = total;
         }
     }
     return server; //default is -1 which means restrict all
@@ -0,0 +1,391 @@
+/* Definitions of client control functions
+ * See the header file for detailed description
+ *
+ * JLV & JB
+ */
+
+#define _DEFAULT_SOURCE // for rand_r
+#include "client_ctl.h"
+
+/*******************
+ * Private functions
+ *******************/
+
+static bool calcSplice(client_ctl* c) {
+    float total = 0;
+    for (unsigned int i = 0; i < c->serverCount; i++) total += c->srcpkts[i];
+    float srcRatio[SERVER_MAX];
+    for (unsigned int i = 0; i < c->serverCount; i++) srcRatio[i] = (c->srcpkts[i] / total);
+    float check = 0;
+    for (unsigned int i = 0; i < c->serverCount; i++) check += srcRatio[i];
+    dprintf("Src pkts recorded:");
+    for (unsigned int i = 0; i < c->serverCount; i++) dprintf(" %u - %f,", i + 1, c->srcpkts[i]);
+    dprintf("\nTotal: %f\n", total);
+    for (unsigned int i = 0; i < c->serverCount; i++) c->srcpkts[i] = 0; //clear packet data
+    if ((check != 1) && !c->quiet) {
+        printf("Error with splice ratio check (= %.10f)\n", check);
+    }
+    pthread_mutex_lock(&c->mutex);
+    for (unsigned int i = 0; i < c->serverCount; i++) c->sendRatio[i] = (int) (srcRatio[i] * SPLICE_FRAME);
+    pthread_mutex_unlock(&c->mutex);
+    return true;
+}
+
+static bool spliceTx(client_ctl* c) {
+    unsigned char pkt[PKTLEN_MSG];
+    uint32_t seqGap = c->lastPkt + SPLICE_GAP;
+    c->ackdNewRatios = false;
+
+    //remember the schedule for NAK routing, previous change is in effect by now
+    pthread_mutex_lock(&c->mutex);
+    if (c->splicePending && ((uint32_t) c->lastPkt >= c->spliceNew.base)) c->spliceCur = c->spliceNew;
+    spliceInit(&c->spliceNew, seqGap, c->sendRatio, c->serverCount);
+    c->splicePending = true;
+    pthread_mutex_unlock(&c->mutex);
+    for (unsigned int i = 0; i < c->serverCount; i++) c->ackdRatio[i] = false;
+
+    for (unsigned int i = 0; i < c->serverCount; i++) {
+        if (fillpktSplice(pkt, i, seqGap, c->sendRatio, c->serverCount) == false) return false;
+        c->send(c->sendArg, i, pkt);
+    }
+    dprintf("Sent splice ratios!!!\n");
+    c->stats.spliceTx++;
+    c->spliceAckNs = monotonicNs();
+    return true;
+}
+
+static void spliceAckCheck(client_ctl* c, unsigned char* pkt, int rxLen) {
+    pkthdr_common* hdr = (pkthdr_common*) pkt;
+    unsigned int i;
+    //check splice timeout
+    int check = (int) ((monotonicNs() - c->spliceAckNs) / 1000000);
+    if (check > (SPLICE_DELAY / 8)) { //TODO mess with this timiing - important
+        if (!c->quiet) printf("Warning: Splice ack timeout, resending ratios\n");
+        c->spliceNs = monotonicNs();
+        if (!calcSplice(c)) { //recalculate splice ratios on timeout
+            printf("Error recalculating splice after ack timeout\n");
+        }
+        if (!spliceTx(c)) {
+            printf("Error: Failed to resend splice ratios\n");
+        }
+    }
+    //read splice ack
+    if (hdr->type == TYPE_SPLICE_ACK) {
+        int src = checkRxSrc(rxLen, pkt, ID_CLIENT);
+        if ((src < 0) || (src >= (int) c->serverCount)) {
+            printf("Error: Splice ack contains invalid src\n");
+        } else {
+            c->ackdRatio[src] = true;
+        }
+    }
+    //exclude extremely congested lines from needing ack
+    int tthresh = (SPLICE_FRAME / SPLICE_IGNORE_THRESH);
+    for (i = 0; i < c->serverCount; i++) if (c->sendRatio[i] <= tthresh) c->ackdRatio[i] = true;
+
+    //check for acks of all servers
+    c->ackdNewRatios = true;
+    for (i = 0; i < c->serverCount; i++) if (!c->ackdRatio[i]) c->ackdNewRatios = false;
+    if (c->ackdNewRatios) dprintf("Splice ack success! Got all %u acks\n", c->serverCount);
+}
+
+static bool spliceRatio(client_ctl* c, unsigned char* pkt, int rxLen) {
+    pkthdr_common* hdr = (pkthdr_common*) pkt;
+    int checkTime;
+    unsigned int i;
+
+    //check for splice acks
+    if (!c->ackdNewRatios) spliceAckCheck(c, pkt, rxLen);
+
+    //check that packet is of valid type before recording
+    if (hdr->type == TYPE_DATA) {
+        //record where packet came from
+        int src = checkRxSrc(rxLen, pkt, ID_CLIENT);
+        if ((src < 0) || (src >= (int) c->serverCount)) return false;
+        c->srcpkts[src]++;
+    } else if (hdr->type == TYPE_SPLICE_ACK) {
+        return true;
+    } else {
+        return false;
+    }
+
+    //timer trigger for splice ratio calculations
+    if (!c->started) {
+        c->spliceNs = monotonicNs();
+        c->started = true;
+        return true;
+    } else {
+        checkTime = (int) ((monotonicNs() - c->spliceNs) / 1000000);
+    }
+    if (checkTime > SPLICE_DELAY) {
+        c->spliceNs = monotonicNs();
+        if (!calcSplice(c)) {
+            printf("Error recalculating splice after ack timeout\n");
+        }
+        if (!c->startedSplice) {
+            for (i = 0; i < c->serverCount; i++) c->oldRatio[i] = c->sendRatio[i];
+            c->startedSplice = true;
+        } else {
+            //calculate total of absolute value of change of each ratio
+            int change = 0;
+            for (i = 0; i < c->serverCount; i++) change += abs(c->sendRatio[i] - c->oldRatio[i]); //TODO must scale with frame size
+            for (i = 0; i < c->serverCount; i++) c->oldRatio[i] = c->sendRatio[i];
+            dprintf("Splice Check: time = %i, ratios:\n", checkTime);
+            if (!c->quiet) for (i = 0; i < c->serverCount; i++) printf("%u: %i\n", i, c->sendRatio[i]);
+            dprintf("change value: %i\n", change);
+            if ((change >= SPLICE_THRESH) && (c->ackdNewRatios)) {
+                //send ratio to servers
+                if (!c->quiet) printf("Change (%i) exceeded at time %i, sending new splice ratios\n", change, checkTime);
+                if (!spliceTx(c)) return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* RFC 6298 estimator, the caller holds the mutex */
+static void rttSample(ctl_rtt* r, unsigned int us) {
+    if (r->srtt == 0) {
+        r->srtt = us;
+        r->rttvar = us / 2;
+    } else {
+        unsigned int diff = (r->srtt > us) ? r->srtt - us : us - r->srtt;
+        r->rttvar = (3 * r->rttvar + diff) / 4;
+        r->srtt = (7 * r->srtt + us) / 8;
+    }
+    unsigned int rto = r->srtt + 4 * r->rttvar;
+    r->rto = (rto < NAK_RTO_MIN) ? NAK_RTO_MIN : ((rto > NAK_RTO_MAX) ? NAK_RTO_MAX : rto);
+}
+
+/* retry timeout of a NAK sent for the tries+1-th time */
+static uint64_t nakTimeoutNs(unsigned int rto, unsigned int tries) {
+    uint64_t us = (uint64_t) rto << ((tries < 16) ? tries : 16);
+    return ((us > NAK_RTO_MAX) ? NAK_RTO_MAX : us) * 1000;
+}
+
+// ask all servers for the new tx rate
+static bool sendRate(client_ctl* c) {
+    unsigned char pkt[PKTLEN_MSG];
+    for (unsigned int i = 0; i < c->serverCount; i++) {
+        if (fillpkt(pkt, ID_CLIENT, i, TYPE_RATE, c->currTxRate, (unsigned char*) &c->currTxRate, sizeof (unsigned int)) == false) {
+            return false;
+        }
+        c->send(c->sendArg, i, pkt);
+    }
+    c->stats.rateTx++;
+    return true;
+}
+
+/*******************
+ * Public functions
+ *******************/
+
+bool ctlInit(client_ctl* c, unsigned int serverCount, ctl_send send, void* arg, unsigned int seed) {
+    if ((serverCount == 0) || (serverCount > SERVER_MAX) || (send == NULL)) return false;
+    memset(c, 0, sizeof (*c));
+    c->serverCount = serverCount;
+    c->send = send;
+    c->sendArg = arg;
+    c->seed = seed;
+    c->ackdNewRatios = true;
+    c->currTxRate = RATE_MAX;
+    for (unsigned int i = 0; i < serverCount; i++) c->rtt[i].rto = NAK_RTO_INIT;
+    spliceInitEven(&c->spliceCur, 1, serverCount);
+    return (pthread_mutex_init(&c->mutex, NULL) == 0);
+}
+
+bool ctlSetBuffer(client_ctl* c, packet_buffer* buf) {
+    c->buf = buf;
+    for (unsigned int i = 0; i < c->serverCount; i++) {
+        free(c->lostList[i]);
+        c->lostList[i] = malloc(bufGetWindow(buf) * sizeof (uint32_t));
+        if (c->lostList[i] == NULL) return false;
+    }
+    free(c->naks);
+    c->naks = calloc(bufGetWindow(buf), sizeof (ctl_nak));
+    c->nakMask = bufGetWindow(buf) - 1;
+    return (c->naks != NULL);
+}
+
+void ctlSeedRtt(client_ctl* c, unsigned int rttUs) {
+    pthread_mutex_lock(&c->mutex);
+    for (unsigned int i = 0; i < c->serverCount; i++) rttSample(&c->rtt[i], rttUs);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void ctlClose(client_ctl* c) {
+    for (unsigned int i = 0; i < c->serverCount; i++) {
+        free(c->lostList[i]);
+        c->lostList[i] = NULL;
+    }
+    free(c->naks);
+    c->naks = NULL;
+    pthread_mutex_destroy(&c->mutex);
+}
+
+bool ctlRxPacket(client_ctl* c, unsigned char* pkt, int rxLen) {
+    pkthdr_common* hdr = (pkthdr_common*) pkt;
+    if (spliceRatio(c, pkt, rxLen) == false) return false;
+
+    //store last sequence number received
+    c->lastPkt = hdr->seq;
+
+    //DEBUG check missing pkt
+    if ((hdr->type == TYPE_DATA) && (hdr->seq == c->debugMisSeq) && !c->quiet) {
+        printf("GOT THE FIRST MISSING PKT = %u after %" PRIu64 " ms\n", c->debugMisSeq, (monotonicNs() - c->debugMisNs) / 1000000);
+    }
+    return true;
+}
+
+bool ctlNakAnswer(client_ctl* c, pkthdr_common* hdr) {
+    if (c->naks == NULL) return true;
+    ctl_nak* n = &c->naks[hdr->seq & c->nakMask];
+    bool retx = (hdr->flags & PKT_FLAG_RETX);
+    // most packets were never NAK'd, only those and retransmissions take the lock
+    if (!retx && (__atomic_load_n(&n->seq, __ATOMIC_RELAXED) != hdr->seq)) return true;
+
+    bool answered = true;
+    pthread_mutex_lock(&c->mutex);
+    if (n->seq == hdr->seq) {
+        // a retransmission answers the last NAK, its round trip is known only if there was one NAK
+        if (retx && (n->tries == 0) && (n->server == hdr->src) && (hdr->src < c->serverCount)) {
+            rttSample(&c->rtt[hdr->src], (unsigned int) ((monotonicNs() - n->sentNs) / 1000));
+            c->stats.rttSamples++;
+        }
+        __atomic_store_n(&n->seq, 0, __ATOMIC_RELAXED);
+    } else {
+        // retransmitted after the seq arrived, NAK'd twice or flushed
+        c->stats.retxDups++;
+        answered = false;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return answered;
+}
+
+//TODO changing to decrease send rates depending on splice ratio (restrictServer, increaseServer in client.c)
+bool ctlTimerRound(client_ctl* c) {
+    double bufOc = bufGetOccupancy(c->buf);
+    dprintf("bufOc = %f\n", bufOc);
+    if ((bufOc > BUF_MAX_OCCUP) && (c->currTxRate >= 2)) {
+        c->currTxRate /= 2;
+        dprintf("Decreased desired tx rate, RATE=%u\n", c->currTxRate);
+        // broadcast decrease rate request to all servers
+        if (!sendRate(c)) return false;
+    } else if ((bufOc < BUF_MIN_OCCUP) && (c->currTxRate + 2 <= RATE_MAX)) {
+        c->currTxRate += 2;
+        dprintf("Increased desired tx rate, RATE=%u\n", c->currTxRate);
+        // broadcast increase rate request to all servers
+        if (!sendRate(c)) return false;
+    }
+
+    // request lost packets, collected per server and sent as NAK lists
+    uint8_t ratios[SERVER_MAX];
+    unsigned int rto[SERVER_MAX];
+    pthread_mutex_lock(&c->mutex);
+    memcpy(ratios, c->sendRatio, sizeof (ratios));
+    for (unsigned int i = 0; i < c->serverCount; i++) rto[i] = c->rtt[i].rto;
+    pthread_mutex_unlock(&c->mutex);
+    unsigned int lostCount[SERVER_MAX] = {};
+    uint64_t now = monotonicNs();
+    //after TYPE_FIN no more fresh packets come, every hole up to the last seq is lost
+    bufSetEnd(c->buf, __atomic_load_n(&c->endSeq, __ATOMIC_ACQUIRE));
+    uint32_t lostSeq = bufGetFirstLost(c->buf);
+    int numMissing = 0;
+    int numHeld = 0;
+    if (lostSeq > 0) dprintf("Sending lost pkt requests:\n");
+
+    //TODO adding better missing packet redirection
+    int tthresh = (SPLICE_FRAME / SPLICE_IGNORE_THRESH);
+    bool selServer[SERVER_MAX] = {};
+    int selCount = 0;
+    for (unsigned int i = 0; i < c->serverCount; i++) {
+        selServer[i] = (ratios[i] >= tthresh);
+        if (selServer[i]) selCount++;
+    }
+    if (selCount == 0) {
+        //no splice ratios calculated yet, ask any server
+        for (unsigned int i = 0; i < c->serverCount; i++) selServer[i] = true;
+        selCount = c->serverCount;
+    }
+
+    while (lostSeq > 0) {
+        //NAK outstanding, wait for its retry deadline
+        ctl_nak* n = &c->naks[lostSeq & c->nakMask];
+        pthread_mutex_lock(&c->mutex);
+        bool pending = (n->seq == lostSeq);
+        unsigned int tries = pending ? n->tries + 1 : 0;
+        int lastServer = n->server;
+        bool held = pending && (n->deadlineNs > now + NAK_RTO_SLACK * 1000ULL);
+        pthread_mutex_unlock(&c->mutex);
+        if (held) {
+            numHeld++;
+            lostSeq = bufGetNextLost(c->buf);
+            continue;
+        }
+
+        bool selected = false;
+        int finalSelection = 0;
+        //path of the server that sent it (or was asked last) dropped the packet, ask another one if possible
+        int owner = pending ? lastServer : ctlLostOwner(c, lostSeq);
+        bool avoidOwner = (owner >= 0) && selServer[owner] && (selCount > 1);
+        while (!selected) {
+            finalSelection = (rand_r(&c->seed) + numMissing) % c->serverCount;
+            if ((selServer[finalSelection] == true) && (!avoidOwner || (finalSelection != owner))) {
+                selected = true;
+            }
+        }
+        int maxServer = finalSelection;
+        dprintf("MIS SEQ=%u to S: %i\n", lostSeq, maxServer);
+        if (c->debugMisSeq == 0) {
+            c->debugMisSeq = lostSeq;
+            c->debugMisNs = monotonicNs();
+        }
+
+        if (lostCount[maxServer] < bufGetWindow(c->buf)) c->lostList[maxServer][lostCount[maxServer]++] = lostSeq;
+        pthread_mutex_lock(&c->mutex);
+        n->server = maxServer;
+        n->tries = (tries > UINT8_MAX) ? UINT8_MAX : tries;
+        n->sentNs = now;
+        n->deadlineNs = now + nakTimeoutNs(rto[maxServer], tries);
+        __atomic_store_n(&n->seq, lostSeq, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&c->mutex);
+        if (tries > 0) c->stats.nakRetries++;
+
+        lostSeq = bufGetNextLost(c->buf);
+        numMissing++;
+    }
+
+    // seqs come sorted from the buffer, pack each server's list in as few packets as possible
+    unsigned char pkt[PKTLEN_MSG];
+    int numNaks = 0;
+    for (unsigned int i = 0; i < c->serverCount; i++) {
+        unsigned int done = 0;
+        while (done < lostCount[i]) {
+            unsigned int packed = fillpktNak(pkt, i, c->lostList[i] + done, lostCount[i] - done);
+            if (packed == 0) return false;
+            c->send(c->sendArg, i, pkt);
+            done += packed;
+            numNaks++;
+        }
+    }
+    dprintf("Total Missing pkts = %i in %i NAK lists, %i waiting for their NAK\n", numMissing, numNaks, numHeld);
+    c->stats.nakSeqs += numMissing;
+    c->stats.nakPkts += numNaks;
+    c->stats.nakHeld += numHeld;
+    return true;
+}
+
+void ctlSetEnd(client_ctl* c, uint32_t seq) {
+    __atomic_store_n(&c->endSeq, seq, __ATOMIC_RELEASE);
+}
+
+bool ctlStreamDone(client_ctl* c) {
+    uint32_t end = __atomic_load_n(&c->endSeq, __ATOMIC_ACQUIRE);
+    return (end > 0) && (bufGetHeadSeq(c->buf) > end);
+}
+
+int ctlLostOwner(client_ctl* c, uint32_t seq) {
+    pthread_mutex_lock(&c->mutex);
+    int owner = (c->splicePending && (seq >= c->spliceNew.base)) ? spliceOwner(&c->spliceNew, seq) : spliceOwner(&c->spliceCur, seq);
+    pthread_mutex_unlock(&c->mutex);
+    return owner;
+}
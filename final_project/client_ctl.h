@@ -0,0 +1,207 @@
+/* Interface of the client control logic
+ * Everything the client decides while the stream runs: splice ratios from
+ * the packets received from each server (and their acks), the tx rate from
+ * the buffer occupancy, and the NAK lists of lost packets. No socket is used,
+ * control packets go out through a callback, so the same logic drives the
+ * real client and the protocol simulator (testing/splice_sim.c).
+ *
+ * The rx path calls ctlRxPacket for every packet, the timer thread calls
+ * ctlTimerRound. Splice state shared by the two is guarded by the mutex.
+ *
+ * A lost seq is NAK'd again only when its retry deadline passed: the retry
+ * timeout of the server asked (smoothed round trip + 4 deviations, doubled
+ * on every retry). The round trips are sampled from the retransmissions
+ * answering a first NAK (Karn's rule), the NAK state of the seqs and the
+ * round trips are shared with the rx path (mutex).
+ *
+ * TYPE_FIN of a server announces the last seq of the stream, the servers keep
+ * answering NAKs after it. Holes before it are then NAK'd at once, the lost
+ * tail after the newest packet too, and the stream is done when every packet
+ * up to the last seq has been flushed from the buffer.
+ *
+ * JLV & JB
+ */
+
+#ifndef CLIENT_CTL_H
+#define	CLIENT_CTL_H
+
+#include <pthread.h>
+#include "common.h"
+#include "packet_buffer.h"
+
+/* Sends a control packet (PKTLEN_MSG bytes) to a server */
+typedef void (*ctl_send)(void* arg, unsigned int server, unsigned char* pkt);
+
+/* Counters of the control packets sent */
+typedef struct ctl_stats {
+    uint64_t spliceTx;      // splice ratio changes sent (incl. resends after an ack timeout)
+    uint64_t rateTx;        // rate changes sent
+    uint64_t nakSeqs;       // lost packets requested
+    uint64_t nakPkts;       // NAK lists sent
+    uint64_t nakRetries;    // lost packets requested again after their retry deadline
+    uint64_t nakHeld;       // lost packets not requested, their NAK was still outstanding
+    uint64_t retxDups;      // retransmitted packets dropped, their NAK was answered already
+    uint64_t rttSamples;
+} ctl_stats;
+
+/* Round trip estimate of a server (usecs) */
+typedef struct ctl_rtt {
+    unsigned int srtt;      // smoothed round trip, 0 until the first sample
+    unsigned int rttvar;    // round trip deviation
+    unsigned int rto;       // retry timeout of the first NAK
+} ctl_rtt;
+
+/* Outstanding NAK of a lost seq */
+typedef struct ctl_nak {
+    uint32_t seq;           // 0 if none outstanding
+    uint8_t server;         // server asked last
+    uint8_t tries;          // NAKs of the seq sent before the last one
+    uint64_t sentNs;        // last NAK sent
+    uint64_t deadlineNs;    // NAK again if not answered by then
+} ctl_nak;
+
+/* Control state of one stream */
+typedef struct client_ctl {
+    unsigned int serverCount;
+    ctl_send send;
+    void* sendArg;
+    packet_buffer* buf;             // buffer the lost packets are looked up in
+    bool quiet;                     // no per-round printouts (simulations)
+    unsigned int seed;              // state of the NAK target choice (rand_r)
+    //splice ratio variables (rx path)
+    float srcpkts[SERVER_MAX];      // pkts received from each server since the last splice calculation
+    int oldRatio[SERVER_MAX];       // holds old ratios to check threshold for change
+    bool ackdRatio[SERVER_MAX];
+    bool started;
+    bool startedSplice;
+    bool ackdNewRatios;
+    uint64_t spliceNs;              // time of the last splice calculation
+    uint64_t spliceAckNs;           // time the last splice ratios were sent
+    int lastPkt;
+    //splice state shared with the timer thread
+    pthread_mutex_t mutex;
+    uint8_t sendRatio[SERVER_MAX];
+    splice_epoch spliceCur;         // splice schedule the servers use
+    splice_epoch spliceNew;         // last sent splice ratios, servers switch at its base
+    bool splicePending;             // spliceNew is valid
+    //rate and lost packet variables (timer thread)
+    unsigned int currTxRate;        // server tx rate currently set
+    uint32_t* lostList[SERVER_MAX]; // lost seqs requested from each server in a timer round (window entries)
+    //NAK retries shared with the rx path (mutex)
+    ctl_nak* naks;                  // by seq, window entries
+    uint32_t nakMask;
+    ctl_rtt rtt[SERVER_MAX];
+    uint32_t endSeq;                // last seq of the stream from TYPE_FIN, 0 until known (atomic)
+    uint32_t debugMisSeq;
+    uint64_t debugMisNs;
+    ctl_stats stats;
+} client_ctl;
+
+/*******************
+ * Public functions
+ *******************/
+
+/*
+ * ctlInit
+ *
+ * Start the control of a stream from serverCount servers with even splice
+ * ratios and the full rate
+ *
+ * send, arg: callback sending the control packets
+ * seed: seed of the random NAK target choice
+ *
+ * Return value: true if initialized, false otherwise
+ */
+bool ctlInit(client_ctl* c, unsigned int serverCount, ctl_send send, void* arg, unsigned int seed);
+
+/*
+ * ctlSetBuffer
+ *
+ * Attach the packet buffer of the stream, needed before the first timer round
+ *
+ * Return value: true if the lost packet lists could be allocated, false otherwise
+ */
+bool ctlSetBuffer(client_ctl* c, packet_buffer* buf);
+
+/*
+ * ctlSeedRtt
+ *
+ * Use a round trip measured before the stream (the file request) as the
+ * first sample of every server
+ */
+void ctlSeedRtt(client_ctl* c, unsigned int rttUs);
+
+/*
+ * ctlClose
+ *
+ * Free the control state, the buffer is not destroyed
+ */
+void ctlClose(client_ctl* c);
+
+/*
+ * ctlRxPacket
+ *
+ * Account a received TYPE_DATA or TYPE_SPLICE_ACK packet, every SPLICE_DELAY
+ * msecs the splice ratios are recalculated and sent when they changed enough
+ *
+ * pkt: received packet (header is enough)
+ * rxLen: its length
+ *
+ * Return value: false if the packet has an invalid source or sending failed
+ */
+bool ctlRxPacket(client_ctl* c, unsigned char* pkt, int rxLen);
+
+/*
+ * ctlNakAnswer
+ *
+ * End the outstanding NAK of a received TYPE_DATA packet, a retransmission
+ * answering the first NAK of its seq gives a round trip sample of the server
+ *
+ * hdr: header of the packet
+ *
+ * Return value: false if the packet is a retransmission whose NAK was
+ *               answered already (duplicate), it need not be buffered
+ */
+bool ctlNakAnswer(client_ctl* c, pkthdr_common* hdr);
+
+/*
+ * ctlTimerRound
+ *
+ * Adjust the tx rate from the buffer occupancy and request the lost packets
+ * whose retry deadline passed, each from a server whose path did not drop
+ * it (called every BUF_CHECK_TIME)
+ *
+ * Return value: false if a packet could not be created
+ */
+bool ctlTimerRound(client_ctl* c);
+
+/*
+ * ctlSetEnd
+ *
+ * Set the last seq of the stream, announced by the TYPE_FIN of a server
+ * (called from the rx path)
+ *
+ * seq: last seq
+ */
+void ctlSetEnd(client_ctl* c, uint32_t seq);
+
+/*
+ * ctlStreamDone
+ *
+ * Check the end of the stream after a flush of the buffer (timer thread)
+ *
+ * Return value: true if the last seq is known and every packet up to it was
+ *               flushed, false otherwise
+ */
+bool ctlStreamDone(client_ctl* c);
+
+/*
+ * ctlLostOwner
+ *
+ * Server that was supposed to send the seq
+ *
+ * Return value: server, -1 if unknown
+ */
+int ctlLostOwner(client_ctl* c, uint32_t seq);
+
+#endif	/* CLIENT_CTL_H */
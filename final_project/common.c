@@ -4,6 +4,7 @@
  * Jan Beran
  */
 
+#define _DEFAULT_SOURCE // for clock_gettime
 #include "common.h"
 
 // TODO: better debug prints
@@ -31,7 +32,7 @@ bool initHostStruct(struct sockaddr_in* host, char* ipAddrStr, unsigned int port
     return true;
 }
 
-int udpInit(unsigned int localPort, unsigned int timeoutSec) {
+int udpInit(char* localIp, unsigned int localPort, unsigned int timeoutSec) {
     // create a socket
     int soc = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (soc == -1) {
@@ -41,7 +42,7 @@ int udpInit(unsigned int localPort, unsigned int timeoutSec) {
 
     // prepare a structure for the local host info
     struct sockaddr_in local;
-    if (initHostStruct(&local, NULL, localPort) == false) {
+    if (initHostStruct(&local, localIp, localPort) == false) {
         close(soc);
         return -1;
     }
@@ -65,6 +66,30 @@ int udpInit(unsigned int localPort, unsigned int timeoutSec) {
     return soc;
 }
 
+int udpInitShared(char* localIp, unsigned int localPort) {
+    int soc = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (soc == -1) {
+        printf("Error: Failed to create a socket\n");
+        return -1;
+    }
+
+    struct sockaddr_in local;
+    int one = 1;
+    if ((initHostStruct(&local, localIp, localPort) == false) ||
+            (setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) != 0)) {
+        printf("Error: Port sharing (SO_REUSEPORT) is not available\n");
+        close(soc);
+        return -1;
+    }
+    // unlike udpInit, a socket that is not bound is useless here
+    if (bind(soc, (struct sockaddr*) &local, sizeof (local)) == -1) {
+        printf("Error: Unable to bind the given port to the socket\n");
+        close(soc);
+        return -1;
+    }
+    return soc;
+}
+
 //TODO change error codes away from server names
 
 int checkRxSrc(int rxRes, unsigned char* pkt, uint8_t expDst) {
@@ -84,12 +109,12 @@ int checkRxSrc(int rxRes, unsigned char* pkt, uint8_t expDst) {
     }
     pkthdr_common* hdr = (pkthdr_common*) pkt;
 
-    if (hdr->src > 8) return RX_ERR;
+    if (hdr->src >= SERVER_MAX) return RX_ERR;
     return hdr->src;
 }
 
 int checkRxStatus(int rxRes, unsigned char* pkt, uint8_t expDst) {
-    if ((pkt == NULL) || (expDst > 8)) {
+    if ((pkt == NULL) || ((expDst >= SERVER_MAX) && (expDst != ID_CLIENT))) {
         printf("Warning: Unknown Rx error occurred\n");
         return RX_ERR;
     }
@@ -149,11 +174,25 @@ unsigned int timeDiff(struct timeval* beg, struct timeval* end) {
     }
 }
 
+#ifdef SIM_CLOCK
+uint64_t simClockNs = 0;
+
+uint64_t monotonicNs(void) {
+    return simClockNs;
+}
+#else
+uint64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+#endif
+
 bool fillpktSplice(
         unsigned char* buf, uint8_t dst,
-        uint32_t sseq, uint8_t ratios[4]) {
+        uint32_t sseq, uint8_t* ratios, unsigned int count) {
 
-    if (buf == NULL) {
+    if ((buf == NULL) || (count == 0) || (count > SERVER_MAX)) {
         dprintf("Error: Packet could not be created\n");
         return false;
     }
@@ -162,14 +201,152 @@ bool fillpktSplice(
     spl->src = ID_CLIENT;
     spl->dst = dst;
     spl->type = TYPE_SPLICE;
+    spl->count = count;
     spl->sseq = sseq;
-    spl->ratios[0] = ratios[0];
-    spl->ratios[1] = ratios[1];
-    spl->ratios[2] = ratios[2];
-    spl->ratios[3] = ratios[3];
+    memcpy(spl->ratios, ratios, count);
     return true;
 }
 
+bool spliceInit(splice_epoch* e, uint32_t base, uint8_t* ratios, unsigned int count) {
+    unsigned int total = 0;
+    uint8_t rounds = 0;
+    if ((count == 0) || (count > SERVER_MAX)) return false;
+    for (unsigned int i = 0; i < count; i++) {
+        total += ratios[i];
+        if (ratios[i] > rounds) rounds = ratios[i];
+    }
+    if (total > SPLICE_TOTAL_MAX) return false;
+
+    e->base = base;
+    e->total = total;
+    e->count = count;
+    unsigned int first = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        e->ratios[i] = ratios[i];
+        e->first[i] = first;
+        first += ratios[i];
+    }
+
+    // deal the slots like the bucket walk did: one per server with ratio left, in server order
+    unsigned int o = 0;
+    for (uint8_t k = 0; k < rounds; k++) {
+        for (unsigned int i = 0; i < count; i++) {
+            if (ratios[i] <= k) continue;
+            e->owner[o] = i;
+            e->round[o] = k;
+            e->slots[e->first[i] + k] = o;
+            o++;
+        }
+    }
+    return true;
+}
+
+bool spliceInitEven(splice_epoch* e, uint32_t base, unsigned int count) {
+    uint8_t ratios[SERVER_MAX];
+    if ((count == 0) || (count > SERVER_MAX)) return false;
+    for (unsigned int i = 0; i < count; i++) ratios[i] = SPLICE_FRAME / count;
+    return spliceInit(e, base, ratios, count);
+}
+
+int spliceOwner(splice_epoch* e, uint32_t seq) {
+    if ((e->total == 0) || (seq < e->base)) return -1;
+    return e->owner[(seq - e->base) % e->total];
+}
+
+uint32_t spliceNextOwned(splice_epoch* e, uint8_t server, uint32_t seq) {
+    if ((e->total == 0) || (server >= e->count) || (e->ratios[server] == 0)) return 0;
+    if (seq < e->base) seq = e->base;
+    uint32_t rel = seq - e->base;
+    unsigned int o = rel % e->total;
+    uint8_t k = e->round[o];
+    const uint16_t* slots = &e->slots[e->first[server]];
+
+    // round k is dealt in server order, the slot of the server in round k is at or after o
+    // if the server comes at or after the owner of o, else its next slot is in round k + 1
+    unsigned int next;
+    if ((e->ratios[server] > k) && (server >= e->owner[o])) next = slots[k];
+    else if (e->ratios[server] > k + 1) next = slots[k + 1];
+    else next = slots[0] + e->total;
+    return seq - o + next;
+}
+
+unsigned int fillpktNak(unsigned char* buf, uint8_t dst, uint32_t* seqs, unsigned int count) {
+    if ((buf == NULL) || (seqs == NULL) || (count == 0)) return 0;
+    memset(buf, 0, PKTLEN_MSG);
+    pkthdr_nak* hdr = (pkthdr_nak*) buf;
+    hdr->src = ID_CLIENT;
+    hdr->dst = dst;
+    hdr->type = TYPE_NAK_LIST;
+    hdr->seq = seqs[0];
+
+    // how many seqs fit in the ranges format, no more than readNak takes from one packet (NAK_MAX_BITS)
+    unsigned int ranges = 0, inRanges = 0, runLen = 0;
+    while ((inRanges < count) && (inRanges < NAK_MAX_BITS) && (seqs[inRanges] - seqs[0] <= UINT16_MAX)) {
+        if ((inRanges > 0) && (seqs[inRanges] == seqs[inRanges - 1] + 1) && (runLen < UINT16_MAX)) {
+            runLen++;
+        } else {
+            if (ranges == NAK_MAX_RANGES) break;
+            ranges++;
+            runLen = 1;
+        }
+        inRanges++;
+    }
+    // how many seqs fit in the bitmap format
+    unsigned int inBitmap = 0;
+    while ((inBitmap < count) && (seqs[inBitmap] - seqs[0] < NAK_MAX_BITS)) inBitmap++;
+
+    unsigned char* payload = buf + NAK_HDRLEN;
+    if (inBitmap > inRanges) {
+        hdr->format = NAK_FMT_BITMAP;
+        for (unsigned int i = 0; i < inBitmap; i++) {
+            uint32_t bit = seqs[i] - seqs[0];
+            payload[bit / 8] |= (uint8_t) (1 << (bit % 8));
+        }
+        hdr->count = (uint16_t) ((seqs[inBitmap - 1] - seqs[0]) / 8 + 1);
+        return inBitmap;
+    }
+
+    hdr->format = NAK_FMT_RANGES;
+    nak_range* range = (nak_range*) payload;
+    int r = -1;
+    for (unsigned int i = 0; i < inRanges; i++) {
+        if ((r >= 0) && (seqs[i] == seqs[i - 1] + 1) && (range[r].len < UINT16_MAX)) {
+            range[r].len++;
+        } else {
+            r++;
+            range[r].offset = (uint16_t) (seqs[i] - seqs[0]);
+            range[r].len = 1;
+        }
+    }
+    hdr->count = (uint16_t) (r + 1);
+    return inRanges;
+}
+
+unsigned int readNak(unsigned char* pkt, uint32_t* seqs, unsigned int max) {
+    if ((pkt == NULL) || (seqs == NULL)) return 0;
+    pkthdr_nak* hdr = (pkthdr_nak*) pkt;
+    unsigned char* payload = pkt + NAK_HDRLEN;
+    unsigned int n = 0;
+
+    if (hdr->format == NAK_FMT_BITMAP) {
+        unsigned int bytes = (hdr->count < NAK_MAX_BITS / 8) ? hdr->count : NAK_MAX_BITS / 8;
+        for (unsigned int i = 0; (i < bytes * 8) && (n < max); i++) {
+            if (payload[i / 8] & (1 << (i % 8))) seqs[n++] = hdr->seq + i;
+        }
+    } else if (hdr->format == NAK_FMT_RANGES) {
+        nak_range* range = (nak_range*) payload;
+        unsigned int ranges = (hdr->count < NAK_MAX_RANGES) ? hdr->count : NAK_MAX_RANGES;
+        for (unsigned int r = 0; r < ranges; r++) {
+            for (unsigned int i = 0; (i < range[r].len) && (n < max); i++) {
+                seqs[n++] = hdr->seq + range[r].offset + i;
+            }
+        }
+    } else {
+        printf("Warning: Unknown NAK list format %u\n", hdr->format);
+    }
+    return n;
+}
+
 bool fillpkt(
         unsigned char* buf,
         uint8_t src, uint8_t dst, uint8_t type, uint32_t seq,
@@ -188,12 +365,7 @@ bool fillpkt(
     }
 
     memset(buf, 0, pktLen);
-
-    pkthdr_common* hdr = (pkthdr_common*) buf;
-    hdr->src = src;
-    hdr->dst = dst;
-    hdr->type = type;
-    hdr->seq = seq;
+    fillhdr((pkthdr_common*) buf, src, dst, type, seq);
 
     if ((payload != NULL) && (payloadLen > 0)) {
         if ((payloadLen + HDRLEN) > pktLen) {
@@ -206,6 +378,14 @@ bool fillpkt(
     return true;
 }
 
+void fillhdr(pkthdr_common* hdr, uint8_t src, uint8_t dst, uint8_t type, uint32_t seq) {
+    memset(hdr, 0, HDRLEN);
+    hdr->src = src;
+    hdr->dst = dst;
+    hdr->type = type;
+    hdr->seq = seq;
+}
+
     /*
 void dprintPkt(unsigned char* pkt, unsigned int pktLen, bool isTx) {
     if (!DEBUG) {
@@ -262,3 +442,113 @@ void dprintPkt(unsigned char* pkt, unsigned int pktLen, bool isTx) {
 unsigned int rateToDelay(unsigned int rate) {    
     return 1000000 / rate;
 }
+
+bool evInit(ev_loop* loop) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        printf("Error: Event loop could not be created\n");
+        return false;
+    }
+    loop->running = false;
+    for (int i = 0; i < EV_MAX_HANDLERS; i++) loop->handlers[i].fd = -1;
+    return true;
+}
+
+static bool evAdd(ev_loop* loop, int fd, bool isTimer, ev_callback cb, void* arg) {
+    for (int i = 0; i < EV_MAX_HANDLERS; i++) {
+        ev_handler* h = &loop->handlers[i];
+        if (h->fd != -1) continue;
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = h};
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            printf("Warning: Descriptor could not be added to the event loop\n");
+            return false;
+        }
+        h->fd = fd;
+        h->isTimer = isTimer;
+        h->cb = cb;
+        h->arg = arg;
+        return true;
+    }
+    printf("Warning: Event loop is full (EV_MAX_HANDLERS)\n");
+    return false;
+}
+
+bool evAddFd(ev_loop* loop, int fd, ev_callback cb, void* arg) {
+    return evAdd(loop, fd, false, cb, arg);
+}
+
+bool evWatchOut(ev_loop* loop, int fd, bool on) {
+    for (int i = 0; i < EV_MAX_HANDLERS; i++) {
+        ev_handler* h = &loop->handlers[i];
+        if ((h->fd != fd) || h->isTimer) continue;
+        struct epoll_event ev = {.events = EPOLLIN | (on ? EPOLLOUT : 0), .data.ptr = h};
+        return (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == 0);
+    }
+    return false;
+}
+
+int evAddTimer(ev_loop* loop, ev_callback cb, void* arg) {
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer == -1) {
+        printf("Warning: Timer could not be created\n");
+        return -1;
+    }
+    if (evAdd(loop, timer, true, cb, arg) == false) {
+        close(timer);
+        return -1;
+    }
+    return timer;
+}
+
+bool evSetTimer(int timer, uint64_t delayNs, uint64_t periodNs) {
+    struct itimerspec its = {
+        .it_value = {.tv_sec = delayNs / 1000000000, .tv_nsec = delayNs % 1000000000},
+        .it_interval = {.tv_sec = periodNs / 1000000000, .tv_nsec = periodNs % 1000000000}
+    };
+    return (timerfd_settime(timer, 0, &its, NULL) == 0);
+}
+
+void evRemove(ev_loop* loop, int fd) {
+    for (int i = 0; i < EV_MAX_HANDLERS; i++) {
+        ev_handler* h = &loop->handlers[i];
+        if (h->fd != fd) continue;
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+        if (h->isTimer) close(fd);
+        h->fd = -1;
+    }
+}
+
+bool evRun(ev_loop* loop) {
+    struct epoll_event events[EV_MAX_EVENTS];
+    loop->running = true;
+    while (loop->running) {
+        int n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            printf("Error: Event loop wait failed\n");
+            return false;
+        }
+        for (int i = 0; (i < n) && loop->running; i++) {
+            ev_handler* h = (ev_handler*) events[i].data.ptr;
+            if (h->fd == -1) continue; // removed by a previous callback
+            if (h->isTimer) {
+                uint64_t expirations;
+                if (read(h->fd, &expirations, sizeof (expirations)) != sizeof (expirations)) continue; // re-armed meanwhile
+            }
+            h->cb(h->fd, h->arg);
+        }
+    }
+    return true;
+}
+
+void evStop(ev_loop* loop) {
+    loop->running = false;
+}
+
+void evClose(ev_loop* loop) {
+    for (int i = 0; i < EV_MAX_HANDLERS; i++) {
+        if (loop->handlers[i].fd != -1) evRemove(loop, loop->handlers[i].fd);
+    }
+    close(loop->epfd);
+}
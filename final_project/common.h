@@ -27,7 +27,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h> // UDP_SEGMENT (GSO)
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 
 /*******************
@@ -45,11 +48,14 @@
  *******************/
 #define dprintf(...) do { if (DEBUG) printf(__VA_ARGS__); } while (0) // debug print (use make debug)
 #define UDP_PORT 55555 // does not matter for now
+#define SERVER_MAX 32 // maximum number of servers streaming to one client (server ids 0 - SERVER_MAX-1)
+#define SERVER_DEFAULT 4 // server count of clients that do not announce it
 #define RECV_TIMEOUT 2 // timeout for recv call (secs)
+#define REQ_RETRY_TIME 200 // time (msecs) before a request is sent again to servers that did not ack it
 #define MAX_FILENAME_LEN 50 // maximum lenght of filenames
 #define TEST_FILE "/dev/urandom"
-#define RATE_STEP 5 // tx rate is changed by this amount (kB/s) when needed
-#define RATE_MAX 30 // maximum intended tx rate per server (kB/s)
+#define RATE_STEP 5 // tx rate is changed by this amount (pkts/s) when needed
+#define RATE_MAX 30 // maximum intended tx rate per server (pkts/s)
 
 /*******************
  * Send file defines
@@ -64,9 +70,15 @@
  *******************/
 #define BUF_MAX_OCCUP 0.5   // maximum intended rx buffer occupancy (ratio <0,1>)
 #define BUF_MIN_OCCUP 0.3   // minimum intended rx buffer occupancy (ratio <0,1>)
-#define BUF_SIZE 1000       // size (pkts) of the packet buffer (in client)
+#ifndef BUF_SIZE
+#define BUF_SIZE 1000       // size (pkts) of the packet buffer (in client), can be set at build time (-DBUF_SIZE=)
+#endif
 #define BUF_LOST_THRSH 300  // missing packets older than seq=(newest seq)-LOST_THRSH are considered as lost 
-#define BUF_CHECK_TIME 1000000 // time (usecs) between subsequent buffer flushes, rate adjustments, missing packet requests 
+#define BUF_CHECK_TIME 1000000 // time (usecs) between subsequent buffer flushes, rate adjustments, missing packet requests
+#define NAK_RTO_INIT BUF_CHECK_TIME // retry timeout (usecs) of a server without round trip samples
+#define NAK_RTO_MIN 20000   // lower bound of the retry timeout (usecs)
+#define NAK_RTO_MAX 8000000 // upper bound of the retry timeout incl. the backoff (usecs)
+#define NAK_RTO_SLACK 10000 // a retry deadline this close (usecs) has passed, timer rounds jitter
 
 /*******************
  * Packet Headers
@@ -77,6 +89,7 @@ typedef struct pkthdr_common {
     uint8_t src; // source
     uint8_t dst; // destination
     uint8_t type; // packet type
+    uint8_t flags; // PKT_FLAG_*, 0 if none (was padding)
     uint32_t seq; // sequence number
     /* followed by payload */
 } pkthdr_common;
@@ -86,10 +99,29 @@ typedef struct pkthdr_spl {
     uint8_t src; // source
     uint8_t dst; // destination
     uint8_t type; // packet type
+    uint8_t count; // number of servers (valid ratios)
     uint32_t sseq; //holds sync seq number for new splice ratios
-    uint8_t ratios[4]; //holds new splice ratios
+    uint8_t ratios[SERVER_MAX]; //holds new splice ratios
 } pkthdr_spl;
 
+/*packet header of TYPE_NAK_LIST packet*/
+typedef struct pkthdr_nak {
+    uint8_t src; // source
+    uint8_t dst; // destination
+    uint8_t type; // packet type
+    uint8_t format; // NAK_FMT_RANGES or NAK_FMT_BITMAP
+    uint32_t seq; // base seq, the first missing seq in the list
+    uint16_t count; // number of ranges / number of used bitmap bytes
+    uint16_t reserved;
+    /* followed by nak_range array or bitmap */
+} pkthdr_nak;
+
+/*one run of missing seqs in NAK_FMT_RANGES list*/
+typedef struct nak_range {
+    uint16_t offset; // first missing seq - base seq
+    uint16_t len; // number of subsequent missing seqs
+} nak_range;
+
 
 /*******************
  * Packet Defines
@@ -105,10 +137,18 @@ typedef struct pkthdr_spl {
 #define TYPE_SPLICE 8   // splice ratio change msg
 #define TYPE_SPLICE_ACK 9 // ack from server for new splice ratio
 #define TYPE_RATE 10    // request to set a certain tx rate
+#define TYPE_NAK_LIST 11 // negative acknowledgement of several missing packets
+
+/* Common header flags */
+#define PKT_FLAG_RETX 0x01 // TYPE_DATA sent again on a NAK
+
+/* TYPE_NAK_LIST formats */
+#define NAK_FMT_RANGES 1 // runs of missing seqs (offset, length)
+#define NAK_FMT_BITMAP 2 // bit i set = seq base+i missing
 
 /* Source/Destination codes */
-/* Nodes 1-8: codes 1-8 */
-#define ID_CLIENT 8
+/* Servers: codes 0 - SERVER_MAX-1, the server count goes in seq of TYPE_REQ */
+#define ID_CLIENT 255
 //below server defines are hardcoded MUST REMAIN to simplify code
 //note - unused
 #define ID_SERVER1 0
@@ -121,6 +161,9 @@ typedef struct pkthdr_spl {
 #define HDRLEN (sizeof(pkthdr_common)) // header size
 #define DATALEN 1024 // data size
 #define PKTLEN_DATA (HDRLEN+DATALEN) // data packet size
+#define NAK_HDRLEN (sizeof(pkthdr_nak)) // TYPE_NAK_LIST header size
+#define NAK_MAX_RANGES ((PKTLEN_MSG - NAK_HDRLEN) / sizeof(nak_range)) // ranges in one NAK list
+#define NAK_MAX_BITS ((PKTLEN_MSG - NAK_HDRLEN) * 8) // seqs covered by one NAK bitmap
 
 /*******************
  * Rx/Tx defines
@@ -136,11 +179,72 @@ typedef struct pkthdr_spl {
 
 #define MAX_ERR_COUNT 5     // maximum number of subsequent errors received
 
+/* Tx batching */
+#define TX_BURST_MAX 32     // max data packets per sendmmsg/GSO call (GSO buffer must stay < 64 kB)
+#define TX_BURST_DEFAULT 1  // default burst size, 1 = one sendto per packet
+#define TX_ROUNDS_MAX 64    // bursts sent per event loop round before pending rx is handled
+#define TX_ZC_RING 16       // zero-copy bursts in flight, each keeps its headers until the kernel completes it
+#define TX_NOBUFS_WAIT 1000 // usecs before sending again after ENOBUFS (the socket stays writable meanwhile)
+
+/* Client rx batching */
+#define RX_BATCH_MAX 64     // max datagrams read by one recvmmsg call
+#define RX_GRO_SLOTS 8      // datagrams per recvmmsg call with UDP GRO, each holds up to RX_GRO_SIZE bytes
+#define RX_GRO_SIZE 65536   // coalesced GRO datagram, several packets of one server
+#define RX_RCVBUF (4 << 20) // client socket buffer (bytes), holds the bursts of all servers (capped by net.core.rmem_max)
+
+/* Server workers */
+#define WORKER_MAX 64       // max server worker processes sharing UDP_PORT (SO_REUSEPORT)
+
+
+/*******************
+ * Event loop defines
+ *******************/
+#define EV_MAX_HANDLERS 40  // maximum number of sockets and timers in one event loop (repeater: two sockets per flow)
+#define EV_MAX_EVENTS 16    // maximum number of events handled per epoll_wait call
+
+/* Callback of the event loop, fd is the socket/timer that fired */
+typedef void (*ev_callback)(int fd, void* arg);
+
+/* Registered socket or timer */
+typedef struct ev_handler {
+    int fd;             // watched descriptor, -1 if the slot is free
+    bool isTimer;       // fd is a timerfd, expirations are read before the callback
+    ev_callback cb;     // called when fd is readable / timer expired
+    void* arg;          // passed to cb
+} ev_handler;
+
+/* Event loop (epoll + timerfd), one per thread */
+typedef struct ev_loop {
+    int epfd;
+    bool running;
+    ev_handler handlers[EV_MAX_HANDLERS];
+} ev_loop;
+
+/*******************
+ * Splice schedule defines
+ *******************/
+#define SPLICE_TOTAL_MAX 1024 // longest splice frame (sum of the ratios)
+
+/* Splice schedule of one ratio epoch, answers who owns a seq in O(1)
+ * The frame of total seqs repeats from base, slots are dealt in rounds: round k
+ * gives one slot to every server with ratio > k, in server order (the order of
+ * the former bucket walk). The k-th slot of a server is in round k. */
+typedef struct splice_epoch {
+    uint32_t base;                      // first seq of the epoch (sseq of the splice change)
+    unsigned int total;                 // frame length = sum of the ratios, 0 if nobody sends
+    unsigned int count;                 // number of servers
+    uint8_t ratios[SERVER_MAX];
+    uint16_t first[SERVER_MAX];         // index of the first slot of each server in slots
+    uint8_t owner[SPLICE_TOTAL_MAX];    // server owning each frame offset
+    uint8_t round[SPLICE_TOTAL_MAX];    // dealing round of each frame offset
+    uint16_t slots[SPLICE_TOTAL_MAX];   // frame offsets of the slots grouped by server, in round order
+} splice_epoch;
 
 /*******************
  * Graph plotting defines
  *******************/
-#define GRAPH_DATA_FILE "graph_datafile"
+#define GRAPH_DATA_FILE "graph_datafile" // "ms seq" lines read by the gnuplot script
+#define GRAPH_TRACE_FILE "graph_trace"   // binary receive trace, converted to GRAPH_DATA_FILE by tracedump
 #define GNUPLOT_SCRIPT "plot.sh"
 
 /*******************
@@ -165,12 +269,28 @@ bool initHostStruct(struct sockaddr_in* host, char* ipAddrStr, unsigned int port
  * 
  * Initialize local udp socket. Can be used for both client/server nodes.
  * 
+ * localIp: local IP address to bind to, NULL for all addresses
  * localPort: local udp port to bind to the socket, 0 to use an arbitrary port (i.e. to not perform bind)
  * timeoutSec: timeout in seconds for recv call. 0 for no timeout (blocking recv calls)
  * 
  * Return value: -1 if init fails, socket id otherwise
  */
-int udpInit(unsigned int localPort, unsigned int timeoutSec);
+int udpInit(char* localIp, unsigned int localPort, unsigned int timeoutSec);
+
+/*
+ * udpInitShared
+ *
+ * Initialize local udp socket with SO_REUSEPORT. Several sockets can be bound
+ * to the same port, the kernel spreads incoming packets among them by a hash
+ * of the source address, so packets of one peer always reach the same socket
+ * (as long as no socket of the group is closed).
+ *
+ * localIp: local IP address to bind to, NULL for all addresses
+ * localPort: local udp port to bind to the socket
+ *
+ * Return value: -1 if init or bind fails, socket id otherwise
+ */
+int udpInitShared(char* localIp, unsigned int localPort);
 
 /* checkRxSrc
  *
@@ -182,8 +302,81 @@ int checkRxSrc(int rxRes, unsigned char* pkt, uint8_t expDst);
  * fillpktSplice
  *
  * Fills splice update packet with all necessary info
+ *
+ * ratios, count: splice ratios of count servers
  */
-bool fillpktSplice(unsigned char* buf, uint8_t dst,uint32_t sseq, uint8_t ratios[4]);
+bool fillpktSplice(unsigned char* buf, uint8_t dst, uint32_t sseq, uint8_t* ratios, unsigned int count);
+
+/*
+ * fillpktNak
+ *
+ * Pack as many missing seqs as possible into one TYPE_NAK_LIST packet, either as
+ * runs of subsequent seqs or as a bitmap, whichever covers more of them.
+ * Either way one packet carries at most NAK_MAX_BITS seqs, the receiver
+ * unpacks that many (readNak).
+ *
+ * buf: pointer to the packet (PKTLEN_MSG)
+ * dst: destination server
+ * seqs: missing seqs, sorted in ascending order
+ * count: number of missing seqs
+ *
+ * Return value: number of seqs (from the beginning of seqs) packed in the packet, 0 if error
+ */
+unsigned int fillpktNak(unsigned char* buf, uint8_t dst, uint32_t* seqs, unsigned int count);
+
+/*
+ * readNak
+ *
+ * Unpack missing seqs from a received TYPE_NAK_LIST packet
+ *
+ * pkt: pointer to the packet
+ * seqs: array to fill with the missing seqs
+ * max: size of the array
+ *
+ * Return value: number of seqs unpacked
+ */
+unsigned int readNak(unsigned char* pkt, uint32_t* seqs, unsigned int max);
+
+/*
+ * spliceInit
+ *
+ * Build the schedule of a splice epoch
+ *
+ * e: epoch to fill
+ * base: first seq of the epoch
+ * ratios, count: splice ratios (slots per frame) of count servers
+ *
+ * Return value: false if the count or the frame length is out of range, e is not changed then
+ */
+bool spliceInit(splice_epoch* e, uint32_t base, uint8_t* ratios, unsigned int count);
+
+/*
+ * spliceInitEven
+ *
+ * Build the initial schedule, SPLICE_FRAME split evenly among count servers
+ */
+bool spliceInitEven(splice_epoch* e, uint32_t base, unsigned int count);
+
+/*
+ * spliceOwner
+ *
+ * Get the server sending the given seq
+ *
+ * Return value: server (0 - count-1), -1 if seq is before the epoch or nobody sends
+ */
+int spliceOwner(splice_epoch* e, uint32_t seq);
+
+/*
+ * spliceNextOwned
+ *
+ * Get the first seq at or after the given one owned by a server
+ *
+ * server: server (0 - count-1)
+ * seq: seq to start at, seqs before the epoch start at base
+ *
+ * Return value: seq owned by the server, 0 if the server owns no slot
+ */
+uint32_t spliceNextOwned(splice_epoch* e, uint8_t server, uint32_t seq);
 
 /* 
  * checkRxStatus
@@ -210,6 +403,20 @@ int checkRxStatus(int rxRes, unsigned char* pkt, uint8_t expDst);
  * Return value: elapsed time in msecs, UINT_MAX if error occured (e.g. end < beg)
  */ unsigned int timeDiff(struct timeval* beg, struct timeval* end);
 
+/*
+ * monotonicNs
+ * 
+ * Get current CLOCK_MONOTONIC time, not affected by system time changes.
+ * Built with -DSIM_CLOCK it returns simClockNs instead, the virtual time
+ * set by a simulator (pacers, sessions and the client control follow it).
+ * 
+ * Return value: time in nsecs
+ */
+uint64_t monotonicNs(void);
+#ifdef SIM_CLOCK
+extern uint64_t simClockNs;
+#endif
+
 /*
  * fillpkt
  * 
@@ -229,6 +436,17 @@ bool fillpkt(
         uint8_t src, uint8_t dst, uint8_t type, uint32_t seq,
         unsigned char* payload, unsigned int payloadLen);
 
+/*
+ * fillhdr
+ * 
+ * Fill only the common header of a packet, used when the payload is sent from elsewhere
+ * (e.g. straight from a file mapping)
+ * 
+ * hdr: pointer to the header to fill
+ * src,dst,type,seq: see fillpkt
+ */
+void fillhdr(pkthdr_common* hdr, uint8_t src, uint8_t dst, uint8_t type, uint32_t seq);
+
 /*
  * dprintPkt
  * 
@@ -246,11 +464,101 @@ void dprintPkt(unsigned char* pkt, unsigned int pktLen, bool isTx);
  * 
  * Convert tx rate to a corresponding delay between subsequent data packet transmissions
  * 
- * rate: rate in kB/s
+ * rate: rate in pkts/s
  * 
  * Return value: delay in usecs
  */
 unsigned int rateToDelay(unsigned int rate);
 
+/*
+ * evInit
+ * 
+ * Initialize an event loop, must be called prior any other event loop function
+ * 
+ * Return value: true if initialized, false otherwise
+ */
+bool evInit(ev_loop* loop);
+
+/*
+ * evAddFd
+ * 
+ * Watch a descriptor (typically a socket) for readability
+ * 
+ * fd: descriptor to watch
+ * cb: called (level triggered) every loop round the descriptor is readable
+ * arg: passed to cb
+ * 
+ * Return value: true if added, false otherwise
+ */
+bool evAddFd(ev_loop* loop, int fd, ev_callback cb, void* arg);
+
+/*
+ * evWatchOut
+ *
+ * Call the callback of a watched descriptor also when it is writable, or
+ * stop doing so. The callback tells the two apart itself.
+ *
+ * fd: descriptor added by evAddFd
+ * on: true to watch for writability as well, false for readability only
+ *
+ * Return value: true if changed, false otherwise
+ */
+bool evWatchOut(ev_loop* loop, int fd, bool on);
+
+/*
+ * evAddTimer
+ * 
+ * Create a (disarmed) CLOCK_MONOTONIC timer, arm it with evSetTimer
+ * 
+ * cb: called when the timer expires
+ * arg: passed to cb
+ * 
+ * Return value: timer descriptor, -1 if error
+ */
+int evAddTimer(ev_loop* loop, ev_callback cb, void* arg);
+
+/*
+ * evSetTimer
+ * 
+ * Arm or disarm a timer
+ * 
+ * timer: descriptor returned by evAddTimer
+ * delayNs: time to the first expiration (nsecs), 0 to disarm the timer
+ * periodNs: period of subsequent expirations (nsecs), 0 for a one-shot timer
+ * 
+ * Return value: true if set, false otherwise
+ */
+bool evSetTimer(int timer, uint64_t delayNs, uint64_t periodNs);
+
+/*
+ * evRemove
+ * 
+ * Stop watching a descriptor. Timers created by evAddTimer are closed.
+ */
+void evRemove(ev_loop* loop, int fd);
+
+/*
+ * evRun
+ * 
+ * Dispatch events until evStop is called (typically from a callback)
+ * 
+ * Return value: true if stopped by evStop, false on error
+ */
+bool evRun(ev_loop* loop);
+
+/*
+ * evStop
+ * 
+ * Make evRun return after the current callback
+ */
+void evStop(ev_loop* loop);
+
+/*
+ * evClose
+ * 
+ * Release the loop and all its timers (watched sockets stay open)
+ */
+void evClose(ev_loop* loop);
+
 #endif	/* COMMON_H */
 
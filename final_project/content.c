@@ -0,0 +1,69 @@
+/* Definitions of content store functions
+ * See the header file for detailed description
+ *
+ * JLV & JB
+ */
+
+#define _DEFAULT_SOURCE // for MAP_POPULATE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "content.h"
+
+bool contentOpen(content* c, char* filename) {
+    if ((c == NULL) || (filename == NULL)) return false;
+    memset(c, 0, sizeof (*c));
+    c->name = filename;
+
+    if (strcmp(filename, TEST_FILE) == 0) {
+        // endless device, stream a fixed number of empty packets
+        c->size = (size_t) EMPTY_PKT_COUNT * DATALEN;
+        c->pktCount = EMPTY_PKT_COUNT;
+        return true;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        printf("Warning: File '%s' could not be opened\n", filename);
+        return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (!S_ISREG(st.st_mode)) || (st.st_size == 0)) {
+        printf("Warning: File '%s' is not a regular non-empty file\n", filename);
+        close(fd);
+        return false;
+    }
+    if ((uint64_t) st.st_size > (uint64_t) UINT32_MAX * DATALEN) {
+        printf("Warning: File '%s' is too large to be streamed\n", filename);
+        close(fd);
+        return false;
+    }
+
+    c->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd); // mapping stays valid
+    if (c->data == MAP_FAILED) {
+        printf("Warning: File '%s' could not be mapped\n", filename);
+        c->data = NULL;
+        return false;
+    }
+    madvise(c->data, st.st_size, MADV_SEQUENTIAL);
+
+    c->size = st.st_size;
+    c->pktCount = (uint32_t) ((c->size + DATALEN - 1) / DATALEN);
+    return true;
+}
+
+void contentClose(content* c) {
+    if ((c == NULL) || (c->data == NULL)) return;
+    munmap(c->data, c->size);
+    c->data = NULL;
+}
+
+unsigned int contentPayload(content* c, uint32_t seq, unsigned char** payload) {
+    *payload = NULL;
+    if ((c->data == NULL) || (seq == 0) || (seq > c->pktCount)) return 0;
+
+    size_t offset = (size_t) (seq - 1) * DATALEN;
+    *payload = c->data + offset;
+    if (c->size - offset < DATALEN) return (unsigned int) (c->size - offset);
+    return DATALEN;
+}
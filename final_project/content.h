@@ -0,0 +1,57 @@
+/* Interface of the server content store
+ * Every streamed file is memory-mapped once, data packet payloads point
+ * straight into the mapping so they can be sent without copying.
+ *
+ * JLV & JB
+ */
+
+#ifndef CONTENT_H
+#define	CONTENT_H
+
+#include "common.h"
+
+/* One streamable file */
+typedef struct content {
+    char* name;             // file name as requested by the client
+    unsigned char* data;    // read-only mapping, NULL for generated content (TEST_FILE)
+    size_t size;            // file size (bytes)
+    uint32_t pktCount;      // number of data packets = last seq of the stream
+} content;
+
+/*******************
+ * Public functions
+ *******************/
+
+/*
+ * contentOpen
+ *
+ * Map the given file. TEST_FILE cannot be mapped, it is served as
+ * EMPTY_PKT_COUNT zero-filled packets instead.
+ *
+ * c: content structure to fill
+ * filename: file to map
+ *
+ * Return value: true if the file can be streamed, false otherwise
+ */
+bool contentOpen(content* c, char* filename);
+
+/*
+ * contentClose
+ *
+ * Unmap the file
+ */
+void contentClose(content* c);
+
+/*
+ * contentPayload
+ *
+ * Get payload of the data packet with the given seq
+ *
+ * seq: seq number of the packet (1 - pktCount)
+ * payload: set to the payload inside the mapping, NULL if there is nothing to send
+ *
+ * Return value: payload length (bytes, 0 - DATALEN), the rest of the packet is zero padding
+ */
+unsigned int contentPayload(content* c, uint32_t seq, unsigned char** payload);
+
+#endif	/* CONTENT_H */
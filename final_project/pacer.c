@@ -0,0 +1,81 @@
+/* Definitions of tx pacer functions
+ * See the header file for detailed description
+ *
+ * JLV & JB
+ */
+
+#define _DEFAULT_SOURCE // for clock_nanosleep
+#include "pacer.h"
+
+/*******************
+ * Private functions
+ *******************/
+
+// add tokens accumulated since the last refill
+static void refill(pacer* p, uint64_t now) {
+    if (now <= p->last) return;
+    p->tokens += (double) (now - p->last) * p->rate / 1000000000.0;
+    if (p->tokens > p->burst) p->tokens = p->burst;
+    p->last = now;
+}
+
+// tokens needed before count packets can go, a burst larger than the bucket
+// waits for a full bucket and leaves the rest as a debt
+static double needed(pacer* p, unsigned int count) {
+    return (count < p->burst) ? count : p->burst;
+}
+
+/*******************
+ * Public functions
+ *******************/
+
+bool pacerInit(pacer* p, unsigned int rate, unsigned int burst) {
+    if ((p == NULL) || (burst == 0)) return false;
+    p->burst = burst;
+    p->tokens = burst;
+    p->last = monotonicNs();
+    pacerSetRate(p, rate);
+    return true;
+}
+
+void pacerSetRate(pacer* p, unsigned int rate) {
+    uint64_t now = monotonicNs();
+    refill(p, now); // tokens gathered so far are kept at the old rate
+    p->rate = (rate < PACER_RATE_MIN) ? PACER_RATE_MIN : rate;
+    p->start = now;
+    p->sent = 0;
+}
+
+uint64_t pacerDelay(pacer* p, unsigned int count) {
+    refill(p, monotonicNs());
+    double missing = needed(p, count) - p->tokens;
+    if (missing <= 0) return 0;
+    return (uint64_t) (missing * 1000000000.0 / p->rate) + 1;
+}
+
+void pacerConsume(pacer* p, unsigned int count) {
+    p->tokens -= count;
+    p->sent += count;
+}
+
+void pacerWait(pacer* p, unsigned int count) {
+    uint64_t delay = pacerDelay(p, count);
+    if (delay > 0) {
+        uint64_t deadline = monotonicNs() + delay;
+        if (delay > PACER_SPIN_NS) {
+            // sleep until shortly before the deadline, oversleep is absorbed by the spin
+            uint64_t wake = deadline - PACER_SPIN_NS;
+            struct timespec ts = {.tv_sec = wake / 1000000000, .tv_nsec = wake % 1000000000};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        }
+        while (monotonicNs() < deadline);
+        refill(p, deadline);
+    }
+    pacerConsume(p, count);
+}
+
+double pacerGetRate(pacer* p) {
+    uint64_t elapsed = monotonicNs() - p->start;
+    if ((p->sent == 0) || (elapsed == 0)) return 0;
+    return p->sent * 1000000000.0 / elapsed;
+}
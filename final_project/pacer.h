@@ -0,0 +1,93 @@
+/* Interface of the tx pacer component
+ * Token bucket driven by CLOCK_MONOTONIC, one token = one data packet.
+ * Data packets and retransmissions draw from the same bucket, so together
+ * they never exceed the rate requested by the client (TYPE_RATE).
+ *
+ * JLV & JB
+ */
+
+#ifndef PACER_H
+#define	PACER_H
+
+#include "common.h"
+
+/*******************
+ * Pacer defines
+ *******************/
+#define PACER_SPIN_NS 100000   // wait shorter than this (ns) is spun, longer one is slept
+#define PACER_BURST_DEFAULT 4  // default bucket depth (pkts)
+#define PACER_RATE_MIN 1       // lowest accepted rate (pkts/s), TYPE_RATE 0 is clamped to it
+
+/* Pacer state, one instance per paced stream */
+typedef struct pacer {
+    unsigned int rate;  // requested rate (pkts/s)
+    unsigned int burst; // bucket depth (pkts)
+    double tokens;      // tokens currently available
+    uint64_t last;      // time of the last refill (ns)
+    uint64_t start;     // beginning of the achieved rate measurement (ns)
+    uint64_t sent;      // packets paced since start
+} pacer;
+
+/*******************
+ * Public functions
+ *******************/
+
+/*
+ * pacerInit
+ *
+ * Initialize the pacer with a full bucket
+ *
+ * p: pacer to initialize
+ * rate: requested rate (pkts/s)
+ * burst: bucket depth (pkts), i.e. how many packets can be sent back to back
+ *
+ * Return value: true if initialized, false otherwise
+ */
+bool pacerInit(pacer* p, unsigned int rate, unsigned int burst);
+
+/*
+ * pacerSetRate
+ *
+ * Change the requested rate. Restarts the achieved rate measurement.
+ *
+ * rate: new rate (pkts/s)
+ */
+void pacerSetRate(pacer* p, unsigned int rate);
+
+/*
+ * pacerDelay
+ *
+ * Get time until count tokens are available, does not consume anything
+ *
+ * count: number of packets to be sent
+ *
+ * Return value: delay in nsecs, 0 if the packets can be sent right away
+ */
+uint64_t pacerDelay(pacer* p, unsigned int count);
+
+/*
+ * pacerConsume
+ *
+ * Take count tokens from the bucket (may go below zero, the debt is paid by
+ * the following packets) and count them as sent
+ */
+void pacerConsume(pacer* p, unsigned int count);
+
+/*
+ * pacerWait
+ *
+ * Block until count tokens are available and consume them. Long waits are slept
+ * on CLOCK_MONOTONIC, the last PACER_SPIN_NS before the deadline are spun.
+ */
+void pacerWait(pacer* p, unsigned int count);
+
+/*
+ * pacerGetRate
+ *
+ * Get the achieved rate since the last rate change
+ *
+ * Return value: achieved rate (pkts/s), 0 if nothing sent yet
+ */
+double pacerGetRate(pacer* p);
+
+#endif	/* PACER_H */
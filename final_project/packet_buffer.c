@@ -4,193 +4,359 @@
  * Jan Beran
  */
 
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS, MAP_HUGETLB, madvise
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "packet_buffer.h"
 
 /*******************
- * Local variables
+ * Buffer structure
  *******************/
 
-// packet structure in the buffer
-
-typedef struct pkt_buffer {
-    bool isFree;
-    uint32_t seq; // sequence number
-    unsigned char data[DATALEN];
-} pkt_buffer;
-
-static pkt_buffer buf[BUF_SIZE]; // buffer itself
-static unsigned int headInd = 0; // buffer starts at
-static uint32_t headSeq = 1; // seq at the buffer start (present or expected)
-static uint32_t lastSeq = 0; // last seq in buffer
-static uint32_t lastReqSeq = 0; // last requested lost seq
-static bool initialized = false;
-static FILE* out = NULL;
+// buffer cells, seq N is always in cell (N - 1) & mask
+// the metadata is kept apart from the payloads, scans only touch the occupancy bitmap
+// all arrays are carved from one mapping (region) in bufCreate, the structure itself is malloc'd
+
+struct packet_buffer {
+    unsigned int window; // number of cells, power of two
+    unsigned int mask; // window - 1
+    uint32_t* cellState; // BUF_CELL_FREE, BUF_CELL_CLAIMED or seq of the packet in the cell (atomic)
+    unsigned char** cellData; // payload slot of the cell, written only by the thread that claimed it
+    uint64_t* present; // bit set = packet of the cell is in place (atomic)
+    unsigned char* slab; // payload slots (DATALEN each), one per cell and the lent ones
+    void* region;
+    size_t regionLen;
+    unsigned int lentCount; // slots lent so far (atomic)
+    uint32_t headSeq; // seq at the buffer start (present or expected), written by the consumer only (atomic)
+    uint32_t lastSeq; // highest seq inserted (atomic)
+    uint32_t lastReqSeq; // last requested lost seq (consumer only)
+    unsigned int lostThresh; // missing packets this much older than the newest one are lost
+    uint32_t endSeq; // last seq of the stream, 0 until known (consumer only)
+    bool quiet; // no warning for dropped packets (BUF_QUIET)
+    uint64_t stalls; // flushes stopped by a hole (consumer only)
+    int out; // output file, -1 if none
+};
 
 /*******************
  * Private functions
  *******************/
 
-static unsigned int getCount(void) {
-    if (lastSeq == 0) return 0;
-    return (lastSeq - headSeq + 1);
+static unsigned int getCount(packet_buffer* buf) {
+    uint32_t head = __atomic_load_n(&buf->headSeq, __ATOMIC_ACQUIRE);
+    uint32_t last = __atomic_load_n(&buf->lastSeq, __ATOMIC_ACQUIRE);
+    if (last < head) return 0;
+    // both are read at different times, the head may be older than last
+    return (last - head + 1 > buf->window) ? buf->window : (last - head + 1);
+}
+
+static unsigned int cellIndex(packet_buffer* buf, uint32_t seq) {
+    return (seq - 1) & buf->mask;
+}
+
+// number of subsequent cells from index (wrapping around) whose present bit equals set, up to max
+static unsigned int runLength(packet_buffer* buf, unsigned int index, unsigned int max, bool set) {
+    unsigned int count = 0;
+    while (count < max) {
+        unsigned int bit = index % 64;
+        uint64_t word = __atomic_load_n(&buf->present[index / 64], __ATOMIC_ACQUIRE);
+        if (!set) word = ~word;
+        word >>= bit;
+        // cells left in this word, the last word of the buffer is not full
+        unsigned int avail = 64 - bit; // the window is a multiple of 64
+        unsigned int run = (~word == 0) ? 64 : (unsigned int) __builtin_ctzll(~word);
+        if (run > avail) run = avail;
+        count += run;
+        if (run < avail) break;
+        index = (index + run) & buf->mask;
+    }
+    return (count < max) ? count : max;
+}
+
+// set or clear the present bits of count cells from index (wrapping around), one atomic operation per word
+static void markCells(packet_buffer* buf, unsigned int index, unsigned int count, bool set) {
+    while (count > 0) {
+        unsigned int bit = index % 64;
+        unsigned int avail = 64 - bit;
+        unsigned int n = (count < avail) ? count : avail;
+        uint64_t bits = ((n == 64) ? ~0ULL : ((1ULL << n) - 1)) << bit;
+        if (set) {
+            __atomic_fetch_or(&buf->present[index / 64], bits, __ATOMIC_RELEASE);
+        } else {
+            __atomic_fetch_and(&buf->present[index / 64], ~bits, __ATOMIC_RELEASE);
+        }
+        count -= n;
+        index = (index + n) & buf->mask;
+    }
+}
+
+// claim the cell of seq for inserting, returns its index or BUF_SEQ_* if seq does not go in the buffer
+static int claimCell(packet_buffer* buf, uint32_t seq) {
+    for (;;) {
+        uint32_t head = __atomic_load_n(&buf->headSeq, __ATOMIC_ACQUIRE);
+        if (seq < head) return BUF_SEQ_OLD;
+        if (seq >= head + buf->window) return BUF_SEQ_HIGH;
+
+        int index = (int) cellIndex(buf, seq);
+        uint32_t state = BUF_CELL_FREE;
+        if (__atomic_compare_exchange_n(&buf->cellState[index], &state, BUF_CELL_CLAIMED, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // the cell is freed after the head moves, recheck in case a flush passed seq meanwhile
+            if (seq < __atomic_load_n(&buf->headSeq, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&buf->cellState[index], BUF_CELL_FREE, __ATOMIC_RELEASE);
+                return BUF_SEQ_OLD;
+            }
+            return index;
+        }
+        if (state == seq) return BUF_SEQ_EXIST;
+        // claimed by another thread or the flushed packet seq - window is still being released, retry
+        sched_yield();
+    }
+}
+
+// make the packet in a claimed cell visible to the consumer
+static void publishCell(packet_buffer* buf, int index, uint32_t seq) {
+    __atomic_store_n(&buf->cellState[index], seq, __ATOMIC_RELEASE);
+    markCells(buf, index, 1, true);
+
+    // update the last seq in the buffer
+    uint32_t last = __atomic_load_n(&buf->lastSeq, __ATOMIC_RELAXED);
+    while ((seq > last) && !__atomic_compare_exchange_n(&buf->lastSeq, &last, seq, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-static int checkScope(uint32_t seq) {
-    if (seq < headSeq) return BUF_SEQ_OLD;
-    if (seq >= headSeq + BUF_SIZE) return BUF_SEQ_HIGH;
+// report a seq that is not inserted, returns the bufAdd result for it
+static bool notInserted(packet_buffer* buf, int index, uint32_t seq) {
+    switch (index) {
+        case BUF_SEQ_OLD:
+            dprintf("Warning: attempt to insert already flushed packet in the buffer, seq=%u\n", seq);
+            return true;
+        case BUF_SEQ_HIGH:
+            if (!buf->quiet) printf("Warning: attempt to insert too high seq in the buffer, packet dropped, seq=%u\n", seq);
+            return false;
+        default:
+            dprintf("Warning: attempt to insert pkt already present in the buffer, seq=%u\n", seq);
+            return true;
+    }
+}
 
-    // get index in the buffer corresponding to seq
-    int index = (int) ((headInd + (seq - headSeq)) % BUF_SIZE);
+// map len bytes for the buffer, huge pages if reserved, transparent huge pages otherwise
+static void* mapRegion(size_t len, unsigned int flags, const char** backing) {
+    int populate = (flags & BUF_PREFAULT) ? MAP_POPULATE : 0;
+    void* mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    *backing = "huge pages";
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+        if (mem == MAP_FAILED) return NULL;
+        *backing = (madvise(mem, len, MADV_HUGEPAGE) == 0) ? "transparent huge pages" : "small pages";
+    }
+    if ((flags & BUF_MLOCK) && (mlock(mem, len) != 0)) {
+        printf("Warning: packet buffer could not be locked in memory (RLIMIT_MEMLOCK)\n");
+    }
+    return mem;
+}
 
-    // is packet with seq already in the buffer?
-    if (buf[index].isFree == false) return BUF_SEQ_EXIST;
+static unsigned int roundWindow(uint64_t pkts) {
+    unsigned int w = 64;
+    while ((w < pkts) && (w < BUF_WINDOW_MAX)) w <<= 1;
+    return w;
+}
 
-    // no, it is empty, return the index
-    return index;
+// write count slots from the buffer head to the output file, one system call
+static void writeSlots(packet_buffer* buf, struct iovec* iov, unsigned int count) {
+    if ((buf->out == -1) || (count == 0)) return;
+    if (writev(buf->out, iov, count) != (ssize_t) (count * DATALEN)) {
+        printf("Warning: local data file write error\n");
+    }
 }
 
 /*******************
  * Public functions
  *******************/
 
-bool bufInit(char* filename) {
+packet_buffer* bufCreate(char* filename, unsigned int size, unsigned int flags) {
+    packet_buffer* buf = calloc(1, sizeof (packet_buffer));
+    if (buf == NULL) {
+        printf("Error: packet buffer memory could not be allocated\n");
+        return NULL;
+    }
 
+    // one mapping: payload slots first (page aligned), then the cell arrays and the bitmap
+    buf->window = roundWindow((size == 0) ? BUF_SIZE : size);
+    buf->mask = buf->window - 1;
+    size_t slabLen = (size_t) (buf->window + BUF_SLOTS_LENT) * DATALEN;
+    size_t dataLen = (size_t) buf->window * sizeof (unsigned char*);
+    size_t stateLen = (size_t) buf->window * sizeof (uint32_t);
+    size_t presentLen = (size_t) (buf->window / 64) * sizeof (uint64_t);
+    buf->regionLen = (slabLen + dataLen + stateLen + presentLen + BUF_HUGE_PAGE - 1) & ~(BUF_HUGE_PAGE - 1);
+    const char* backing;
+    buf->region = mapRegion(buf->regionLen, flags, &backing);
+    if (buf->region == NULL) {
+        printf("Error: packet buffer memory could not be allocated\n");
+        free(buf);
+        return NULL;
+    }
+    buf->slab = (unsigned char*) buf->region;
+    buf->cellData = (unsigned char**) (buf->slab + slabLen);
+    buf->cellState = (uint32_t*) ((unsigned char*) buf->cellData + dataLen);
+    buf->present = (uint64_t*) ((unsigned char*) buf->cellState + stateLen);
+    dprintf("Packet buffer window %u pkts (%.1f MB, %s%s%s)\n", buf->window, buf->regionLen / 1048576.0, backing,
+            (flags & BUF_PREFAULT) ? ", pre-faulted" : "", (flags & BUF_MLOCK) ? ", locked" : "");
+
+    buf->out = -1;
     if (filename != NULL) {
         // open the output file
-        out = fopen(filename, "wb");
-        if (out == NULL) {
+        buf->out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (buf->out == -1) {
             printf("Error: Local data file could not be opened, program stopped\n");
-            return false;
+            munmap(buf->region, buf->regionLen);
+            free(buf);
+            return NULL;
         }
     }
 
-    // set init values
-    for (int i = 0; i < BUF_SIZE; i++) {
-        buf[i].isFree = true;
-        buf[i].seq = 0;
-    }
+    // set init values, the fresh mapping is zeroed (all cells free, no bits set)
+    for (unsigned int i = 0; i < buf->window; i++) buf->cellData[i] = buf->slab + (size_t) i * DATALEN;
+    buf->headSeq = 1;
+    buf->lostThresh = BUF_LOST_THRSH;
+    buf->quiet = (flags & BUF_QUIET);
+    return buf;
+}
 
-    initialized = true;
-    return true;
+void bufDestroy(packet_buffer* buf) {
+    if (buf == NULL) return;
+
+    if (buf->out != -1) close(buf->out);
+    munmap(buf->region, buf->regionLen);
+    free(buf);
 }
 
-bool bufFinish(void) {
-    if (!initialized) return false;
+unsigned int bufBdpWindow(unsigned int pktRate, unsigned int rttUs) {
+    uint64_t pkts = (uint64_t) pktRate * (BUF_CHECK_TIME + (uint64_t) BUF_BDP_RTTS * rttUs) / 1000000 + BUF_LOST_THRSH;
+    return roundWindow((pkts > BUF_SIZE) ? pkts : BUF_SIZE);
+}
 
-    if (out != NULL) {
-        fclose(out);
-    }
-    initialized = false;
-    return true;
+unsigned int bufGetWindow(packet_buffer* buf) {
+    return (buf == NULL) ? 0 : buf->window;
 }
 
-bool bufAdd(uint32_t seq, unsigned char* data) {
-    if ((!initialized) || (data == NULL) || (seq == 0)) return false;
+void bufSetLostThresh(packet_buffer* buf, unsigned int pkts) {
+    if (buf != NULL) buf->lostThresh = pkts;
+}
 
-    int index = checkScope(seq);
-    switch (index) {
-        case BUF_SEQ_OLD:
-            dprintf("Warning: attempt to insert already flushed packet in the buffer, seq=%u\n", seq);
-            return true;
-        case BUF_SEQ_HIGH:
-            printf("Warning: attempt to insert too high seq in the buffer, packet dropped, seq=%u\n", seq);
-            return false;
-        case BUF_SEQ_EXIST:
-            dprintf("Warning: attempt to insert pkt already present in the buffer, seq=%u\n", seq);
-            return true;
-        default:
-            //dprintf("Packet Inserted in the buffer, seq=%u index=%d\n", seq, index);
-            break;
-    }
+void bufSetEnd(packet_buffer* buf, uint32_t seq) {
+    if (buf != NULL) buf->endSeq = seq;
+}
 
-    // set the packet data
-    buf[index].isFree = false;
-    buf[index].seq = seq;
-    memcpy(buf[index].data, data, DATALEN);
+uint32_t bufGetHeadSeq(packet_buffer* buf) {
+    return (buf == NULL) ? 0 : __atomic_load_n(&buf->headSeq, __ATOMIC_ACQUIRE);
+}
 
-    // update the last seq in the buffer
-    if (seq > lastSeq) {
-        lastSeq = seq;
-    }
+uint64_t bufGetStalls(packet_buffer* buf) {
+    return (buf == NULL) ? 0 : buf->stalls;
+}
 
+bool bufAdd(packet_buffer* buf, uint32_t seq, unsigned char* data) {
+    if ((buf == NULL) || (data == NULL) || (seq == 0)) return false;
+
+    int index = claimCell(buf, seq);
+    if (index < 0) return notInserted(buf, index, seq);
+    memcpy(buf->cellData[index], data, DATALEN);
+    publishCell(buf, index, seq);
     return true;
 }
 
-unsigned int bufGetSubseqCount(void) {
-    if (!initialized) return 0;
+unsigned char* bufGetSlot(packet_buffer* buf) {
+    if (buf == NULL) return NULL;
+    unsigned int n = __atomic_fetch_add(&buf->lentCount, 1, __ATOMIC_RELAXED);
+    if (n >= BUF_SLOTS_LENT) return NULL;
+    return buf->slab + (size_t) (buf->window + n) * DATALEN;
+}
+
+bool bufCommit(packet_buffer* buf, uint32_t seq, unsigned char** slot) {
+    if ((buf == NULL) || (slot == NULL) || (*slot == NULL) || (seq == 0)) return false;
 
-    unsigned int count = 0; // packet counter
-    unsigned int ind = headInd; // index in the buffer
-    while (count < BUF_SIZE) {
-        if (buf[ind].isFree == true) break; // stop at the first free cell
-        count++;
-        ind = (ind + 1) % BUF_SIZE;
-    }
-    return count;
+    int index = claimCell(buf, seq);
+    if (index < 0) return notInserted(buf, index, seq);
+
+    // exchange the slots, the cell keeps the payload and its free slot goes to the caller
+    unsigned char* spare = buf->cellData[index];
+    buf->cellData[index] = *slot;
+    *slot = spare;
+    publishCell(buf, index, seq);
+    return true;
 }
 
-bool bufFlushFrame(void) {
-    if (!initialized) return false;
+unsigned int bufGetSubseqCount(packet_buffer* buf) {
+    if (buf == NULL) return 0;
 
-    while (buf[headInd].isFree == false) {
-        // flush the packet
-        if (out != NULL) {
-            if (fwrite(buf[headInd].data, 1, DATALEN, out) != (DATALEN)) {
-                printf("Warning: local data file write error\n");
-            }
+    // a present cell in the window always holds the packet of its seq
+    return runLength(buf, cellIndex(buf, __atomic_load_n(&buf->headSeq, __ATOMIC_RELAXED)), buf->window, true);
+}
+
+bool bufFlushFrame(packet_buffer* buf) {
+    if (buf == NULL) return false;
+
+    struct iovec iov[BUF_WRITE_BATCH];
+    uint32_t head = __atomic_load_n(&buf->headSeq, __ATOMIC_RELAXED);
+    for (;;) {
+        // collect present packets from the head, written straight from their slots
+        unsigned int count = runLength(buf, cellIndex(buf, head), BUF_WRITE_BATCH, true);
+        if (count == 0) break;
+        for (unsigned int i = 0; i < count; i++) {
+            iov[i].iov_base = buf->cellData[cellIndex(buf, head + i)];
+            iov[i].iov_len = DATALEN;
+            dprintf("Packet flushed from the buffer, seq=%u index=%u\n", head + i, cellIndex(buf, head + i));
         }
-        dprintf("Packet flushed from the buffer, seq=%u index=%d\n", buf[headInd].seq, headInd);
-
-        // update the buffer head
-        buf[headInd].isFree = true;
-        headInd = (headInd + 1) % BUF_SIZE;
-        headSeq++;
-        if (lastSeq < headSeq) {
-            // buffer is empty
-            lastSeq = 0;
+        writeSlots(buf, iov, count);
+
+        // move the head first, a producer that sees a freed cell sees the new head as well
+        // the bits are cleared before the cells are freed, a new packet in a freed cell keeps its bit
+        __atomic_store_n(&buf->headSeq, head + count, __ATOMIC_RELEASE);
+        markCells(buf, cellIndex(buf, head), count, false);
+        for (unsigned int i = 0; i < count; i++) {
+            __atomic_store_n(&buf->cellState[cellIndex(buf, head + i)], BUF_CELL_FREE, __ATOMIC_RELEASE);
         }
+        head += count;
+        if (count < BUF_WRITE_BATCH) break;
     }
-    //dprintf("Reached free cell at index=%d\n, flushing stopped\n", headInd);
+    // newer packets wait behind the missing head
+    if ((int32_t) (__atomic_load_n(&buf->lastSeq, __ATOMIC_ACQUIRE) - head) > 0) buf->stalls++;
+    //dprintf("Reached free cell at seq=%u\n, flushing stopped\n", head);
     return true;
 }
 
-double bufGetOccupancy(void) {
-    if (!initialized) return 0;
-    return (((double) getCount()) / BUF_SIZE);
+double bufGetOccupancy(packet_buffer* buf) {
+    if (buf == NULL) return 0;
+    return (((double) getCount(buf)) / buf->window);
 }
 
-uint32_t bufGetFirstLost(void) {
-    lastReqSeq = 0; // reset the requested packets memory
-    return bufGetNextLost();
+uint32_t bufGetFirstLost(packet_buffer* buf) {
+    if (buf == NULL) return 0;
+    buf->lastReqSeq = 0; // reset the requested packets memory
+    return bufGetNextLost(buf);
 }
 
-uint32_t bufGetNextLost(void) {
-    if (!initialized) return 0;
-    unsigned int pktCount = getCount();
-    if (pktCount <= BUF_LOST_THRSH) return 0; // not enough packets to have a lost one
-    if (lastReqSeq >= lastSeq - BUF_LOST_THRSH) return 0; // already requested all possible losses
-    if (lastReqSeq < headSeq) lastReqSeq = 0; // last requested seq too old
-
-    // index in the buffer 
-    unsigned int ind;
-    if (lastReqSeq == 0) {
-        // start from the beginning
-        ind = headInd;
-        lastReqSeq = headSeq - 1;
+uint32_t bufGetNextLost(packet_buffer* buf) {
+    if (buf == NULL) return 0;
+    uint32_t head = __atomic_load_n(&buf->headSeq, __ATOMIC_RELAXED);
+    uint32_t end;
+    if (buf->endSeq != 0) {
+        // end of the stream known, every missing seq up to it is lost (newer than the newest packet too)
+        if ((int32_t) (buf->endSeq - head) < 0) return 0;
+        end = ((buf->endSeq - head) >= buf->window) ? head + buf->window : buf->endSeq + 1;
     } else {
-        // start from the last request
-        ind = (headInd + (lastReqSeq - headSeq + 1)) % BUF_SIZE;
-    }
-
-    unsigned int count = 1; // packet counter
-    while (count < (pktCount - BUF_LOST_THRSH)) {
-        if (buf[ind].isFree == true) {
-            // lost packet detected            
-            lastReqSeq += count; // remember its seq
-            return lastReqSeq; // request it
-        }
-        count++;
-        ind = (ind + 1) % BUF_SIZE;
+        unsigned int pktCount = getCount(buf);
+        if (pktCount <= buf->lostThresh) return 0; // not enough packets to have a lost one
+        end = head + pktCount - buf->lostThresh - 1; // newer seqs may still arrive
     }
-    return 0;
+    if (buf->lastReqSeq + 1 >= end) return 0; // already requested all possible losses
+    if (buf->lastReqSeq < head) buf->lastReqSeq = head - 1; // last requested seq too old, start from the beginning
+
+    // skip the present packets a word at a time, the first missing one in the scope is lost
+    uint32_t seq = buf->lastReqSeq + 1;
+    seq += runLength(buf, cellIndex(buf, seq), end - seq, true);
+    if (seq >= end) return 0;
+    buf->lastReqSeq = seq; // remember its seq
+    return buf->lastReqSeq; // request it
 }
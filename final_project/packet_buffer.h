@@ -1,5 +1,28 @@
 /* Interface of the packet buffer component
- * Implemented as a fixed-length ring buffer
+ * Implemented as a fixed-length ring buffer of payload slots. The slots come
+ * from a slab owned by the buffer, the receive path can borrow free slots,
+ * receive payloads straight into them and hand them over (bufGetSlot, bufCommit),
+ * so a payload is never copied between the socket and the output file.
+ *
+ * The buffer has no lock. Every cell holds the seq of its packet in an atomic
+ * state word (free, claimed by an inserting thread, or the seq once the payload
+ * is in place). Any number of threads can insert packets (bufAdd, bufCommit,
+ * bufGetSlot) while one other thread, the consumer, flushes frames and scans
+ * for lost packets (bufFlushFrame, bufGetSubseqCount, bufGetFirstLost,
+ * bufGetNextLost, bufSetEnd). The consumer is the only writer of the buffer head.
+ * bufGetOccupancy can be called from any thread.
+ * Which cells hold their packet is kept in a dense bitmap apart from the cell
+ * metadata and payloads, so runs and holes are found 64 cells at a time.
+ *
+ * The window (number of cells) is set by bufCreate and rounded up to a power of
+ * two, cells are indexed by masking the seq. bufBdpWindow sizes it for a path
+ * from its rate and round trip time. All buffer memory is one mapping backed
+ * by huge pages when the system has them reserved (transparent huge pages
+ * otherwise), it can be pre-faulted and locked in memory.
+ *
+ * Every buffer is an independent instance (bufCreate, bufDestroy) with no
+ * global state, a process can run several streams or benchmarks side by side.
+ * The rules above hold per instance.
  *
  * Jan Beran
  */
@@ -18,30 +41,114 @@
 #define BUF_SEQ_HIGH -2 // seq > end of the buffer
 #define BUF_SEQ_EXIST -1// seq already in the buffer
 
+// states of a buffer cell besides the seq of its packet - internal use only
+#define BUF_CELL_FREE 0             // no packet, seq numbers start at 1
+#define BUF_CELL_CLAIMED UINT32_MAX // a packet is being inserted
+
+#define BUF_SLOTS_LENT RX_BATCH_MAX // slab slots that can be lent to the receive path
+#define BUF_WRITE_BATCH 64          // slots written to the output file by one writev call
+#define BUF_WINDOW_MAX (1 << 20)    // largest window (pkts), 1 GB of payload slots
+#define BUF_BDP_RTTS 4              // round trips a lost packet may take to be recovered (bufBdpWindow)
+#define BUF_HUGE_PAGE (2UL << 20)   // huge page size the buffer mapping is rounded to
+
+// bufInit flags
+#define BUF_PREFAULT 0x1    // fault all buffer pages in at init
+#define BUF_MLOCK 0x2       // lock the buffer in memory
+#define BUF_QUIET 0x4       // no warning for packets dropped as too high (replays, simulations)
+
+/* Packet buffer instance, its members are private to packet_buffer.c */
+typedef struct packet_buffer packet_buffer;
+
 
 /*******************
  * Public functions
  *******************/
 
 /* 
- * bufInit
+ * bufCreate
  * 
- * Initialize the buffer, must be called prior any other buffer function
+ * Create a buffer, the handle is passed to all other buffer functions
  * 
  * filename: name of the output file, NULL if no file used 
+ * size: window, number of packets the buffer holds, rounded up to a power
+ *       of two, 0 for BUF_SIZE. At most BUF_WINDOW_MAX.
+ * flags: BUF_PREFAULT, BUF_MLOCK, BUF_QUIET or 0
  * 
- * Return value: true if initialized, fail otherwise
+ * Return value: new buffer, NULL if it could not be created
  */
-bool bufInit(char* filename);
+packet_buffer* bufCreate(char* filename, unsigned int size, unsigned int flags);
 
 /* 
- * bufFinish
- * 
- * Clean up allocated resources, should be called when the streaming is finished
+ * bufDestroy
  * 
- * Return value: true if successfully finished, fail otherwise
+ * Close the output file and free the buffer, should be called when the streaming is finished.
+ * No other thread may use the buffer any more.
+ */
+void bufDestroy(packet_buffer* buf);
+
+/*
+ * bufBdpWindow
+ *
+ * Window for a path: packets that arrive until the next flush and during
+ * BUF_BDP_RTTS round trips, plus the packets newer than the lost threshold.
+ * Never smaller than BUF_SIZE.
+ *
+ * pktRate: expected rate (pkts/s)
+ * rttUs: measured round trip time (usecs)
+ *
+ * Return value: window for bufCreate (power of two, at most BUF_WINDOW_MAX)
+ */
+unsigned int bufBdpWindow(unsigned int pktRate, unsigned int rttUs);
+
+/*
+ * bufGetWindow
+ *
+ * Return value: number of packets the buffer holds, 0 if buf is NULL
+ */
+unsigned int bufGetWindow(packet_buffer* buf);
+
+/*
+ * bufSetLostThresh
+ *
+ * Change how much older than the newest packet a missing one has to be to
+ * count as lost (bufGetFirstLost, bufGetNextLost), BUF_LOST_THRSH by default.
+ * Call it from the consumer thread.
+ *
+ * pkts: threshold (pkts)
+ */
+void bufSetLostThresh(packet_buffer* buf, unsigned int pkts);
+
+/*
+ * bufSetEnd
+ *
+ * Set the last seq of the stream (announced by TYPE_FIN). From then on every
+ * missing packet up to it counts as lost, regardless of the lost threshold,
+ * the ones newer than the newest received packet included. Call it from the
+ * consumer thread.
+ *
+ * seq: last seq, 0 if unknown
+ */
+void bufSetEnd(packet_buffer* buf, uint32_t seq);
+
+/*
+ * bufGetHeadSeq
+ *
+ * Seq at the buffer start, every packet before it was flushed.
+ * Can be called from any thread.
+ *
+ * Return value: head seq, 0 if buf is NULL
+ */
+uint32_t bufGetHeadSeq(packet_buffer* buf);
+
+/*
+ * bufGetStalls
+ *
+ * Number of bufFlushFrame calls that stopped at a missing packet while newer
+ * packets were waiting behind it (playback stalled by a hole)
+ *
+ * Return value: stall count, 0 if buf is NULL
  */
-bool bufFinish(void);
+uint64_t bufGetStalls(packet_buffer* buf);
 
 /* 
  * bufAdd
@@ -54,7 +161,34 @@ bool bufFinish(void);
  * Return value:    false if the packet has to be dropped (seq too high to get in the buffer)
  *                  true if the packet is successfully inserted or if it is an already processed packet
  */
-bool bufAdd(uint32_t seq, unsigned char* data);
+bool bufAdd(packet_buffer* buf, uint32_t seq, unsigned char* data);
+
+/*
+ * bufGetSlot
+ *
+ * Borrow a payload slot (DATALEN bytes) to receive packets into.
+ * BUF_SLOTS_LENT slots can be borrowed in total, they are kept by the
+ * receive path for the whole stream (bufCommit exchanges them).
+ *
+ * Return value: slot, NULL if all slots are lent
+ */
+unsigned char* bufGetSlot(packet_buffer* buf);
+
+/*
+ * bufCommit
+ *
+ * Add a new (received) packet whose payload is in a borrowed slot.
+ * The slot is attached to the buffer as it is, no data is copied.
+ *
+ * seq: seq number of the packet
+ * slot: borrowed slot holding the payload. When the buffer takes it over it
+ *       is replaced by the free slot of the buffer cell, otherwise (old,
+ *       duplicate or too high seq) it is left as it is. Either way the caller
+ *       can receive the next packet into *slot.
+ *
+ * Return value: same as bufAdd
+ */
+bool bufCommit(packet_buffer* buf, uint32_t seq, unsigned char** slot);
 
 /* 
  * bufGetSubseqCount
@@ -63,7 +197,7 @@ bool bufAdd(uint32_t seq, unsigned char* data);
  * 
  * Return value: 0 if error, number of subsequent packets otherwise (can be 0 as well)
  */
-unsigned int bufGetSubseqCount(void);
+unsigned int bufGetSubseqCount(packet_buffer* buf);
 
 /* 
  * bufFlushFrame
@@ -74,7 +208,7 @@ unsigned int bufGetSubseqCount(void);
  * Return value:    true if frame successfully flushed, 
  *                  false if error or if there is missing packet at the beginning of the buffer
  */
-bool bufFlushFrame(void);
+bool bufFlushFrame(packet_buffer* buf);
 
 /* 
  * bufGetOccupancy
@@ -84,7 +218,7 @@ bool bufFlushFrame(void);
  * 
  * Return value: floating point value within <0,1>, ratio of occupancy (0 empty, 1 full)
  */
-double bufGetOccupancy(void);
+double bufGetOccupancy(packet_buffer* buf);
 
 /* 
  * bufGetFirstLost
@@ -94,7 +228,7 @@ double bufGetOccupancy(void);
  * 
  * Return value: 0 if there no lost packet in the buffer, seq of the first lost packet otherwise
  */
-uint32_t bufGetFirstLost(void);
+uint32_t bufGetFirstLost(packet_buffer* buf);
 
 /* 
  * bufGetNextLost
@@ -105,7 +239,7 @@ uint32_t bufGetFirstLost(void);
  * 
  * Return value: 0 if there no next lost packet, seq of the next lost packet otherwise
  */
-uint32_t bufGetNextLost(void);
+uint32_t bufGetNextLost(packet_buffer* buf);
 
 #endif	/* PACKET_BUFFER_H */
 
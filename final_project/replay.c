@@ -0,0 +1,361 @@
+/*
+ * Trace replay
+ * Feeds recorded arrivals ("ms seq" data files or client traces) through the
+ * packet buffer on a virtual clock and reports what the client would have
+ * experienced with other settings:
+ * - every check interval a timer round flushes the buffer and scans it for
+ *   lost packets, every lost seq is a NAK
+ * - a NAK'd seq arrives one round trip later (unless it is still on its way),
+ *   packets missing from the recording are recovered this way
+ * - packets above the window are dropped (and NAK'd later)
+ * - after the last recorded arrival the stream end is known, all remaining
+ *   holes are NAK'd regardless of the lost threshold
+ * - a player starts the startup delay after the first arrival and plays R
+ *   frames (packets) per second, a frame not flushed by its time stalls the
+ *   playback until it is
+ * Reported per configuration: stalls and stall time, NAKs, retransmitted
+ * packets, dropped packets, peak buffer occupancy and packets never delivered.
+ * Every file x configuration is an independent buffer, they are replayed in
+ * parallel.
+ *
+ * usage: ./replay [-w <windows>] [-l <lost thresholds>] [-i <check intervals ms>] [-r <rates>]
+ *                 [-d <startup delays ms>] [-t <round trips ms>] [-j <threads>] <file> ...
+ *   every option takes a comma separated list of values and first:last:step ranges,
+ *   all combinations are replayed (defaults: the client settings, R 30, startup 2000 ms, round trip 50 ms)
+ *
+ * JLV & JB
+ */
+
+#define _DEFAULT_SOURCE // for mmap, sysconf
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "packet_buffer.h"
+#include "trace.h"
+
+#define RP_VALUES_MAX 32    // values per swept parameter
+#define RP_FILES_MAX 64
+#define RP_THREADS_MAX 64
+#define RP_CONFIGS_MAX 65536
+
+/* One recorded arrival */
+typedef struct rp_arrival {
+    uint64_t ns;    // arrival time (ns)
+    uint32_t seq;
+} rp_arrival;
+
+/* One recorded stream */
+typedef struct rp_file {
+    char* path;
+    rp_arrival* arr;
+    uint32_t count;
+    uint32_t lastSeq;   // highest seq in the recording = stream length
+} rp_file;
+
+/* Replayed settings */
+typedef struct rp_config {
+    unsigned int window;        // buffer window (pkts, rounded by the buffer)
+    unsigned int lostThresh;    // BUF_LOST_THRSH
+    unsigned int checkMs;       // BUF_CHECK_TIME (ms)
+    unsigned int rate;          // playback rate R (frames/s)
+    unsigned int startMs;       // startup delay (ms)
+    unsigned int rttMs;         // NAK to retransmission time (ms)
+} rp_config;
+
+/* Replay result */
+typedef struct rp_result {
+    unsigned int window;        // window used
+    uint64_t stalls;
+    uint64_t stallNs;
+    uint64_t naks;
+    uint64_t retx;              // retransmissions that arrived
+    uint64_t drops;             // arrivals above the window
+    double peakOc;
+    uint32_t undelivered;       // seqs never flushed
+} rp_result;
+
+static rp_file files[RP_FILES_MAX];
+static unsigned int fileCount = 0;
+static rp_config configs[RP_CONFIGS_MAX];
+static unsigned int configCount = 0;
+static rp_result* results; // fileCount x configCount
+static unsigned int nextJob = 0; // (atomic)
+
+/*******************
+ * Replay
+ *******************/
+
+/* player state, frame = seq */
+typedef struct rp_player {
+    uint64_t frameNs;
+    uint64_t next;      // time the next frame is due (ns)
+    bool started;
+} rp_player;
+
+// frames first - last were flushed at time now
+static void play(rp_player* p, rp_result* res, uint32_t first, uint32_t last, uint64_t now) {
+    for (uint32_t f = first; f <= last; f++) {
+        if (now > p->next) {
+            // frame late, the playback waits for it
+            res->stalls++;
+            res->stallNs += now - p->next;
+            p->next = now;
+        }
+        p->next += p->frameNs;
+    }
+}
+
+static void replay(rp_file* file, rp_config* cfg, rp_result* res) {
+    memset(res, 0, sizeof (*res));
+    packet_buffer* buf = bufCreate(NULL, cfg->window, BUF_QUIET);
+    uint8_t* pending = calloc(file->lastSeq + 1, 1); // NAK'd seq on its way
+    // FIFO in time order (constant round trip), a seq is in it at most once
+    unsigned int retxSize = file->lastSeq + 1;
+    rp_arrival* retx = malloc(retxSize * sizeof (rp_arrival));
+    unsigned char* slot = bufGetSlot(buf); // payload content does not matter, committed without copying
+    if ((buf == NULL) || (pending == NULL) || (retx == NULL) || (slot == NULL)) {
+        printf("Error: replay of %s could not be initialized\n", file->path);
+        bufDestroy(buf);
+        free(pending);
+        free(retx);
+        res->undelivered = file->lastSeq;
+        return;
+    }
+    bufSetLostThresh(buf, cfg->lostThresh);
+    res->window = bufGetWindow(buf);
+    unsigned int retxHead = 0, retxTail = 0;
+    uint64_t checkNs = (uint64_t) cfg->checkMs * 1000000;
+    uint64_t rttNs = (uint64_t) cfg->rttMs * 1000000;
+    rp_player player = {1000000000ULL / cfg->rate, 0, false};
+    uint32_t delivered = 0;
+    uint32_t i = 0;
+    uint64_t timer = checkNs;
+    bool idle = false; // a round without arrivals before it
+
+    for (;;) {
+        // next arrival, recorded or retransmitted
+        bool fromRetx = (retxHead != retxTail) && ((i == file->count) || (retx[retxHead].ns < file->arr[i].ns));
+        bool any = fromRetx || (i < file->count);
+        rp_arrival* a = fromRetx ? &retx[retxHead] : &file->arr[i];
+        if (!player.started && any) {
+            player.next = a->ns + (uint64_t) cfg->startMs * 1000000;
+            player.started = true;
+        }
+
+        if (any && (a->ns < timer)) {
+            if (fromRetx) {
+                retxHead = (retxHead + 1) % retxSize;
+                pending[a->seq] = 0;
+                res->retx++;
+            } else {
+                i++;
+            }
+            if (!bufCommit(buf, a->seq, &slot)) res->drops++;
+            double oc = bufGetOccupancy(buf);
+            if (oc > res->peakOc) res->peakOc = oc;
+            idle = false;
+            continue;
+        }
+
+        // timer round: flush, then NAK the lost packets
+        // after the last recorded arrival the end of the stream is known (TYPE_FIN), every hole is lost
+        if (i == file->count) bufSetLostThresh(buf, 0);
+        unsigned int count = bufGetSubseqCount(buf);
+        bufFlushFrame(buf);
+        if (count > 0) play(&player, res, delivered + 1, delivered + count, timer);
+        delivered += count;
+        for (uint32_t lost = bufGetFirstLost(buf); lost > 0; lost = bufGetNextLost(buf)) {
+            res->naks++;
+            if ((lost > file->lastSeq) || pending[lost]) continue;
+            pending[lost] = 1;
+            retx[retxTail].ns = timer + rttNs;
+            retx[retxTail].seq = lost;
+            retxTail = (retxTail + 1) % retxSize;
+        }
+        timer += checkNs;
+        // nothing more can arrive, the rest of the stream is never delivered
+        if (!any && (idle || (delivered >= file->lastSeq))) break;
+        if (!any) idle = true;
+    }
+    res->undelivered = file->lastSeq - delivered;
+    bufDestroy(buf);
+    free(pending);
+    free(retx);
+}
+
+static void* worker(void* arg) {
+    if (arg) arg = NULL;
+    for (;;) {
+        unsigned int j = __atomic_fetch_add(&nextJob, 1, __ATOMIC_RELAXED);
+        if (j >= fileCount * configCount) return NULL;
+        replay(&files[j / configCount], &configs[j % configCount], &results[j]);
+    }
+}
+
+/*******************
+ * Input
+ *******************/
+
+// parse an unsigned number, returns false at the end of the data
+static bool parseNum(const char** p, const char* end, uint64_t* val) {
+    while ((*p < end) && ((**p < '0') || (**p > '9'))) (*p)++;
+    if (*p == end) return false;
+    *val = 0;
+    while ((*p < end) && (**p >= '0') && (**p <= '9')) *val = *val * 10 + (uint64_t) (*(*p)++ - '0');
+    return true;
+}
+
+static int byTime(const void* a, const void* b) {
+    const rp_arrival* x = (const rp_arrival*) a;
+    const rp_arrival* y = (const rp_arrival*) b;
+    return (x->ns > y->ns) - (x->ns < y->ns);
+}
+
+// load the data packet arrivals of a data file or trace
+static bool loadFile(rp_file* f, char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ((fd == -1) || (fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        if (fd != -1) close(fd);
+        return false;
+    }
+    size_t len = st.st_size;
+    const char* mem = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return false;
+
+    trace_filehdr hdr = {};
+    if (len >= sizeof (hdr)) memcpy(&hdr, mem, sizeof (hdr));
+    bool trace = (hdr.magic == TRACE_MAGIC) && (hdr.recSize == sizeof (trace_rec));
+    // upper bound of the record count: a text line is at least 4 bytes
+    size_t max = trace ? (len - sizeof (hdr)) / sizeof (trace_rec) : len / 4 + 1;
+    f->arr = malloc(max * sizeof (rp_arrival));
+    if (f->arr == NULL) {
+        munmap((void*) mem, len);
+        return false;
+    }
+    f->path = path;
+    f->count = 0;
+    f->lastSeq = 0;
+    bool sorted = true;
+    if (trace) {
+        const trace_rec* rec = (const trace_rec*) (mem + sizeof (hdr));
+        for (size_t r = 0; r < max; r++) {
+            if ((rec[r].type != TYPE_DATA) || (rec[r].seq == 0)) continue;
+            f->arr[f->count].ns = rec[r].ns;
+            f->arr[f->count++].seq = rec[r].seq;
+        }
+    } else {
+        const char* p = mem;
+        uint64_t ms, seq;
+        while (parseNum(&p, mem + len, &ms) && parseNum(&p, mem + len, &seq)) {
+            if ((seq == 0) || (seq > UINT32_MAX)) continue;
+            f->arr[f->count].ns = ms * 1000000;
+            f->arr[f->count++].seq = (uint32_t) seq;
+        }
+    }
+    munmap((void*) mem, len);
+    for (uint32_t a = 0; a < f->count; a++) {
+        if (f->arr[a].seq > f->lastSeq) f->lastSeq = f->arr[a].seq;
+        if ((a > 0) && (f->arr[a].ns < f->arr[a - 1].ns)) sorted = false;
+    }
+    if (!sorted) qsort(f->arr, f->count, sizeof (rp_arrival), byTime);
+    return (f->count > 0);
+}
+
+// "10,25,30:100:10" - returns the number of values, 0 if malformed or too many
+static unsigned int parseList(char* list, unsigned int* vals) {
+    unsigned int n = 0;
+    for (char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        unsigned int first, last, step = 1;
+        int k = sscanf(tok, "%u:%u:%u", &first, &last, &step);
+        if (k == 1) last = first;
+        if ((k < 1) || (last < first) || (step == 0)) return 0;
+        for (unsigned int v = first; v <= last; v += step) {
+            if (n == RP_VALUES_MAX) return 0;
+            vals[n++] = v;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    // swept parameters: window, lost threshold, check interval, rate, startup delay, round trip
+    unsigned int vals[6][RP_VALUES_MAX] = {{BUF_SIZE}, {BUF_LOST_THRSH}, {BUF_CHECK_TIME / 1000}, {30}, {2000}, {50}};
+    unsigned int counts[6] = {1, 1, 1, 1, 1, 1};
+    const char* opts = "wlirdt";
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = (cpus > 0) ? (unsigned int) cpus : 1;
+    bool ok = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:l:i:r:d:t:j:")) != -1) {
+        char* o = strchr(opts, opt);
+        if (opt == 'j') {
+            threads = (unsigned int) strtoul(optarg, NULL, 10);
+        } else if (o != NULL) {
+            counts[o - opts] = parseList(optarg, vals[o - opts]);
+            ok = ok && (counts[o - opts] > 0);
+        } else {
+            ok = false;
+        }
+    }
+    configCount = 1;
+    for (unsigned int p = 0; p < 6; p++) configCount *= counts[p];
+    for (unsigned int r = 0; r < counts[3]; r++) ok = ok && (vals[3][r] > 0);
+    for (unsigned int c = 0; c < counts[2]; c++) ok = ok && (vals[2][c] > 0);
+    if (!ok || (optind == argc) || (argc - optind > RP_FILES_MAX) || (configCount > RP_CONFIGS_MAX) ||
+            (threads < 1) || (threads > RP_THREADS_MAX)) {
+        printf("Usage: %s [-w <windows>] [-l <lost thresholds>] [-i <check intervals ms>] [-r <rates>]\n", argv[0]);
+        printf("       [-d <startup delays ms>] [-t <round trips ms>] [-j <threads 1-%u>] <file> ...\n", RP_THREADS_MAX);
+        printf("  lists: comma separated values and first:last:step ranges (at most %u values each)\n", RP_VALUES_MAX);
+        printf("  all combinations are replayed (at most %u), for at most %u files\n", RP_CONFIGS_MAX, RP_FILES_MAX);
+        exit(1);
+    }
+
+    // all combinations, the window varies slowest
+    for (unsigned int c = 0; c < configCount; c++) {
+        unsigned int idx[6], rest = c;
+        for (int p = 5; p >= 0; p--) {
+            idx[p] = rest % counts[p];
+            rest /= counts[p];
+        }
+        configs[c] = (rp_config) {vals[0][idx[0]], vals[1][idx[1]], vals[2][idx[2]], vals[3][idx[3]], vals[4][idx[4]],
+            vals[5][idx[5]]};
+    }
+    for (int a = optind; a < argc; a++) {
+        if (!loadFile(&files[fileCount], argv[a])) {
+            printf("Error: no data packets read from %s\n", argv[a]);
+            exit(1);
+        }
+        fileCount++;
+    }
+    results = calloc((size_t) fileCount * configCount, sizeof (rp_result));
+    if (results == NULL) exit(1);
+    if (threads > fileCount * configCount) threads = fileCount * configCount;
+
+    uint64_t start = monotonicNs();
+    pthread_t pool[RP_THREADS_MAX];
+    for (unsigned int t = 0; t < threads; t++) pthread_create(&pool[t], NULL, worker, NULL);
+    for (unsigned int t = 0; t < threads; t++) pthread_join(pool[t], NULL);
+    double ms = (monotonicNs() - start) / 1e6;
+
+    for (unsigned int f = 0; f < fileCount; f++) {
+        unsigned int clean = 0;
+        printf("%s: %u arrivals, %u pkts\n", files[f].path, files[f].count, files[f].lastSeq);
+        printf("%8s %6s %6s %5s %7s %6s | %6s %10s %8s %8s %8s %6s %8s\n", "window", "lost", "chk ms", "R", "start",
+                "rtt", "stalls", "stall ms", "naks", "retx", "drops", "peak%", "missing");
+        for (unsigned int c = 0; c < configCount; c++) {
+            rp_config* cfg = &configs[c];
+            rp_result* res = &results[f * configCount + c];
+            if ((res->stalls == 0) && (res->undelivered == 0)) clean++;
+            printf("%8u %6u %6u %5u %7u %6u | %6" PRIu64 " %10.0f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %6.1f %8u\n",
+                    res->window, cfg->lostThresh, cfg->checkMs, cfg->rate, cfg->startMs, cfg->rttMs, res->stalls,
+                    res->stallNs / 1e6, res->naks, res->retx, res->drops, 100 * res->peakOc, res->undelivered);
+        }
+        printf("%u of %u configurations without a stall\n", clean, configCount);
+        free(files[f].arr);
+    }
+    printf("%u files x %u configurations, %u threads, %.1f ms\n", fileCount, configCount, threads, ms);
+    free(results);
+    return 0;
+}
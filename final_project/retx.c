@@ -0,0 +1,103 @@
+/* Definitions of retransmission functions
+ * See the header file for detailed description
+ *
+ * JLV & JB
+ */
+
+#include "retx.h"
+
+/*******************
+ * Private functions
+ *******************/
+
+static retx_entry* slot(retx_cache* r, uint32_t seq) {
+    return &r->cache[seq & (RETX_CACHE_SIZE - 1)];
+}
+
+static unsigned int setHome(uint32_t seq) {
+    return ((seq * 2654435761u) >> 16) & (RETX_SET_SIZE - 1);
+}
+
+/* position of the seq in the queued set, or of the empty slot ending its probe */
+static unsigned int setFind(retx_cache* r, uint32_t seq) {
+    unsigned int i = setHome(seq);
+    while ((r->queued[i] != 0) && (r->queued[i] != seq)) i = (i + 1) & (RETX_SET_SIZE - 1);
+    return i;
+}
+
+/* remove the seq, later entries of the probe move back (no tombstones) */
+static void setRemove(retx_cache* r, uint32_t seq) {
+    unsigned int i = setFind(r, seq);
+    if (r->queued[i] == 0) return;
+    r->queued[i] = 0;
+    for (unsigned int j = (i + 1) & (RETX_SET_SIZE - 1); r->queued[j] != 0; j = (j + 1) & (RETX_SET_SIZE - 1)) {
+        // an entry may fill the hole if its home is not between the hole and it
+        unsigned int home = setHome(r->queued[j]);
+        if (((j - home) & (RETX_SET_SIZE - 1)) >= ((j - i) & (RETX_SET_SIZE - 1))) {
+            r->queued[i] = r->queued[j];
+            r->queued[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/*******************
+ * Public functions
+ *******************/
+
+void retxInit(retx_cache* r, content* file) {
+    memset(r, 0, sizeof (*r));
+    r->file = file;
+}
+
+void retxSent(retx_cache* r, uint32_t seq) {
+    slot(r, seq)->seq = seq;
+}
+
+bool retxRequest(retx_cache* r, uint32_t seq) {
+    if ((seq == 0) || (seq > r->file->pktCount)) return false;
+
+    unsigned int i = setFind(r, seq);
+    if (r->queued[i] == seq) {
+        r->stats.dups++;
+        return false;
+    }
+    if (slot(r, seq)->seq == seq) {
+        r->stats.hits++;
+    } else {
+        r->stats.misses++;
+    }
+
+    if (r->depth == RETX_QUEUE_SIZE) {
+        r->stats.drops++;
+        return false;
+    }
+    r->queue[(r->head + r->depth) % RETX_QUEUE_SIZE] = seq;
+    r->depth++;
+    if (r->depth > r->stats.maxDepth) r->stats.maxDepth = r->depth;
+    r->queued[i] = seq;
+    return true;
+}
+
+unsigned int retxNext(retx_cache* r, uint32_t* seqs, unsigned int max) {
+    unsigned int count = 0;
+    while ((count < max) && (r->depth > 0)) {
+        uint32_t seq = r->queue[r->head];
+        r->head = (r->head + 1) % RETX_QUEUE_SIZE;
+        r->depth--;
+
+        setRemove(r, seq);
+        seqs[count++] = seq;
+    }
+    return count;
+}
+
+unsigned int retxPayload(retx_cache* r, uint32_t seq, unsigned char** payload) {
+    return contentPayload(r->file, seq, payload);
+}
+
+void retxPrintStats(retx_cache* r) {
+    printf("Retransmissions: cache hits %" PRIu64 ", misses %" PRIu64 ", duplicate NAKs %" PRIu64
+            ", dropped %" PRIu64 ", queue depth %u (max %u)\n",
+            r->stats.hits, r->stats.misses, r->stats.dups, r->stats.drops, r->depth, r->stats.maxDepth);
+}
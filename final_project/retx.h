@@ -0,0 +1,110 @@
+/* Interface of the server retransmission component
+ * Cache of recently sent data packets indexed by seq and a queue of packets
+ * requested by NAKs. The receive path only enqueues, the queue is served by
+ * the tx path with priority over fresh data (and paced like fresh data).
+ * The queued seqs are kept in a hash set of their own, a seq is never queued
+ * twice even when its cache slot holds another seq.
+ *
+ * JLV & JB
+ */
+
+#ifndef RETX_H
+#define	RETX_H
+
+#include "common.h"
+#include "content.h"
+
+/*******************
+ * Retransmission defines
+ *******************/
+#define RETX_CACHE_SIZE 4096 // recently sent packets remembered, must be a power of two
+#define RETX_QUEUE_SIZE 1024 // maximum number of pending retransmissions
+#define RETX_SET_SIZE (2 * RETX_QUEUE_SIZE) // slots of the queued seq set, must be a power of two
+
+/* Cached packet, the payload is found in the content mapping by seq */
+typedef struct retx_entry {
+    uint32_t seq;           // seq of the cached packet, 0 if the entry is empty
+} retx_entry;
+
+/* Retransmission counters */
+typedef struct retx_stats {
+    uint64_t hits;          // NAKs served from the cache
+    uint64_t misses;        // NAKs for packets not in the cache (sent by other server or evicted)
+    uint64_t dups;          // NAKs for packets already waiting in the queue
+    uint64_t drops;         // NAKs dropped because the queue was full
+    unsigned int maxDepth;  // maximum queue depth seen
+} retx_stats;
+
+/* Retransmission state of one stream (one per session, kept small) */
+typedef struct retx_cache {
+    content* file;                      // streamed file, source of cache misses
+    retx_entry cache[RETX_CACHE_SIZE];
+    uint32_t queue[RETX_QUEUE_SIZE];    // ring of seqs to retransmit
+    uint32_t queued[RETX_SET_SIZE];     // seqs in the queue, open addressing (0 = empty slot)
+    unsigned int head;                  // index of the oldest queued seq
+    unsigned int depth;                 // number of queued seqs
+    retx_stats stats;
+} retx_cache;
+
+/*******************
+ * Public functions
+ *******************/
+
+/*
+ * retxInit
+ *
+ * Empty the cache and the queue, reset the counters
+ *
+ * file: streamed file
+ */
+void retxInit(retx_cache* r, content* file);
+
+/*
+ * retxSent
+ *
+ * Remember a freshly sent data packet (evicts the packet cached in the same slot)
+ *
+ * seq: seq of the packet
+ */
+void retxSent(retx_cache* r, uint32_t seq);
+
+/*
+ * retxRequest
+ *
+ * Queue a packet for retransmission (called on NAK, never blocks)
+ *
+ * seq: seq of the missing packet
+ *
+ * Return value: true if queued, false if already queued, out of file or the queue is full
+ */
+bool retxRequest(retx_cache* r, uint32_t seq);
+
+/*
+ * retxNext
+ *
+ * Take the oldest queued packets
+ *
+ * seqs: array to fill with the seqs
+ * max: size of the array
+ *
+ * Return value: number of seqs taken (0 if the queue is empty)
+ */
+unsigned int retxNext(retx_cache* r, uint32_t* seqs, unsigned int max);
+
+/*
+ * retxPayload
+ *
+ * Get payload of a packet to retransmit from the file
+ *
+ * Return value: payload length (bytes), see contentPayload
+ */
+unsigned int retxPayload(retx_cache* r, uint32_t seq, unsigned char** payload);
+
+/*
+ * retxPrintStats
+ *
+ * Print the counters
+ */
+void retxPrintStats(retx_cache* r);
+
+#endif	/* RETX_H */
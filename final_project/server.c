@@ -4,6 +4,8 @@
  * 1. Splice Ratio Calculations with acknowledges and cutoff
  * 2. Packet recovery priority
  * 3. Non-blocking operation
+ * 4. Concurrent streams to many clients, one session per client request
+ * 5. Optional shared-nothing worker processes, one per core
  *
  *
  * Created: 11/26
@@ -11,299 +13,663 @@
  * Team: ATeam
  *
  */
-//TODO real send file support: pkt recovery and sending
 
-#define _BSD_SOURCE // for usleep
+#define _GNU_SOURCE // for sendmmsg, sched_setaffinity
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <linux/errqueue.h>
 #include "common.h"
+#include "content.h"
+#include "pacer.h"
+#include "session.h"
 
 /* Variable Declarations */
-//splice ratio and sequence variables
-static int serverName; //local name of server (0-3)
-static int spliceRatios[4] = {[0 ... 3] = (int) (.25 * SPLICE_FRAME)};
-static int newSpliceRatios[4] = {};
-static int b[4] = {};
-static int sseq = 0;
-static bool waitSpliceChange = false;
-static bool emptyBucket = true;
-static int seq = 1;
-
-//in/out packet structures
+static int serverName; //local name of server (0 - SERVER_MAX-1)
+static char* bindIp = NULL; //local address of the server, NULL for all (several servers on one host)
+
+//in/out packet structures, shared by all sessions
 static unsigned char pktIn[PKTLEN_MSG] = {};
-static unsigned char pktOut[PKTLEN_DATA] = {};
+static unsigned char pktOut[PKTLEN_MSG] = {};
+static pkthdr_common hdrOut[TX_BURST_MAX]; //data headers of one tx burst (copied by the kernel), payload is sent from the mapping
+static unsigned char zeroPad[DATALEN] = {}; //padding of the last (and generated) packets
 static pkthdr_common* hdrIn = (pkthdr_common*) pktIn;
 static unsigned char* payloadIn = pktIn + HDRLEN;
 
 //send file variables
-static char* fileDb[FILE_COUNT] = {FILE1, FILE2};
-static unsigned int delayTx;
+static char* fileNames[FILE_COUNT] = {FILE1, FILE2};
+static content fileDb[FILE_COUNT];
+static unsigned int pacerBurst = PACER_BURST_DEFAULT;
+
+//session variables
+static session_table sessions; //one session per streaming client
+static unsigned int txCursor = 0; //session served first in the next tx round
+
+//event loop variables
+static ev_loop loop;
+static int txTimer; //fires when the pacer of some session allows the next burst
+static int sessionTimer; //periodic check of idle sessions
+static int txBlocked = 0; //EAGAIN or ENOBUFS: the socket refused a burst, no session sends until it drains
+static uint64_t txDeferrals = 0; //bursts (partly) refused by the socket
+
+//worker variables
+static unsigned int workerCount = 1; //processes sharing UDP_PORT, 1 = no workers
+static unsigned int workerId = 0; //index of this worker
+
+//tx batching variables
+static unsigned int burstSize = TX_BURST_DEFAULT; //max data packets per send call
+static bool gsoEnabled = false; //send bursts as one UDP GSO buffer
+static bool zeroCopy = false; //send with MSG_ZEROCOPY
+static uint32_t zcSent = 0; //zero-copy sends issued
+static uint32_t zcDone = 0; //zero-copy sends completed by the kernel
+static pkthdr_common zcHdr[TX_ZC_RING][TX_BURST_MAX]; //headers of the zero-copy bursts, read by the kernel until completion
+static uint32_t zcEnd[TX_ZC_RING] = {}; //zcSent after each ring burst, its headers are free once zcDone reaches it
+static unsigned int zcNext = 0; //ring entry of the next zero-copy burst
+static uint64_t zcCopied = 0; //bursts sent with copy, all ring entries were in flight
 
 
 /* Function Declarations */
 void checkArgs(int argc, char *argv[]);
+int startWorkers(void);
 void mainLoop(int soc);
-int stream(int soc, struct sockaddr_in* client);
-int getSplice();
-bool rxSplice(int soc, struct sockaddr_in* client);
-bool readPkt(int soc, struct sockaddr_in* client);
-bool receiveReq(int soc, struct sockaddr_in* client, char** filename);
-bool lookupFile(char* file);
+void onSocket(int soc, void* arg);
+void onTxTimer(int timer, void* arg);
+void onSessionTimer(int timer, void* arg);
+void txKick(session* s);
+void txBlock(int soc, int err);
+void endSession(session* s, char* reason);
+int stream(int soc, session* s);
+bool sendBurst(int soc, session* s, uint32_t* seqs, unsigned int count, bool retransmit);
+void zcBurstSent(int flags);
+void reapZeroCopy(int soc);
+bool initGso(int soc);
+bool rxSplice(int soc, session* s);
+bool readPkt(int soc);
+bool receiveReq(int soc, struct sockaddr_in* client);
+content* lookupFile(char* file);
 
 /* Function Definitions*/
 int main(int argc, char *argv[]) {
     checkArgs(argc, argv);
-    int soc = udpInit(UDP_PORT, 0);
+    //mapped before the workers start, all of them share the pages
+    for (int i = 0; i < FILE_COUNT; i++) {
+        if (contentOpen(&fileDb[i], fileNames[i])) {
+            printf("File '%s' ready, %u pkts\n", fileNames[i], fileDb[i].pktCount);
+        }
+    }
+    int soc = (workerCount > 1) ? startWorkers() : udpInit(bindIp, UDP_PORT, 0);
     if (soc == -1) {
         printf("Error: UDP socket could not be initialized\n");
         exit(1);
     } else {
         dprintf("UDP socket initialized, SOCID=%d\n", soc);
     }
+    if (zeroCopy) {
+        int one = 1;
+        if (setsockopt(soc, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof (one)) != 0) {
+            printf("Warning: MSG_ZEROCOPY not supported, sending with copy\n");
+            zeroCopy = false;
+        }
+    }
+    if (burstSize > 1) {
+        gsoEnabled = initGso(soc);
+        printf("Tx burst size %u, %s\n", burstSize, gsoEnabled ? "UDP GSO" : "sendmmsg");
+    }
     mainLoop(soc);
     return 0;
 }
 
+/* fork the workers, each gets its own socket on UDP_PORT and a core, returns the socket in the worker */
+int startWorkers(void) {
+    int socs[WORKER_MAX];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+
+    //whole socket group exists before the first packet, a client never moves to another worker
+    for (unsigned int i = 0; i < workerCount; i++) {
+        socs[i] = udpInitShared(bindIp, UDP_PORT);
+        if (socs[i] == -1) return -1;
+    }
+    for (unsigned int i = 0; i < workerCount; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            printf("Error: Worker %u could not be started\n", i);
+            exit(1);
+        }
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM); //workers end with the server
+            for (unsigned int j = 0; j < workerCount; j++) if (j != i) close(socs[j]);
+            workerId = i;
+            cpu_set_t cpu;
+            CPU_ZERO(&cpu);
+            CPU_SET(i % cpus, &cpu);
+            if (sched_setaffinity(0, sizeof (cpu), &cpu) != 0) {
+                printf("Warning: Worker %u could not be pinned to CPU %ld\n", i, i % cpus);
+            }
+            printf("Worker %u (pid %d) started on CPU %ld\n", workerId, getpid(), i % cpus);
+            return socs[i];
+        }
+    }
+
+    //parent only waits, the workers do not share any state
+    for (unsigned int i = 0; i < workerCount; i++) close(socs[i]);
+    unsigned int alive = workerCount;
+    while (alive > 0) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        printf("Warning: Worker with pid %d exited (status %d)\n", pid, WEXITSTATUS(status));
+        alive--;
+    }
+    exit(1);
+}
+
 void mainLoop(int soc) {
-    int i, errCount = 0;
-    struct sockaddr_in client;
-    char* filename;
-    bool start = false;
-    delayTx = rateToDelay(RATE_MAX);
-    printf("Initial Delay %i ms\n",delayTx);
-
-    dprintf("Initial Splice Ratios:");
-    for (i = 0; i < 4; i++) dprintf(" %i ", spliceRatios[i]);
-    dprintf("\n");
-    printf("Server %i waiting for a request from client\n", serverName);
-
-    while (errCount < MAX_ERR_COUNT) {
-        if (!start) { //waiting for start request
-            // set socket to blocking mode
-            int opts = fcntl(soc, F_GETFL);
-            opts = opts & (~O_NONBLOCK);
-            fcntl(soc, F_SETFL, opts);
-
-            if (receiveReq(soc, &client, &filename) == false) {
-                dprintf("File streaming request could not be received, waiting for a next one\n");
+    if (pacerBurst < burstSize) pacerBurst = burstSize;
+    sessionInit(&sessions);
+    printf("Initial rate %u pkts/s, pacer burst %u pkts\n", RATE_MAX, pacerBurst);
+    printf("Up to %u sessions, %zu bytes each\n", SESSION_MAX, sizeof (session));
+    printf("Server %i (worker %u of %u) waiting for requests from clients\n", serverName, workerId, workerCount);
+
+    // socket stays non-blocking, the event loop waits for it
+    int opts = fcntl(soc, F_GETFL);
+    opts = (opts | O_NONBLOCK);
+    fcntl(soc, F_SETFL, opts);
+
+    if (!evInit(&loop) || !evAddFd(&loop, soc, onSocket, NULL)) exit(1);
+    txTimer = evAddTimer(&loop, onTxTimer, &soc);
+    sessionTimer = evAddTimer(&loop, onSessionTimer, NULL);
+    if ((txTimer == -1) || (sessionTimer == -1)) exit(1);
+    evSetTimer(sessionTimer, SESSION_CHECK_TIME * 1000000000ULL, SESSION_CHECK_TIME * 1000000000ULL);
+    evRun(&loop);
+    evClose(&loop);
+
+    //sessions end on their own, the loop only returns on failure
+    printf("Error: event loop failed, exiting\n");
+    close(soc);
+    exit(1);
+}
+
+/* socket readable: requests and control packets from the clients, or zero-copy completions (EPOLLERR) */
+void onSocket(int soc, void* arg) {
+    if (arg) arg = NULL; // dummy arg usage
+    if (zeroCopy) reapZeroCopy(soc);
+    if (txBlocked == EAGAIN) {
+        //socket drained (EPOLLOUT), the deferred bursts go first
+        struct pollfd pfd = {.fd = soc, .events = POLLOUT};
+        if ((poll(&pfd, 1, 0) == 1) && (pfd.revents & POLLOUT)) {
+            txBlocked = 0;
+            evWatchOut(&loop, soc, false);
+            evSetTimer(txTimer, 1, 0);
+        }
+    }
+    while (readPkt(soc)) {};
+}
+
+/* tx timer expired: pacers of some sessions have tokens for the next burst */
+void onTxTimer(int timer, void* arg) {
+    if (timer) timer = 0; // dummy arg usage
+    int soc = *((int*) arg);
+    unsigned int bursts = 0;
+    uint64_t minDelay = UINT64_MAX;
+    bool progress = true;
+
+    if (txBlocked == EAGAIN) return; //waits for EPOLLOUT
+    txBlocked = 0; //ENOBUFS wait is over
+
+    //round robin, every session with tokens gets one burst per round
+    while (progress && (bursts < TX_ROUNDS_MAX) && !txBlocked) {
+        progress = false;
+        minDelay = UINT64_MAX;
+        for (unsigned int n = sessions.count; (n > 0) && (bursts < TX_ROUNDS_MAX) && !txBlocked; n--) {
+            if (txCursor >= sessions.count) txCursor = 0;
+            session* s = sessions.list[txCursor];
+            if (s->txIdle) {
+                txCursor++;
                 continue;
             }
-            printf("Request from %s received, file: '%s'\n", inet_ntoa(client.sin_addr), filename);
-            printf("Beginning streaming of requested file\n");
-            start = true;
-
-            // set socket to non-blocking mode
-            opts = fcntl(soc, F_GETFL);
-            opts = (opts | O_NONBLOCK);
-            fcntl(soc, F_SETFL, opts);
-        } else { //streaming file
-            while (readPkt(soc, &client)) {};
-            switch (stream(soc, &client)) {
-                case 0: //pkt sent successfully
-                    break;
-                case 1: //stream finished
-                    printf("File successfully broadcast\n");
-                    close(soc);
-                    exit(0);
+            uint64_t delay = pacerDelay(&s->txPacer, burstSize);
+            if (delay > 0) {
+                if (delay < minDelay) minDelay = delay;
+                txCursor++;
+                continue;
+            }
+            bursts++;
+            progress = true;
+            switch (stream(soc, s)) {
+                case 0: //pkts sent successfully (or only other servers' slots passed)
                     break;
                 case 2: //error sending packet
                     printf("Error sending packet\n");
-                    errCount++;
+                    if (++s->errCount >= MAX_ERR_COUNT) {
+                        endSession(s, "error limit exceeded");
+                        continue;
+                    }
+                    break;
+                case 3: //nothing owned under current splice ratios or file sent, wait for the client
+                    s->txIdle = true;
+                    break;
+                case 4: //socket full, the rest of the burst waits in the session, which goes first again
                     continue;
                 default:
                     printf("Unknown send error occurred\n");
-                    errCount++;
-                    continue;
+                    s->errCount++;
+                    break;
             }
+            txCursor++;
         }
     }
-    printf("Server exceeded error limit of %i, exiting\n", MAX_ERR_COUNT);
-    close(soc);
-    exit(1);
+
+    if (txBlocked) {
+        //txBlock armed the wakeup
+        return;
+    } else if (bursts >= TX_ROUNDS_MAX) {
+        //more to send, let waiting socket events in first
+        evSetTimer(txTimer, 1, 0);
+    } else if (minDelay != UINT64_MAX) {
+        //sleep in epoll, close to the deadline keep polling so the pacer stays precise
+        evSetTimer(txTimer, (minDelay > PACER_SPIN_NS) ? minDelay - PACER_SPIN_NS : 1, 0);
+    }
+    //otherwise all sessions are idle, a packet from a client kicks the timer
 }
 
-/* send packets based on splice ratio with delay */
-int stream(int soc, struct sockaddr_in* client) {
-    int i;
+/* drop sessions of clients that went silent, repeat the FIN of the sessions whose file was sent */
+void onSessionTimer(int timer, void* arg) {
+    if (timer) timer = 0; // dummy arg usage
+    if (arg) arg = NULL;
+    uint64_t now = monotonicNs();
+    //backwards, closing moves the last session to the freed position
+    for (unsigned int i = sessions.count; i-- > 0;) {
+        session* s = sessions.list[i];
+        if (now - s->lastActive > SESSION_TIMEOUT * 1000000000ULL) {
+            endSession(s, sessionFileSent(s) ? "file sent, no FIN from the client" : "timeout");
+        } else if (sessionFileSent(s)) {
+            txKick(s); //FIN again, the client may have lost all of them
+        }
+    }
+}
 
-    //check end condition
-    if (seq > EMPTY_PKT_COUNT) {
-        if (fillpkt(pktOut, serverName, ID_CLIENT, TYPE_FIN, 0, NULL, 0) == false) return 2;
-        for (int i = 0; i < 2; i++) sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) client, sizeof (*client));
-        return 1;
+/* (re)start transmission of the session as soon as possible */
+void txKick(session* s) {
+    s->txIdle = false;
+    if (!txBlocked) evSetTimer(txTimer, 1, 0);
+}
+
+/* socket refused a burst, stop sending until it drains (EPOLLOUT) or for TX_NOBUFS_WAIT (ENOBUFS, socket stays writable) */
+void txBlock(int soc, int err) {
+    txDeferrals++;
+    if (err == ENOBUFS) {
+        txBlocked = ENOBUFS;
+        evSetTimer(txTimer, TX_NOBUFS_WAIT * 1000ULL, 0);
+    } else {
+        txBlocked = EAGAIN;
+        evWatchOut(&loop, soc, true);
     }
+}
+
+/* print session statistics and remove it */
+void endSession(session* s, char* reason) {
+    printf("Session of %s:%u closed (%s), achieved rate %.1f of %u pkts/s, %u sessions left\n",
+            inet_ntoa(s->client.sin_addr), ntohs(s->client.sin_port), reason,
+            pacerGetRate(&s->txPacer), s->txPacer.rate, sessions.count - 1);
+    retxPrintStats(&s->retx);
+    if (txDeferrals > 0) printf("Socket full: %" PRIu64 " bursts deferred\n", txDeferrals);
+    if (zeroCopy) printf("Zero-copy: %u sends, %u completed, %" PRIu64 " bursts copied (ring full)\n", zcSent, zcDone, zcCopied);
+    sessionClose(&sessions, s);
+}
 
-    //check for splice ratio change over sequence number
-    if ((seq >= sseq) && (waitSpliceChange)) {
-        dprintf("Switching splice ratios\n");
-        for (i = 0; i < 4; i++) spliceRatios[i] = newSpliceRatios[i];
-        waitSpliceChange = false;
+/* send a burst of retransmissions or packets based on splice ratio with delay */
+int stream(int soc, session* s) {
+    unsigned int count = 0;
+    bool retransmit = false;
+    uint32_t seqs[TX_BURST_MAX];
+
+    switch (sessionNextBurst(s, serverName, seqs, burstSize, &count, &retransmit)) {
+        case SESSION_TX_END:
+            //FIN carries the last seq, the session stays for the NAKs of the client until its FIN (or the timeout)
+            if (fillpkt(pktOut, serverName, ID_CLIENT, TYPE_FIN, s->file->pktCount, NULL, 0) == false) return 2;
+            for (int i = 0; i < 2; i++) sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &s->client, sizeof (s->client));
+            return 3;
+        case SESSION_TX_IDLE:
+            return 3;
+        default:
+            break;
+    }
+    if (count == 0) return 0;
+
+    //send delay, the whole burst draws from the pacer (a deferred burst again, a full socket is a reason to slow down)
+    pacerWait(&s->txPacer, count);
+    if (sendBurst(soc, s, seqs, count, retransmit) == false) {
+        if (retransmit) {
+            printf("Warning: tx error occurred for %u retransmitted pkts\n", count);
+        } else {
+            printf("Warning: tx error occurred for burst of %u pkts\n", count);
+        }
+        return 2;
     }
-    int tseq = getSplice();
-    if (tseq == -1) return 0;
+    return txBlocked ? 4 : 0;
+}
 
-    //if ((tseq >= 177) && (tseq <= 200)) dprintf("Server entered CRITICAL area: Sending seq %i\n",tseq);
+/* send data packets with given seqs with a single syscall, payload straight from the file mapping */
+bool sendBurst(int soc, session* s, uint32_t* seqs, unsigned int count, bool retransmit) {
+    struct iovec iovs[3 * TX_BURST_MAX]; //header, payload, padding per packet
+    unsigned int iovFirst[TX_BURST_MAX + 1];
+    unsigned int n = 0;
+    int flags = 0;
+    pkthdr_common* hdrs = hdrOut;
+
+    //a zero-copy burst needs headers no earlier send still uses, otherwise it is copied
+    if (zeroCopy) {
+        reapZeroCopy(soc);
+        if ((int32_t) (zcDone - zcEnd[zcNext]) >= 0) {
+            hdrs = zcHdr[zcNext];
+            flags = MSG_ZEROCOPY;
+        } else {
+            zcCopied++;
+        }
+    }
 
-    if (fillpkt(pktOut, serverName, ID_CLIENT, TYPE_DATA, tseq, NULL, 0) == false) return 2;
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned char* payload;
+        unsigned int len;
+        if (retransmit) {
+            len = retxPayload(&s->retx, seqs[i], &payload);
+        } else {
+            len = contentPayload(s->file, seqs[i], &payload);
+        }
+        fillhdr(&hdrs[i], serverName, ID_CLIENT, TYPE_DATA, seqs[i]);
+        if (retransmit) hdrs[i].flags = PKT_FLAG_RETX;
+        iovFirst[i] = n;
+        iovs[n].iov_base = &hdrs[i];
+        iovs[n++].iov_len = HDRLEN;
+        if (len > 0) {
+            iovs[n].iov_base = payload;
+            iovs[n++].iov_len = len;
+        }
+        if (len < DATALEN) {
+            iovs[n].iov_base = zeroPad;
+            iovs[n++].iov_len = DATALEN - len;
+        }
+    }
+    iovFirst[count] = n;
+    s->lastActive = monotonicNs();
+
+    if ((count > 1) && gsoEnabled) {
+        //every packet is exactly PKTLEN_DATA, kernel cuts the buffer into datagrams
+        char ctrl[CMSG_SPACE(sizeof (uint16_t))] = {};
+        struct msghdr msg = {
+            .msg_name = &s->client, .msg_namelen = sizeof (s->client),
+            .msg_iov = iovs, .msg_iovlen = n,
+            .msg_control = ctrl, .msg_controllen = sizeof (ctrl)
+        };
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof (uint16_t));
+        *((uint16_t*) CMSG_DATA(cm)) = PKTLEN_DATA;
+
+        if (sendmsg(soc, &msg, flags) == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) {
+                //nothing of the buffer was sent, the headers of the ring entry stay free
+                sessionDefer(s, seqs, count, retransmit);
+                txBlock(soc, errno);
+                return true;
+            }
+            //e.g. no checksum offload on the route, use sendmmsg from now on
+            printf("Warning: UDP GSO send failed (errno %d), falling back to sendmmsg\n", errno);
+            gsoEnabled = false;
+        }
+        if (gsoEnabled) {
+            if (flags) zcSent++;
+            zcBurstSent(flags);
+            return true;
+        }
+    }
 
-    int res = sendto(soc, pktOut, PKTLEN_DATA, 0, (struct sockaddr*) client, sizeof (*client));
-    if (res == -1) {
-        printf("Warning: tx error occurred for SEQ=%u\n", tseq);
-        return 2;
+    struct mmsghdr msgs[TX_BURST_MAX];
+    memset(msgs, 0, count * sizeof (msgs[0]));
+    for (unsigned int i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_name = &s->client;
+        msgs[i].msg_hdr.msg_namelen = sizeof (s->client);
+        msgs[i].msg_hdr.msg_iov = &iovs[iovFirst[i]];
+        msgs[i].msg_hdr.msg_iovlen = iovFirst[i + 1] - iovFirst[i];
     }
-    //send delay
-    usleep(delayTx);
+    unsigned int sent = 0;
+    while (sent < count) {
+        int res = sendmmsg(soc, msgs + sent, count - sent, flags);
+        if (res == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) {
+                //socket buffer (or zero-copy optmem) full, the rest waits in the session, back to the event loop
+                sessionDefer(s, seqs + sent, count - sent, retransmit);
+                txBlock(soc, errno);
+                break;
+            }
+            zcBurstSent(flags); //the packets sent so far may still use the headers
+            return false;
+        }
+        sent += res;
+        if (flags) zcSent += res;
+    }
+    zcBurstSent(flags);
+    return true;
+}
 
-    return 0;
+/* the headers of the burst stay in use until its last zero-copy send completes */
+void zcBurstSent(int flags) {
+    if (!flags) return;
+    zcEnd[zcNext] = zcSent;
+    zcNext = (zcNext + 1) % TX_ZC_RING;
+}
+
+/* take the completions of zero-copy sends from the error queue without waiting, their ring entries can be reused */
+void reapZeroCopy(int soc) {
+    while (zcDone != zcSent) {
+        char ctrl[CMSG_SPACE(sizeof (struct sock_extended_err))];
+        struct msghdr msg = {.msg_control = ctrl, .msg_controllen = sizeof (ctrl)};
+        if (recvmsg(soc, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) return; //the rest arrives with EPOLLERR
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if ((cm->cmsg_level != SOL_IP) || (cm->cmsg_type != IP_RECVERR)) continue;
+            struct sock_extended_err* serr = (struct sock_extended_err*) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            zcDone += serr->ee_data - serr->ee_info + 1; //range of completed sends
+        }
+    }
+}
+
+/* check if the kernel supports UDP GSO on the socket */
+bool initGso(int soc) {
+    int segSize = PKTLEN_DATA;
+    if (setsockopt(soc, SOL_UDP, UDP_SEGMENT, &segSize, sizeof (segSize)) != 0) return false;
+    //only probing, segment size is set per send call
+    segSize = 0;
+    setsockopt(soc, SOL_UDP, UDP_SEGMENT, &segSize, sizeof (segSize));
+    return true;
 }
 
-bool readPkt(int soc, struct sockaddr_in* client) {
+/* read one packet and pass it to the session of the client, false if there is nothing to read */
+bool readPkt(int soc) {
+    struct sockaddr_in client;
     uint32_t misSeq;
-    unsigned int size = sizeof (*client);
+    uint32_t nakSeqs[NAK_MAX_BITS];
+    unsigned int nakCount;
+    unsigned int size = sizeof (client);
 
-    int rxRes = recvfrom(soc, pktIn, PKTLEN_MSG, 0, (struct sockaddr*) client, &size);
+    int rxRes = recvfrom(soc, pktIn, PKTLEN_MSG, 0, (struct sockaddr*) &client, &size);
     if (rxRes < 0) return false;
     rxRes = checkRxStatus(rxRes, pktIn, serverName);
-    if (rxRes == RX_TERMINATED) return false;
-    if (rxRes != RX_OK) return false;
+    if ((rxRes != RX_OK) && (rxRes != RX_TERMINATED)) return true; //broken packet, read the next one
+
+    if ((rxRes == RX_OK) && (hdrIn->type == TYPE_REQ)) {
+        receiveReq(soc, &client);
+        return true;
+    }
+    session* s = sessionFind(&sessions, &client);
+    if (s == NULL) {
+        dprintf("Packet of type %u from %s without a session, ignoring\n", hdrIn->type, inet_ntoa(client.sin_addr));
+        return true;
+    }
+    if (rxRes == RX_TERMINATED) {
+        endSession(s, "client failed");
+        return true;
+    }
+    s->lastActive = monotonicNs();
 
     switch (hdrIn->type) {
         case TYPE_FIN: //kill signal
-            printf("Got kill signal from client, exiting\n");
-            close(soc);
-            exit(0);
-            break;
+            printf("Got kill signal from client %s\n", inet_ntoa(client.sin_addr));
+            endSession(s, "client finished");
+            return true;
         case TYPE_NAK: //missing pkt request
             misSeq = hdrIn->seq;
-            fillpkt(pktOut, serverName, ID_CLIENT, TYPE_DATA, misSeq, NULL, 0);
-            sendto(soc, pktOut, PKTLEN_DATA, 0, (struct sockaddr*) client, sizeof (*client));
-            dprintf("(seq = %i) Missing pkt request: SEQ=%u\n",seq, misSeq);
-            //dprintPkt(pktOut, PKTLEN_DATA, true);
-            usleep(rateToDelay(RATE_MAX));
-            //usleep(delayTx); // send delay
+            //only queued here, stream() sends it ahead of new data
+            if (retxRequest(&s->retx, misSeq) == false) {
+                dprintf("Missing pkt request not queued: SEQ=%u\n", misSeq);
+                break;
+            }
+            dprintf("(seq = %i) Missing pkt request: SEQ=%u\n", s->seq, misSeq);
+            break;
+        case TYPE_NAK_LIST: //several missing pkts in one request
+            nakCount = readNak(pktIn, nakSeqs, NAK_MAX_BITS);
+            for (unsigned int i = 0; i < nakCount; i++) retxRequest(&s->retx, nakSeqs[i]);
+            dprintf("(seq = %i) Missing pkt list: %u pkts from SEQ=%u\n", s->seq, nakCount, hdrIn->seq);
             break;
         case TYPE_SPLICE: //new splice ratio
-            rxSplice(soc, client);
-            return false;
+            rxSplice(soc, s);
             break;
         case TYPE_RATE:
-            printf("Got rate change request to %u\n",hdrIn->seq);
-            delayTx = rateToDelay(hdrIn->seq);
-            return false;
+            printf("Got rate change request to %u from %s, achieved %.1f of %u pkts/s\n",
+                    hdrIn->seq, inet_ntoa(client.sin_addr), pacerGetRate(&s->txPacer), s->txPacer.rate);
+            pacerSetRate(&s->txPacer, hdrIn->seq);
             break;
         default:
             printf("Read packet of incorrect type, continuing\n");
-            return false;
+            return true;
     }
+    //NAK, splice or rate change may give the session something to send sooner
+    txKick(s);
     return true;
 }
 
 /* reads new splice ratio from client and handles data accordingly*/
-bool rxSplice(int soc, struct sockaddr_in* client) {
-    int i;
+bool rxSplice(int soc, session* s) {
     pkthdr_spl* splIn = (pkthdr_spl*) pktIn;
     printf("New splice ratios received - start at pkt #%i\n", splIn->sseq);
-    dprintf("Splice Change Packet Info:\n");
-    dprintf("\tsrc: %i\n", splIn->src);
-    dprintf("\tdst: %i\n", splIn->dst);
-    dprintf("\ttype: %i\n", splIn->type);
-    dprintf("\tsseq: %i\n", splIn->sseq);
-    dprintf("\tratios:");
-    for (i = 0; i < 4; i++) dprintf(" %i ", splIn->ratios[i]);
-    dprintf("\n");
-
-    //save new values
-    for (i = 0; i < 4; i++) newSpliceRatios[i] = splIn->ratios[i];
-    sseq = splIn->sseq;
-    waitSpliceChange = true;
-
-    //check valid sequence number
-    if (sseq <= seq) {
-        printf("ERROR: sseq (%i) number below current seq (%i) number\n",sseq,seq);
-        return false;
-    }
+    if (!sessionSplice(s, splIn)) return false;
 
     //send acknowledge
     if (!fillpkt(pktOut, serverName, ID_CLIENT, TYPE_SPLICE_ACK, 0, NULL, 0)) {
         printf("Error: failed to construct splice ack msg\n");
         return false;
     }
-    sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) client, sizeof (*client));
+    sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) &s->client, sizeof (s->client));
     return true;
 }
 
-bool receiveReq(int soc, struct sockaddr_in* client, char** filename) {
-    unsigned int size = sizeof (*client);
-    memset(pktIn, 0, PKTLEN_MSG);
-    int rxRes = recvfrom(soc, pktIn, PKTLEN_MSG, 0, (struct sockaddr*) client, &size);
-    if (rxRes < 0) return false; //return if no packet to read
-    rxRes = checkRxStatus(rxRes, pktIn, serverName);
-    if (rxRes == RX_TERMINATED) return false;
-    if (rxRes != RX_OK) return false;
-    if (hdrIn->type != TYPE_REQ) return false;
+/* start a session for the streaming request in pktIn, repeated request is only acknowledged again */
+bool receiveReq(int soc, struct sockaddr_in* client) {
+    pktIn[PKTLEN_MSG - 1] = 0; //file name must be terminated
+    char* filename = (char*) payloadIn;
+    content* file = lookupFile(filename);
+    session* s = sessionFind(&sessions, client);
+    int typeOut = TYPE_REQACK;
+    //number of servers the client streams from, older clients do not send it
+    unsigned int serverCount = (hdrIn->seq == 0) ? SERVER_DEFAULT : hdrIn->seq;
 
-    //send response
-    *filename = (char*) payloadIn;
-    int typeOut;
-    if (lookupFile(*filename) == true) {
-        typeOut = TYPE_REQACK;
-    } else {
+    if (file == NULL) {
         typeOut = TYPE_REQNAK;
         printf("Error: Requested file does not exist\n");
+    } else if ((serverCount > SERVER_MAX) || ((unsigned int) serverName >= serverCount)) {
+        typeOut = TYPE_REQNAK;
+        printf("Error: Request for %u servers, this is server %i\n", serverCount, serverName);
+    } else if ((s != NULL) && (s->file == file) && (s->serverCount == serverCount)) {
+        //our ack got lost, the client asks again
+        dprintf("Repeated request from %s, acknowledging again\n", inet_ntoa(client->sin_addr));
+        s->lastActive = monotonicNs();
+    } else {
+        if (s != NULL) endSession(s, "new request");
+        s = sessionOpen(&sessions, client, file, serverCount, pacerBurst);
+        if (s == NULL) {
+            typeOut = TYPE_REQNAK;
+            printf("Warning: No room for a new session, rejecting request from %s\n", inet_ntoa(client->sin_addr));
+        } else {
+            printf("Request from %s:%u received, file: '%s', %u servers, %u sessions\n",
+                    inet_ntoa(client->sin_addr), ntohs(client->sin_port), filename, serverCount, sessions.count);
+            txKick(s);
+        }
     }
+
+    //send response
     if (fillpkt(pktOut, serverName, ID_CLIENT, typeOut, 0, NULL, 0) == false) {
         return false;
     }
     sendto(soc, pktOut, PKTLEN_MSG, 0, (struct sockaddr*) client, sizeof (*client));
     //dprintPkt(pktOut, PKTLEN_MSG, true);
-
-    if (typeOut == TYPE_REQACK) {
-        return true;
-    } else {
-        return false;
-    }
+    return (typeOut == TYPE_REQACK);
 }
 
-int getSplice() {
-    int i;
-    emptyBucket = true;
-    for (i = 0; i < 4; i++) if (b[i] > 0) emptyBucket = false;
-    if (emptyBucket) {
-        for (i = 0; i < 4; i++) b[i] = spliceRatios[i];
-        emptyBucket = false;
-    }
-    int out = -1;
-    for (i = 0; i < 4; i++) {
-        if (b[i] > 0) {
-            b[i]--;
-            seq++;
-            if (i == serverName) out = seq - 1;
+void checkArgs(int argc, char *argv[]) {
+    int opt;
+    char *ptr;
+    while ((opt = getopt(argc, argv, "a:b:B:w:z")) != -1) {
+        switch (opt) {
+            case 'a':
+                bindIp = optarg;
+                break;
+            case 'b':
+                burstSize = (unsigned int) strtoul(optarg, &ptr, 10);
+                if ((burstSize < 1) || (burstSize > TX_BURST_MAX)) {
+                    printf("Invalid burst size, must be 1-%u\n", TX_BURST_MAX);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                pacerBurst = (unsigned int) strtoul(optarg, &ptr, 10);
+                if (pacerBurst < 1) {
+                    printf("Invalid pacer burst, must be at least 1\n");
+                    exit(1);
+                }
+                break;
+            case 'w':
+                workerCount = (unsigned int) strtoul(optarg, &ptr, 10);
+                if ((workerCount < 1) || (workerCount > WORKER_MAX)) {
+                    printf("Invalid worker count, must be 1-%u\n", WORKER_MAX);
+                    exit(1);
+                }
+                break;
+            case 'z':
+                zeroCopy = true;
+                break;
+            default:
+                optind = argc + 1; //force usage print
+                break;
         }
     }
-    return out;
-}
-
-void checkArgs(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <server number>\n", argv[0]);
+    if (optind != argc - 1) {
+        printf("Usage: %s [-a <local ip>] [-b <burst size>] [-B <pacer burst>] [-w <workers>] [-z] <server number>\n", argv[0]);
         exit(1);
     } else {
-        char *ptr;
-        serverName = (int) strtol(argv[1], &ptr, 10);
-        if ((serverName < 0) || (serverName > 3)) {
-            printf("Invalid server number, must be 0-3\n");
+        serverName = (int) strtol(argv[optind], &ptr, 10);
+        if ((*ptr != '\0') || (serverName < 0) || (serverName >= SERVER_MAX)) {
+            printf("Invalid server number, must be 0-%u\n", SERVER_MAX - 1);
             exit(1);
         }
     }
 }
 
-bool lookupFile(char* file) {
+content* lookupFile(char* file) {
     if (file == NULL) {
-        return false;
+        return NULL;
     }
     unsigned int arrSize = sizeof (fileDb) / sizeof (fileDb[0]);
     for (unsigned int i = 0; i < arrSize; i++) {
-        if (strcmp(fileDb[i], file) == 0) {
-            return true;
+        if ((fileDb[i].name != NULL) && (strcmp(fileDb[i].name, file) == 0)) {
+            return &fileDb[i];
         }
     }
-    return false;
+    return NULL;
 }
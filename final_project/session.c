@@ -0,0 +1,161 @@
+/* Definitions of session table functions
+ * See the header file for detailed description
+ *
+ * JLV & JB
+ */
+
+#include "session.h"
+
+/*******************
+ * Private functions
+ *******************/
+
+static session** bucket(session_table* t, struct sockaddr_in* client) {
+    uint32_t h = client->sin_addr.s_addr ^ ((uint32_t) client->sin_port * 2654435761u);
+    h ^= h >> 16;
+    return &t->buckets[h & (SESSION_HASH_SIZE - 1)];
+}
+
+static bool sameClient(struct sockaddr_in* a, struct sockaddr_in* b) {
+    return (a->sin_addr.s_addr == b->sin_addr.s_addr) && (a->sin_port == b->sin_port);
+}
+
+/*******************
+ * Public functions
+ *******************/
+
+void sessionInit(session_table* t) {
+    memset(t, 0, sizeof (*t));
+}
+
+session* sessionFind(session_table* t, struct sockaddr_in* client) {
+    for (session* s = *bucket(t, client); s != NULL; s = s->next) {
+        if (sameClient(&s->client, client)) return s;
+    }
+    return NULL;
+}
+
+session* sessionOpen(session_table* t, struct sockaddr_in* client, content* file,
+        unsigned int serverCount, unsigned int pacerBurst) {
+    if ((t->count == SESSION_MAX) || (serverCount == 0) || (serverCount > SERVER_MAX)) return NULL;
+    session* s = calloc(1, sizeof (session));
+    if (s == NULL) return NULL;
+
+    s->client = *client;
+    s->file = file;
+    s->serverCount = serverCount;
+    spliceInitEven(&s->splice, 1, serverCount);
+    s->seq = 1;
+    pacerInit(&s->txPacer, RATE_MAX, pacerBurst);
+    retxInit(&s->retx, file);
+    s->lastActive = monotonicNs();
+
+    session** head = bucket(t, client);
+    s->next = *head;
+    *head = s;
+    s->index = t->count;
+    t->list[t->count++] = s;
+    return s;
+}
+
+void sessionClose(session_table* t, session* s) {
+    session** link = bucket(t, &s->client);
+    while ((*link != NULL) && (*link != s)) link = &(*link)->next;
+    if (*link == NULL) return; // not in the table
+    *link = s->next;
+
+    // keep the list dense, the last session takes the freed position
+    session* last = t->list[--t->count];
+    last->index = s->index;
+    t->list[s->index] = last;
+    t->list[t->count] = NULL;
+    free(s);
+}
+
+void sessionDefer(session* s, uint32_t* seqs, unsigned int count, bool retransmit) {
+    if (count > TX_BURST_MAX) count = TX_BURST_MAX;
+    memcpy(s->txDeferred, seqs, count * sizeof (uint32_t));
+    s->txDeferredCount = count;
+    s->txDeferredRetx = retransmit;
+}
+
+int sessionNextBurst(session* s, uint8_t server, uint32_t* seqs, unsigned int max, unsigned int* count, bool* retransmit) {
+    //a burst the socket refused goes out first, as it was picked
+    if (s->txDeferredCount > 0) {
+        *count = (s->txDeferredCount < max) ? s->txDeferredCount : max;
+        *retransmit = s->txDeferredRetx;
+        memcpy(seqs, s->txDeferred, *count * sizeof (uint32_t));
+        s->txDeferredCount -= *count;
+        memmove(s->txDeferred, s->txDeferred + *count, s->txDeferredCount * sizeof (uint32_t));
+        return SESSION_TX_SEND;
+    }
+
+    //requested packets go first
+    *count = retxNext(&s->retx, seqs, max);
+    *retransmit = (*count > 0);
+    if (*retransmit) return SESSION_TX_SEND;
+
+    //check end condition
+    if (sessionFileSent(s)) return SESSION_TX_END;
+
+    //collect up to max seqs owned by this server, other servers' slots are skipped at once
+    while ((*count < max) && ((uint32_t) s->seq <= s->file->pktCount)) {
+        uint32_t next = spliceNextOwned(&s->splice, server, s->seq);
+        //new splice ratios take over exactly at sseq
+        if ((s->waitSpliceChange) && ((next == 0) || (next >= (uint32_t) s->sseq))) {
+            dprintf("Switching splice ratios\n");
+            spliceInit(&s->splice, s->sseq, s->newSpliceRatios, s->serverCount);
+            s->waitSpliceChange = false;
+            if (s->seq < s->sseq) s->seq = s->sseq;
+            continue;
+        }
+        if (next == 0) break; //nothing owned under current splice ratios
+        s->seq = next + 1;
+        if (next > s->file->pktCount) break; //past the end of file
+
+        retxSent(&s->retx, next);
+        seqs[(*count)++] = next;
+    }
+    //nothing owned, idle until a splice change or NAK
+    if ((*count == 0) && ((uint32_t) s->seq <= s->file->pktCount)) return SESSION_TX_IDLE;
+    return SESSION_TX_SEND;
+}
+
+bool sessionFileSent(session* s) {
+    return ((uint32_t) s->seq > s->file->pktCount);
+}
+
+bool sessionSplice(session* s, pkthdr_spl* spl) {
+    unsigned int i;
+    unsigned int total = 0;
+    //count comes from the network, ratios holds SERVER_MAX entries at most
+    if (spl->count != s->serverCount) {
+        printf("Error: Splice ratios for %u servers, session has %u\n", spl->count, s->serverCount);
+        return false;
+    }
+    for (i = 0; i < s->serverCount; i++) total += spl->ratios[i];
+    if (total > SPLICE_TOTAL_MAX) {
+        printf("Error: Invalid splice ratios (total %u)\n", total);
+        return false;
+    }
+    dprintf("Splice Change Packet Info:\n");
+    dprintf("\tsrc: %i\n", spl->src);
+    dprintf("\tdst: %i\n", spl->dst);
+    dprintf("\ttype: %i\n", spl->type);
+    dprintf("\tsseq: %i\n", spl->sseq);
+    dprintf("\tratios:");
+    for (i = 0; i < s->serverCount; i++) dprintf(" %i ", spl->ratios[i]);
+    dprintf("\n");
+
+    //save new values
+    for (i = 0; i < s->serverCount; i++) s->newSpliceRatios[i] = spl->ratios[i];
+    s->sseq = spl->sseq;
+    s->waitSpliceChange = true;
+
+    //check valid sequence number
+    if (s->sseq <= s->seq) {
+        printf("ERROR: sseq (%i) number below current seq (%i) number\n", s->sseq, s->seq);
+        return false;
+    }
+    return true;
+}
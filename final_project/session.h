@@ -0,0 +1,156 @@
+/* Interface of the server session table
+ * One session per client streaming request, keyed by the client address.
+ * A session holds all state of one stream (splice ratios, seq, pacer and
+ * retransmissions), so a single server process can stream to many clients.
+ *
+ * JLV & JB
+ */
+
+#ifndef SESSION_H
+#define	SESSION_H
+
+#include "common.h"
+#include "content.h"
+#include "pacer.h"
+#include "retx.h"
+
+/*******************
+ * Session defines
+ *******************/
+#define SESSION_MAX 1024        // maximum number of concurrent sessions
+#define SESSION_HASH_SIZE 256   // buckets of the address lookup, must be a power of two
+#define SESSION_TIMEOUT 10      // seconds without traffic to/from the client before the session is dropped
+#define SESSION_CHECK_TIME 1    // seconds between session timeout checks
+
+// results of sessionNextBurst
+#define SESSION_TX_SEND 0       // seqs to send (possibly none when only other servers' slots passed)
+#define SESSION_TX_END 1        // whole file sent and no retransmission queued, TYPE_FIN is due
+#define SESSION_TX_IDLE 2       // nothing owned under current splice ratios, wait for the client
+
+/* State of one stream */
+typedef struct session {
+    struct sockaddr_in client;  // client address, key of the session
+    content* file;              // requested file
+    //splice ratio and sequence variables
+    unsigned int serverCount;   // number of servers streaming to the client
+    splice_epoch splice;        // schedule of the current splice ratios
+    uint8_t newSpliceRatios[SERVER_MAX];
+    int sseq;                   // first seq of the new splice ratios
+    bool waitSpliceChange;
+    int seq;                    // seqs below this one are sent (or owned by other servers)
+    //tx variables
+    pacer txPacer;              // paces data and retransmitted packets
+    retx_cache retx;            // recently sent packets and NAK'd packets waiting for retransmission
+    bool txIdle;                // nothing to send until the client asks for something
+    uint32_t txDeferred[TX_BURST_MAX]; // seqs of a burst the full socket did not take, sent first
+    unsigned int txDeferredCount;
+    bool txDeferredRetx;        // deferred seqs are retransmissions
+    uint64_t lastActive;        // time of the last packet from/to the client (ns)
+    int errCount;
+    //table bookkeeping
+    unsigned int index;         // position in the session list
+    struct session* next;       // next session in the same hash bucket
+} session;
+
+/* All sessions of the server */
+typedef struct session_table {
+    session* list[SESSION_MAX];             // active sessions, the first count entries are used
+    unsigned int count;
+    session* buckets[SESSION_HASH_SIZE];    // lookup by client address
+} session_table;
+
+/*******************
+ * Public functions
+ *******************/
+
+/*
+ * sessionInit
+ *
+ * Empty the table
+ */
+void sessionInit(session_table* t);
+
+/*
+ * sessionFind
+ *
+ * Look up the session of a client
+ *
+ * client: address the packet came from
+ *
+ * Return value: session, NULL if the client has no session
+ */
+session* sessionFind(session_table* t, struct sockaddr_in* client);
+
+/*
+ * sessionOpen
+ *
+ * Create a session streaming the file from seq 1 with the initial splice
+ * ratios and rate. The client must not have a session yet.
+ *
+ * client: address of the client
+ * file: requested file
+ * serverCount: number of servers streaming to the client (1 - SERVER_MAX)
+ * pacerBurst: pacer bucket depth (pkts)
+ *
+ * Return value: new session, NULL if the table is full, out of memory or the count is invalid
+ */
+session* sessionOpen(session_table* t, struct sockaddr_in* client, content* file,
+        unsigned int serverCount, unsigned int pacerBurst);
+
+/*
+ * sessionClose
+ *
+ * Remove the session from the table and free it. Sessions after it in the
+ * list may move, iterate the list backwards when closing sessions in a loop.
+ */
+void sessionClose(session_table* t, session* s);
+
+/*
+ * sessionDefer
+ *
+ * Keep the seqs of a burst the socket did not take, the next burst sends
+ * them before anything else
+ *
+ * seqs: seqs not sent, count entries (at most TX_BURST_MAX)
+ * retransmit: set if the seqs are retransmissions
+ */
+void sessionDefer(session* s, uint32_t* seqs, unsigned int count, bool retransmit);
+
+/*
+ * sessionNextBurst
+ *
+ * Pick the seqs of the next burst: deferred seqs (sessionDefer) first, then
+ * queued retransmissions, otherwise
+ * the following seqs owned by the server under the splice ratios (new ratios
+ * take over exactly at sseq). Fresh seqs are remembered for retransmission.
+ *
+ * server: name of this server
+ * seqs: array to fill, max entries
+ * count: set to the number of seqs taken
+ * retransmit: set if the seqs are retransmissions
+ *
+ * Return value: SESSION_TX_SEND, SESSION_TX_END or SESSION_TX_IDLE
+ */
+int sessionNextBurst(session* s, uint8_t server, uint32_t* seqs, unsigned int max, unsigned int* count, bool* retransmit);
+
+/*
+ * sessionFileSent
+ *
+ * Return value: true if every fresh seq of the file was sent, the session
+ *               only answers NAKs until the client ends it
+ */
+bool sessionFileSent(session* s);
+
+/*
+ * sessionSplice
+ *
+ * Take new splice ratios of the client (TYPE_SPLICE), the stream switches
+ * to them at their sseq
+ *
+ * spl: received splice packet
+ *
+ * Return value: true if the ratios are valid and should be acknowledged, false otherwise
+ */
+bool sessionSplice(session* s, pkthdr_spl* spl);
+
+#endif	/* SESSION_H */
@@ -0,0 +1,108 @@
+/* Definitions of receive trace functions
+ * See the header file for detailed description
+ *
+ * JLV & JB
+ */
+
+#define _DEFAULT_SOURCE // for usleep
+#include "trace.h"
+
+/*******************
+ * Private functions
+ *******************/
+
+// write count records from index i of the ring
+static bool writeRecs(trace* t, uint64_t i, uint64_t count) {
+    size_t len = count * sizeof (trace_rec);
+    return (write(t->fd, &t->ring[i & (TRACE_RING_SIZE - 1)], len) == (ssize_t) len);
+}
+
+// write all records stored so far, at most two calls (the ring wraps once)
+static bool drain(trace* t) {
+    uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = t->tail;
+    if (head == tail) return true;
+    uint64_t first = TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1)); // records until the ring end
+    if (first > head - tail) first = head - tail;
+    bool ok = writeRecs(t, tail, first);
+    if (head - tail > first) ok = writeRecs(t, tail + first, head - tail - first) && ok;
+    // the records are copied to the file, their ring cells can be reused
+    __atomic_store_n(&t->tail, head, __ATOMIC_RELEASE);
+    return ok;
+}
+
+static void* writerProc(void* arg) {
+    trace* t = (trace*) arg;
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        if (!drain(t)) printf("Warning: trace file write error\n");
+        usleep(TRACE_DRAIN_TIME);
+    }
+    return NULL;
+}
+
+/*******************
+ * Public functions
+ *******************/
+
+bool traceOpen(trace* t, char* filename) {
+    memset(t, 0, sizeof (*t));
+    t->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (t->fd == -1) {
+        printf("Error: Trace file could not be opened\n");
+        return false;
+    }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    trace_filehdr hdr = {TRACE_MAGIC, sizeof (trace_rec), (uint64_t) now.tv_sec * 1000000 + now.tv_usec};
+    t->ring = malloc(TRACE_RING_SIZE * sizeof (trace_rec));
+    if ((t->ring == NULL) || (write(t->fd, &hdr, sizeof (hdr)) != sizeof (hdr))) {
+        printf("Error: Trace could not be initialized\n");
+        free(t->ring);
+        t->ring = NULL;
+        close(t->fd);
+        return false;
+    }
+    t->start = monotonicNs();
+    if (pthread_create(&t->writer, NULL, writerProc, t) != 0) {
+        printf("Error: Trace writer thread could not be created\n");
+        free(t->ring);
+        t->ring = NULL;
+        close(t->fd);
+        return false;
+    }
+    return true;
+}
+
+void traceRecord(trace* t, uint64_t ns, pkthdr_common* hdr) {
+    if (t->ring == NULL) return;
+    uint64_t head = t->head;
+    if (head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+        t->dropped++; // writer behind, keep the receive path going
+        return;
+    }
+    trace_rec* r = &t->ring[head & (TRACE_RING_SIZE - 1)];
+    r->ns = ns - t->start;
+    r->seq = hdr->seq;
+    r->src = hdr->src;
+    r->type = hdr->type;
+    r->flags = hdr->flags;
+    r->reserved = 0;
+    __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool traceClose(trace* t) {
+    if (t->ring == NULL) return false;
+
+    __atomic_store_n(&t->stop, true, __ATOMIC_RELEASE);
+    pthread_join(t->writer, NULL);
+    bool ok = drain(t);
+    if (!ok) printf("Warning: trace file write error\n");
+    if (t->dropped > 0) {
+        printf("Warning: %" PRIu64 " trace records dropped (ring full)\n", t->dropped);
+        ok = false;
+    }
+    close(t->fd);
+    free(t->ring);
+    t->ring = NULL;
+    return ok;
+}
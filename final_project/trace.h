@@ -0,0 +1,92 @@
+/* Interface of the receive trace component
+ * Fixed-size ring of binary packet records filled by the receive path: a
+ * record is stored with no formatting and no system call. A background thread
+ * drains the ring to the trace file. A full ring drops records (they are
+ * counted), the receive path never waits for the disk.
+ * One thread records, any number of records can be pending in the ring.
+ *
+ * The trace file is a trace_filehdr followed by trace_rec records,
+ * tracedump converts it to the "ms seq" lines read by plot.sh.
+ *
+ * JLV & JB
+ */
+
+#ifndef TRACE_H
+#define	TRACE_H
+
+#include <pthread.h>
+#include "common.h"
+
+/*******************
+ * Trace defines
+ *******************/
+#define TRACE_RING_SIZE (1 << 16)   // records in the ring (power of two), 1 MB
+#define TRACE_DRAIN_TIME 10000      // time (usecs) between subsequent ring drains
+#define TRACE_MAGIC 0x31435254      // "TRC1" at the start of the trace file
+
+/* One received packet */
+typedef struct trace_rec {
+    uint64_t ns;        // receive time since traceOpen (ns)
+    uint32_t seq;       // seq number from the header
+    uint8_t src;        // source server
+    uint8_t type;       // packet type
+    uint8_t flags;      // PKT_FLAG_* from the header
+    uint8_t reserved;
+} trace_rec;
+
+/* Beginning of the trace file */
+typedef struct trace_filehdr {
+    uint32_t magic;     // TRACE_MAGIC
+    uint32_t recSize;   // sizeof (trace_rec)
+    uint64_t startUs;   // wall clock time of traceOpen (usecs since the epoch)
+} trace_filehdr;
+
+/* Trace state, one instance per traced stream */
+typedef struct trace {
+    trace_rec* ring;    // TRACE_RING_SIZE records, NULL if not open
+    uint64_t head;      // records stored so far (atomic, written by the recording thread)
+    uint64_t tail;      // records written to the file so far (atomic, written by the writer thread)
+    uint64_t dropped;   // records lost to a full ring (recording thread only)
+    uint64_t start;     // time of traceOpen (ns, monotonicNs)
+    int fd;             // trace file
+    bool stop;          // the writer thread should finish (atomic)
+    pthread_t writer;
+} trace;
+
+/*******************
+ * Public functions
+ *******************/
+
+/*
+ * traceOpen
+ *
+ * Create the trace file and start its writer thread
+ *
+ * t: trace to open
+ * filename: trace file, truncated if it exists
+ *
+ * Return value: true if opened, false otherwise (t stays closed, traceRecord ignores it)
+ */
+bool traceOpen(trace* t, char* filename);
+
+/*
+ * traceRecord
+ *
+ * Store one received packet in the ring, dropped if the ring is full.
+ * Does nothing if the trace is not open.
+ *
+ * ns: receive time (monotonicNs), one timestamp can be shared by a batch
+ * hdr: header of the received packet
+ */
+void traceRecord(trace* t, uint64_t ns, pkthdr_common* hdr);
+
+/*
+ * traceClose
+ *
+ * Stop the writer thread, write the pending records and close the file
+ *
+ * Return value: true if all records were written, false if some were dropped or a write failed
+ */
+bool traceClose(trace* t);
+
+#endif	/* TRACE_H */
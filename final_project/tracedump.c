@@ -0,0 +1,58 @@
+/*
+ * Receive trace converter
+ * Reads a binary trace written by the client (GRAPH_TRACE_FILE) and prints
+ * one "ms seq" line per received data packet, the format read by plot.sh.
+ * With -a every record is printed with all its fields instead:
+ * "ns src type flags seq", retransmitted data packets have PKT_FLAG_RETX set.
+ *
+ * usage: ./tracedump [-a] <trace file> > <data file>
+ *
+ * JLV & JB
+ */
+
+#include "trace.h"
+
+#define DUMP_BATCH 4096 // records read at once
+
+int main(int argc, char *argv[]) {
+    bool all = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "a")) != -1) {
+        if (opt == 'a') {
+            all = true;
+        } else {
+            optind = argc + 1; //force usage print
+        }
+    }
+    if (optind != argc - 1) {
+        printf("Usage: %s [-a] <trace file>\n", argv[0]);
+        exit(1);
+    }
+
+    FILE* f = fopen(argv[optind], "r");
+    if (f == NULL) {
+        printf("Error: Trace file could not be opened\n");
+        exit(1);
+    }
+    trace_filehdr hdr;
+    if ((fread(&hdr, sizeof (hdr), 1, f) != 1) || (hdr.magic != TRACE_MAGIC) || (hdr.recSize != sizeof (trace_rec))) {
+        printf("Error: %s is not a trace file\n", argv[optind]);
+        fclose(f);
+        exit(1);
+    }
+
+    static trace_rec recs[DUMP_BATCH];
+    size_t n;
+    while ((n = fread(recs, sizeof (trace_rec), DUMP_BATCH, f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            trace_rec* r = &recs[i];
+            if (all) {
+                printf("%" PRIu64 " %u %u %u %u\n", r->ns, r->src, r->type, r->flags, r->seq);
+            } else if (r->type == TYPE_DATA) {
+                printf("%" PRIu64 " %u\n", r->ns / 1000000, r->seq);
+            }
+        }
+    }
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Packet buffer throughput benchmark
+ * Producer threads insert consecutive seqs (taken from a shared counter) while
+ * a consumer thread runs client-like timer rounds: flush a frame, scan for
+ * lost packets and send NAK-sized packets, then sleep until the next round.
+ * With -m every buffer call takes one global mutex and the consumer holds it
+ * for its whole round, as the client did before the buffer became lock-free.
+ * -s adds a blocking call of the given length to every round (a slow write or
+ * a full socket on a loaded host).
+ * Reports the insert rate, the insert latency (buffer call incl. locking) and
+ * how many inserts stalled.
+ * Producers wait for the window instead of inserting too high seqs.
+ *
+ * usage: ./buffer_bench [-p <producers>] [-t <secs>] [-i <round us>] [-k <naks per round>] [-s <stall us>] [-m]
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for mkstemp
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include "packet_buffer.h"
+
+#define BENCH_PRODUCERS_MAX 16
+#define BENCH_HIST 40                   // latency histogram, bucket i holds 2^i - 2^(i+1) - 1 ns
+#define BENCH_TRUNC (256 * 1024 * 1024) // output file blocks are released past this size
+#define BENCH_STALL_BUCKET 16           // inserts from 2^16 ns (65 us) on are counted as stalled
+
+static unsigned int producers = 1;
+static unsigned int secs = 3;
+static unsigned int roundUs = 1000;
+static unsigned int naks = 16;
+static unsigned int stallUs = 0;
+static bool locked = false;
+
+static char path[] = "/tmp/buffer_benchXXXXXX";
+static packet_buffer* buf;
+static pthread_mutex_t benchMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t nextSeq = 1;     // next seq to insert (atomic)
+static uint32_t flushed = 0;     // packets written to the output file (atomic)
+static bool stop = false;        // (atomic)
+static uint64_t hist[BENCH_PRODUCERS_MAX][BENCH_HIST];
+static uint64_t inserted[BENCH_PRODUCERS_MAX];
+static uint64_t rounds = 0;
+
+static unsigned int bucketOf(uint64_t ns) {
+    unsigned int b = 0;
+    while ((ns >>= 1) && (b < BENCH_HIST - 1)) b++;
+    return b;
+}
+
+static void* producer(void* arg) {
+    unsigned int p = (unsigned int) (uintptr_t) arg;
+    unsigned char data[DATALEN];
+    memset(data, p, DATALEN);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        uint32_t seq = __atomic_fetch_add(&nextSeq, 1, __ATOMIC_RELAXED);
+        while ((seq > __atomic_load_n(&flushed, __ATOMIC_ACQUIRE) + bufGetWindow(buf)) && !__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+            sched_yield(); // window full
+        }
+        if (__atomic_load_n(&stop, __ATOMIC_RELAXED)) break;
+        uint64_t t = monotonicNs();
+        if (locked) pthread_mutex_lock(&benchMutex);
+        bufAdd(buf, seq, data);
+        if (locked) pthread_mutex_unlock(&benchMutex);
+        hist[p][bucketOf(monotonicNs() - t)]++;
+        inserted[p]++;
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    int soc = *((int*) arg);
+    struct sockaddr_in dst;
+    socklen_t size = sizeof (dst);
+    getsockname(soc, (struct sockaddr*) &dst, &size);
+    unsigned char pkt[PKTLEN_MSG] = {};
+    struct stat st;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if (locked) pthread_mutex_lock(&benchMutex);
+        bufFlushFrame(buf);
+        for (uint32_t lost = bufGetFirstLost(buf); lost > 0; lost = bufGetNextLost(buf));
+        for (unsigned int i = 0; i < naks; i++) sendto(soc, pkt, PKTLEN_MSG, 0, (struct sockaddr*) &dst, sizeof (dst));
+        if (stallUs > 0) usleep(stallUs);
+        if (locked) pthread_mutex_unlock(&benchMutex);
+        rounds++;
+
+        // output file size tells how far the buffer head moved
+        if ((stat(path, &st) == 0) && (st.st_size / DATALEN > flushed)) {
+            __atomic_store_n(&flushed, (uint32_t) (st.st_size / DATALEN), __ATOMIC_RELEASE);
+        }
+        if (st.st_size > BENCH_TRUNC) {
+            if (truncate(path, 0) != 0) printf("Warning: output file not truncated\n");
+        }
+        usleep(roundUs);
+    }
+    return NULL;
+}
+
+/* latency (ns) below which pct percent of the inserts finished */
+static uint64_t percentile(uint64_t* sum, uint64_t total, double pct) {
+    uint64_t acc = 0;
+    for (unsigned int b = 0; b < BENCH_HIST; b++) {
+        acc += sum[b];
+        if (acc >= total * pct / 100) return 2ULL << b;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:i:k:s:m")) != -1) {
+        switch (opt) {
+            case 'p':
+                producers = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                secs = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                roundUs = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                naks = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                stallUs = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                locked = true;
+                break;
+            default:
+                producers = 0; //force usage print
+                break;
+        }
+    }
+    if ((producers < 1) || (producers > BENCH_PRODUCERS_MAX) || (secs < 1) || (optind != argc)) {
+        printf("Usage: %s [-p <producers 1-%u>] [-t <secs>] [-i <round us>] [-k <naks per round>] [-s <stall us>] [-m]\n",
+                argv[0], BENCH_PRODUCERS_MAX);
+        exit(1);
+    }
+    int fd = mkstemp(path);
+    int soc = udpInit("127.0.0.1", 0, 0); // NAKs go to this unread socket
+    if ((fd == -1) || (soc == -1) || ((buf = bufCreate(path, 0, 0)) == NULL)) {
+        printf("Error: Benchmark could not be initialized\n");
+        exit(1);
+    }
+    close(fd);
+
+    pthread_t threads[BENCH_PRODUCERS_MAX], cons;
+    pthread_create(&cons, NULL, consumer, &soc);
+    for (unsigned int p = 0; p < producers; p++) pthread_create(&threads[p], NULL, producer, (void*) (uintptr_t) p);
+    usleep(secs * 1000000);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for (unsigned int p = 0; p < producers; p++) pthread_join(threads[p], NULL);
+    pthread_join(cons, NULL);
+    bufDestroy(buf);
+    unlink(path);
+    close(soc);
+
+    uint64_t sum[BENCH_HIST] = {}, total = 0, max = 0, stalled = 0;
+    for (unsigned int p = 0; p < producers; p++) {
+        total += inserted[p];
+        for (unsigned int b = 0; b < BENCH_HIST; b++) {
+            sum[b] += hist[p][b];
+            if (b >= BENCH_STALL_BUCKET) stalled += hist[p][b];
+            if (hist[p][b] && (2ULL << b > max)) max = 2ULL << b;
+        }
+    }
+    printf("%s buffer, %u producers, %u s, round %u us, %u naks/round, stall %u us, %" PRIu64 " rounds\n",
+            locked ? "mutex" : "lock-free", producers, secs, roundUs, naks, stallUs, rounds);
+    printf("%12s %12s %10s %10s %10s %10s %10s\n", "inserts", "inserts/s", "p50 ns", "p99 ns", "p99.9 ns", "max ns", "stalled");
+    printf("%12" PRIu64 " %12.0f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", total,
+            total / (double) secs, percentile(sum, total, 50), percentile(sum, total, 99), percentile(sum, total, 99.9),
+            max, stalled);
+    return 0;
+}
@@ -0,0 +1,476 @@
+/*
+ * Packet buffer conformance suite and microbenchmark
+ * Drives one buffer with synthetic arrival patterns (single thread) and checks
+ * every result against a plain reference model of the buffer semantics:
+ *   inorder - seqs 1 - N in order
+ *   reorder - every seq displaced by up to CONF_REORDER_DIST arrivals
+ *   bursty  - Gilbert-Elliott losses, the lost seqs arrive again
+ *             (retransmitted) a while later, some only on a second retransmission
+ *   dups    - CONF_DUP_PCT % of the seqs arrive twice, some after they were flushed
+ *   mixed   - all of the above
+ * Between bursts of arrivals a consumer round runs bufFlushFrame,
+ * bufGetSubseqCount, bufGetOccupancy and a full bufGetFirstLost /
+ * bufGetNextLost scan, as the client timer does. After the last arrival one
+ * round runs with lost threshold 0, another one with an end of stream
+ * (bufSetEnd) past the last seq, whose tail never arrives and does not fit in
+ * the window. Every return value, the lost lists, the stall count and the
+ * output file (each flushed payload once, in seq order) are checked. Arrivals alternate between bufAdd and bufCommit.
+ *
+ * Then the same arrivals are replayed on a buffer without an output file and
+ * without the model, and timed per operation: ns/op and cache misses/op
+ * (where the kernel gives perf events). Each group of calls (the arrivals
+ * between two rounds, one subseq count, one flush, one lost scan) is wrapped
+ * by one clock and counter read, the cost of an empty group is subtracted.
+ * Flush costs are per flushed packet, lost scan costs per First/Next call.
+ *
+ * usage: ./buffer_conf [-n <seqs per window slot>] [-s <seed>] [-c] [-p] [window ...]  (default 1024 65536 1048576)
+ *   -c conformance only
+ *   -p prefault the benchmarked buffers (BUF_PREFAULT)
+ * exit status 0 if every pattern conforms
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for rand_r, mkstemp and syscall
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "packet_buffer.h"
+
+#define CONF_WINDOWS_MAX 16
+#define CONF_REORDER_DIST 16    // max displacement of a reordered seq (arrivals)
+#define CONF_DUP_PCT 10
+#define CONF_GE_P 0.01          // good -> bad (loss burst starts)
+#define CONF_GE_R 0.25          // bad -> good
+#define CONF_RETX_PCT 80        // lost seqs that arrive on the first retransmission
+#define CONF_ROUND_MIN 16       // average arrivals between consumer rounds, window / 32 for bigger windows
+
+enum { PAT_INORDER, PAT_REORDER, PAT_BURSTY, PAT_DUPS, PAT_MIXED, PAT_COUNT };
+static const char* patNames[PAT_COUNT] = {"inorder", "reorder", "bursty", "dups", "mixed"};
+
+enum { OP_ADD, OP_FLUSH, OP_SUBSEQ, OP_LOST, OP_COUNT };
+static const char* opNames[OP_COUNT] = {"add", "flush", "subseq", "lost"};
+
+/* One arrival, the consumer runs a round after it if round is set */
+typedef struct conf_arrival {
+    double key;                 // arrival order while generating
+    uint32_t seq;
+    bool round;
+} conf_arrival;
+
+/* Reference model of the buffer, plain arrays and loops */
+typedef struct conf_model {
+    uint8_t* present;           // by seq
+    uint32_t head;
+    uint32_t last;
+    uint32_t lastReq;
+    unsigned int window;
+    unsigned int thresh;
+    uint32_t end;               // last seq of the stream, 0 until known
+    uint64_t stalls;
+} conf_model;
+
+/* Time and cache misses of one operation type */
+typedef struct conf_cost {
+    uint64_t ops;
+    uint64_t groups;
+    uint64_t ns;
+    uint64_t misses;
+} conf_cost;
+
+static unsigned int seqFactor = 4;
+static unsigned int seed = 1;
+static unsigned int benchFlags = BUF_QUIET;
+static int perfFd = -1;
+static double emptyNs = 0;      // cost of one timed empty group
+static double emptyMisses = 0;
+
+/*******************
+ * Arrival patterns
+ *******************/
+
+static double uniform(unsigned int* s) {
+    return rand_r(s) / ((double) RAND_MAX + 1);
+}
+
+static int compareArrival(const void* a, const void* b) {
+    double x = ((const conf_arrival*) a)->key, y = ((const conf_arrival*) b)->key;
+    return (x > y) - (x < y);
+}
+
+/*
+ * genArrivals
+ *
+ * Arrivals of seqs 1 - n for a pattern, retransmissions of the bursty losses
+ * come back between window / 8 and window * 3 / 8 arrivals later, a second
+ * retransmission as late again. Everything still fits the window, so the
+ * stream never stalls for good.
+ *
+ * Return value: arrivals (count in *count), NULL if out of memory
+ */
+static conf_arrival* genArrivals(unsigned int pat, uint32_t n, unsigned int window, unsigned int* count) {
+    conf_arrival* arr = malloc(sizeof (conf_arrival) * (size_t) n * 2);
+    if (arr == NULL) return NULL;
+    unsigned int s = seed + pat * 7919 + window;
+    bool reorder = (pat == PAT_REORDER) || (pat == PAT_MIXED);
+    bool bursty = (pat == PAT_BURSTY) || (pat == PAT_MIXED);
+    bool dups = (pat == PAT_DUPS) || (pat == PAT_MIXED);
+    bool bad = false;
+    unsigned int c = 0;
+    for (uint32_t seq = 1; seq <= n; seq++) {
+        double key = seq + (reorder ? uniform(&s) * CONF_REORDER_DIST : 0);
+        if (bursty) bad = bad ? (uniform(&s) >= CONF_GE_R) : (uniform(&s) < CONF_GE_P);
+        if (bursty && bad && (seq < n)) {
+            // the newest seq always arrives, it ends the stream
+            key += window / 8 + uniform(&s) * (window / 4);
+            if ((unsigned int) rand_r(&s) % 100 >= CONF_RETX_PCT) key += window / 8 + uniform(&s) * (window / 4);
+            arr[c++] = (conf_arrival) {key, seq, false};
+        } else {
+            arr[c++] = (conf_arrival) {key, seq, false};
+        }
+        if (dups && ((unsigned int) rand_r(&s) % 100 < CONF_DUP_PCT)) {
+            arr[c++] = (conf_arrival) {key + uniform(&s) * window * 2, seq, false};
+        }
+    }
+    qsort(arr, c, sizeof (conf_arrival), compareArrival);
+    unsigned int avg = (window / 32 > CONF_ROUND_MIN) ? window / 32 : CONF_ROUND_MIN;
+    for (unsigned int i = 0, next = 0; i < c; i++) {
+        if (i == next) {
+            arr[i].round = true;
+            next = i + 1 + (unsigned int) rand_r(&s) % (2 * avg);
+        }
+    }
+    *count = c;
+    return arr;
+}
+
+/*******************
+ * Reference model
+ *******************/
+
+static bool modelAdd(conf_model* m, uint32_t seq) {
+    if (seq < m->head) return true;
+    if (seq >= m->head + m->window) return false;
+    m->present[seq] = 1;
+    if (seq > m->last) m->last = seq;
+    return true;
+}
+
+static unsigned int modelCount(conf_model* m) {
+    if (m->last < m->head) return 0;
+    return (m->last - m->head + 1 > m->window) ? m->window : m->last - m->head + 1;
+}
+
+static unsigned int modelSubseq(conf_model* m) {
+    unsigned int n = 0;
+    while ((n < m->window) && m->present[m->head + n]) n++;
+    return n;
+}
+
+static void modelFlush(conf_model* m) {
+    while (m->present[m->head]) m->present[m->head++] = 0;
+    if (m->last > m->head) m->stalls++;
+}
+
+static uint32_t modelNextLost(conf_model* m) {
+    uint32_t end;
+    if (m->end != 0) {
+        if (m->end < m->head) return 0;
+        end = (m->end + 1 > m->head + m->window) ? m->head + m->window : m->end + 1;
+    } else {
+        unsigned int count = modelCount(m);
+        if (count <= m->thresh) return 0;
+        end = m->head + count - m->thresh - 1;
+    }
+    if (m->lastReq + 1 >= end) return 0;
+    if (m->lastReq < m->head) m->lastReq = m->head - 1;
+    uint32_t seq = m->lastReq + 1;
+    while ((seq < end) && m->present[seq]) seq++;
+    if (seq >= end) return 0;
+    m->lastReq = seq;
+    return seq;
+}
+
+/*******************
+ * Conformance
+ *******************/
+
+#define CHECK(cond, what, got, exp) \
+    if (!(cond)) { \
+        printf("FAIL %-7s window %7u, arrival %u: %s = %u, expected %u\n", patNames[pat], window, i, what, \
+                (unsigned int) (got), (unsigned int) (exp)); \
+        ok = false; \
+        break; \
+    }
+
+static void fillPayload(unsigned char* data, uint32_t seq) {
+    memcpy(data, &seq, sizeof (seq));
+    memcpy(data + DATALEN - sizeof (seq), &seq, sizeof (seq));
+}
+
+static bool conform(unsigned int pat, unsigned int window, conf_arrival* arr, unsigned int count, uint32_t n) {
+    char path[] = "/tmp/buffer_conf_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) return false;
+    close(fd);
+    packet_buffer* buf = bufCreate(path, window, BUF_QUIET);
+    conf_model m = {calloc((size_t) n + window + 2, 1), 1, 0, 0, window, BUF_LOST_THRSH, 0, 0};
+    if ((buf == NULL) || (m.present == NULL)) {
+        printf("Error: Buffer of %u pkts could not be created\n", window);
+        bufDestroy(buf);
+        free(m.present);
+        unlink(path);
+        return false;
+    }
+    unsigned char data[DATALEN];
+    unsigned char* slot = bufGetSlot(buf);
+    bool ok = true;
+    for (unsigned int i = 0; i <= count + 1; i++) {
+        if (i < count) {
+            uint32_t seq = arr[i].seq;
+            bool fresh = (seq >= m.head) && (seq < m.head + window) && !m.present[seq];
+            bool exp = modelAdd(&m, seq);
+            bool res;
+            if (i % 2) {
+                fillPayload(data, seq);
+                res = bufAdd(buf, seq, data);
+            } else {
+                // the slot is handed over only when the seq is new to the buffer
+                unsigned char* lent = slot;
+                fillPayload(slot, seq);
+                res = bufCommit(buf, seq, &slot);
+                CHECK(slot != NULL, "slot", 0, 1);
+                CHECK((slot != lent) == fresh, "slot swapped", slot != lent, fresh);
+            }
+            CHECK(res == exp, "add", res, exp);
+            if (!arr[i].round) continue;
+        } else if (i == count) {
+            // end of the stream, every hole is lost now
+            m.thresh = 0;
+            bufSetLostThresh(buf, 0);
+        } else {
+            // end of the stream announced, the tail after the last seq was lost
+            m.end = n + window + window / 2;
+            bufSetEnd(buf, m.end);
+        }
+
+        bufFlushFrame(buf);
+        modelFlush(&m);
+        CHECK(bufGetStalls(buf) == m.stalls, "stalls", bufGetStalls(buf), m.stalls);
+        unsigned int subseq = bufGetSubseqCount(buf);
+        CHECK(subseq == modelSubseq(&m), "subseq", subseq, modelSubseq(&m));
+        double occ = bufGetOccupancy(buf);
+        CHECK(occ == (double) modelCount(&m) / window, "occupied", occ * window, modelCount(&m));
+        m.lastReq = 0;
+        uint32_t lost = bufGetFirstLost(buf);
+        for (;;) {
+            uint32_t exp = modelNextLost(&m);
+            CHECK(lost == exp, "lost", lost, exp);
+            if (lost == 0) break;
+            lost = bufGetNextLost(buf);
+        }
+        if (!ok) break;
+    }
+    // the stall count is checked per round, so the duplicate seqs of the last round were settled
+    uint32_t flushed = m.head - 1;
+    bufDestroy(buf);
+
+    // every flushed payload once, in seq order
+    FILE* f = fopen(path, "r");
+    for (uint32_t seq = 1; ok && (f != NULL) && (seq <= flushed); seq++) {
+        uint32_t first, last;
+        if (fread(data, DATALEN, 1, f) != 1) {
+            printf("FAIL %-7s window %7u: output ends at seq %u, expected %u\n", patNames[pat], window, seq, flushed);
+            ok = false;
+            break;
+        }
+        memcpy(&first, data, sizeof (first));
+        memcpy(&last, data + DATALEN - sizeof (last), sizeof (last));
+        if ((first != seq) || (last != seq)) {
+            printf("FAIL %-7s window %7u: output payload %u holds seq %u\n", patNames[pat], window, seq, first);
+            ok = false;
+        }
+    }
+    if (ok && (f != NULL) && (fread(data, 1, 1, f) != 0)) {
+        printf("FAIL %-7s window %7u: output longer than %u pkts\n", patNames[pat], window, flushed);
+        ok = false;
+    }
+    if (f != NULL) fclose(f);
+    unlink(path);
+    free(m.present);
+    if (ok) printf("ok   %-7s window %7u: %u arrivals, %u pkts flushed, %" PRIu64 " stalls\n", patNames[pat], window, count,
+            flushed, m.stalls);
+    return ok;
+}
+
+/*******************
+ * Microbenchmark
+ *******************/
+
+static int perfOpen(void) {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof (pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof (pe);
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static uint64_t misses(void) {
+    uint64_t v = 0;
+    if ((perfFd != -1) && (read(perfFd, &v, sizeof (v)) != sizeof (v))) v = 0;
+    return v;
+}
+
+/* counter read first, clock last, so neither is inside the other's group */
+#define GROUP_START(c0, t0) uint64_t c0 = misses(); uint64_t t0 = monotonicNs()
+#define GROUP_END(cost, n, c0, t0) do { \
+        uint64_t tEnd = monotonicNs(); \
+        uint64_t cEnd = misses(); \
+        (cost).ns += tEnd - t0; \
+        (cost).misses += cEnd - c0; \
+        (cost).ops += (n); \
+        (cost).groups++; \
+    } while (0)
+
+static void calibrate(void) {
+    conf_cost c = {0, 0, 0, 0};
+    for (unsigned int i = 0; i < 100000; i++) {
+        GROUP_START(c0, t0);
+        GROUP_END(c, 0, c0, t0);
+    }
+    emptyNs = (double) c.ns / c.groups;
+    emptyMisses = (double) c.misses / c.groups;
+}
+
+static void bench(unsigned int pat, unsigned int window, conf_arrival* arr, unsigned int count) {
+    packet_buffer* buf = bufCreate(NULL, window, benchFlags);
+    if (buf == NULL) return;
+    unsigned char data[DATALEN];
+    memset(data, 0xAB, DATALEN);
+    unsigned char* slot = bufGetSlot(buf);
+    conf_cost cost[OP_COUNT];
+    memset(cost, 0, sizeof (cost));
+
+    unsigned int i = 0;
+    while (i < count) {
+        unsigned int first = i;
+        GROUP_START(c0, t0);
+        for (; i < count; i++) {
+            if (i % 2) bufAdd(buf, arr[i].seq, data);
+            else bufCommit(buf, arr[i].seq, &slot);
+            if (arr[i].round) break;
+        }
+        i++;
+        GROUP_END(cost[OP_ADD], i - first, c0, t0);
+
+        // the subseq count is what the flush writes
+        GROUP_START(c1, t1);
+        unsigned int subseq = bufGetSubseqCount(buf);
+        GROUP_END(cost[OP_SUBSEQ], 1, c1, t1);
+
+        GROUP_START(c2, t2);
+        bufFlushFrame(buf);
+        GROUP_END(cost[OP_FLUSH], subseq, c2, t2);
+
+        unsigned int calls = 1;
+        GROUP_START(c3, t3);
+        for (uint32_t lost = bufGetFirstLost(buf); lost > 0; lost = bufGetNextLost(buf)) calls++;
+        GROUP_END(cost[OP_LOST], calls, c3, t3);
+    }
+    bufDestroy(buf);
+
+    printf("%7u %-7s", window, patNames[pat]);
+    for (unsigned int op = 0; op < OP_COUNT; op++) {
+        conf_cost* c = &cost[op];
+        // the subtraction can undershoot for calls close to the clock resolution
+        double ns = (c->ops > 0) ? ((double) c->ns - emptyNs * c->groups) / c->ops : 0;
+        double miss = (c->ops > 0) ? ((double) c->misses - emptyMisses * c->groups) / c->ops : 0;
+        printf(" %9.1f", (ns > 0) ? ns : 0);
+        if (perfFd != -1) printf(" %7.2f", (miss > 0) ? miss : 0);
+        else printf(" %7s", "-");
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int windows[CONF_WINDOWS_MAX] = {1024, 65536, 1048576};
+    unsigned int windowCount = 3;
+    bool benchOn = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:cp")) != -1) {
+        switch (opt) {
+            case 'n':
+                seqFactor = atoi(optarg);
+                break;
+            case 's':
+                seed = atoi(optarg);
+                break;
+            case 'c':
+                benchOn = false;
+                break;
+            case 'p':
+                benchFlags |= BUF_PREFAULT;
+                break;
+            default: //force usage print
+                seqFactor = 0;
+        }
+    }
+    if (seqFactor == 0) {
+        printf("Usage: %s [-n <seqs per window slot>] [-s <seed>] [-c] [-p] [window ...]\n", argv[0]);
+        exit(1);
+    }
+    if (optind < argc) windowCount = 0;
+    for (int i = optind; (i < argc) && (windowCount < CONF_WINDOWS_MAX); i++) {
+        windows[windowCount++] = (unsigned int) strtoul(argv[i], NULL, 10);
+    }
+
+    bool ok = true;
+    for (unsigned int w = 0; w < windowCount; w++) {
+        packet_buffer* probe = bufCreate(NULL, windows[w], BUF_QUIET); // rounds the window
+        if (probe == NULL) {
+            printf("Error: Buffer of %u pkts could not be created\n", windows[w]);
+            exit(1);
+        }
+        windows[w] = bufGetWindow(probe);
+        bufDestroy(probe);
+    }
+
+    printf("Conformance, %u seqs per window slot, seed %u\n", seqFactor, seed);
+    for (unsigned int w = 0; w < windowCount; w++) {
+        for (unsigned int pat = 0; pat < PAT_COUNT; pat++) {
+            uint32_t n = windows[w] * seqFactor;
+            unsigned int count;
+            conf_arrival* arr = genArrivals(pat, n, windows[w], &count);
+            if (arr == NULL) {
+                printf("Error: Arrivals could not be allocated\n");
+                exit(1);
+            }
+            ok = conform(pat, windows[w], arr, count, n) && ok;
+            free(arr);
+        }
+    }
+    if (!benchOn) return ok ? 0 : 1;
+
+    perfFd = perfOpen();
+    if (perfFd == -1) printf("Cache misses: perf events not available (%s)\n", strerror(errno));
+    calibrate();
+    printf("\nns/op and cache misses/op (empty group %.1f ns subtracted)\n", emptyNs);
+    printf("%7s %-7s", "window", "pattern");
+    for (unsigned int op = 0; op < OP_COUNT; op++) printf(" %9s %7s", opNames[op], "miss");
+    printf("\n");
+    for (unsigned int w = 0; w < windowCount; w++) {
+        for (unsigned int pat = 0; pat < PAT_COUNT; pat++) {
+            uint32_t n = windows[w] * seqFactor;
+            unsigned int count;
+            conf_arrival* arr = genArrivals(pat, n, windows[w], &count);
+            if (arr == NULL) exit(1);
+            bench(pat, windows[w], arr, count);
+            free(arr);
+        }
+    }
+    if (perfFd != -1) close(perfFd);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+/*
+ * Packet buffer scan benchmark
+ * Times the queries that walk the buffer window (single thread):
+ * 1. lost scan - bufGetFirstLost / bufGetNextLost over a full window with
+ *    random holes (the NAK list of one timer round)
+ * 2. subsequent count - bufGetSubseqCount over a full window
+ * 3. insert + flush - fill the window and flush it (no output file), packets
+ *    committed from a lent slot, so only the buffer metadata is touched
+ * 4. copy + flush - the same with bufAdd copying every payload
+ * The first window of 3 and 4 is timed apart (page faults unless the buffer
+ * is pre-faulted).
+ * Each test is run for every given window size.
+ *
+ * usage: ./buffer_scan_bench [-p] [-l] [window ...]   (default 1024 65536 1048576)
+ *   -p pre-faults the buffer, -l locks it in memory
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for rand_r
+#include "packet_buffer.h"
+
+#define BENCH_SLOTS 100000000ULL // window slots scanned per test (repeats = BENCH_SLOTS / window)
+#define BENCH_WINDOWS_MAX 16
+
+static unsigned int window;
+static unsigned int flags = 0;
+static unsigned char* slot;
+static packet_buffer* buf;
+
+static bool init(void) {
+    buf = bufCreate(NULL, window, flags);
+    if (buf == NULL) return false;
+    window = bufGetWindow(buf);
+    slot = bufGetSlot(buf); // every buffer lends its own slots
+    return true;
+}
+
+/* window 1 - window with holePpm missing packets per million, returns the number of holes */
+static unsigned int fill(unsigned int holePpm, unsigned int seed) {
+    unsigned int holes = 0;
+    for (uint32_t seq = 1; seq <= window; seq++) {
+        if ((seq < window) && ((unsigned int) rand_r(&seed) % 1000000 < holePpm)) {
+            holes++; // the newest seq is always present, it sets the window end
+            continue;
+        }
+        bufCommit(buf, seq, &slot);
+    }
+    return holes;
+}
+
+static unsigned int repeats(void) {
+    return (BENCH_SLOTS / window > 0) ? BENCH_SLOTS / window : 1;
+}
+
+static void benchLost(unsigned int holePpm) {
+    if (!init()) return;
+    fill(holePpm, 1);
+    unsigned int reps = repeats();
+    uint64_t found = 0;
+    uint64_t t = monotonicNs();
+    for (unsigned int r = 0; r < reps; r++) {
+        for (uint32_t lost = bufGetFirstLost(buf); lost > 0; lost = bufGetNextLost(buf)) found++;
+    }
+    double ns = (double) (monotonicNs() - t);
+    bufDestroy(buf);
+    printf("  lost scan, %5.1f%% holes: %10.0f ns/round %8.3f ns/slot %8.1f ns/lost (%" PRIu64 " lost/round)\n",
+            holePpm / 10000.0, ns / reps, ns / reps / window, found ? ns / found : 0, found / reps);
+}
+
+static void benchSubseq(void) {
+    if (!init()) return;
+    fill(0, 1);
+    unsigned int reps = repeats();
+    uint64_t sum = 0;
+    uint64_t t = monotonicNs();
+    for (unsigned int r = 0; r < reps; r++) sum += bufGetSubseqCount(buf);
+    double ns = (double) (monotonicNs() - t);
+    bufDestroy(buf);
+    printf("  subseq count:           %10.0f ns/call  %8.3f ns/slot (%" PRIu64 " pkts)\n",
+            ns / reps, ns / reps / window, sum / reps);
+}
+
+static void benchFlush(bool copy) {
+    unsigned char data[DATALEN];
+    memset(data, 0xAB, DATALEN);
+    uint64_t t = monotonicNs();
+    if (!init()) return;
+    double initNs = (double) (monotonicNs() - t);
+    unsigned int reps = repeats() + 1;
+    uint32_t seq = 1;
+    double firstNs = 0;
+    t = monotonicNs();
+    for (unsigned int r = 0; r < reps; r++) {
+        for (unsigned int i = 0; i < window; i++) {
+            if (copy) {
+                bufAdd(buf, seq++, data);
+            } else {
+                bufCommit(buf, seq++, &slot);
+            }
+        }
+        bufFlushFrame(buf);
+        if (r == 0) {
+            firstNs = (double) (monotonicNs() - t);
+            t = monotonicNs();
+        }
+    }
+    double ns = (double) (monotonicNs() - t);
+    bufDestroy(buf);
+    // windows after the first one
+    printf("  %s + flush:         %10.0f ns/window %7.3f ns/pkt, first window %.3f ns/pkt, init %.1f ms\n",
+            copy ? "  copy" : "insert", ns / (reps - 1), ns / (reps - 1) / window, firstNs / window, initNs / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int windows[BENCH_WINDOWS_MAX] = {1024, 65536, 1048576};
+    unsigned int count = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "pl")) != -1) {
+        switch (opt) {
+            case 'p':
+                flags |= BUF_PREFAULT;
+                break;
+            case 'l':
+                flags |= BUF_MLOCK;
+                break;
+            default:
+                printf("Usage: %s [-p] [-l] [window ...]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind < argc) count = 0;
+    for (int i = optind; (i < argc) && (count < BENCH_WINDOWS_MAX); i++) {
+        windows[count++] = (unsigned int) strtoul(argv[i], NULL, 10);
+    }
+
+    for (unsigned int w = 0; w < count; w++) {
+        window = windows[w];
+        if (!init()) continue; // rounds the window
+        bufDestroy(buf);
+        printf("window %u, %u rounds per test\n", window, repeats());
+        benchLost(1000);
+        benchLost(10000);
+        benchLost(100000);
+        benchSubseq();
+        benchFlush(false);
+        benchFlush(true);
+    }
+    return 0;
+}
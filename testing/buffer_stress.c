@@ -0,0 +1,237 @@
+/*
+ * Packet buffer stress test
+ * Producer threads insert seqs 1 - N concurrently (producer p takes the seqs
+ * with seq % producers == p, shuffled in small groups, with duplicates), half
+ * of them copy the payload (bufAdd) and half hand over lent slots (bufCommit).
+ * A consumer thread flushes frames and scans for lost packets meanwhile.
+ * The output file must hold every payload exactly once and in order.
+ * Producers wait for the window instead of inserting too high seqs: the
+ * consumer publishes how many packets were flushed (output file size), so the
+ * window must hold producers x STRESS_GROUP seqs.
+ * With -b several buffers are stressed side by side, each with its own
+ * producers, consumer and output file.
+ *
+ * usage: ./buffer_stress [-p <producers>] [-n <seqs>] [-r <rounds>] [-w <window>] [-b <buffers>]
+ * exit status 0 if all rounds pass
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for rand_r, mkstemp
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include "packet_buffer.h"
+
+#define STRESS_PRODUCERS_MAX 16
+#define STRESS_BUFFERS_MAX 8
+#define STRESS_GROUP 16     // seqs of one producer shuffled together
+#define STRESS_DUP_PCT 10   // percentage of seqs inserted twice
+
+static unsigned int producers = 4;
+static uint32_t seqs = 1000000;
+static unsigned int rounds = 3;
+static unsigned int window = 0; // buffer window, 0 = default
+static unsigned int buffers = 1;
+
+/* One stressed buffer with its output file */
+typedef struct stream {
+    packet_buffer* buf;
+    char path[32];
+    uint32_t flushed;       // packets in the output file (atomic)
+    unsigned int running;   // producers not finished yet (atomic)
+    uint64_t lostReported;
+} stream;
+
+/* Producer thread argument */
+typedef struct producer_arg {
+    stream* s;
+    unsigned int p;
+} producer_arg;
+
+static stream streams[STRESS_BUFFERS_MAX];
+
+static void fillPayload(unsigned char* data, uint32_t seq) {
+    for (unsigned int i = 0; i < DATALEN; i += sizeof (seq)) memcpy(data + i, &seq, sizeof (seq));
+}
+
+/* wait until seq fits in the buffer window */
+static void waitWindow(stream* s, uint32_t seq) {
+    while (seq > __atomic_load_n(&s->flushed, __ATOMIC_ACQUIRE) + bufGetWindow(s->buf)) sched_yield();
+}
+
+static bool insert(stream* s, uint32_t seq, unsigned char** slot) {
+    waitWindow(s, seq);
+    if (slot == NULL) {
+        unsigned char data[DATALEN];
+        fillPayload(data, seq);
+        return bufAdd(s->buf, seq, data);
+    }
+    fillPayload(*slot, seq);
+    return bufCommit(s->buf, seq, slot);
+}
+
+static void* producer(void* arg) {
+    stream* s = ((producer_arg*) arg)->s;
+    unsigned int p = ((producer_arg*) arg)->p;
+    unsigned int rnd = p + 1;
+    unsigned char* slot = NULL;
+    if (p % 2 == 1) {
+        slot = bufGetSlot(s->buf);
+        if (slot == NULL) printf("Error: No slot lent to producer %u\n", p);
+    }
+
+    uint32_t group[STRESS_GROUP];
+    for (uint32_t first = p + 1; first <= seqs; first += producers * STRESS_GROUP) {
+        unsigned int n = 0;
+        for (uint32_t seq = first; (seq <= seqs) && (n < STRESS_GROUP); seq += producers) group[n++] = seq;
+        for (unsigned int i = n - 1; i > 0; i--) {
+            unsigned int j = rand_r(&rnd) % (i + 1);
+            uint32_t t = group[i];
+            group[i] = group[j];
+            group[j] = t;
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            if (!insert(s, group[i], (slot != NULL) ? &slot : NULL)) printf("Error: seq %u not inserted\n", group[i]);
+            if ((unsigned int) rand_r(&rnd) % 100 < STRESS_DUP_PCT) insert(s, group[i], (slot != NULL) ? &slot : NULL);
+        }
+    }
+    __atomic_fetch_sub(&s->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    stream* s = (stream*) arg;
+    struct stat st;
+    for (;;) {
+        bool done = (__atomic_load_n(&s->running, __ATOMIC_ACQUIRE) == 0);
+        bufFlushFrame(s->buf);
+        uint32_t n = s->flushed;
+        if (stat(s->path, &st) == 0) n = (uint32_t) (st.st_size / DATALEN);
+        __atomic_store_n(&s->flushed, n, __ATOMIC_RELEASE);
+        double oc = bufGetOccupancy(s->buf);
+        if ((oc < 0) || (oc > 1)) printf("Error: occupancy %f\n", oc);
+        for (uint32_t lost = bufGetFirstLost(s->buf); lost > 0; lost = bufGetNextLost(s->buf)) {
+            if (lost <= n) printf("Error: flushed seq %u reported lost\n", lost);
+            s->lostReported++;
+        }
+        if (done && (bufGetSubseqCount(s->buf) == 0) && (n == seqs)) break;
+        sched_yield();
+    }
+    return NULL;
+}
+
+/* every block of the output file must hold its own seq */
+static bool verify(stream* s) {
+    FILE* f = fopen(s->path, "r");
+    if (f == NULL) return false;
+    unsigned char data[DATALEN], exp[DATALEN];
+    uint32_t seq = 0;
+    while (fread(data, 1, DATALEN, f) == DATALEN) {
+        fillPayload(exp, ++seq);
+        if (memcmp(data, exp, DATALEN) != 0) {
+            printf("Error: %s block %u does not hold its payload\n", s->path, seq);
+            fclose(f);
+            return false;
+        }
+    }
+    fclose(f);
+    if (seq != seqs) printf("Error: %u of %u packets in %s\n", seq, seqs, s->path);
+    return (seq == seqs);
+}
+
+static bool runRound(unsigned int round) {
+    pthread_t threads[STRESS_BUFFERS_MAX][STRESS_PRODUCERS_MAX], cons[STRESS_BUFFERS_MAX];
+    producer_arg args[STRESS_BUFFERS_MAX][STRESS_PRODUCERS_MAX];
+    unsigned int size = 0;
+    for (unsigned int b = 0; b < buffers; b++) {
+        stream* s = &streams[b];
+        s->flushed = 0;
+        s->lostReported = 0;
+        s->running = producers;
+        s->buf = bufCreate(s->path, window, 0);
+        if (s->buf == NULL) {
+            while (b-- > 0) bufDestroy(streams[b].buf);
+            return false;
+        }
+        size = bufGetWindow(s->buf);
+    }
+    if (size < producers * STRESS_GROUP) {
+        // a producer could wait for the window on a hole of its own group
+        printf("Error: window %u smaller than %u (producers x %u)\n", size, producers * STRESS_GROUP, STRESS_GROUP);
+        for (unsigned int b = 0; b < buffers; b++) bufDestroy(streams[b].buf);
+        return false;
+    }
+
+    uint64_t start = monotonicNs();
+    for (unsigned int b = 0; b < buffers; b++) {
+        pthread_create(&cons[b], NULL, consumer, &streams[b]);
+        for (unsigned int p = 0; p < producers; p++) {
+            args[b][p].s = &streams[b];
+            args[b][p].p = p;
+            pthread_create(&threads[b][p], NULL, producer, &args[b][p]);
+        }
+    }
+    for (unsigned int b = 0; b < buffers; b++) {
+        for (unsigned int p = 0; p < producers; p++) pthread_join(threads[b][p], NULL);
+        pthread_join(cons[b], NULL);
+    }
+    double secs = (monotonicNs() - start) / 1e9;
+
+    bool ok = true;
+    uint64_t lostReported = 0;
+    for (unsigned int b = 0; b < buffers; b++) {
+        bufDestroy(streams[b].buf);
+        ok = verify(&streams[b]) && ok;
+        lostReported += streams[b].lostReported;
+    }
+    printf("round %u: %u buffers x %u seqs, %u producers each, window %u, %.2f s (%.0f pkts/s), %" PRIu64 " lost reports, %s\n",
+            round, buffers, seqs, producers, size, secs, buffers * seqs / secs, lostReported, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:r:w:b:")) != -1) {
+        switch (opt) {
+            case 'p':
+                producers = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                seqs = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                window = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                buffers = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            default:
+                producers = 0; //force usage print
+                break;
+        }
+    }
+    if ((producers < 1) || (producers > STRESS_PRODUCERS_MAX) || (seqs < 1) || (buffers < 1) ||
+            (buffers > STRESS_BUFFERS_MAX) || (optind != argc)) {
+        printf("Usage: %s [-p <producers 1-%u>] [-n <seqs>] [-r <rounds>] [-w <window>] [-b <buffers 1-%u>]\n",
+                argv[0], STRESS_PRODUCERS_MAX, STRESS_BUFFERS_MAX);
+        exit(1);
+    }
+    for (unsigned int b = 0; b < buffers; b++) {
+        strcpy(streams[b].path, "/tmp/buffer_stressXXXXXX");
+        int fd = mkstemp(streams[b].path);
+        if (fd == -1) {
+            printf("Error: Output file could not be created\n");
+            exit(1);
+        }
+        close(fd);
+    }
+
+    bool ok = true;
+    for (unsigned int r = 1; r <= rounds; r++) ok = runRound(r) && ok;
+    for (unsigned int b = 0; b < buffers; b++) unlink(streams[b].path);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+/*
+ * Client receive benchmark
+ * Plays all servers of one client on loopback (server i on 127.0.0.(i+2)),
+ * acknowledges the request and floods the client with data packets for a
+ * fixed time. Reports how many packets the client processed per second and
+ * the client CPU time per packet (from wait4).
+ * Data seqs repeat within BENCH_SEQ_RANGE, so the client buffer never runs
+ * out of room and every packet takes the full rx path.
+ *
+ * usage: ./client_bench [-c <client binary>] [-n <servers>] [-t <secs>] [-r <pkts/s>] [-g] [-z]
+ *   -g sends bursts as one UDP GSO buffer (the client can take them with GRO)
+ *   -z runs the client in zero-copy receive mode
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for sendmmsg
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "common.h"
+
+#define BENCH_BURST 32          // packets per send call (sendmmsg or GSO buffer)
+#define BENCH_SEQ_RANGE 500     // data seqs 1 - BENCH_SEQ_RANGE are repeated
+#define BENCH_REQ_TIMEOUT 5000  // time (ms) to wait for the client request
+#define BENCH_FIN_MS 50         // FIN is repeated until the client exits
+
+static char* clientBin = "../final_project/client";
+static unsigned int servers = SERVER_DEFAULT;
+static unsigned int secs = 5;
+static unsigned int rate = 0; //total offered rate (pkts/s), 0 = as fast as possible
+static bool gso = false;
+static bool zeroCopy = false; //client -z
+
+static int socs[SERVER_MAX];
+static struct sockaddr_in client;
+
+/* start the client in a scratch directory (it writes its file and graph data there) */
+pid_t startClient(char* dir) {
+    char* args[SERVER_MAX + 4];
+    static char addrs[SERVER_MAX][INET_ADDRSTRLEN];
+    unsigned int n = 0;
+    args[n++] = clientBin;
+    if (zeroCopy) args[n++] = "-z";
+    for (unsigned int i = 0; i < servers; i++) {
+        snprintf(addrs[i], sizeof (addrs[i]), "127.0.0.%u", i + 2);
+        args[n++] = addrs[i];
+    }
+    args[n++] = FILE1;
+    args[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if ((chdir(dir) != 0) || (freopen("client.log", "w", stdout) == NULL)) exit(1);
+        execv(clientBin, args);
+        exit(1);
+    }
+    return pid;
+}
+
+/* wait for the request on every server socket and acknowledge it */
+bool handshake(void) {
+    unsigned char pkt[PKTLEN_MSG];
+    struct pollfd pfds[SERVER_MAX];
+    bool acked[SERVER_MAX] = {};
+    unsigned int left = servers;
+    for (unsigned int i = 0; i < servers; i++) pfds[i] = (struct pollfd) {.fd = socs[i], .events = POLLIN};
+
+    while (left > 0) {
+        if (poll(pfds, servers, BENCH_REQ_TIMEOUT) <= 0) return false;
+        for (unsigned int i = 0; i < servers; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            socklen_t size = sizeof (client);
+            if (recvfrom(socs[i], pkt, PKTLEN_MSG, 0, (struct sockaddr*) &client, &size) < 0) continue;
+            if (((pkthdr_common*) pkt)->type != TYPE_REQ) continue;
+            fillpkt(pkt, i, ID_CLIENT, TYPE_REQACK, 0, NULL, 0);
+            sendto(socs[i], pkt, PKTLEN_MSG, 0, (struct sockaddr*) &client, sizeof (client));
+            if (!acked[i]) left--;
+            acked[i] = true;
+        }
+    }
+    return true;
+}
+
+/* one burst of data packets from server i, returns packets handed to the kernel */
+unsigned int sendBurst(unsigned int i, uint32_t* seq) {
+    static unsigned char pkts[BENCH_BURST][PKTLEN_DATA];
+    struct iovec iovs[BENCH_BURST];
+    struct mmsghdr msgs[BENCH_BURST];
+    for (unsigned int p = 0; p < BENCH_BURST; p++) {
+        pkthdr_common* hdr = (pkthdr_common*) pkts[p];
+        hdr->src = i;
+        hdr->dst = ID_CLIENT;
+        hdr->type = TYPE_DATA;
+        hdr->seq = *seq;
+        *seq = (*seq % BENCH_SEQ_RANGE) + 1;
+        iovs[p].iov_base = pkts[p];
+        iovs[p].iov_len = PKTLEN_DATA;
+    }
+
+    if (gso) {
+        char ctrl[CMSG_SPACE(sizeof (uint16_t))] = {};
+        struct msghdr msg = {.msg_name = &client, .msg_namelen = sizeof (client),
+            .msg_iov = iovs, .msg_iovlen = BENCH_BURST, .msg_control = ctrl, .msg_controllen = sizeof (ctrl)};
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof (uint16_t));
+        *((uint16_t*) CMSG_DATA(cm)) = PKTLEN_DATA;
+        return (sendmsg(socs[i], &msg, 0) > 0) ? BENCH_BURST : 0;
+    }
+    memset(msgs, 0, sizeof (msgs));
+    for (unsigned int p = 0; p < BENCH_BURST; p++) {
+        msgs[p].msg_hdr.msg_name = &client;
+        msgs[p].msg_hdr.msg_namelen = sizeof (client);
+        msgs[p].msg_hdr.msg_iov = &iovs[p];
+        msgs[p].msg_hdr.msg_iovlen = 1;
+    }
+    int res = sendmmsg(socs[i], msgs, BENCH_BURST, 0);
+    return (res > 0) ? res : 0;
+}
+
+/* data packets received by the client = lines of its graph data file */
+uint64_t clientPkts(char* dir) {
+    char path[PATH_MAX], line[64];
+    uint64_t lines = 0;
+    snprintf(path, sizeof (path), "%s/%s", dir, GRAPH_DATA_FILE);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof (line), f) != NULL) lines++;
+    fclose(f);
+    return lines;
+}
+
+void checkArgs(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:t:r:gz")) != -1) {
+        switch (opt) {
+            case 'c':
+                clientBin = optarg;
+                break;
+            case 'n':
+                servers = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                secs = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rate = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'g':
+                gso = true;
+                break;
+            case 'z':
+                zeroCopy = true;
+                break;
+            default:
+                servers = 0; //force usage print
+                break;
+        }
+    }
+    if ((servers < 1) || (servers > SERVER_MAX) || (secs < 1) || (optind != argc)) {
+        printf("Usage: %s [-c <client binary>] [-n <servers 1-%u>] [-t <secs>] [-r <pkts/s>] [-g] [-z]\n", argv[0], SERVER_MAX);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    checkArgs(argc, argv);
+    static char binPath[PATH_MAX];
+    if (realpath(clientBin, binPath) == NULL) { //client runs in the scratch directory
+        printf("Error: Client binary %s not found\n", clientBin);
+        exit(1);
+    }
+    clientBin = binPath;
+    for (unsigned int i = 0; i < servers; i++) {
+        char addr[INET_ADDRSTRLEN];
+        snprintf(addr, sizeof (addr), "127.0.0.%u", i + 2);
+        socs[i] = udpInit(addr, UDP_PORT, 0);
+        if (socs[i] == -1) exit(1);
+    }
+    char dir[] = "/tmp/client_benchXXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        printf("Error: Scratch directory could not be created\n");
+        exit(1);
+    }
+    pid_t pid = startClient(dir);
+    if ((pid == -1) || !handshake()) {
+        printf("Error: No request from the client\n");
+        if (pid > 0) kill(pid, SIGKILL);
+        exit(1);
+    }
+
+    //flood, paced per burst when a rate is given
+    uint64_t sent = 0;
+    uint32_t seq = 1;
+    uint64_t start = monotonicNs();
+    uint64_t end = start + secs * 1000000000ULL;
+    uint64_t now = start;
+    while (now < end) {
+        for (unsigned int i = 0; i < servers; i++) sent += sendBurst(i, &seq);
+        now = monotonicNs();
+        if (rate > 0) {
+            uint64_t due = start + sent * 1000000000ULL / rate;
+            if (due > now) usleep((due - now) / 1000);
+        }
+    }
+
+    //stop the client, FIN is repeated as the client socket may still be full
+    unsigned char pkt[PKTLEN_MSG];
+    struct rusage usage;
+    int status;
+    fillpkt(pkt, 0, ID_CLIENT, TYPE_FIN, 0, NULL, 0);
+    while (wait4(pid, &status, WNOHANG, &usage) == 0) {
+        sendto(socs[0], pkt, PKTLEN_MSG, 0, (struct sockaddr*) &client, sizeof (client));
+        usleep(BENCH_FIN_MS * 1000);
+    }
+
+    uint64_t pkts = clientPkts(dir);
+    double usr = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    double cpu = usr + sys;
+    printf("%u servers, %u s, %s, offered %s%s\n", servers, secs, gso ? "GSO bursts" : "sendmmsg bursts",
+            (rate > 0) ? "paced" : "unlimited", zeroCopy ? ", client zero-copy" : "");
+    printf("%12s %12s %8s %12s %8s %8s %12s\n", "sent", "received", "lost %", "pkts/s", "usr s", "sys s", "cpu ns/pkt");
+    printf("%12" PRIu64 " %12" PRIu64 " %8.1f %12.0f %8.2f %8.2f %12.0f\n", sent, pkts,
+            sent ? 100.0 * (sent - pkts) / sent : 0, pkts / (double) secs, usr, sys, pkts ? cpu * 1e9 / pkts : 0);
+
+    char cmd[PATH_MAX + 16];
+    snprintf(cmd, sizeof (cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) printf("Warning: %s not removed\n", dir);
+    return 0;
+}
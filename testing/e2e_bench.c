@@ -0,0 +1,483 @@
+/*
+ * End-to-end loopback benchmark
+ * Streams a generated file of a fixed size from N servers to the client on
+ * loopback, optionally through the impairment relay (repeater profile), and
+ * prints the results of every run and their medians as JSON.
+ *
+ * Server i is bound to 127.0.0.(i+2). With a profile the client gets
+ * 127.0.1.(i+1) instead, the flows of the profile have to relay these to the
+ * servers (profiles/geni.prof does for 4 servers). The runs use their own
+ * temporary directory (content, client copy, receive trace and logs), the
+ * relay a fixed seed, so repeated runs of one commit see the same losses.
+ *
+ * Results per run, from the client receive trace (GRAPH_TRACE_FILE), its
+ * "Stream stats" line and the rusage of the processes:
+ *   ttfbMs         request to the first data packet
+ *   completeMs     request to the arrival of the last missing packet
+ *   goodputKbps    file size / completeMs
+ *   naks, nakSeqs  NAK lists sent and seqs requested in them
+ *   nakRetries     seqs requested again after their NAK timed out
+ *   dupRetxPkts    retransmitted packets the client dropped as duplicates
+ *   dupPkts        data packets received more than once
+ *   retxPkts       retransmitted data packets received
+ *   recovery*Ms    retransmission recovery latency: arrival of a retransmitted packet
+ *                  filling a hole minus the arrival of the first packet past the hole
+ *   stalls         buffer flushes stopped by a hole
+ *   cpuNsPerByte   client + server CPU time (user + sys) per file byte, relay excluded
+ * A run that did not receive the whole file is reported as not completed:
+ * complete is false, completeMs and goodputKbps are null (their medians too
+ * unless every run completed) and the exit status is 1.
+ *
+ * To be run from the testing directory after make in final_project and testing
+ * usage: ./e2e_bench [-n <servers>] [-s <bytes>] [-r <runs>] [-p <profile>] [-t <timeout secs>] [-o <json file>] [-k]
+ *   -k keeps the run directories
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for mkdtemp, wait4 and getopt
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "trace.h"
+
+#define E2E_FILE FILE1         // generated content under the name the servers serve
+#define E2E_SERVER_WAIT_MS 300  // servers and relay bind their sockets
+#define E2E_POLL_MS 10
+#define E2E_RUNS_MAX 100
+
+/* Results of one run, all numbers are doubles so the medians are taken generically */
+typedef struct e2e_result {
+    bool complete;              // every packet of the file received
+    bool intact;                // client copy matches the file
+    double ttfbMs;
+    double completeMs;
+    double lastMs;              // last data packet
+    double goodputKbps;
+    double uniquePkts;
+    double dupPkts;
+    double retxPkts;
+    double naks;
+    double nakSeqs;
+    double nakRetries;
+    double dupRetxPkts;
+    double recovered;           // holes filled by a retransmission
+    double recoveryMeanMs;
+    double recoveryP50Ms;
+    double recoveryP95Ms;
+    double recoveryMaxMs;
+    double stalls;
+    double clientCpuMs;
+    double serverCpuMs;
+    double relayCpuMs;
+    double cpuNsPerByte;
+    double wallMs;
+} e2e_result;
+
+/* JSON name and place of every numeric result */
+static const struct {
+    const char* name;
+    size_t offset;
+} fields[] = {
+    {"ttfbMs", offsetof(e2e_result, ttfbMs)},
+    {"completeMs", offsetof(e2e_result, completeMs)},
+    {"lastMs", offsetof(e2e_result, lastMs)},
+    {"goodputKbps", offsetof(e2e_result, goodputKbps)},
+    {"uniquePkts", offsetof(e2e_result, uniquePkts)},
+    {"dupPkts", offsetof(e2e_result, dupPkts)},
+    {"retxPkts", offsetof(e2e_result, retxPkts)},
+    {"naks", offsetof(e2e_result, naks)},
+    {"nakSeqs", offsetof(e2e_result, nakSeqs)},
+    {"nakRetries", offsetof(e2e_result, nakRetries)},
+    {"dupRetxPkts", offsetof(e2e_result, dupRetxPkts)},
+    {"recovered", offsetof(e2e_result, recovered)},
+    {"recoveryMeanMs", offsetof(e2e_result, recoveryMeanMs)},
+    {"recoveryP50Ms", offsetof(e2e_result, recoveryP50Ms)},
+    {"recoveryP95Ms", offsetof(e2e_result, recoveryP95Ms)},
+    {"recoveryMaxMs", offsetof(e2e_result, recoveryMaxMs)},
+    {"stalls", offsetof(e2e_result, stalls)},
+    {"clientCpuMs", offsetof(e2e_result, clientCpuMs)},
+    {"serverCpuMs", offsetof(e2e_result, serverCpuMs)},
+    {"relayCpuMs", offsetof(e2e_result, relayCpuMs)},
+    {"cpuNsPerByte", offsetof(e2e_result, cpuNsPerByte)},
+    {"wallMs", offsetof(e2e_result, wallMs)},
+};
+#define FIELD_COUNT (sizeof (fields) / sizeof (fields[0]))
+#define FIELD(r, i) (*(double*) ((char*) (r) + fields[i].offset))
+
+static unsigned int serverCount = SERVER_DEFAULT;
+static uint64_t fileSize = 1024 * 1024; // longer than BUF_LOST_THRSH packets, or no NAK is ever sent
+static unsigned int timeoutSecs = 120;
+static char binDir[PATH_MAX];       // final_project
+static char relayBin[PATH_MAX];
+static char* profile = NULL;        // absolute path, NULL = no relay
+
+/*******************
+ * Helper functions
+ *******************/
+
+static void sleepMs(unsigned int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static double cpuMs(struct rusage* ru) {
+    return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000.0 + (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1000.0;
+}
+
+/* deterministic file content, the same for every run and commit */
+static uint8_t contentByte(uint64_t i) {
+    uint64_t x = (i / 8 + 1) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 31;
+    return (uint8_t) (x >> (8 * (i % 8)));
+}
+
+static bool writeContent(char* path) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) return false;
+    for (uint64_t i = 0; i < fileSize; i++) fputc(contentByte(i), f);
+    return (fclose(f) == 0);
+}
+
+/* the copy is padded to whole packets */
+static bool checkCopy(char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return false;
+    bool ok = true;
+    for (uint64_t i = 0; ok && (i < fileSize); i++) ok = (fgetc(f) == contentByte(i));
+    fclose(f);
+    return ok;
+}
+
+/* start a program in dir with its output in dir/log */
+static pid_t spawn(char* dir, char* log, char* argv[]) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    char path[PATH_MAX];
+    snprintf(path, sizeof (path), "%s/%s", dir, log);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((chdir(dir) != 0) || (fd == -1)) _exit(127);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    execv(argv[0], argv);
+    _exit(127);
+}
+
+/* stop a process and collect its CPU time */
+static double reap(pid_t pid, int sig) {
+    struct rusage ru;
+    int status;
+    if (pid <= 0) return 0;
+    kill(pid, sig);
+    for (unsigned int i = 0; i < 1000 / E2E_POLL_MS; i++) {
+        if (wait4(pid, &status, WNOHANG, &ru) == pid) return cpuMs(&ru);
+        sleepMs(E2E_POLL_MS);
+    }
+    kill(pid, SIGKILL);
+    return (wait4(pid, &status, 0, &ru) == pid) ? cpuMs(&ru) : 0;
+}
+
+static int compareDouble(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * readTrace
+ *
+ * Fill the trace based results of a run
+ *
+ * Return value: false if the trace cannot be read
+ */
+static bool readTrace(char* path, e2e_result* r) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return false;
+    trace_filehdr hdr;
+    if ((fread(&hdr, sizeof (hdr), 1, f) != 1) || (hdr.magic != TRACE_MAGIC) || (hdr.recSize != sizeof (trace_rec))) {
+        fclose(f);
+        return false;
+    }
+    uint32_t pktCount = (uint32_t) ((fileSize + DATALEN - 1) / DATALEN);
+    uint64_t* arrival = calloc(pktCount + 1, sizeof (uint64_t));  // first arrival of each seq (ns + 1, 0 = never)
+    uint64_t* passed = calloc(pktCount + 1, sizeof (uint64_t));   // first arrival of a higher seq (ns + 1)
+    double* recovery = malloc((pktCount + 1) * sizeof (double));
+    if ((arrival == NULL) || (passed == NULL) || (recovery == NULL)) {
+        free(arrival);
+        free(passed);
+        free(recovery);
+        fclose(f);
+        return false;
+    }
+
+    uint32_t maxSeq = 0;
+    uint64_t unique = 0;
+    uint64_t recovered = 0;
+    trace_rec rec;
+    while (fread(&rec, sizeof (rec), 1, f) == 1) {
+        if ((rec.type != TYPE_DATA) || (rec.seq == 0) || (rec.seq > pktCount)) continue;
+        if (r->uniquePkts + r->dupPkts == 0) r->ttfbMs = rec.ns / 1e6;
+        r->lastMs = rec.ns / 1e6;
+        if (rec.flags & PKT_FLAG_RETX) r->retxPkts++;
+        if (arrival[rec.seq] != 0) {
+            r->dupPkts++;
+            continue;
+        }
+        arrival[rec.seq] = rec.ns + 1;
+        r->uniquePkts++;
+        if ((++unique == pktCount) && !r->complete) {
+            r->complete = true;
+            r->completeMs = rec.ns / 1e6;
+        }
+        // holes left behind by this packet became visible now
+        for (uint32_t s = maxSeq + 1; s < rec.seq; s++) passed[s] = rec.ns + 1;
+        if (rec.seq > maxSeq) maxSeq = rec.seq;
+        if ((rec.flags & PKT_FLAG_RETX) && (passed[rec.seq] != 0)) {
+            recovery[recovered++] = (rec.ns + 1 - passed[rec.seq]) / 1e6;
+        }
+    }
+    fclose(f);
+
+    r->recovered = recovered;
+    if (recovered > 0) {
+        qsort(recovery, recovered, sizeof (double), compareDouble);
+        double sum = 0;
+        for (uint64_t i = 0; i < recovered; i++) sum += recovery[i];
+        r->recoveryMeanMs = sum / recovered;
+        r->recoveryP50Ms = recovery[recovered / 2];
+        r->recoveryP95Ms = recovery[(recovered * 95) / 100];
+        r->recoveryMaxMs = recovery[recovered - 1];
+    }
+    free(arrival);
+    free(passed);
+    free(recovery);
+    return true;
+}
+
+/* NAK and stall counters printed by the client at the end of the stream */
+static void readClientLog(char* path, e2e_result* r) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return;
+    char line[256];
+    while (fgets(line, sizeof (line), f) != NULL) {
+        unsigned long long naks, seqs, retries, held, dups, splices, rates, stalls;
+        if (sscanf(line, "Stream stats: %llu NAK lists, %llu NAK seqs (%llu retries, %llu held), %llu duplicate retx, "
+                "%llu splice changes, %llu rate changes, %llu buffer stalls",
+                &naks, &seqs, &retries, &held, &dups, &splices, &rates, &stalls) == 8) {
+            r->naks = naks;
+            r->nakSeqs = seqs;
+            r->nakRetries = retries;
+            r->dupRetxPkts = dups;
+            r->stalls = stalls;
+        }
+    }
+    fclose(f);
+}
+
+/*******************
+ * Benchmark run
+ *******************/
+
+static bool run(unsigned int idx, bool keep, e2e_result* r) {
+    memset(r, 0, sizeof (*r));
+    char dir[] = "/tmp/e2e_bench_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        printf("Error: Run directory could not be created\n");
+        return false;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof (path), "%s/%s", dir, E2E_FILE);
+    if (writeContent(path) == false) {
+        printf("Error: Content file could not be written\n");
+        return false;
+    }
+
+    char server[PATH_MAX + 8], client[PATH_MAX + 8];
+    snprintf(server, sizeof (server), "%s/server", binDir);
+    snprintf(client, sizeof (client), "%s/client", binDir);
+    pid_t servers[SERVER_MAX];
+    char addrs[SERVER_MAX][INET_ADDRSTRLEN];
+    char* clientArgv[SERVER_MAX + 3];
+    clientArgv[0] = client;
+    for (unsigned int i = 0; i < serverCount; i++) {
+        char bind[INET_ADDRSTRLEN], name[8], log[32];
+        snprintf(bind, sizeof (bind), "127.0.0.%u", i + 2);
+        snprintf(name, sizeof (name), "%u", i);
+        snprintf(log, sizeof (log), "server%u.log", i);
+        char* argv[] = {server, "-a", bind, name, NULL};
+        servers[i] = spawn(dir, log, argv);
+        snprintf(addrs[i], sizeof (addrs[i]), profile ? "127.0.1.%u" : "127.0.0.%u", profile ? i + 1 : i + 2);
+        clientArgv[i + 1] = addrs[i];
+    }
+    clientArgv[serverCount + 1] = E2E_FILE;
+    clientArgv[serverCount + 2] = NULL;
+    pid_t relay = -1;
+    if (profile != NULL) {
+        char* argv[] = {relayBin, "-s", "1", profile, NULL};
+        relay = spawn(dir, "relay.log", argv);
+    }
+    sleepMs(E2E_SERVER_WAIT_MS);
+
+    // client, stopped like from the keyboard when it runs out of time
+    uint64_t start = monotonicNs();
+    pid_t pid = spawn(dir, "client.log", clientArgv);
+    struct rusage ru;
+    int status = 0;
+    bool exited = false;
+    while (!exited && (monotonicNs() - start < timeoutSecs * 1000000000ULL)) {
+        exited = (wait4(pid, &status, WNOHANG, &ru) == pid);
+        if (!exited) sleepMs(E2E_POLL_MS);
+    }
+    if (exited) {
+        r->clientCpuMs = cpuMs(&ru);
+    } else {
+        printf("Warning: Run %u timed out after %u secs\n", idx, timeoutSecs);
+        r->clientCpuMs = reap(pid, SIGINT);
+    }
+    r->wallMs = (monotonicNs() - start) / 1e6;
+    for (unsigned int i = 0; i < serverCount; i++) r->serverCpuMs += reap(servers[i], SIGTERM);
+    r->relayCpuMs = reap(relay, SIGINT);
+    r->cpuNsPerByte = (r->clientCpuMs + r->serverCpuMs) * 1e6 / fileSize;
+
+    snprintf(path, sizeof (path), "%s/%s", dir, GRAPH_TRACE_FILE);
+    bool ok = readTrace(path, r);
+    if (!ok) printf("Warning: Run %u left no receive trace\n", idx);
+    snprintf(path, sizeof (path), "%s/client.log", dir);
+    readClientLog(path, r);
+    snprintf(path, sizeof (path), "%s/client_%s", dir, E2E_FILE);
+    r->intact = r->complete && checkCopy(path);
+    r->goodputKbps = (r->complete && (r->completeMs > 0)) ? fileSize * 8 / r->completeMs : 0;
+
+    if (keep) {
+        printf("Run %u kept in %s\n", idx, dir);
+    } else {
+        char cmd[PATH_MAX + 16];
+        snprintf(cmd, sizeof (cmd), "rm -rf %s", dir);
+        if (system(cmd) != 0) printf("Warning: %s could not be removed\n", dir);
+    }
+    return ok;
+}
+
+static void printResult(FILE* out, e2e_result* r, bool single, const char* indent) {
+    if (single) fprintf(out, "%s\"complete\": %s,\n%s\"intact\": %s,\n", indent, r->complete ? "true" : "false",
+            indent, r->intact ? "true" : "false");
+    for (unsigned int i = 0; i < FIELD_COUNT; i++) {
+        double v = FIELD(r, i);
+        // no time-to-complete without the whole file
+        bool none = !r->complete && ((fields[i].offset == offsetof(e2e_result, completeMs)) ||
+                (fields[i].offset == offsetof(e2e_result, goodputKbps)));
+        fprintf(out, "%s\"%s\": ", indent, fields[i].name);
+        if (none) fprintf(out, "null");
+        else fprintf(out, "%.3f", v);
+        fprintf(out, "%s\n", (i + 1 < FIELD_COUNT) ? "," : "");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int runs = 3;
+    char* outName = NULL;
+    bool keep = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:r:p:t:o:k")) != -1) {
+        switch (opt) {
+            case 'n':
+                serverCount = atoi(optarg);
+                break;
+            case 's':
+                fileSize = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'p':
+                profile = realpath(optarg, NULL);
+                if (profile == NULL) {
+                    printf("Error: Profile %s not found\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                timeoutSecs = atoi(optarg);
+                break;
+            case 'o':
+                outName = optarg;
+                break;
+            case 'k':
+                keep = true;
+                break;
+            default: //force usage print
+                runs = 0;
+        }
+    }
+    if ((optind != argc) || (runs == 0) || (runs > E2E_RUNS_MAX) || (serverCount == 0) || (serverCount > SERVER_MAX) ||
+            (fileSize == 0) || (timeoutSecs == 0)) {
+        printf("Usage: %s [-n <servers>] [-s <bytes>] [-r <runs>] [-p <profile>] [-t <timeout secs>] [-o <json file>] [-k]\n", argv[0]);
+        printf("servers: 1 to %d, runs: 1 to %d\n", SERVER_MAX, E2E_RUNS_MAX);
+        exit(1);
+    }
+    if ((realpath("../final_project", binDir) == NULL) || (realpath("repeater", relayBin) == NULL)) {
+        printf("Error: Run from the testing directory after make in final_project and testing\n");
+        exit(1);
+    }
+
+    static e2e_result results[E2E_RUNS_MAX];
+    unsigned int completeRuns = 0, intactRuns = 0;
+    for (unsigned int i = 0; i < runs; i++) {
+        run(i, keep, &results[i]);
+        completeRuns += results[i].complete;
+        intactRuns += results[i].intact;
+        if (results[i].complete) {
+            printf("Run %u: complete, %.0f ms, %.1f kbit/s\n", i, results[i].completeMs, results[i].goodputKbps);
+        } else {
+            printf("Run %u: not completed, %.0f of %u pkts, last packet at %.0f ms\n", i, results[i].uniquePkts,
+                    (unsigned int) ((fileSize + DATALEN - 1) / DATALEN), results[i].lastMs);
+        }
+        fflush(stdout);
+    }
+
+    // medians of every field over the runs
+    e2e_result median;
+    memset(&median, 0, sizeof (median));
+    median.complete = (completeRuns == runs);
+    double values[E2E_RUNS_MAX];
+    for (unsigned int f = 0; f < FIELD_COUNT; f++) {
+        for (unsigned int i = 0; i < runs; i++) values[i] = FIELD(&results[i], f);
+        qsort(values, runs, sizeof (double), compareDouble);
+        FIELD(&median, f) = values[runs / 2];
+    }
+    if (median.complete) {
+        printf("%u of %u runs completed, median %.0f ms\n", completeRuns, runs, median.completeMs);
+    } else {
+        printf("%u of %u runs completed, no median time-to-complete\n", completeRuns, runs);
+    }
+
+    FILE* out = stdout;
+    if ((outName != NULL) && ((out = fopen(outName, "w")) == NULL)) {
+        printf("Error: %s could not be created\n", outName);
+        exit(1);
+    }
+    char commit[64] = "";
+    FILE* git = popen("git rev-parse --short HEAD 2> /dev/null", "r");
+    if (git != NULL) {
+        if (fgets(commit, sizeof (commit), git) != NULL) commit[strcspn(commit, "\n")] = '\0';
+        pclose(git);
+    }
+    fprintf(out, "{\n  \"commit\": \"%s\",\n  \"servers\": %u,\n  \"bytes\": %" PRIu64 ",\n  \"profile\": ", commit, serverCount, fileSize);
+    if (profile != NULL) fprintf(out, "\"%s\",\n", profile);
+    else fprintf(out, "null,\n");
+    fprintf(out, "  \"runs\": %u,\n  \"completeRuns\": %u,\n  \"intactRuns\": %u,\n  \"results\": [\n", runs, completeRuns, intactRuns);
+    for (unsigned int i = 0; i < runs; i++) {
+        fprintf(out, "    {\n");
+        printResult(out, &results[i], true, "      ");
+        fprintf(out, "    }%s\n", (i + 1 < runs) ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"median\": {\n");
+    printResult(out, &median, false, "    ");
+    fprintf(out, "  }\n}\n");
+    if (out != stdout) fclose(out);
+    free(profile);
+    return (completeRuns == runs) ? 0 : 1;
+}
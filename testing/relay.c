@@ -0,0 +1,359 @@
+/*
+ * UDP relay
+ * Forwards datagrams between any number of peers on one port, by a routing
+ * table from the sender to one or more destinations (fan-in / fan-out):
+ *
+ *   <src>=<dst>[,<dst>...]
+ *       src: ip[:port] of the sender, * for every sender without a route
+ *       dst: ip[:port], the port defaults to the relay port
+ *       the first route matching the sender wins, ip:port before ip
+ *
+ * The hops of the multi-hop topology are relays, e.g. the original repeater
+ * (a and b <-> c) is: ./relay -p 55555 <c>=<a>,<b> '*'=<c>
+ *
+ * Every worker thread has its own SO_REUSEPORT socket on the port, reads
+ * batches with recvmmsg and sends the copies of the whole batch with one
+ * sendmmsg call. The kernel spreads the senders over the sockets by their
+ * address, so the packets of one sender stay in order. Packet counters are
+ * kept per worker and per peer, -i prints them periodically, Ctrl-C prints
+ * the totals and stops the relay.
+ *
+ * Usage: ./relay [-w <workers>] [-i <stats interval secs>] [-a <bind ip>] -p <port> <route> [<route> ...]
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for recvmmsg, sendmmsg and getopt
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include "common.h"
+
+#define RELAY_WORKER_MAX 64
+#define RELAY_ROUTE_MAX 64
+#define RELAY_FANOUT_MAX 8      // destinations of one route
+#define RELAY_PEER_MAX (RELAY_ROUTE_MAX * (RELAY_FANOUT_MAX + 1) + 1)
+#define RELAY_BATCH RX_BATCH_MAX // datagrams per recvmmsg call
+#define RELAY_PKT_MAX 65536     // largest relayed datagram
+#define RELAY_ANY 0             // peer of the senders without a route of their own
+
+/* Packet counters of a peer in one worker */
+typedef struct relay_counters {
+    uint64_t rxPkts;            // received from the peer
+    uint64_t rxBytes;
+    uint64_t txPkts;            // sent to the peer
+    uint64_t txBytes;
+    uint64_t txDrops;           // copies the socket refused
+} relay_counters;
+
+/* Sender matched by a route, a destination or both */
+typedef struct relay_peer {
+    struct sockaddr_in addr;    // port 0 = any port of the ip
+} relay_peer;
+
+typedef struct relay_route {
+    unsigned int src;           // peer
+    unsigned int dst[RELAY_FANOUT_MAX];
+    unsigned int dstCount;
+} relay_route;
+
+typedef struct relay_worker {
+    pthread_t thread;
+    int soc;
+    uint64_t unrouted;          // received from a sender without a route
+    relay_counters counters[RELAY_PEER_MAX];
+} relay_worker;
+
+static relay_peer peers[RELAY_PEER_MAX];
+static unsigned int peerCount = 1; // RELAY_ANY
+static relay_route routes[RELAY_ROUTE_MAX];
+static unsigned int routeCount = 0;
+static int anyRoute = -1;       // route of *, -1 if none
+static relay_worker* workers = NULL;
+static unsigned int workerCount = 1;
+static volatile sig_atomic_t stop = 0;
+
+/*******************
+ * Helper functions
+ *******************/
+
+/* counters are written by their worker only and read by the stats printer */
+static inline void count(uint64_t* c, uint64_t n) {
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+static unsigned int addPeer(struct sockaddr_in* addr) {
+    for (unsigned int i = RELAY_ANY + 1; i < peerCount; i++) {
+        if ((peers[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr) && (peers[i].addr.sin_port == addr->sin_port)) return i;
+    }
+    peers[peerCount].addr = *addr;
+    return peerCount++;
+}
+
+static bool parsePeer(char* str, unsigned int defPort, struct sockaddr_in* addr) {
+    char ip[INET_ADDRSTRLEN];
+    char* colon = strchr(str, ':');
+    size_t len = (colon == NULL) ? strlen(str) : (size_t) (colon - str);
+    if (len >= INET_ADDRSTRLEN) return false;
+    memcpy(ip, str, len);
+    ip[len] = '\0';
+    return initHostStruct(addr, ip, (colon == NULL) ? defPort : (unsigned int) atoi(colon + 1));
+}
+
+/* <src>=<dst>[,<dst>...] */
+static bool parseRoute(char* str, unsigned int port) {
+    char* eq = strchr(str, '=');
+    if ((eq == NULL) || (routeCount == RELAY_ROUTE_MAX)) return false;
+    *eq = '\0';
+    relay_route* r = &routes[routeCount];
+    struct sockaddr_in addr;
+    if (strcmp(str, "*") == 0) {
+        if (anyRoute != -1) return false;
+        r->src = RELAY_ANY;
+    } else if (parsePeer(str, 0, &addr)) {
+        r->src = addPeer(&addr);
+    } else {
+        return false;
+    }
+    r->dstCount = 0;
+    char* save;
+    for (char* dst = strtok_r(eq + 1, ",", &save); dst != NULL; dst = strtok_r(NULL, ",", &save)) {
+        if ((r->dstCount == RELAY_FANOUT_MAX) || !parsePeer(dst, port, &addr) || (addr.sin_port == 0)) return false;
+        r->dst[r->dstCount++] = addPeer(&addr);
+    }
+    if (r->dstCount == 0) return false;
+    if (r->src == RELAY_ANY) anyRoute = routeCount;
+    routeCount++;
+    return true;
+}
+
+/*
+ * findRoute
+ *
+ * Route of a sender, ip:port routes before ip routes before *
+ *
+ * Return value: route, NULL if the sender has none
+ */
+static relay_route* findRoute(struct sockaddr_in* src) {
+    relay_route* ipMatch = NULL;
+    for (unsigned int i = 0; i < routeCount; i++) {
+        struct sockaddr_in* a = &peers[routes[i].src].addr;
+        if ((routes[i].src == RELAY_ANY) || (a->sin_addr.s_addr != src->sin_addr.s_addr)) continue;
+        if (a->sin_port == src->sin_port) return &routes[i];
+        if ((a->sin_port == 0) && (ipMatch == NULL)) ipMatch = &routes[i];
+    }
+    if (ipMatch != NULL) return ipMatch;
+    return (anyRoute == -1) ? NULL : &routes[anyRoute];
+}
+
+static void printStats(uint64_t* last, double secs) {
+    printf("%-21s %12s %10s %12s %10s %10s", "peer", "rx pkts", "rx MB", "tx pkts", "tx MB", "tx drops");
+    printf((secs > 0) ? " %10s\n" : "\n", "pkts/s");
+    uint64_t unrouted = 0;
+    for (unsigned int w = 0; w < workerCount; w++) unrouted += __atomic_load_n(&workers[w].unrouted, __ATOMIC_RELAXED);
+    for (unsigned int p = 0; p < peerCount; p++) {
+        relay_counters sum = {0, 0, 0, 0, 0};
+        for (unsigned int w = 0; w < workerCount; w++) {
+            relay_counters* c = &workers[w].counters[p];
+            sum.rxPkts += __atomic_load_n(&c->rxPkts, __ATOMIC_RELAXED);
+            sum.rxBytes += __atomic_load_n(&c->rxBytes, __ATOMIC_RELAXED);
+            sum.txPkts += __atomic_load_n(&c->txPkts, __ATOMIC_RELAXED);
+            sum.txBytes += __atomic_load_n(&c->txBytes, __ATOMIC_RELAXED);
+            sum.txDrops += __atomic_load_n(&c->txDrops, __ATOMIC_RELAXED);
+        }
+        char name[32];
+        if (p == RELAY_ANY) {
+            snprintf(name, sizeof (name), "*");
+        } else {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &peers[p].addr.sin_addr, ip, sizeof (ip));
+            if (peers[p].addr.sin_port == 0) snprintf(name, sizeof (name), "%s:*", ip);
+            else snprintf(name, sizeof (name), "%s:%u", ip, ntohs(peers[p].addr.sin_port));
+        }
+        printf("%-21s %12llu %10.1f %12llu %10.1f %10llu", name, (unsigned long long) sum.rxPkts, sum.rxBytes / 1e6,
+                (unsigned long long) sum.txPkts, sum.txBytes / 1e6, (unsigned long long) sum.txDrops);
+        // rate of the packets forwarded to the peer since the last print
+        if (secs > 0) printf(" %10.0f", (sum.txPkts - last[p]) / secs);
+        last[p] = sum.txPkts;
+        printf("\n");
+    }
+    if (unrouted > 0) printf("%llu pkts dropped without a route\n", (unsigned long long) unrouted);
+    fflush(stdout);
+}
+
+/*******************
+ * Worker
+ *******************/
+
+static void* workerProc(void* arg) {
+    relay_worker* w = (relay_worker*) arg;
+    unsigned char* bufs = malloc((size_t) RELAY_BATCH * RELAY_PKT_MAX);
+    struct mmsghdr* tx = malloc(sizeof (struct mmsghdr) * RELAY_BATCH * RELAY_FANOUT_MAX);
+    unsigned int* txPeer = malloc(sizeof (unsigned int) * RELAY_BATCH * RELAY_FANOUT_MAX);
+    if ((bufs == NULL) || (tx == NULL) || (txPeer == NULL)) {
+        printf("Error: Worker buffers could not be allocated\n");
+        free(bufs);
+        free(tx);
+        free(txPeer);
+        return NULL;
+    }
+    struct mmsghdr rx[RELAY_BATCH];
+    struct iovec rxIov[RELAY_BATCH];
+    struct iovec txIov[RELAY_BATCH];
+    struct sockaddr_in src[RELAY_BATCH];
+    memset(rx, 0, sizeof (rx));
+    memset(tx, 0, sizeof (struct mmsghdr) * RELAY_BATCH * RELAY_FANOUT_MAX);
+    for (unsigned int i = 0; i < RELAY_BATCH; i++) {
+        rxIov[i].iov_base = bufs + (size_t) i * RELAY_PKT_MAX;
+        rxIov[i].iov_len = RELAY_PKT_MAX;
+        rx[i].msg_hdr.msg_iov = &rxIov[i];
+        rx[i].msg_hdr.msg_iovlen = 1;
+        rx[i].msg_hdr.msg_name = &src[i];
+    }
+
+    while (!stop) {
+        for (unsigned int i = 0; i < RELAY_BATCH; i++) rx[i].msg_hdr.msg_namelen = sizeof (src[i]);
+        // blocks for the first datagram only, the receive timeout lets the worker see stop
+        int n = recvmmsg(w->soc, rx, RELAY_BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0) continue;
+
+        // copies of the batch, all destinations of a datagram share its buffer
+        unsigned int txCount = 0;
+        for (int i = 0; i < n; i++) {
+            relay_route* r = findRoute(&src[i]);
+            if (r == NULL) {
+                count(&w->unrouted, 1);
+                continue;
+            }
+            relay_counters* c = &w->counters[r->src];
+            count(&c->rxPkts, 1);
+            count(&c->rxBytes, rx[i].msg_len);
+            txIov[i].iov_base = rxIov[i].iov_base;
+            txIov[i].iov_len = rx[i].msg_len;
+            for (unsigned int d = 0; d < r->dstCount; d++) {
+                struct msghdr* m = &tx[txCount].msg_hdr;
+                m->msg_iov = &txIov[i];
+                m->msg_iovlen = 1;
+                m->msg_name = &peers[r->dst[d]].addr;
+                m->msg_namelen = sizeof (struct sockaddr_in);
+                txPeer[txCount++] = r->dst[d];
+            }
+        }
+
+        // sendmmsg stops at the first copy that fails, count it and go on with the rest
+        for (unsigned int sent = 0; sent < txCount;) {
+            int res = sendmmsg(w->soc, tx + sent, txCount - sent, 0);
+            unsigned int done = (res > 0) ? (unsigned int) res : 0;
+            for (unsigned int i = sent; i < sent + done; i++) {
+                count(&w->counters[txPeer[i]].txPkts, 1);
+                count(&w->counters[txPeer[i]].txBytes, tx[i].msg_hdr.msg_iov->iov_len);
+            }
+            sent += done;
+            if ((res == 0) || ((res < 0) && (errno != EINTR))) count(&w->counters[txPeer[sent++]].txDrops, 1);
+        }
+    }
+    free(bufs);
+    free(tx);
+    free(txPeer);
+    return NULL;
+}
+
+static void onSignal(int sig) {
+    if (sig) stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    char* bindIp = NULL;
+    unsigned int port = 0;
+    unsigned int statsSecs = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:i:a:p:")) != -1) {
+        switch (opt) {
+            case 'w':
+                workerCount = atoi(optarg);
+                break;
+            case 'i':
+                statsSecs = atoi(optarg);
+                break;
+            case 'a':
+                bindIp = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            default: //force usage print
+                port = 0;
+                optind = argc;
+        }
+    }
+    bool ok = (port != 0) && (optind < argc) && (workerCount > 0) && (workerCount <= RELAY_WORKER_MAX);
+    for (int i = optind; ok && (i < argc); i++) {
+        if (parseRoute(argv[i], port) == false) {
+            printf("Error: Invalid route '%s'\n", argv[i]);
+            ok = false;
+        }
+    }
+    if (!ok) {
+        printf("Usage: %s [-w <workers>] [-i <stats interval secs>] [-a <bind ip>] -p <port> <route> [<route> ...]\n", argv[0]);
+        printf("route: <src ip[:port] or *>=<dst ip[:port]>[,<dst ip[:port]>...]  (up to %d routes, %d destinations each)\n",
+                RELAY_ROUTE_MAX, RELAY_FANOUT_MAX);
+        printf("workers: 1 to %d\n", RELAY_WORKER_MAX);
+        exit(1);
+    }
+
+    workers = calloc(workerCount, sizeof (relay_worker));
+    if (workers == NULL) {
+        printf("Error: Workers could not be allocated\n");
+        exit(1);
+    }
+    struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
+    int size = RX_RCVBUF;
+    for (unsigned int i = 0; i < workerCount; i++) {
+        workers[i].soc = udpInitShared(bindIp, port);
+        if (workers[i].soc == -1) exit(1);
+        setsockopt(workers[i].soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+        setsockopt(workers[i].soc, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+        setsockopt(workers[i].soc, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // workers inherit the blocked signals, the main thread is the one woken by them
+    sigset_t sigs, oldSigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldSigs);
+    for (unsigned int i = 0; i < workerCount; i++) {
+        if (pthread_create(&workers[i].thread, NULL, workerProc, &workers[i]) != 0) {
+            printf("Error: Worker %u could not be started\n", i);
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+    printf("Relaying port %u with %u workers, %u routes, %u peers\n", port, workerCount, routeCount, peerCount - 1);
+    fflush(stdout);
+
+    uint64_t last[RELAY_PEER_MAX] = {0};
+    uint64_t lastNs = monotonicNs();
+    while (!stop) {
+        // the signal interrupts the sleep
+        struct timespec ts = {.tv_sec = (statsSecs > 0) ? statsSecs : 3600, .tv_nsec = 0};
+        if ((nanosleep(&ts, NULL) == 0) && (statsSecs > 0)) {
+            uint64_t now = monotonicNs();
+            printStats(last, (now - lastNs) / 1e9);
+            lastNs = now;
+        }
+    }
+    for (unsigned int i = 0; i < workerCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].soc);
+    }
+    printStats(last, 0);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Relay forwarding benchmark
+ * Sender threads blast datagrams at the relay (unpaced sendmmsg bursts, each
+ * thread from its own socket so the relay workers share the senders) and one
+ * receiver per sink counts what comes out. Prints one row: offered and
+ * forwarded packet rates over the measured interval and the delivered share,
+ * computed as if every sink got a copy of every packet (the routes of the
+ * relay_bench.sh runs). Columns: senders, sinks, bytes, offered pkts/s,
+ * forwarded pkts/s, forwarded Mbit/s, delivered %.
+ *
+ * Start the relay first, routing the senders to the sinks, e.g.
+ *   ./relay -p 56000 '*'=127.0.5.1:56001 &
+ *   ./relay_bench 127.0.0.1:56000 127.0.5.1:56001
+ *
+ * Usage: ./relay_bench [-s <senders>] [-b <burst>] [-l <bytes>] [-t <secs>] <relay ip:port> <sink ip:port>...
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for recvmmsg, sendmmsg and getopt
+#include <getopt.h>
+#include <pthread.h>
+#include "common.h"
+
+#define BENCH_SENDERS_MAX 64
+#define BENCH_SINKS_MAX 8
+#define BENCH_BATCH 64          // datagrams per sendmmsg / recvmmsg call
+#define BENCH_WARMUP_MS 500     // not measured, the relay and socket buffers settle
+#define BENCH_DRAIN_MS 200      // receivers keep counting late packets of the interval
+
+typedef struct bench_thread {
+    pthread_t thread;
+    int soc;
+    uint64_t pkts;              // sent / received within the measured interval
+} bench_thread;
+
+static struct sockaddr_in relayAddr;
+static unsigned int pktLen = PKTLEN_DATA;
+static unsigned int burst = BENCH_BATCH;
+static volatile int phase = 0;  // 0 warm-up, 1 measured, 2 over, 3 receivers stop
+
+static bool parseAddr(char* str, struct sockaddr_in* addr) {
+    char ip[INET_ADDRSTRLEN];
+    char* colon = strchr(str, ':');
+    if ((colon == NULL) || (colon - str >= INET_ADDRSTRLEN)) return false;
+    memcpy(ip, str, colon - str);
+    ip[colon - str] = '\0';
+    return initHostStruct(addr, ip, atoi(colon + 1)) && (addr->sin_port != 0);
+}
+
+static void* senderProc(void* arg) {
+    bench_thread* t = (bench_thread*) arg;
+    unsigned char* pkt = calloc(1, pktLen);
+    if (pkt == NULL) return NULL;
+    struct iovec iov = {.iov_base = pkt, .iov_len = pktLen};
+    struct mmsghdr msgs[BENCH_BATCH];
+    memset(msgs, 0, sizeof (msgs));
+    for (unsigned int i = 0; i < burst; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &relayAddr;
+        msgs[i].msg_hdr.msg_namelen = sizeof (relayAddr);
+    }
+    while (__atomic_load_n(&phase, __ATOMIC_RELAXED) < 2) {
+        int n = sendmmsg(t->soc, msgs, burst, 0);
+        if ((n > 0) && (__atomic_load_n(&phase, __ATOMIC_RELAXED) == 1)) t->pkts += n;
+    }
+    free(pkt);
+    return NULL;
+}
+
+static void* sinkProc(void* arg) {
+    bench_thread* t = (bench_thread*) arg;
+    unsigned char* bufs = malloc((size_t) BENCH_BATCH * pktLen);
+    if (bufs == NULL) return NULL;
+    struct iovec iov[BENCH_BATCH];
+    struct mmsghdr msgs[BENCH_BATCH];
+    memset(msgs, 0, sizeof (msgs));
+    for (unsigned int i = 0; i < BENCH_BATCH; i++) {
+        iov[i].iov_base = bufs + (size_t) i * pktLen;
+        iov[i].iov_len = pktLen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (__atomic_load_n(&phase, __ATOMIC_RELAXED) < 3) {
+        int n = recvmmsg(t->soc, msgs, BENCH_BATCH, MSG_WAITFORONE, NULL);
+        int p = __atomic_load_n(&phase, __ATOMIC_RELAXED);
+        if ((n > 0) && ((p == 1) || (p == 2))) t->pkts += n;
+    }
+    free(bufs);
+    return NULL;
+}
+
+static void sleepMs(unsigned int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int senderCount = 1;
+    unsigned int secs = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:l:t:")) != -1) {
+        switch (opt) {
+            case 's':
+                senderCount = atoi(optarg);
+                break;
+            case 'b':
+                burst = atoi(optarg);
+                break;
+            case 'l':
+                pktLen = atoi(optarg);
+                break;
+            case 't':
+                secs = atoi(optarg);
+                break;
+            default: //force usage print
+                optind = argc;
+        }
+    }
+    unsigned int sinkCount = (optind + 1 < argc) ? argc - optind - 1 : 0;
+    bool ok = (sinkCount > 0) && (sinkCount <= BENCH_SINKS_MAX) && (senderCount > 0) && (senderCount <= BENCH_SENDERS_MAX) &&
+            (burst > 0) && (burst <= BENCH_BATCH) && (pktLen > 0) && (pktLen <= 65507) && (secs > 0) &&
+            parseAddr(argv[optind], &relayAddr);
+    if (!ok) {
+        printf("Usage: %s [-s <senders>] [-b <burst>] [-l <bytes>] [-t <secs>] <relay ip:port> <sink ip:port>...\n", argv[0]);
+        printf("up to %d senders, %d sinks, bursts of %d\n", BENCH_SENDERS_MAX, BENCH_SINKS_MAX, BENCH_BATCH);
+        exit(1);
+    }
+
+    bench_thread senders[BENCH_SENDERS_MAX];
+    bench_thread sinks[BENCH_SINKS_MAX];
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+    int size = RX_RCVBUF;
+    for (unsigned int i = 0; i < sinkCount; i++) {
+        struct sockaddr_in addr;
+        sinks[i].pkts = 0;
+        sinks[i].soc = parseAddr(argv[optind + 1 + i], &addr) ? socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP) : -1;
+        if ((sinks[i].soc == -1) || (bind(sinks[i].soc, (struct sockaddr*) &addr, sizeof (addr)) == -1)) {
+            printf("Error: Sink %s cannot be bound\n", argv[optind + 1 + i]);
+            exit(1);
+        }
+        setsockopt(sinks[i].soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+        setsockopt(sinks[i].soc, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+        pthread_create(&sinks[i].thread, NULL, sinkProc, &sinks[i]);
+    }
+    for (unsigned int i = 0; i < senderCount; i++) {
+        senders[i].pkts = 0;
+        senders[i].soc = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (senders[i].soc == -1) {
+            printf("Error: Sender socket could not be created\n");
+            exit(1);
+        }
+        pthread_create(&senders[i].thread, NULL, senderProc, &senders[i]);
+    }
+
+    sleepMs(BENCH_WARMUP_MS);
+    uint64_t start = monotonicNs();
+    __atomic_store_n(&phase, 1, __ATOMIC_RELAXED);
+    sleepMs(secs * 1000);
+    __atomic_store_n(&phase, 2, __ATOMIC_RELAXED);
+    double elapsed = (monotonicNs() - start) / 1e9;
+    for (unsigned int i = 0; i < senderCount; i++) pthread_join(senders[i].thread, NULL);
+    sleepMs(BENCH_DRAIN_MS);
+    __atomic_store_n(&phase, 3, __ATOMIC_RELAXED);
+
+    uint64_t sent = 0, recvd = 0;
+    for (unsigned int i = 0; i < senderCount; i++) sent += senders[i].pkts;
+    for (unsigned int i = 0; i < sinkCount; i++) {
+        pthread_join(sinks[i].thread, NULL);
+        recvd += sinks[i].pkts;
+    }
+    printf("%8u %6u %6u %12.0f %12.0f %10.1f %9.1f%%\n", senderCount, sinkCount, pktLen, sent / elapsed, recvd / elapsed,
+            recvd * pktLen * 8 / elapsed / 1e6, (sent > 0) ? 100.0 * recvd / ((double) sent * sinkCount) : 0);
+    return 0;
+}
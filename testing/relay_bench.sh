@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Relay forwarding test: packets/s the relay forwards on loopback vs. number
+# of relay workers (-w), 1:1 and fanned out to two sinks. The first row sends
+# straight to the sink, the ceiling of the load generator on this box.
+# To be run from the testing directory after make
+# usage: ./relay_bench.sh [worker counts...]   (default 1 2 4)
+# env: SENDERS = sender threads (4), SECS = measured secs per row (5),
+#      BYTES = datagram size (PKTLEN_DATA)
+
+workers=${@:-1 2 4}
+senders=${SENDERS:-4}
+secs=${SECS:-5}
+bytes=${BYTES:+-l $BYTES}
+port=56000
+sink1=127.0.5.1:$((port + 1))
+sink2=127.0.5.2:$((port + 1))
+
+echo "cpus: $(nproc), senders: $senders"
+printf "%-12s %8s %6s %6s %12s %12s %10s %10s\n" route senders sinks bytes "offered/s" "forwarded/s" "Mbit/s" delivered
+printf "%-12s " direct
+./relay_bench -s $senders -t $secs $bytes $sink1 $sink1
+for w in $workers; do
+  for fanout in 1 2; do
+    sinks=$sink1
+    [ $fanout -eq 2 ] && sinks="$sink1 $sink2"
+    ./relay -w $w -p $port "*=${sinks// /,}" > /dev/null &
+    relay=$!
+    sleep 0.3
+    printf "%-12s " "w=$w 1:$fanout"
+    ./relay_bench -s $senders -t $secs $bytes 127.0.0.1:$port $sinks
+    kill -INT $relay
+    wait $relay 2> /dev/null
+  done
+done
@@ -1,81 +1,621 @@
 /*
- * UDP Repeater
- * Forwards traffic from nodes a and b to node c, any packets recieved from
- * c will be duplicated and sent back to both a and b
- * all traffic uses same designated port
- * a      b
- *  \    /
- *   \  /
- *    me
- *    |
- *    |
- *    c
- * JLV - 10/30/14
+ * UDP Repeater / network impairment relay
+ * Relays the streaming flows between the client and the servers through
+ * emulated links, so the four server topology of the GENI slice (access links
+ * joining shared bottlenecks) runs on one box. A profile describes the flows
+ * and the links:
+ *
+ *   flow <name> <listen ip:port> <target ip:port>
+ *       the client sends to the listen address, the relay forwards to the
+ *       target (a server) and relays the answers back to the client
+ *   group <name>
+ *       shared link, e.g. the bottleneck several access links meet at
+ *   join <flow> <group> [<group> ...]
+ *       groups on the path of the flow, from the server side to the client
+ *   impair <flow|group|*> <up|down|both> [key=value ...]
+ *       rate=<kbit/s> queue=<pkts> delay=<ms> jitter=<ms> loss=<%>
+ *       ge=<p%>,<r%>[,<good loss%>,<bad loss%>] reorder=<%>
+ *       down is server -> client, * applies to the flows defined so far
+ *   include <file>
+ *       relative to the directory of the including profile
+ *   seed <n>
+ *
+ * Each link serializes packets at its rate behind a drop-tail queue of queue
+ * packets, then adds the delay (+-jitter, packet order kept), loses packets
+ * (Bernoulli loss and/or a Gilbert-Elliott good/bad chain with transition
+ * probabilities p and r) and sends reorder % of them without the delay, ahead
+ * of the queued ones (like netem). Packets cross the flow link and then its
+ * groups going down, the reverse going up. Ctrl-C prints the link counters.
+ *
+ * Usage: ./repeater [-i <stats interval secs>] [-s <seed>] <profile>
+ *
+ * Plain forwarding without impairments (the original a, b <-> c repeater)
+ * is done by relay.c: ./relay -p <port> <c>=<a>,<b> '*'=<c>
+ *
+ * JLV & JB
  */
 
+#define _GNU_SOURCE // for getopt, strtok_r and sigaction
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <signal.h>
 #include "common.h"
 
-int main(int argc, char *argv[]) {
-	if (argc!=5) {
-		printf("Usage: %s this-port a-ip b-ip c-ip\n",argv[0]);
-		printf("Note - uses same port for all connected nodes, see below for configuration\n");
-		printf("     <node a>      <node b>\n");
-		printf("       \\              /\n");
-		printf("        \\            /\n");
-		printf("         \\          /\n");
-		printf("          \\        /\n");
-		printf("          <this node>\n");
-		printf("               |\n");
-		printf("               |\n");
-		printf("               |\n");
-		printf("           <node c>\n");
-		exit(1);
-	}
-
-	int os=socket(PF_INET,SOCK_DGRAM,IPPROTO_IP);
-
-	struct sockaddr_in a;
-	a.sin_family=AF_INET;
-	a.sin_addr.s_addr=inet_addr(argv[2]);
-	a.sin_port=htons(atoi(argv[1]));
-
-	struct sockaddr_in b;
-	b.sin_family=AF_INET;
-	b.sin_addr.s_addr=inet_addr(argv[3]);
-	b.sin_port=htons(atoi(argv[1]));
-
-	struct sockaddr_in c;
-	c.sin_family=AF_INET;
-	c.sin_port=htons(atoi(argv[1]));
-
-	if(bind(os,(struct sockaddr *)&c,sizeof(c)) == -1) {
-		printf("Can't bind port (%s)\n", argv[1]);
-		exit(1); 
-	}
-
-	c.sin_addr.s_addr=inet_addr(argv[4]); 
-	c.sin_port=htons(atoi(argv[1])); 
-	dprintf("TARGET ID: %i\n Starting repeater...\n",(int)c.sin_addr.s_addr);
-
-	struct sockaddr_in sa;
-	while(1) {
-		char buf[65535]; //TODO reduce to appropriate size
-		socklen_t sn=sizeof(sa);
-
-		//read udp packet
-		int n=recvfrom(os,buf,sizeof(buf),0,(struct sockaddr *)&sa,&sn);
-		if(n<=0) continue;
-
-		//send udp packet
-		if (sa.sin_addr.s_addr==c.sin_addr.s_addr) {
-			dprintf("REVERSE: %s from %i\n",buf,(int)sa.sin_addr.s_addr);
-			sendto(os,buf,n,0,(struct sockaddr *)&a,sizeof(a)); 
-			sendto(os,buf,n,0,(struct sockaddr *)&b,sizeof(b)); 
-		} else {  
-			dprintf("FORWARD: %s from %i\n",buf,(int)sa.sin_addr.s_addr);
-			sendto(os,buf,n,0,(struct sockaddr *)&c,sizeof(c)); 
-		}
-	}
+#define RELAY_FLOW_MAX ((EV_MAX_HANDLERS - 2) / 2) // two sockets per flow, release and stats timers
+#define RELAY_GROUP_MAX 16
+#define RELAY_HOPS_MAX 4        // groups joined by one flow
+#define RELAY_QUEUE_MAX 65536   // longest link queue (pkts)
+#define RELAY_PKT_MAX 65536     // largest relayed datagram
+#define RELAY_HEAP_MAX (1 << 20) // packets in flight in the whole relay
+#define RELAY_NAME_LEN 32
+#define RELAY_INCLUDE_DEPTH 8
+#define RELAY_WIRE_OVERHEAD 28  // IP + UDP header bytes counted against the rate
+
+#define RELAY_UP 0              // client -> server
+#define RELAY_DOWN 1            // server -> client
+
+/* Packet counters of one link */
+typedef struct relay_stats {
+    uint64_t pkts;              // packets entering the link
+    uint64_t bytes;
+    uint64_t drops;             // queue overflows
+    uint64_t losses;            // random losses
+    uint64_t reordered;         // sent ahead of the delay
+    unsigned int maxQueue;      // longest queue seen (pkts)
+} relay_stats;
+
+/* One direction of a flow or group */
+typedef struct relay_link {
+    unsigned int kbps;          // 0 = unlimited
+    unsigned int queue;         // queue limit (pkts)
+    uint64_t delayNs;
+    uint64_t jitterNs;          // delay varies uniformly by +-jitter
+    double loss;                // Bernoulli loss probability
+    double geP;                 // Gilbert-Elliott good -> bad probability, 0 = off
+    double geR;                 // bad -> good probability
+    double geGoodLoss;
+    double geBadLoss;
+    bool geBad;                 // chain state
+    double reorder;
+    uint64_t busyNs;            // end of the serialization of the last queued packet
+    uint64_t* departs;          // serialization ends of the queued packets (ring of queue entries)
+    unsigned int qHead;
+    unsigned int qCount;
+    uint64_t lastOutNs;         // release of the last in-order packet
+    relay_stats stats;
+} relay_link;
+
+/* Named pair of links, a flow or a group */
+typedef struct relay_node {
+    char name[RELAY_NAME_LEN];
+    relay_link dir[2];
+} relay_node;
+
+/* Client <-> server flow */
+typedef struct relay_flow {
+    relay_node node;
+    struct sockaddr_in listen;  // address the client sends to
+    struct sockaddr_in target;  // server
+    struct sockaddr_in peer;    // client, learned from its first packet
+    bool hasPeer;
+    int front;                  // socket bound to listen
+    int back;                   // socket towards the target
+    unsigned int hops[RELAY_HOPS_MAX]; // joined groups, server side first
+    unsigned int hopCount;
+} relay_flow;
+
+/* Packet in flight, waits in the heap until it reaches the next hop */
+typedef struct relay_pkt {
+    uint64_t t;                 // time it leaves the current hop
+    uint64_t order;             // arrival order, breaks ties
+    uint8_t flow;
+    uint8_t dir;
+    uint8_t hop;                // links already crossed
+    uint16_t len;
+    unsigned char data[];
+} relay_pkt;
+
+static relay_flow flows[RELAY_FLOW_MAX];
+static unsigned int flowCount = 0;
+static relay_node groups[RELAY_GROUP_MAX];
+static unsigned int groupCount = 0;
+static uint64_t rng = 1;
+
+static relay_pkt** heap = NULL;
+static unsigned int heapCount = 0;
+static uint64_t pktOrder = 0;
+
+static ev_loop loop;
+static int releaseTimer = -1;
+static volatile sig_atomic_t stopped = 0;
+
+/*******************
+ * Helper functions
+ *******************/
+
+/* xorshift64*, uniform in [0, 1) */
+static double uniform(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (double) ((rng * 2685821657736338717ULL) >> 11) / (double) (1ULL << 53);
+}
+
+static void initLink(relay_link* l) {
+    memset(l, 0, sizeof (*l));
+    l->queue = 1000;
 }
 
+static relay_link* pathLink(relay_flow* f, unsigned int dir, unsigned int hop) {
+    if (dir == RELAY_DOWN) {
+        return (hop == 0) ? &f->node.dir[dir] : &groups[f->hops[hop - 1]].dir[dir];
+    }
+    return (hop == f->hopCount) ? &f->node.dir[dir] : &groups[f->hops[f->hopCount - 1 - hop]].dir[dir];
+}
+
+/*
+ * linkPass
+ *
+ * Pass a packet entering the link at t
+ *
+ * Return value: time the packet leaves the link, 0 if dropped or lost
+ */
+static uint64_t linkPass(relay_link* l, uint64_t t, unsigned int len) {
+    l->stats.pkts++;
+    l->stats.bytes += len;
 
+    // queue: forget the packets serialized by now
+    while ((l->qCount > 0) && (l->departs[l->qHead] <= t)) {
+        l->qHead = (l->qHead + 1) % l->queue;
+        l->qCount--;
+    }
+    uint64_t done = t;
+    if (l->kbps > 0) {
+        if (l->qCount >= l->queue) {
+            l->stats.drops++;
+            return 0;
+        }
+        done = ((l->busyNs > t) ? l->busyNs : t) + (uint64_t) (len + RELAY_WIRE_OVERHEAD) * 8000000ULL / l->kbps;
+        l->busyNs = done;
+        l->departs[(l->qHead + l->qCount) % l->queue] = done;
+        l->qCount++;
+        if (l->qCount > l->stats.maxQueue) l->stats.maxQueue = l->qCount;
+    }
+
+    bool lost = false;
+    if (l->geP > 0) {
+        l->geBad = l->geBad ? (uniform() >= l->geR) : (uniform() < l->geP);
+        lost = (uniform() < (l->geBad ? l->geBadLoss : l->geGoodLoss));
+    }
+    if ((l->loss > 0) && (uniform() < l->loss)) lost = true;
+    if (lost) {
+        l->stats.losses++;
+        return 0;
+    }
+
+    if ((l->reorder > 0) && (uniform() < l->reorder)) {
+        l->stats.reordered++;
+        return done;
+    }
+    uint64_t out = done + l->delayNs;
+    if (l->jitterNs > 0) {
+        int64_t j = (int64_t) ((2 * uniform() - 1) * (double) l->jitterNs);
+        out = ((j < 0) && ((uint64_t) -j > out - done)) ? done : out + j;
+    }
+    if (out < l->lastOutNs) out = l->lastOutNs; // jitter does not reorder
+    l->lastOutNs = out;
+    return out;
+}
+
+static bool heapLess(relay_pkt* a, relay_pkt* b) {
+    return (a->t < b->t) || ((a->t == b->t) && (a->order < b->order));
+}
+
+static void heapPush(relay_pkt* p) {
+    unsigned int i = heapCount++;
+    while (i > 0) {
+        unsigned int parent = (i - 1) / 2;
+        if (!heapLess(p, heap[parent])) break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = p;
+}
+
+static relay_pkt* heapPop(void) {
+    relay_pkt* top = heap[0];
+    relay_pkt* last = heap[--heapCount];
+    unsigned int i = 0;
+    while (true) {
+        unsigned int c = 2 * i + 1;
+        if (c >= heapCount) break;
+        if ((c + 1 < heapCount) && heapLess(heap[c + 1], heap[c])) c++;
+        if (!heapLess(heap[c], last)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (heapCount > 0) heap[i] = last;
+    return top;
+}
+
+/* Arm the release timer for the earliest packet in flight */
+static void armRelease(void) {
+    if (heapCount == 0) {
+        evSetTimer(releaseTimer, 0, 0);
+        return;
+    }
+    uint64_t now = monotonicNs();
+    evSetTimer(releaseTimer, (heap[0]->t > now) ? heap[0]->t - now : 1, 0);
+}
+
+/* Pass the packet through its next link and queue it until it leaves */
+static void advance(relay_pkt* p) {
+    relay_flow* f = &flows[p->flow];
+    uint64_t out = linkPass(pathLink(f, p->dir, p->hop), p->t, p->len);
+    if ((out == 0) || (heapCount == RELAY_HEAP_MAX)) {
+        free(p);
+        return;
+    }
+    p->t = out;
+    p->hop++;
+    heapPush(p);
+}
+
+static void deliver(relay_pkt* p) {
+    relay_flow* f = &flows[p->flow];
+    if (p->dir == RELAY_UP) {
+        sendto(f->back, p->data, p->len, 0, (struct sockaddr*) &f->target, sizeof (f->target));
+    } else if (f->hasPeer) {
+        sendto(f->front, p->data, p->len, 0, (struct sockaddr*) &f->peer, sizeof (f->peer));
+    }
+    free(p);
+}
+
+static void printStats(void) {
+    printf("%-12s %-4s %10s %10s %8s %8s %8s %6s\n", "link", "dir", "pkts", "kB", "drops", "lost", "reord", "maxq");
+    for (unsigned int i = 0; i < flowCount + groupCount; i++) {
+        relay_node* n = (i < flowCount) ? &flows[i].node : &groups[i - flowCount];
+        for (unsigned int d = 0; d < 2; d++) {
+            relay_stats* s = &n->dir[d].stats;
+            printf("%-12s %-4s %10llu %10llu %8llu %8llu %8llu %6u\n", n->name, (d == RELAY_UP) ? "up" : "down",
+                    (unsigned long long) s->pkts, (unsigned long long) (s->bytes / 1000),
+                    (unsigned long long) s->drops, (unsigned long long) s->losses,
+                    (unsigned long long) s->reordered, s->maxQueue);
+        }
+    }
+    fflush(stdout);
+}
+
+/*******************
+ * Event loop callbacks
+ *******************/
+
+static void rxPackets(relay_flow* f, int fd, unsigned int dir) {
+    unsigned char buf[RELAY_PKT_MAX];
+    while (true) {
+        struct sockaddr_in src;
+        socklen_t srcLen = sizeof (src);
+        ssize_t n = recvfrom(fd, buf, sizeof (buf), 0, (struct sockaddr*) &src, &srcLen);
+        if (n < 0) break;
+        if (dir == RELAY_UP) {
+            f->peer = src;
+            f->hasPeer = true;
+        } else if (f->hasPeer == false) {
+            continue;
+        }
+        relay_pkt* p = malloc(sizeof (relay_pkt) + n);
+        if (p == NULL) break;
+        p->t = monotonicNs();
+        p->order = pktOrder++;
+        p->flow = f - flows;
+        p->dir = dir;
+        p->hop = 0;
+        p->len = n;
+        memcpy(p->data, buf, n);
+        advance(p);
+    }
+    armRelease();
+}
+
+static void onFront(int fd, void* arg) {
+    rxPackets(arg, fd, RELAY_UP);
+}
+
+static void onBack(int fd, void* arg) {
+    rxPackets(arg, fd, RELAY_DOWN);
+}
+
+static void onRelease(int fd, void* arg) {
+    if (fd || arg) arg = NULL; // dummy arg usage
+    uint64_t now = monotonicNs();
+    while ((heapCount > 0) && (heap[0]->t <= now)) {
+        relay_pkt* p = heapPop();
+        if (p->hop == flows[p->flow].hopCount + 1) {
+            deliver(p);
+        } else {
+            advance(p);
+        }
+    }
+    armRelease();
+}
+
+static void onStats(int fd, void* arg) {
+    if (fd || arg) arg = NULL; // dummy arg usage
+    printStats();
+}
+
+static void onSignal(int sig) {
+    if (sig) stopped = 1;
+    evStop(&loop);
+}
+
+/*******************
+ * Profile parsing
+ *******************/
+
+static bool parseAddr(char* str, struct sockaddr_in* addr) {
+    char ip[INET_ADDRSTRLEN];
+    char* colon = strrchr(str, ':');
+    if ((colon == NULL) || (colon - str >= INET_ADDRSTRLEN)) return false;
+    memcpy(ip, str, colon - str);
+    ip[colon - str] = '\0';
+    return initHostStruct(addr, ip, atoi(colon + 1)) && (addr->sin_port != 0);
+}
+
+static relay_node* findNode(char* name, bool groupsOnly) {
+    if (groupsOnly == false) {
+        for (unsigned int i = 0; i < flowCount; i++) {
+            if (strcmp(flows[i].node.name, name) == 0) return &flows[i].node;
+        }
+    }
+    for (unsigned int i = 0; i < groupCount; i++) {
+        if (strcmp(groups[i].name, name) == 0) return &groups[i];
+    }
+    return NULL;
+}
+
+/* Apply one key=value to a link, percentages become probabilities */
+static bool setImpair(relay_link* l, char* key, char* val) {
+    double v = atof(val);
+    if (strcmp(key, "rate") == 0) {
+        l->kbps = (unsigned int) v;
+    } else if (strcmp(key, "queue") == 0) {
+        if ((v < 1) || (v > RELAY_QUEUE_MAX)) return false;
+        l->queue = (unsigned int) v;
+    } else if (strcmp(key, "delay") == 0) {
+        l->delayNs = (uint64_t) (v * 1000000);
+    } else if (strcmp(key, "jitter") == 0) {
+        l->jitterNs = (uint64_t) (v * 1000000);
+    } else if (strcmp(key, "loss") == 0) {
+        l->loss = v / 100;
+    } else if (strcmp(key, "reorder") == 0) {
+        l->reorder = v / 100;
+    } else if (strcmp(key, "ge") == 0) {
+        double ge[4] = {0, 0, 0, 100};
+        char* save;
+        char* tok = strtok_r(val, ",", &save);
+        unsigned int n = 0;
+        for (; (tok != NULL) && (n < 4); n++, tok = strtok_r(NULL, ",", &save)) ge[n] = atof(tok);
+        if (n < 2) return false;
+        l->geP = ge[0] / 100;
+        l->geR = ge[1] / 100;
+        l->geGoodLoss = ge[2] / 100;
+        l->geBadLoss = ge[3] / 100;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool loadProfile(char* path, unsigned int depth) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("Error: Cannot open profile %s\n", path);
+        return false;
+    }
+    char pathCopy[PATH_MAX];
+    snprintf(pathCopy, sizeof (pathCopy), "%s", path);
+    char* dir = dirname(pathCopy);
+
+    char line[512];
+    unsigned int lineNo = 0;
+    bool ok = true;
+    while (ok && (fgets(line, sizeof (line), fp) != NULL)) {
+        lineNo++;
+        char* hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+        char* args[16];
+        unsigned int argc = 0;
+        char* save;
+        for (char* tok = strtok_r(line, " \t\r\n", &save); (tok != NULL) && (argc < 16); tok = strtok_r(NULL, " \t\r\n", &save)) {
+            args[argc++] = tok;
+        }
+        if (argc == 0) continue;
+
+        if ((strcmp(args[0], "flow") == 0) && (argc == 4)) {
+            if (flowCount == RELAY_FLOW_MAX) {
+                printf("Error: %s:%u: More than %d flows\n", path, lineNo, RELAY_FLOW_MAX);
+                ok = false;
+                break;
+            }
+            relay_flow* f = &flows[flowCount];
+            memset(f, 0, sizeof (*f));
+            snprintf(f->node.name, RELAY_NAME_LEN, "%s", args[1]);
+            initLink(&f->node.dir[RELAY_UP]);
+            initLink(&f->node.dir[RELAY_DOWN]);
+            ok = parseAddr(args[2], &f->listen) && parseAddr(args[3], &f->target);
+            if (ok) flowCount++;
+        } else if ((strcmp(args[0], "group") == 0) && (argc == 2)) {
+            if (groupCount == RELAY_GROUP_MAX) {
+                printf("Error: %s:%u: More than %d groups\n", path, lineNo, RELAY_GROUP_MAX);
+                ok = false;
+                break;
+            }
+            relay_node* g = &groups[groupCount++];
+            snprintf(g->name, RELAY_NAME_LEN, "%s", args[1]);
+            initLink(&g->dir[RELAY_UP]);
+            initLink(&g->dir[RELAY_DOWN]);
+        } else if ((strcmp(args[0], "join") == 0) && (argc >= 3)) {
+            relay_node* n = findNode(args[1], false);
+            ok = (n != NULL) && ((relay_flow*) n < flows + flowCount) && (argc - 2 <= RELAY_HOPS_MAX);
+            for (unsigned int i = 2; ok && (i < argc); i++) {
+                relay_node* g = findNode(args[i], true);
+                if (g == NULL) ok = false;
+                else flows[(relay_flow*) n - flows].hops[i - 2] = g - groups;
+            }
+            if (ok) ((relay_flow*) n)->hopCount = argc - 2;
+        } else if ((strcmp(args[0], "impair") == 0) && (argc >= 3)) {
+            unsigned int dirs = (strcmp(args[2], "up") == 0) ? 1 : (strcmp(args[2], "down") == 0) ? 2 :
+                    (strcmp(args[2], "both") == 0) ? 3 : 0;
+            bool all = (strcmp(args[1], "*") == 0);
+            relay_node* target = all ? NULL : findNode(args[1], false);
+            ok = (dirs != 0) && (all || (target != NULL));
+            for (unsigned int i = 3; ok && (i < argc); i++) {
+                char* eq = strchr(args[i], '=');
+                if (eq == NULL) {
+                    ok = false;
+                    break;
+                }
+                *eq = '\0';
+                for (unsigned int n = 0; ok && (n < (all ? flowCount : 1)); n++) {
+                    relay_node* node = all ? &flows[n].node : target;
+                    for (unsigned int d = 0; ok && (d < 2); d++) {
+                        char val[64];
+                        snprintf(val, sizeof (val), "%s", eq + 1); // ge is tokenized in place
+                        if (dirs & (1 << d)) ok = setImpair(&node->dir[d], args[i], val);
+                    }
+                }
+            }
+        } else if ((strcmp(args[0], "include") == 0) && (argc == 2)) {
+            char inc[PATH_MAX];
+            if (args[1][0] == '/') snprintf(inc, sizeof (inc), "%s", args[1]);
+            else snprintf(inc, sizeof (inc), "%s/%s", dir, args[1]);
+            if (depth == RELAY_INCLUDE_DEPTH) {
+                printf("Error: %s:%u: Includes nested too deep\n", path, lineNo);
+                ok = false;
+                break;
+            }
+            if (loadProfile(inc, depth + 1) == false) {
+                fclose(fp);
+                return false;
+            }
+        } else if ((strcmp(args[0], "seed") == 0) && (argc == 2)) {
+            rng = strtoull(args[1], NULL, 10) | 1;
+        } else {
+            ok = false;
+        }
+        if (ok == false) printf("Error: %s:%u: Invalid %s directive\n", path, lineNo, args[0]);
+    }
+    fclose(fp);
+    return ok;
+}
+
+static int relaySocket(struct sockaddr_in* local) {
+    int soc = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (soc == -1) return -1;
+    int size = RX_RCVBUF;
+    setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+    setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+    if (((local != NULL) && (bind(soc, (struct sockaddr*) local, sizeof (*local)) == -1))
+            || (fcntl(soc, F_SETFL, O_NONBLOCK) == -1)) {
+        close(soc);
+        return -1;
+    }
+    return soc;
+}
+
+/* Impaired relay of the flows of a profile */
+static int relay(char* profile, unsigned int statsSecs, bool seedSet, uint64_t seed) {
+    if (loadProfile(profile, 0) == false) return 1;
+    if (seedSet) rng = seed | 1;
+    if (flowCount == 0) {
+        printf("Error: No flow in %s\n", profile);
+        return 1;
+    }
+    heap = malloc(RELAY_HEAP_MAX * sizeof (relay_pkt*));
+    if ((heap == NULL) || (evInit(&loop) == false)) {
+        printf("Error: Relay could not be initialized\n");
+        return 1;
+    }
+    for (unsigned int i = 0; i < flowCount + groupCount; i++) {
+        relay_node* n = (i < flowCount) ? &flows[i].node : &groups[i - flowCount];
+        for (unsigned int d = 0; d < 2; d++) {
+            n->dir[d].departs = malloc(n->dir[d].queue * sizeof (uint64_t));
+            if (n->dir[d].departs == NULL) {
+                printf("Error: Relay could not be initialized\n");
+                return 1;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < flowCount; i++) {
+        relay_flow* f = &flows[i];
+        char listen[INET_ADDRSTRLEN], target[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &f->listen.sin_addr, listen, sizeof (listen));
+        inet_ntop(AF_INET, &f->target.sin_addr, target, sizeof (target));
+        f->front = relaySocket(&f->listen);
+        f->back = relaySocket(NULL);
+        if ((f->front == -1) || (f->back == -1)) {
+            printf("Error: Flow %s cannot bind %s:%u\n", f->node.name, listen, ntohs(f->listen.sin_port));
+            return 1;
+        }
+        if ((evAddFd(&loop, f->front, onFront, f) == false) || (evAddFd(&loop, f->back, onBack, f) == false)) {
+            printf("Error: Flow %s could not be added to the event loop\n", f->node.name);
+            return 1;
+        }
+        printf("%s: %s:%u -> %s:%u", f->node.name, listen, ntohs(f->listen.sin_port), target, ntohs(f->target.sin_port));
+        for (unsigned int h = 0; h < f->hopCount; h++) printf(" %s %s", (h == 0) ? "via" : "->", groups[f->hops[h]].name);
+        printf("\n");
+    }
+    releaseTimer = evAddTimer(&loop, onRelease, NULL);
+    if (releaseTimer == -1) {
+        printf("Error: Release timer could not be created\n");
+        return 1;
+    }
+    if (statsSecs > 0) {
+        int statsTimer = evAddTimer(&loop, onStats, NULL);
+        if ((statsTimer == -1) || (evSetTimer(statsTimer, statsSecs * 1000000000ULL, statsSecs * 1000000000ULL) == false)) {
+            printf("Warning: Stats timer could not be created\n");
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Relaying %u flows through %u groups...\n", flowCount, groupCount);
+    fflush(stdout);
+    bool res = evRun(&loop);
+    printStats();
+    evClose(&loop);
+    return (res || stopped) ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int statsSecs = 0;
+    bool seedSet = false;
+    uint64_t seed = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:s:")) != -1) {
+        switch (opt) {
+            case 'i':
+                statsSecs = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                seedSet = true;
+                break;
+            default: //force usage print
+                optind = argc;
+        }
+    }
+    if (optind != argc - 1) {
+        printf("Usage: %s [-i <stats interval secs>] [-s <seed>] <profile>\n", argv[0]);
+        printf("Note - plain forwarding (the former a, b <-> c repeater) is done by ./relay\n");
+        exit(1);
+    }
+    return relay(argv[optind], statsSecs, seedSet, seed);
+}
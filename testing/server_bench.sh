@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Server scaling test: aggregate goodput of one client streaming a file from
+# N servers on loopback. Server i is bound to 127.0.0.(i+2) (-a), the client
+# gets all N addresses. Goodput is computed from the client graph data file:
+# unique data packets received x payload size / time of the last packet.
+# To be run from the testing directory after make in final_project
+# usage: ./server_bench.sh [server counts...]   (default 1 2 4 8 16 32)
+# env: FILE = streamed file in the repository root (pic.bmp),
+#      SERVER_OPTS = extra server options, TIMEOUT = client time limit (120 s)
+
+counts=${@:-1 2 4 8 16 32}
+file=${FILE:-pic.bmp}
+opts=${SERVER_OPTS:-}
+limit=${TIMEOUT:-120}
+bin=$(cd ../final_project && pwd)
+root=$(cd .. && pwd)
+datalen=1024
+
+echo "file: $file ($(stat -c %s $root/$file) bytes)"
+printf "%8s %8s %10s %10s %12s\n" servers "pkts" "time [s]" "kB/s" "kB/s/server"
+for n in $counts; do
+  servers=""
+  addrs=""
+  for i in $(seq 0 $((n - 1))); do
+    # servers look for the streamed files in their working directory
+    (cd $root && exec $bin/server $opts -a 127.0.0.$((i + 2)) $i > /dev/null 2>&1) &
+    servers="$servers $!"
+    addrs="$addrs 127.0.0.$((i + 2))"
+  done
+  sleep 0.5
+
+  dir=$(mktemp -d)
+  (cd $dir && timeout $limit $bin/client $addrs $file > client.log 2>&1)
+  status=$?
+
+  # graph data file lines: <ms since the request> <seq>
+  awk -v n=$n -v len=$datalen -v st=$status '
+    !seen[$2]++ { pkts++ } $1 > last { last = $1 }
+    END {
+      secs = last / 1000
+      kbs = (secs > 0) ? pkts * len / 1000 / secs : 0
+      printf "%8u %8u %10.2f %10.1f %12.1f%s\n", n, pkts, secs, kbs, kbs / n, (st == 0) ? "" : "  (client failed)"
+    }' $dir/graph_datafile
+  rm -rf $dir
+  kill $servers 2> /dev/null
+  wait $servers 2> /dev/null
+done
@@ -0,0 +1,195 @@
+/*
+ * Server session benchmark
+ * Opens a growing number of concurrent streaming sessions against one server
+ * and reports the aggregate throughput and the server memory per session.
+ * Every session is a separate socket requesting TEST_FILE (generated content,
+ * the server sends its splice share of EMPTY_PKT_COUNT packets).
+ *
+ * Start the server first (e.g. ./server -b 8 0) and pass its pid to get the
+ * memory numbers (session counts in increasing order):
+ *   ./session_bench -p $(pgrep -x server) 1 10 100 500
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for recvmmsg
+#include "common.h"
+
+#define BENCH_BATCH 64          // packets read per recvmmsg call
+#define BENCH_IDLE_MS 2000      // the run ends after this long without data
+#define BENCH_RCVBUF (4 << 20)  // receive buffer of every session socket
+#define BENCH_CTRL_GROUP 32     // control packets sent back to back, the server socket buffer is small
+#define BENCH_RETRY_MS 200      // request retransmission period
+
+/* One benchmark client */
+typedef struct bench_session {
+    int soc;
+    bool acked;                 // REQACK received
+    bool done;                  // FIN received
+    uint64_t pkts;              // data packets received
+    uint64_t first, last;       // time of the first and last data packet (ns)
+} bench_session;
+
+static struct sockaddr_in server;
+static unsigned int serverName = 0;
+static unsigned int rate = 1000000;
+static int serverPid = 0;
+static long rssBase = 0; //server peak memory before the first run (kB)
+
+/* peak resident memory of the server (kB), 0 if unknown */
+long serverRss(void) {
+    char path[64], line[128];
+    long rss = 0;
+    if (serverPid == 0) return 0;
+    snprintf(path, sizeof (path), "/proc/%d/status", serverPid);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof (line), f) != NULL) {
+        if (sscanf(line, "VmHWM: %ld kB", &rss) == 1) break;
+    }
+    fclose(f);
+    return rss;
+}
+
+void sendAll(bench_session* ss, unsigned int n, uint8_t type, uint32_t seq, char* payload) {
+    unsigned char pkt[PKTLEN_MSG];
+    unsigned int len = (payload != NULL) ? strlen(payload) + 1 : 0;
+    fillpkt(pkt, ID_CLIENT, serverName, type, seq, (unsigned char*) payload, len);
+    unsigned int sent = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        if ((type == TYPE_REQ) && ss[i].acked) continue;
+        sendto(ss[i].soc, pkt, PKTLEN_MSG, 0, (struct sockaddr*) &server, sizeof (server));
+        if (++sent % BENCH_CTRL_GROUP == 0) usleep(1000);
+    }
+}
+
+/* receive on all sessions until every one got FIN (or REQACK when handshake is set) */
+void receiveAll(int ep, bench_session* ss, unsigned int n, bool handshake) {
+    static unsigned char bufs[BENCH_BATCH][PKTLEN_DATA];
+    struct iovec iovs[BENCH_BATCH];
+    struct mmsghdr msgs[BENCH_BATCH];
+    struct epoll_event evs[EV_MAX_EVENTS];
+    unsigned int left = n;
+    uint64_t retry = monotonicNs() + BENCH_RETRY_MS * 1000000ULL;
+
+    for (unsigned int i = 0; i < BENCH_BATCH; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = PKTLEN_DATA;
+    }
+    while (left > 0) {
+        int nev = epoll_wait(ep, evs, EV_MAX_EVENTS, handshake ? BENCH_RETRY_MS : BENCH_IDLE_MS);
+        if ((nev <= 0) && !handshake) break; //server stopped sending
+        uint64_t now = monotonicNs();
+        if (handshake && (now > retry)) {
+            sendAll(ss, n, TYPE_REQ, 0, TEST_FILE); //request or ack lost
+            retry = now + BENCH_RETRY_MS * 1000000ULL;
+        }
+        for (int e = 0; e < nev; e++) {
+            bench_session* s = (bench_session*) evs[e].data.ptr;
+            memset(msgs, 0, sizeof (msgs));
+            for (unsigned int i = 0; i < BENCH_BATCH; i++) {
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int res = recvmmsg(s->soc, msgs, BENCH_BATCH, MSG_DONTWAIT, NULL);
+            for (int i = 0; i < res; i++) {
+                pkthdr_common* hdr = (pkthdr_common*) bufs[i];
+                if (hdr->type == TYPE_DATA) {
+                    if (s->pkts++ == 0) s->first = now;
+                    s->last = now;
+                } else if ((hdr->type == TYPE_REQACK) && handshake && !s->acked) {
+                    s->acked = true;
+                    left--;
+                } else if ((hdr->type == TYPE_FIN) && !handshake && !s->done) {
+                    s->done = true;
+                    left--;
+                }
+            }
+        }
+    }
+}
+
+void runBench(unsigned int n) {
+    bench_session* ss = calloc(n, sizeof (bench_session));
+    int ep = epoll_create1(0);
+    if ((ss == NULL) || (ep == -1)) {
+        printf("Error: Out of resources for %u sessions\n", n);
+        exit(1);
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        int size = BENCH_RCVBUF;
+        ss[i].soc = udpInit(NULL, 0, 0);
+        if (ss[i].soc == -1) exit(1);
+        setsockopt(ss[i].soc, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &ss[i]};
+        epoll_ctl(ep, EPOLL_CTL_ADD, ss[i].soc, &ev);
+    }
+
+    //open all sessions first (they stream at the initial rate), then let them go
+    sendAll(ss, n, TYPE_REQ, 0, TEST_FILE);
+    receiveAll(ep, ss, n, true);
+    uint64_t start = monotonicNs();
+    sendAll(ss, n, TYPE_RATE, rate, NULL);
+    receiveAll(ep, ss, n, false);
+    //peak of the server, runs in increasing order show the memory of n sessions
+    long rss = serverRss();
+
+    uint64_t total = 0, end = start;
+    unsigned int done = 0;
+    double minRate = -1, maxRate = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        total += ss[i].pkts;
+        if (ss[i].done) done++;
+        if (ss[i].last > end) end = ss[i].last;
+        double r = (ss[i].last > start) ? ss[i].pkts * 1e9 / (ss[i].last - start) : 0;
+        if ((minRate < 0) || (r < minRate)) minRate = r;
+        if (r > maxRate) maxRate = r;
+    }
+    double secs = (end - start) / 1e9;
+    printf("%8u %10" PRIu64 " %8.3f %10.0f %8.1f %10.0f %10.0f %8u",
+            n, total, secs, (secs > 0) ? total / secs : 0,
+            (secs > 0) ? total * PKTLEN_DATA * 8 / secs / 1e6 : 0, minRate, maxRate, done);
+    if (serverPid != 0) printf(" %10.1f", (rss - rssBase) / (double) n);
+    printf("\n");
+
+    sendAll(ss, n, TYPE_FIN, 0, NULL);
+    for (unsigned int i = 0; i < n; i++) close(ss[i].soc);
+    close(ep);
+    free(ss);
+    usleep(200000); //let the server drop the sessions before the next run
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    char* addr = "127.0.0.1";
+    while ((opt = getopt(argc, argv, "a:s:r:p:")) != -1) {
+        switch (opt) {
+            case 'a':
+                addr = optarg;
+                break;
+            case 's':
+                serverName = (unsigned int) atoi(optarg);
+                break;
+            case 'r':
+                rate = (unsigned int) atoi(optarg);
+                break;
+            case 'p':
+                serverPid = atoi(optarg);
+                break;
+            default:
+                optind = argc + 1; //force usage print
+                break;
+        }
+    }
+    if (optind >= argc) {
+        printf("Usage: %s [-a <server ip>] [-s <server number>] [-r <rate per session>] [-p <server pid>] <sessions>...\n", argv[0]);
+        return 1;
+    }
+    if (initHostStruct(&server, addr, UDP_PORT) == false) return 1;
+
+    printf("%8s %10s %8s %10s %8s %10s %10s %8s%s\n", "sessions", "pkts", "secs", "pkts/s", "Mbit/s",
+            "min pps", "max pps", "finished", (serverPid != 0) ? "   kB/sess" : "");
+    rssBase = serverRss();
+    for (int i = optind; i < argc; i++) runBench((unsigned int) atoi(argv[i]));
+    return 0;
+}
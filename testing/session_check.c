@@ -0,0 +1,172 @@
+/*
+ * Server session checks
+ * Feeds the session and retransmission code of the server with the control
+ * packets and NAKs of a client, including broken ones, and checks the
+ * outcome. Retransmission requests are also checked against a plain model
+ * (queued flag per seq) with random NAKs and sends. NAK lists are packed
+ * (fillpktNak) and unpacked as the server does (readNak): each packet has to
+ * give back the seqs it claims to carry. Control
+ * packets are placed at the end of a page followed by an inaccessible one, so
+ * reading past the receive buffer (PKTLEN_MSG) crashes the check.
+ *
+ * usage: ./session_check
+ * exit status 0 if every check passes
+ *
+ * JLV & JB
+ */
+
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS and rand_r
+#include <sys/mman.h>
+#include "session.h"
+
+#define CHECK_PKTS 10000        // packets of the streamed (generated) content
+#define CHECK_RETX_OPS 1000000  // random NAKs and sends of the retransmission model check
+#define CHECK_NAK_SEQS 5000     // missing seqs of the NAK list checks
+
+static unsigned int failed = 0;
+
+static void check(bool cond, char* what) {
+    printf("%s %s\n", cond ? "ok  " : "FAIL", what);
+    if (!cond) failed++;
+}
+
+/* receive buffer of one control packet, its last byte is the last accessible one */
+static unsigned char* guardedPkt(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char* mem = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((mem == MAP_FAILED) || (mprotect(mem + page, page, PROT_NONE) != 0)) {
+        printf("Error: Guard page could not be mapped\n");
+        exit(1);
+    }
+    return mem + page - PKTLEN_MSG;
+}
+
+static void checkSplice(session* s, unsigned char* pkt) {
+    uint8_t ratios[SERVER_MAX] = {50, 50};
+    memset(pkt, 0, PKTLEN_MSG);
+    check(fillpktSplice(pkt, 0, 100, ratios, 2) && sessionSplice(s, (pkthdr_spl*) pkt), "splice ratios of 2 servers taken");
+
+    // count of a broken packet, more ratios than the packet and the array hold
+    memset(pkt, 0xFF, PKTLEN_MSG);
+    pkthdr_spl* spl = (pkthdr_spl*) pkt;
+    spl->type = TYPE_SPLICE;
+    spl->count = 255;
+    spl->sseq = 200;
+    check(!sessionSplice(s, spl), "splice ratios with count 255 rejected");
+    spl->count = 3;
+    check(!sessionSplice(s, spl), "splice ratios for another server count rejected");
+}
+
+static void checkSpliceTotal(session* s, unsigned char* pkt) {
+    memset(pkt, 0xFF, PKTLEN_MSG);
+    pkthdr_spl* spl = (pkthdr_spl*) pkt;
+    spl->type = TYPE_SPLICE;
+    spl->count = SERVER_MAX;
+    spl->sseq = 200;
+    check(!sessionSplice(s, spl), "splice ratios above SPLICE_TOTAL_MAX rejected");
+}
+
+/* seqs sharing a cache slot are queued once each */
+static void checkRetxAlias(content* file) {
+    static retx_cache r;
+    uint32_t a = 5, b = 5 + RETX_CACHE_SIZE;
+    uint32_t seqs[4];
+    retxInit(&r, file);
+    retxSent(&r, a);
+    check(retxRequest(&r, a) && retxRequest(&r, b), "NAKs of two seqs in one cache slot queued");
+    check(!retxRequest(&r, b) && !retxRequest(&r, b) && !retxRequest(&r, a), "repeated NAKs of both not queued again");
+    check((r.stats.dups == 3) && (r.depth == 2), "repeated NAKs counted as duplicates");
+    check((retxNext(&r, seqs, 4) == 2) && (seqs[0] == a) && (seqs[1] == b), "both sent once, in NAK order");
+    check(retxRequest(&r, b), "seq NAK'd again after it was sent is queued");
+}
+
+/* random NAKs and sends against a queued flag per seq */
+static void checkRetxModel(content* file) {
+    static retx_cache r;
+    static bool model[CHECK_PKTS + 1];
+    uint32_t seqs[4];
+    unsigned int depth = 0, seed = 1;
+    bool ok = true;
+    retxInit(&r, file);
+    for (unsigned int i = 0; ok && (i < CHECK_RETX_OPS); i++) {
+        if (rand_r(&seed) % 5 > 0) { // NAKs outpace the small sends, the queue fills up
+            // CHECK_PKTS seqs over RETX_CACHE_SIZE slots, many share a cache slot
+            uint32_t seq = 1 + (uint32_t) rand_r(&seed) % CHECK_PKTS;
+            bool exp = !model[seq] && (depth < RETX_QUEUE_SIZE);
+            ok = (retxRequest(&r, seq) == exp);
+            if (exp) {
+                model[seq] = true;
+                depth++;
+            }
+        } else {
+            unsigned int n = retxNext(&r, seqs, 1 + (unsigned int) rand_r(&seed) % 4);
+            for (unsigned int j = 0; ok && (j < n); j++) {
+                ok = model[seqs[j]];
+                model[seqs[j]] = false;
+                depth--;
+            }
+        }
+        ok = ok && (r.depth == depth);
+    }
+    check(ok, "random NAKs and sends match the model");
+}
+
+/* pack the seqs in NAK lists, every list unpacks to the seqs packed in it */
+static bool nakRoundTrip(uint32_t* seqs, unsigned int count) {
+    unsigned char pkt[PKTLEN_MSG];
+    uint32_t got[NAK_MAX_BITS];
+    unsigned int done = 0;
+    while (done < count) {
+        unsigned int packed = fillpktNak(pkt, 0, seqs + done, count - done);
+        unsigned int read = readNak(pkt, got, NAK_MAX_BITS);
+        if ((packed == 0) || (read != packed)) {
+            printf("     packed %u seqs from SEQ=%u, read %u\n", packed, seqs[done], read);
+            return false;
+        }
+        if (memcmp(got, seqs + done, packed * sizeof (uint32_t)) != 0) return false;
+        done += packed;
+    }
+    return true;
+}
+
+static void checkNakList(void) {
+    static uint32_t seqs[CHECK_NAK_SEQS];
+    unsigned int seed = 1;
+    for (unsigned int i = 0; i < CHECK_NAK_SEQS; i++) seqs[i] = 100 + i;
+    check(nakRoundTrip(seqs, CHECK_NAK_SEQS), "NAK lists of a long loss burst");
+    for (unsigned int i = 0; i < CHECK_NAK_SEQS; i++) seqs[i] = 100 + (i / 40) * 50 + i % 40;
+    check(nakRoundTrip(seqs, CHECK_NAK_SEQS), "NAK lists of runs");
+    for (unsigned int i = 0; i < CHECK_NAK_SEQS; i++) seqs[i] = 100 + 3 * i;
+    check(nakRoundTrip(seqs, CHECK_NAK_SEQS), "NAK lists of scattered seqs");
+    seqs[0] = 100;
+    for (unsigned int i = 1; i < CHECK_NAK_SEQS; i++) seqs[i] = seqs[i - 1] + 1 + (uint32_t) rand_r(&seed) % ((i % 500 < 400) ? 2 : 300);
+    check(nakRoundTrip(seqs, CHECK_NAK_SEQS), "NAK lists of random seqs");
+}
+
+int main(void) {
+    content file = {.name = "check", .data = NULL, .size = (size_t) CHECK_PKTS * DATALEN, .pktCount = CHECK_PKTS};
+    session_table table;
+    struct sockaddr_in client;
+    if (!initHostStruct(&client, "127.0.0.1", UDP_PORT + 1)) exit(1);
+    sessionInit(&table);
+    session* s = sessionOpen(&table, &client, &file, 2, PACER_BURST_DEFAULT);
+    if (s == NULL) {
+        printf("Error: Session could not be opened\n");
+        exit(1);
+    }
+    unsigned char* pkt = guardedPkt();
+
+    checkSplice(s, pkt);
+    sessionClose(&table, s);
+
+    s = sessionOpen(&table, &client, &file, SERVER_MAX, PACER_BURST_DEFAULT);
+    if (s == NULL) exit(1);
+    checkSpliceTotal(s, pkt);
+    sessionClose(&table, s);
+
+    checkRetxAlias(&file);
+    checkRetxModel(&file);
+    checkNakList();
+    printf("%s\n", (failed == 0) ? "All checks passed" : "Some checks failed");
+    return (failed == 0) ? 0 : 1;
+}
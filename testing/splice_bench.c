@@ -0,0 +1,168 @@
+/*
+ * Splice schedule benchmark
+ * Compares the bucket walk formerly used by the server (getSplice) with the
+ * precomputed splice schedule from common.c (spliceOwner, spliceNextOwned):
+ * 1. conformance - both assign every seq to the same server
+ * 2. streaming - collect the seqs owned by one server
+ * 3. random lookup - which server owns seq N
+ *
+ * usage: ./splice_bench [seq count]
+ *
+ * JLV & JB
+ */
+
+#include "common.h"
+
+#define BENCH_SEQS_DEFAULT 10000000 // seqs streamed per test
+#define BENCH_LOOKUPS 1000000       // random owner queries (schedule)
+#define BENCH_LOOKUPS_WALK 50       // random owner queries (bucket walk, replays from seq 1)
+
+/* Bucket walk of the server before the splice schedule (one stream) */
+typedef struct walk {
+    int ratios[SERVER_MAX];
+    int b[SERVER_MAX];
+    int count;
+    int seq;
+} walk;
+
+static void walkInit(walk* w, uint8_t* ratios, int count) {
+    memset(w, 0, sizeof (*w));
+    for (int i = 0; i < count; i++) w->ratios[i] = ratios[i];
+    w->count = count;
+    w->seq = 1;
+}
+
+/* former getSplice: deal one bucket round, return the seq of server or -1 */
+static int walkNext(walk* w, int server, int* owners) {
+    int i;
+    bool emptyBucket = true;
+    for (i = 0; i < w->count; i++) if (w->b[i] > 0) emptyBucket = false;
+    if (emptyBucket) {
+        for (i = 0; i < w->count; i++) w->b[i] = w->ratios[i];
+    }
+    int out = -1;
+    for (i = 0; i < w->count; i++) {
+        if (w->b[i] > 0) {
+            w->b[i]--;
+            if (owners != NULL) owners[w->seq] = i;
+            w->seq++;
+            if (i == server) out = w->seq - 1;
+        }
+    }
+    return out;
+}
+
+/* owner of seq by replaying the walk from the beginning */
+static int walkOwner(uint8_t* ratios, int count, uint32_t seq) {
+    walk w;
+    walkInit(&w, ratios, count);
+    for (;;) {
+        for (int i = 0; i < count; i++) {
+            int s = walkNext(&w, i, NULL);
+            if (s == (int) seq) return i;
+        }
+        if ((uint32_t) w.seq > seq) return -1;
+    }
+}
+
+static double secsSince(uint64_t start) {
+    return (monotonicNs() - start) / 1e9;
+}
+
+static bool conformance(uint8_t* ratios, int servers, uint32_t count) {
+    int* owners = malloc((count + SPLICE_TOTAL_MAX + 1) * sizeof (int));
+    walk w;
+    splice_epoch e;
+    walkInit(&w, ratios, servers);
+    if (!spliceInit(&e, 1, ratios, servers)) {
+        free(owners);
+        return false;
+    }
+    while ((uint32_t) w.seq <= count) walkNext(&w, -1, owners);
+
+    bool ok = true;
+    for (uint32_t seq = 1; seq <= count; seq++) {
+        if (spliceOwner(&e, seq) != owners[seq]) ok = false;
+    }
+    for (uint8_t s = 0; s < servers; s++) {
+        uint32_t next = spliceNextOwned(&e, s, 1);
+        for (uint32_t seq = 1; seq <= count; seq++) {
+            if (owners[seq] != s) continue;
+            if (next != seq) ok = false;
+            next = spliceNextOwned(&e, s, seq + 1);
+        }
+    }
+    free(owners);
+    return ok;
+}
+
+static void benchRatios(uint8_t* ratios, int servers, uint8_t server, uint32_t count) {
+    walk w;
+    splice_epoch e;
+    uint64_t sumWalk = 0, sumSched = 0, owned = 0, calls = 0;
+
+    //streaming, the walk is called until past count like the server did
+    uint64_t t = monotonicNs();
+    walkInit(&w, ratios, servers);
+    while ((uint32_t) w.seq <= count) {
+        int seq = walkNext(&w, server, NULL);
+        calls++;
+        if ((seq != -1) && ((uint32_t) seq <= count)) sumWalk += seq; //last round may end past count
+    }
+    double walkSecs = secsSince(t);
+
+    t = monotonicNs();
+    spliceInit(&e, 1, ratios, servers);
+    double initSecs = secsSince(t);
+    t = monotonicNs();
+    for (uint32_t seq = spliceNextOwned(&e, server, 1); (seq != 0) && (seq <= count);
+            seq = spliceNextOwned(&e, server, seq + 1)) {
+        sumSched += seq;
+        owned++;
+    }
+    double schedSecs = secsSince(t);
+
+    //random owner lookups
+    srand(1);
+    int check = 0;
+    t = monotonicNs();
+    for (int i = 0; i < BENCH_LOOKUPS_WALK; i++) check += walkOwner(ratios, servers, 1 + rand() % count);
+    double walkLookup = secsSince(t) / BENCH_LOOKUPS_WALK;
+    t = monotonicNs();
+    for (int i = 0; i < BENCH_LOOKUPS; i++) check += spliceOwner(&e, 1 + rand() % count);
+    double schedLookup = secsSince(t) / BENCH_LOOKUPS;
+
+    printf("ratios");
+    for (int i = 0; i < servers; i++) printf("%c%u", (i == 0) ? ' ' : '/', ratios[i]);
+    printf(" server %u: %s, %" PRIu64 " owned seqs\n", server,
+            conformance(ratios, servers, 100000) && (sumWalk == sumSched) ? "schedules match" : "SCHEDULES DIFFER", owned);
+    printf("  stream:  walk %8.2f ns/seq (%" PRIu64 " calls), schedule %8.2f ns/seq (init %.1f us)\n",
+            owned ? walkSecs * 1e9 / owned : 0, calls, owned ? schedSecs * 1e9 / owned : 0, initSecs * 1e6);
+    printf("  lookup:  walk %8.0f ns/query, schedule %8.2f ns/query (%d)\n",
+            walkLookup * 1e9, schedLookup * 1e9, check & 1);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t count = (argc > 1) ? (uint32_t) strtoul(argv[1], NULL, 10) : BENCH_SEQS_DEFAULT;
+    if (count < 1) count = BENCH_SEQS_DEFAULT;
+    uint8_t even[4] = {25, 25, 25, 25};
+    uint8_t skewed[4] = {97, 1, 1, 1};
+    uint8_t two[4] = {0, 50, 50, 0};
+    uint8_t big[4] = {255, 200, 13, 1};
+    uint8_t one[1] = {100};
+    uint8_t eight[8] = {13, 12, 12, 13, 12, 13, 12, 13};
+    uint8_t many[SERVER_MAX];
+    for (int i = 0; i < SERVER_MAX; i++) many[i] = (i % 5 == 0) ? 1 : SPLICE_FRAME / SERVER_MAX;
+
+    printf("%u seqs per stream test, lookups in 1 - %u\n", count, count);
+    benchRatios(even, 4, 0, count);
+    benchRatios(skewed, 4, 0, count);
+    benchRatios(skewed, 4, 3, count);
+    benchRatios(two, 4, 2, count);
+    benchRatios(big, 4, 3, count);
+    benchRatios(one, 1, 0, count);
+    benchRatios(eight, 8, 5, count);
+    benchRatios(many, SERVER_MAX, 0, count);
+    benchRatios(many, SERVER_MAX, SERVER_MAX - 1, count);
+    return 0;
+}
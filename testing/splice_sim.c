@@ -0,0 +1,592 @@
+/*
+ * Splice protocol simulator
+ * Deterministic discrete-event simulation of one client streaming a file from
+ * several servers. The real protocol logic runs on a virtual clock (common.c
+ * built with -DSIM_CLOCK), only the sockets are replaced by modeled links:
+ * - client: splice ratios and their acks, tx rate and NAK lists (client_ctl.c)
+ *   over the packet buffer, a timer round every BUF_CHECK_TIME
+ * - servers: one session each with its splice schedule, pacer and
+ *   retransmission queue (session.c, pacer.c, retx.c), handled like readPkt
+ *   and onTxTimer of the server
+ * Every server has an access link (bandwidth, delay, random loss, drop-tail
+ * queue), servers can share a bottleneck link behind it. Packets from the
+ * client see the delay and loss of the same path, but no queue. The request
+ * is assumed to reach every server, session timeouts are not modeled.
+ * The run is complete when the client has flushed every packet up to the
+ * last seq of the servers' FIN (the sessions answer NAKs after it).
+ * Hours of streaming take seconds, the same seed gives the same run.
+ *
+ * usage: ./splice_sim [-n <servers>] [-p <pkts>] [-l [<server>=]<kbit/s>,<ms>,<loss %>[,<queue pkts>]]
+ *                     [-B <kbit/s>,<ms>,<loss %>[,<queue pkts>][:<server list>]] [-w <window>]
+ *                     [-b <burst>] [-t <secs>] [-i <secs>] [-s <seed>]
+ *   -l: access link of one server or of all (repeatable), default 1000,20,0,64
+ *   -B: shared bottleneck of the listed servers (all by default), repeatable
+ *   -t: simulated time limit, -i: status line interval (0 = summary only)
+ *
+ * JLV & JB
+ */
+
+#include "client_ctl.h"
+#include "session.h"
+
+#define SIM_BOTTLENECK_MAX 4
+#define SIM_WIRE_OVERHEAD 28    // IPv4 + UDP header bytes of every packet
+#define SIM_RX_TIMEOUT (RECV_TIMEOUT * MAX_ERR_COUNT) // secs without packets before the client gives up
+
+// event types
+#define SIM_EV_TX 1         // tx timer of a server
+#define SIM_EV_BOTTLENECK 2 // packet to the client leaves the access link into a bottleneck
+#define SIM_EV_CLIENT 3     // packet reaches the client
+#define SIM_EV_SERVER 4     // packet reaches a server
+#define SIM_EV_TIMER 5      // timer round of the client
+
+/* Link of one direction, packets are serialized at kbps and queued drop-tail */
+typedef struct sim_link {
+    unsigned int kbps;      // bandwidth (kbit/s), 0 = unlimited
+    unsigned int delayUs;   // propagation delay
+    double loss;            // random loss probability
+    unsigned int queue;     // queue limit (data pkts)
+    uint64_t busy;          // time the packets queued so far are sent (ns)
+    uint64_t pkts;          // packets sent over the link
+    uint64_t drops;         // packets dropped by the full queue
+    uint64_t losses;        // packets lost at random (both directions)
+} sim_link;
+
+typedef struct sim_event {
+    uint64_t t;
+    uint64_t order;         // insertion order, events of the same time keep it
+    uint8_t type;
+    uint8_t node;           // server of the event
+    uint16_t len;           // packet length
+    pkthdr_common hdr;      // packet to the client
+    unsigned char* msg;     // packet to a server (PKTLEN_MSG), NULL otherwise
+} sim_event;
+
+typedef struct sim_server {
+    session_table table;
+    session* s;             // session of the client, NULL when ended
+    sim_link access;
+    int bottleneck;         // shared link behind the access link, -1 if none
+    bool txQueued;          // SIM_EV_TX pending
+    uint64_t sent;
+    uint64_t retx;
+    unsigned int rate;      // pacer rate when the session ended
+    retx_stats stats;       // retransmission counters when the session ended
+} sim_server;
+
+static unsigned int serverCount = SERVER_DEFAULT;
+static uint32_t pktCount = EMPTY_PKT_COUNT;
+static unsigned int window = 0;
+static unsigned int burstSize = TX_BURST_DEFAULT;
+static double limit = 0; // secs, 0 = until the stream ends
+static double interval = 0;
+static uint64_t seed = 1;
+
+static sim_server servers[SERVER_MAX];
+static sim_link bottlenecks[SIM_BOTTLENECK_MAX];
+static unsigned int bottleneckCount = 0;
+static content file;
+static struct sockaddr_in clientAddr;
+
+static sim_event* heap = NULL;
+static size_t heapCount = 0, heapSize = 0;
+static uint64_t evOrder = 0, evCount = 0;
+static uint64_t rng;
+
+static client_ctl ctl;
+static packet_buffer* buf;
+static unsigned char payload[DATALEN]; //payload of every data packet
+static uint8_t* seen; //per seq, received at least once
+static uint64_t lastRx = 0;
+static bool finished = false;
+static char* endReason = "no events";
+static uint64_t rxPkts = 0, rxRetx = 0, rxUnique = 0, rxDrops = 0;
+static double peakOccupancy = 0;
+
+/*******************
+ * Events
+ *******************/
+
+static bool before(sim_event* a, sim_event* b) {
+    return (a->t < b->t) || ((a->t == b->t) && (a->order < b->order));
+}
+
+static void push(sim_event e) {
+    if (heapCount == heapSize) {
+        heapSize = (heapSize == 0) ? 1024 : 2 * heapSize;
+        heap = realloc(heap, heapSize * sizeof (sim_event));
+        if (heap == NULL) {
+            printf("Error: Event queue could not be allocated\n");
+            exit(1);
+        }
+    }
+    e.order = evOrder++;
+    size_t i = heapCount++;
+    while ((i > 0) && before(&e, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = e;
+}
+
+static sim_event pop(void) {
+    sim_event top = heap[0];
+    sim_event last = heap[--heapCount];
+    size_t i = 0;
+    while (2 * i + 1 < heapCount) {
+        size_t c = 2 * i + 1;
+        if ((c + 1 < heapCount) && before(&heap[c + 1], &heap[c])) c++;
+        if (!before(&heap[c], &last)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/*******************
+ * Links
+ *******************/
+
+// xorshift64*, uniform in <0,1)
+static double uniform(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (double) ((rng * 2685821657736338717ULL) >> 11) / (double) (1ULL << 53);
+}
+
+// packet of len bytes enters the link now, returns the time it reaches the far end, 0 if dropped or lost
+static uint64_t linkPass(sim_link* l, uint64_t now, unsigned int len) {
+    uint64_t bytes = len + SIM_WIRE_OVERHEAD;
+    uint64_t done = now;
+    if (l->kbps > 0) {
+        uint64_t start = (l->busy > now) ? l->busy : now;
+        uint64_t queued = (start - now) * l->kbps / 8000000; // bytes waiting ahead of the packet
+        if (queued + bytes > (uint64_t) l->queue * (PKTLEN_DATA + SIM_WIRE_OVERHEAD)) {
+            l->drops++;
+            return 0;
+        }
+        done = start + bytes * 8000000 / l->kbps;
+        l->busy = done;
+    }
+    l->pkts++;
+    if ((l->loss > 0) && (uniform() < l->loss)) {
+        l->losses++;
+        return 0;
+    }
+    return done + (uint64_t) l->delayUs * 1000;
+}
+
+// packet to the client, through the access link and the bottleneck (next event)
+static void toClient(unsigned int i, uint8_t type, uint32_t seq, uint8_t flags, unsigned int len) {
+    sim_server* sv = &servers[i];
+    sim_event e = {.node = i, .len = len};
+    fillhdr(&e.hdr, i, ID_CLIENT, type, seq);
+    e.hdr.flags = flags;
+    e.t = linkPass(&sv->access, simClockNs, len);
+    if (e.t == 0) return;
+    e.type = (sv->bottleneck >= 0) ? SIM_EV_BOTTLENECK : SIM_EV_CLIENT;
+    push(e);
+}
+
+// packet from the client: delay and loss of the path, the upstream direction has no queue
+static void toServer(unsigned int i, unsigned char* pkt) {
+    sim_server* sv = &servers[i];
+    uint64_t t = simClockNs;
+    sim_link* path[2] = {(sv->bottleneck >= 0) ? &bottlenecks[sv->bottleneck] : NULL, &sv->access};
+    for (int k = 0; k < 2; k++) {
+        if (path[k] == NULL) continue;
+        if ((path[k]->loss > 0) && (uniform() < path[k]->loss)) {
+            path[k]->losses++;
+            return;
+        }
+        t += (uint64_t) path[k]->delayUs * 1000;
+    }
+    sim_event e = {.t = t, .type = SIM_EV_SERVER, .node = i, .len = PKTLEN_MSG};
+    e.msg = malloc(PKTLEN_MSG);
+    if (e.msg == NULL) return;
+    memcpy(e.msg, pkt, PKTLEN_MSG);
+    push(e);
+}
+
+/*******************
+ * Servers
+ *******************/
+
+static void txAt(unsigned int i, uint64_t t) {
+    if (servers[i].txQueued) return;
+    servers[i].txQueued = true;
+    sim_event e = {.t = t, .type = SIM_EV_TX, .node = i};
+    push(e);
+}
+
+static void endSession(unsigned int i) {
+    sim_server* sv = &servers[i];
+    sv->rate = sv->s->txPacer.rate;
+    sv->stats = sv->s->retx.stats;
+    sessionClose(&sv->table, sv->s);
+    sv->s = NULL;
+}
+
+/* one burst of the session, like onTxTimer */
+static void serverTx(unsigned int i) {
+    sim_server* sv = &servers[i];
+    sv->txQueued = false;
+    session* s = sv->s;
+    if ((s == NULL) || s->txIdle) return;
+    uint64_t delay = pacerDelay(&s->txPacer, burstSize);
+    if (delay > 0) {
+        txAt(i, simClockNs + delay);
+        return;
+    }
+
+    uint32_t seqs[TX_BURST_MAX];
+    unsigned int count = 0;
+    bool retransmit = false;
+    switch (sessionNextBurst(s, i, seqs, burstSize, &count, &retransmit)) {
+        case SESSION_TX_END:
+            //the session stays for the NAKs until the client's FIN
+            for (int k = 0; k < 2; k++) toClient(i, TYPE_FIN, s->file->pktCount, 0, PKTLEN_MSG);
+            s->txIdle = true;
+            return;
+        case SESSION_TX_IDLE:
+            s->txIdle = true;
+            return;
+        default:
+            break;
+    }
+    pacerConsume(&s->txPacer, count);
+    for (unsigned int k = 0; k < count; k++) {
+        toClient(i, TYPE_DATA, seqs[k], retransmit ? PKT_FLAG_RETX : 0, PKTLEN_DATA);
+    }
+    sv->sent += count;
+    if (retransmit) sv->retx += count;
+    s->lastActive = simClockNs;
+    txAt(i, simClockNs + pacerDelay(&s->txPacer, burstSize));
+}
+
+/* packet from the client, like readPkt */
+static void serverRx(unsigned int i, unsigned char* pkt) {
+    sim_server* sv = &servers[i];
+    pkthdr_common* hdr = (pkthdr_common*) pkt;
+    uint32_t nakSeqs[NAK_MAX_BITS];
+
+    if (hdr->type == TYPE_REQ) {
+        sv->s = sessionOpen(&sv->table, &clientAddr, &file, serverCount, (burstSize > PACER_BURST_DEFAULT) ? burstSize : PACER_BURST_DEFAULT);
+        if (sv->s == NULL) return;
+        toClient(i, TYPE_REQACK, 0, 0, PKTLEN_MSG);
+    } else {
+        session* s = sv->s;
+        if (s == NULL) return; //session ended, packet is ignored
+        s->lastActive = simClockNs;
+        switch (hdr->type) {
+            case TYPE_FIN:
+                endSession(i);
+                return;
+            case TYPE_NAK:
+                retxRequest(&s->retx, hdr->seq);
+                break;
+            case TYPE_NAK_LIST:
+                for (unsigned int k = readNak(pkt, nakSeqs, NAK_MAX_BITS); k > 0; k--) retxRequest(&s->retx, nakSeqs[k - 1]);
+                break;
+            case TYPE_SPLICE:
+                if (sessionSplice(s, (pkthdr_spl*) pkt)) toClient(i, TYPE_SPLICE_ACK, 0, 0, PKTLEN_MSG);
+                break;
+            case TYPE_RATE:
+                pacerSetRate(&s->txPacer, hdr->seq);
+                break;
+            default:
+                return;
+        }
+    }
+    //NAK, splice or rate change may give the session something to send sooner
+    sv->s->txIdle = false;
+    txAt(i, simClockNs);
+}
+
+/*******************
+ * Client
+ *******************/
+
+static void clientSend(void* arg, unsigned int i, unsigned char* pkt) {
+    if (arg) arg = NULL; // dummy arg usage
+    toServer(i, pkt);
+}
+
+/* packet from a server, like rxPacket */
+static void clientRx(sim_event* e) {
+    unsigned char* pkt = (unsigned char*) &e->hdr;
+    lastRx = simClockNs;
+    switch (e->hdr.type) {
+        case TYPE_FIN:
+            ctlSetEnd(&ctl, e->hdr.seq);
+            return;
+        case TYPE_SPLICE_ACK:
+            ctlRxPacket(&ctl, pkt, PKTLEN_MSG);
+            return;
+        case TYPE_DATA:
+            break;
+        default:
+            return;
+    }
+    if (!ctlRxPacket(&ctl, pkt, PKTLEN_DATA)) return;
+    rxPkts++;
+    if (e->hdr.flags & PKT_FLAG_RETX) rxRetx++;
+    if (!ctlNakAnswer(&ctl, &e->hdr)) return; // duplicate retransmission
+    if ((e->hdr.seq <= pktCount) && !seen[e->hdr.seq]) {
+        seen[e->hdr.seq] = 1;
+        rxUnique++;
+    }
+    if (!bufAdd(buf, e->hdr.seq, payload)) rxDrops++;
+}
+
+static void printStatus(void) {
+    printf("%8.1f s  seq %9d  occupancy %5.1f%%  rate %3u  naks %8" PRIu64 "  ratios",
+            simClockNs / 1e9, ctl.lastPkt, 100 * bufGetOccupancy(buf), ctl.currTxRate, ctl.stats.nakSeqs);
+    for (unsigned int i = 0; i < serverCount; i++) printf("%s%u", (i == 0) ? " " : "/", ctl.sendRatio[i]);
+    printf("\n");
+}
+
+/* timer round, like onCheckTimer */
+static void clientTimer(void) {
+    double occupancy = bufGetOccupancy(buf);
+    if (occupancy > peakOccupancy) peakOccupancy = occupancy;
+    bufFlushFrame(buf);
+    if (ctlStreamDone(&ctl)) {
+        finished = true;
+        endReason = "complete";
+        return;
+    }
+    ctlTimerRound(&ctl);
+    if (simClockNs - lastRx > SIM_RX_TIMEOUT * 1000000000ULL) {
+        finished = true;
+        endReason = "rx timeout";
+        return;
+    }
+    uint64_t period = BUF_CHECK_TIME * 1000ULL;
+    uint64_t every = (uint64_t) (interval * 1e9);
+    if ((every > 0) && ((simClockNs / every) != ((simClockNs - period) / every))) printStatus();
+    sim_event e = {.t = simClockNs + period, .type = SIM_EV_TIMER};
+    push(e);
+}
+
+/*******************
+ * Setup
+ *******************/
+
+// "<kbit/s>,<ms>,<loss %>[,<queue pkts>]"
+static bool parseLink(char* arg, sim_link* l) {
+    unsigned int kbps, queue = l->queue;
+    double delay, loss;
+    int n = sscanf(arg, "%u,%lf,%lf,%u", &kbps, &delay, &loss, &queue);
+    if ((n < 3) || (delay < 0) || (loss < 0) || (loss > 100) || (queue < 1)) return false;
+    l->kbps = kbps;
+    l->delayUs = (unsigned int) (delay * 1000);
+    l->loss = loss / 100;
+    l->queue = queue;
+    return true;
+}
+
+static bool parseArgs(int argc, char* argv[]) {
+    sim_link def = {.kbps = 1000, .delayUs = 20000, .loss = 0, .queue = 64};
+    char* links[SERVER_MAX + 1] = {}; //per server, last one for all
+    char* shared[SIM_BOTTLENECK_MAX];
+    int opt;
+    bool ok = true;
+    while ((opt = getopt(argc, argv, "n:p:l:B:w:b:t:i:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                serverCount = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                pktCount = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'l': {
+                char* eq = strchr(optarg, '=');
+                unsigned int i = (eq == NULL) ? SERVER_MAX : (unsigned int) strtoul(optarg, NULL, 10);
+                if (i > SERVER_MAX) ok = false;
+                else links[i] = (eq == NULL) ? optarg : eq + 1;
+                break;
+            }
+            case 'B':
+                if (bottleneckCount == SIM_BOTTLENECK_MAX) ok = false;
+                else shared[bottleneckCount++] = optarg;
+                break;
+            case 'w':
+                window = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                burstSize = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                limit = strtod(optarg, NULL);
+                break;
+            case 'i':
+                interval = strtod(optarg, NULL);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                ok = false; //force usage print
+                break;
+        }
+    }
+    if ((optind != argc) || (serverCount < 1) || (serverCount > SERVER_MAX) || (pktCount < 1) ||
+            (burstSize < 1) || (burstSize > TX_BURST_MAX) || (window > BUF_WINDOW_MAX) || (limit < 0) || (interval < 0)) {
+        ok = false;
+    }
+    if ((links[SERVER_MAX] != NULL) && !parseLink(links[SERVER_MAX], &def)) ok = false;
+    for (unsigned int i = 0; ok && (i < serverCount); i++) {
+        servers[i].access = def;
+        servers[i].bottleneck = -1;
+        if ((links[i] != NULL) && !parseLink(links[i], &servers[i].access)) ok = false;
+    }
+    for (unsigned int b = 0; ok && (b < bottleneckCount); b++) {
+        bottlenecks[b] = def;
+        if (!parseLink(shared[b], &bottlenecks[b])) ok = false;
+        char* list = strchr(shared[b], ':');
+        for (unsigned int i = 0; i < serverCount; i++) if (list == NULL) servers[i].bottleneck = b;
+        while (ok && (list != NULL)) {
+            char* end;
+            unsigned int i = (unsigned int) strtoul(list + 1, &end, 10);
+            if ((end == list + 1) || (i >= serverCount)) ok = false;
+            else servers[i].bottleneck = b;
+            list = (*end == ',') ? end : NULL;
+        }
+    }
+    if (!ok) {
+        printf("Usage: %s [-n <servers>] [-p <pkts>] [-l [<server>=]<kbit/s>,<ms>,<loss %%>[,<queue pkts>]]\n"
+                "         [-B <kbit/s>,<ms>,<loss %%>[,<queue pkts>][:<server list>]] [-w <window>]\n"
+                "         [-b <burst>] [-t <secs>] [-i <secs>] [-s <seed>]\n", argv[0]);
+        printf("  -l: access link of one server or of all, default 1000,20,0,64\n");
+        printf("  -B: bottleneck shared by the listed servers (all by default), up to %u\n", SIM_BOTTLENECK_MAX);
+        printf("  -t: simulated time limit, -i: status line interval (0 = summary only)\n");
+    }
+    return ok;
+}
+
+// client buffer like initBuffer, the round trip of the closest server
+static bool initClient(void) {
+    unsigned int rttUs = UINT_MAX;
+    for (unsigned int i = 0; i < serverCount; i++) {
+        unsigned int rtt = 2 * servers[i].access.delayUs;
+        if (servers[i].bottleneck >= 0) rtt += 2 * bottlenecks[servers[i].bottleneck].delayUs;
+        if (rtt < rttUs) rttUs = rtt;
+    }
+    if (window == 0) window = bufBdpWindow(serverCount * RATE_MAX, rttUs);
+    buf = bufCreate(NULL, window, BUF_QUIET);
+    seen = calloc((size_t) pktCount + 1, 1);
+    if ((buf == NULL) || (seen == NULL) || !ctlInit(&ctl, serverCount, clientSend, NULL, (unsigned int) seed) ||
+            !ctlSetBuffer(&ctl, buf)) {
+        printf("Error: Client could not be initialized\n");
+        return false;
+    }
+    ctl.quiet = true;
+    return true;
+}
+
+// real time, monotonicNs is the virtual clock here
+static uint64_t wallNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void printSummary(double wall) {
+    double simSecs = simClockNs / 1e9;
+    printf("Simulated %.1f s in %.2f s (%.0fx), %" PRIu64 " events, end: %s\n",
+            simSecs, wall, (wall > 0) ? simSecs / wall : 0, evCount, endReason);
+    printf("Client: %" PRIu64 " pkts (%" PRIu64 " retransmitted), %" PRIu64 " of %u unique, %" PRIu64 " missing, "
+            "%" PRIu64 " dropped by the window (%u pkts), peak occupancy %.1f%%\n",
+            rxPkts, rxRetx, rxUnique, pktCount, pktCount - rxUnique, rxDrops, bufGetWindow(buf), 100 * peakOccupancy);
+    printf("Control: %" PRIu64 " splice changes, %" PRIu64 " rate changes (final %u), %" PRIu64 " lost pkts requested in %" PRIu64 " NAK lists\n",
+            ctl.stats.spliceTx, ctl.stats.rateTx, ctl.currTxRate, ctl.stats.nakSeqs, ctl.stats.nakPkts);
+    printf("NAKs: %" PRIu64 " retries, %" PRIu64 " held until their deadline, %" PRIu64 " duplicate retx dropped, %" PRIu64
+            " round trip samples\n", ctl.stats.nakRetries, ctl.stats.nakHeld, ctl.stats.retxDups, ctl.stats.rttSamples);
+    printf("server     sent     retx  ratio  rate | link pkts  q drops   lost | nak hits misses   dups  drops\n");
+    for (unsigned int i = 0; i < serverCount; i++) {
+        sim_server* sv = &servers[i];
+        if (sv->s != NULL) {
+            sv->rate = sv->s->txPacer.rate;
+            sv->stats = sv->s->retx.stats;
+        }
+        printf("%6u %8" PRIu64 " %8" PRIu64 " %6u %5u | %9" PRIu64 " %8" PRIu64 " %6" PRIu64 " | %8" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6" PRIu64 "\n",
+                i, sv->sent, sv->retx, ctl.sendRatio[i], sv->rate, sv->access.pkts, sv->access.drops, sv->access.losses,
+                sv->stats.hits, sv->stats.misses, sv->stats.dups, sv->stats.drops);
+    }
+    for (unsigned int b = 0; b < bottleneckCount; b++) {
+        printf("bottleneck %u: %" PRIu64 " pkts, %" PRIu64 " queue drops, %" PRIu64 " lost\n",
+                b, bottlenecks[b].pkts, bottlenecks[b].drops, bottlenecks[b].losses);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (!parseArgs(argc, argv)) exit(1);
+    rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+    file.name = "sim";
+    file.size = (size_t) pktCount * DATALEN;
+    file.pktCount = pktCount;
+    clientAddr.sin_family = AF_INET;
+    clientAddr.sin_port = htons(UDP_PORT + 1);
+    simClockNs = 0;
+    for (unsigned int i = 0; i < serverCount; i++) sessionInit(&servers[i].table);
+    if (!initClient()) exit(1);
+
+    //request reaches every server (the client repeats it until acked)
+    unsigned char req[PKTLEN_MSG];
+    for (unsigned int i = 0; i < serverCount; i++) {
+        fillpkt(req, ID_CLIENT, i, TYPE_REQ, serverCount, (unsigned char*) file.name, strlen(file.name));
+        uint64_t t = (uint64_t) servers[i].access.delayUs * 1000;
+        if (servers[i].bottleneck >= 0) t += (uint64_t) bottlenecks[servers[i].bottleneck].delayUs * 1000;
+        sim_event e = {.t = t, .type = SIM_EV_SERVER, .node = i, .len = PKTLEN_MSG, .msg = malloc(PKTLEN_MSG)};
+        if (e.msg == NULL) exit(1);
+        memcpy(e.msg, req, PKTLEN_MSG);
+        push(e);
+    }
+    sim_event timer = {.t = BUF_CHECK_TIME * 1000ULL, .type = SIM_EV_TIMER};
+    push(timer);
+
+    uint64_t limitNs = (limit > 0) ? (uint64_t) (limit * 1e9) : UINT64_MAX;
+    uint64_t wallStart = wallNs();
+    while (!finished && (heapCount > 0)) {
+        sim_event e = pop();
+        if (e.t > limitNs) {
+            free(e.msg);
+            endReason = "time limit";
+            break;
+        }
+        simClockNs = e.t;
+        evCount++;
+        switch (e.type) {
+            case SIM_EV_TX:
+                serverTx(e.node);
+                break;
+            case SIM_EV_BOTTLENECK:
+                e.t = linkPass(&bottlenecks[servers[e.node].bottleneck], simClockNs, e.len);
+                e.type = SIM_EV_CLIENT;
+                if (e.t != 0) push(e);
+                break;
+            case SIM_EV_CLIENT:
+                clientRx(&e);
+                break;
+            case SIM_EV_SERVER:
+                serverRx(e.node, e.msg);
+                free(e.msg);
+                break;
+            case SIM_EV_TIMER:
+                clientTimer();
+                break;
+        }
+    }
+    printSummary((wallNs() - wallStart) / 1e9);
+
+    while (heapCount > 0) free(pop().msg);
+    free(heap);
+    for (unsigned int i = 0; i < serverCount; i++) if (servers[i].s != NULL) sessionClose(&servers[i].table, servers[i].s);
+    ctlClose(&ctl);
+    bufDestroy(buf);
+    free(seen);
+    return 0;
+}
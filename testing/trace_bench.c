@@ -0,0 +1,104 @@
+/*
+ * Receive trace overhead benchmark
+ * Times the per-packet cost of logging a received data packet on the
+ * receive path (single thread, no network):
+ * 1. none - the loop alone (header fill, a timestamp per batch)
+ * 2. fprintf - the former graph file line, "ms seq" formatted by stdio
+ * 3. trace - traceRecord into the ring, drained by the writer thread
+ * The rate limit (-r) paces the packets like a real stream, 0 = back to back.
+ * Reports ns per packet and the records the trace dropped.
+ *
+ * usage: ./trace_bench [-n <pkts>] [-r <pkts/s>]
+ *
+ * JLV & JB
+ */
+
+#define _GNU_SOURCE // for usleep
+#include "trace.h"
+
+#define BENCH_BATCH 64 // packets sharing one timestamp, like a recvmmsg batch
+
+static uint32_t pkts = 10000000;
+static unsigned int rate = 0;
+static char path[] = "/tmp/trace_benchXXXXXX";
+
+/* run the logging method for pkts packets, returns ns per packet */
+static double run(int method) {
+    pkthdr_common hdr;
+    fillhdr(&hdr, 0, ID_CLIENT, TYPE_DATA, 0);
+    FILE* f = NULL;
+    trace t;
+    struct timeval tvStart, tvRecv;
+    gettimeofday(&tvStart, NULL);
+    if ((method == 1) && ((f = fopen(path, "w")) == NULL)) return 0;
+    if ((method == 2) && !traceOpen(&t, path)) return 0;
+
+    uint64_t start = monotonicNs();
+    uint64_t paced = 0; // time spent waiting for the rate (ns)
+    uint64_t ns = start;
+    for (uint32_t seq = 1; seq <= pkts; seq++) {
+        if ((seq % BENCH_BATCH) == 1) {
+            if (rate > 0) {
+                // sleep off the batch ahead of the rate, not counted
+                uint64_t w = monotonicNs();
+                uint64_t due = start + (uint64_t) seq * 1000000000 / rate;
+                if (due > w) usleep((due - w) / 1000);
+                paced += monotonicNs() - w;
+            }
+            gettimeofday(&tvRecv, NULL);
+            ns = monotonicNs();
+        }
+        hdr.seq = seq;
+        if (method == 1) {
+            unsigned int diff = timeDiff(&tvStart, &tvRecv);
+            if ((diff == UINT_MAX) || (fprintf(f, "%u %u\n", diff, hdr.seq) < 0)) printf("Warning: write error\n");
+        } else if (method == 2) {
+            traceRecord(&t, ns, &hdr);
+        }
+    }
+    if (method == 1) fclose(f);
+    double total = (double) (monotonicNs() - start - paced);
+    if (method == 2) {
+        uint64_t dropped = t.dropped;
+        traceClose(&t);
+        printf("  %" PRIu64 " records dropped\n", dropped);
+    }
+    return total / pkts;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+            case 'n':
+                pkts = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rate = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            default:
+                pkts = 0; //force usage print
+                break;
+        }
+    }
+    if ((pkts < 1) || (optind != argc)) {
+        printf("Usage: %s [-n <pkts>] [-r <pkts/s>]\n", argv[0]);
+        exit(1);
+    }
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        printf("Error: Output file could not be created\n");
+        exit(1);
+    }
+    close(fd);
+
+    printf("%u pkts, %s\n", pkts, (rate > 0) ? "paced" : "back to back");
+    double none = run(0);
+    printf("none:    %7.1f ns/pkt\n", none);
+    double text = run(1);
+    printf("fprintf: %7.1f ns/pkt (+%.1f)\n", text, text - none);
+    double bin = run(2);
+    printf("trace:   %7.1f ns/pkt (+%.1f)\n", bin, bin - none);
+    unlink(path);
+    return 0;
+}
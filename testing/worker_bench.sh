@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Worker scaling test: aggregate packet rate of one server node vs. number of
+# server workers (-w) on loopback. Several session_bench processes receive in
+# parallel so the receiving side does not cap the result.
+# To be run from the testing directory after make in final_project and testing
+# usage: ./worker_bench.sh [worker counts...]   (default 1 2 4)
+# env: PROCS = bench processes (4), SESSIONS = sessions per process (16),
+#      RATE = rate per session (unlimited), SERVER_OPTS = extra server options (-b 8)
+
+workers=${@:-1 2 4}
+procs=${PROCS:-4}
+sessions=${SESSIONS:-16}
+rate=${RATE:-1000000}
+opts=${SERVER_OPTS:--b 8}
+bench=$(pwd)/session_bench
+
+echo "cpus: $(nproc), bench processes: $procs x $sessions sessions, rate per session: $rate"
+printf "%8s %12s %10s\n" workers "pkts/s" "Mbit/s"
+for w in $workers; do
+  # server looks for the streamed files in its working directory
+  (cd ../final_project && exec ./server $opts -w $w 0 > /dev/null 2>&1) &
+  server=$!
+  sleep 0.5
+
+  out=$(mktemp)
+  for p in $(seq $procs); do
+    $bench -r $rate $sessions >> $out &
+  done
+  wait $(jobs -p | grep -v "^$server$")
+
+  # sum the rows of all bench processes (column 4 = pkts/s, column 5 = Mbit/s)
+  awk -v w=$w '$1 ~ /^[0-9]+$/ { pps += $4; mbit += $5 } END { printf "%8u %12.0f %10.1f\n", w, pps, mbit }' $out
+  rm -f $out
+  kill $server
+  wait $server 2> /dev/null
+done